@@ -2,13 +2,17 @@
 
 #include <limits>
 
-#if true // for now
-#include <cstdlib>
-#define GC_NEW(Type) new (malloc(sizeof(Type))) Type
-#define GC_ALLOC malloc
+#include "alloc_stats.hpp"
+#include "gc/heap.hpp"
+
+// GC_NEW(Type)(args) makes a Type on the collected heap (see gc/heap.hpp), and
+// GC_ALLOC_AS(Tag, bytes) allocates untyped memory there, accounted against Tag
+#ifdef HARKON_NO_ALLOC_STATS
+#define GC_NEW(Type) new (gc::allocate<Type>()) Type
+#define GC_ALLOC_AS(Tag, Bytes) gc::allocate_block<Tag>(Bytes)
 #else
-#include <gc.h>
-#define GC_NEW(Type) new (GC_MALLOC(sizeof(Type))) Type
-#define GC_ALLOC GC_MALLOC
+#define GC_NEW(Type) new (alloc_stats::record<Type>(gc::allocate<Type>(), sizeof(Type))) Type
+#define GC_ALLOC_AS(Tag, Bytes) alloc_stats::record<Tag>(gc::allocate_block<Tag>(Bytes), Bytes)
 #endif
 
+#define GC_ALLOC(Bytes) GC_ALLOC_AS(alloc_stats::raw_bytes, Bytes)
@@ -0,0 +1,169 @@
+#pragma once
+
+// Allocation accounting for GC_NEW/GC_ALLOC. Every allocated type gets a slot the
+// first time it's allocated, and each thread counts into its own table of slots,
+// so the cost of counting is a couple of unsynchronised increments.
+//
+// Types are reported by name: `alloc_name(T const*)` is found by argument
+// dependent lookup, so a type can name itself by declaring an overload next to
+// it (e.g. the map nodes report their arity). Everything else gets its
+// demangled type name.
+
+#include <cxxabi.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+namespace alloc_stats {
+
+const unsigned max_slots = 256;
+
+struct counter {
+    unsigned long long count;
+    unsigned long long bytes;
+};
+
+struct entry {
+    entry(std::string const& name, counter c) :
+            name(name), count(c.count), bytes(c.bytes) {
+    }
+    std::string name;
+    long long count;
+    long long bytes;
+};
+
+typedef std::vector<entry> snapshot;
+
+// used as the type of untyped GC_ALLOC blocks
+struct raw_bytes {
+};
+
+inline char const* alloc_name(raw_bytes const*) {
+    return "raw bytes";
+}
+
+template<typename T>
+std::string alloc_name(T const*) {
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(typeid(T).name(), NULL, NULL, &status);
+    std::string name = (status == 0 && demangled) ? demangled : typeid(T).name();
+    std::free(demangled);
+    return name;
+}
+
+namespace detail {
+
+struct registry {
+    registry() :
+            slots(0) {
+    }
+    boost::mutex lock;
+    std::vector<std::string> names;
+    unsigned slots;
+};
+
+inline registry & global() {
+    static registry r;
+    return r;
+}
+
+inline counter* local() {
+    static __thread counter table[max_slots];
+    return table;
+}
+
+inline unsigned register_slot(std::string const& name) {
+    registry & r = global();
+    boost::mutex::scoped_lock l(r.lock);
+
+    std::vector<std::string>::iterator it = std::find(r.names.begin(), r.names.end(), name);
+    if (it != r.names.end())
+        return it - r.names.begin(); // distinct types sharing a name share a slot
+
+    if (r.names.size() >= max_slots - 1) {
+        // the last slot counts every type there's no room for
+        if (r.names.size() == max_slots - 1)
+            r.names.push_back("other");
+        return max_slots - 1;
+    }
+
+    r.names.push_back(name);
+    return r.names.size() - 1;
+}
+
+template<typename T>
+inline unsigned slot() {
+    static const unsigned s = register_slot(alloc_name(static_cast<T const*>(NULL)));
+    return s;
+}
+
+}
+
+// counts `bytes` against T on this thread, and passes `p` through
+template<typename T>
+inline void* record(void* p, std::size_t bytes) {
+    counter & c = detail::local()[detail::slot<T>()];
+    ++c.count;
+    c.bytes += bytes;
+    return p;
+}
+
+// what this thread has allocated so far, by type
+inline snapshot take() {
+    detail::registry & r = detail::global();
+    std::vector<std::string> names;
+    {
+        boost::mutex::scoped_lock l(r.lock);
+        names = r.names;
+    }
+
+    counter const* table = detail::local();
+    snapshot s;
+    for (std::size_t i(0); i < names.size(); ++i) {
+        s.push_back(entry(names[i], table[i]));
+    }
+    return s;
+}
+
+// what was allocated between two snapshots. types which allocated nothing are dropped
+inline snapshot diff(snapshot const& before, snapshot const& after) {
+    snapshot d;
+    for (std::size_t i(0); i < after.size(); ++i) {
+        entry e = after[i];
+        if (i < before.size()) {
+            e.count -= before[i].count;
+            e.bytes -= before[i].bytes;
+        }
+        if (e.count != 0)
+            d.push_back(e);
+    }
+    return d;
+}
+
+inline bool by_bytes(entry const& a, entry const& b) {
+    return a.bytes > b.bytes;
+}
+
+inline void print(std::ostream & out, snapshot s) {
+    std::sort(s.begin(), s.end(), by_bytes);
+
+    long long count = 0;
+    long long bytes = 0;
+    for (snapshot::const_iterator it(s.begin()); it != s.end(); ++it) {
+        if (it->count == 0)
+            continue;
+        out << std::setw(12) << it->bytes << " bytes " << std::setw(10) << it->count << " allocs  " << it->name << "\n";
+        count += it->count;
+        bytes += it->bytes;
+    }
+    out << std::setw(12) << bytes << " bytes " << std::setw(10) << count << " allocs  total" << std::endl;
+}
+
+}
@@ -0,0 +1,96 @@
+// Times splitting a large file of records into lines: read a line at a time
+// into wisp strings, as (next s) does, and mapped with (open-bytes path) and
+// sliced where it is, a find at a time and with one (split b 10). Each runs in a
+// region, and prints what was allocated in it: for the slices only the list
+// split makes, as a slice is no more than an object.
+//
+//   g++ -O3 -o bytes_bench bench/bytes_bench.cc -lboost_thread
+//   ./bytes_bench [megabytes] [file]
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "../interpretter/interpretter.hpp"
+
+using namespace harkon;
+
+typedef std::chrono::steady_clock clock_type;
+
+double seconds(clock_type::duration d) {
+    return std::chrono::duration<double>(d).count();
+}
+
+void write_records(std::string const& path, std::size_t megabytes) {
+    std::ofstream out(path.c_str());
+    std::size_t written = 0;
+    for (unsigned long i(0); written < megabytes << 20; ++i) {
+        std::ostringstream line;
+        line << "id=" << i << " key=" << (i * 2654435761u) % 100000 << " flags=" << i % 7 << " payload="
+                << std::string(20 + i % 40, 'a' + i % 26) << '\n';
+        out << line.str();
+        written += line.str().size();
+    }
+}
+
+void report(char const* what, std::size_t bytes, std::size_t lines, clock_type::duration d, std::size_t heap) {
+    std::cout << std::fixed << std::setprecision(1) << "  " << std::left << std::setw(16) << what << std::right
+            << std::setw(9) << lines << " lines " << std::setw(8) << bytes / seconds(d) / (1 << 20) << " MB/s"
+            << std::setw(9) << heap / 1024 << " KB allocated\n";
+}
+
+std::size_t allocated() {
+    return gc::stats().region_bytes;
+}
+
+int main(int argc, char** argv) {
+    std::size_t megabytes = argc > 1 ? std::atoi(argv[1]) : 128;
+    std::string path = argc > 2 ? argv[2] : "/tmp/bytes_bench.log";
+    write_records(path, megabytes);
+    std::cout << megabytes << "MB of records\n";
+
+    environment env = create_new_environment();
+    gc::root<environment> env_root(env);
+    object_list form;
+    env.insert("path", string(path.c_str(), path.size()));
+    object split = object_list(object_list().new_push_front(10).new_push_front(object_list(object_list()
+            .new_push_front(symbol("path")).new_push_front(symbol("open-bytes")))).new_push_front(symbol("split")));
+    gc::mutator_scope scope;
+    std::size_t lines = 0, bytes = 0, before = allocated();
+    clock_type::time_point start = clock_type::now();
+    {
+        gc::region r;
+        stream_ref s(io::stream::open(path, io::stream::lines));
+        for (object line = s(form, env); string const* l = boost::get<string>(&line); line = s(form, env)) {
+            ++lines;
+            bytes += l->size() + 1;
+        }
+    }
+    report("strings", bytes, lines, clock_type::now() - start, allocated() - before);
+
+    lines = 0, before = allocated();
+    start = clock_type::now();
+    {
+        gc::region r;
+        persistent::bytes b = persistent::bytes::map(path);
+        for (std::size_t from = 0, at; (at = b.find('\n', from)) != persistent::bytes::npos; from = at + 1) {
+            object line = b.slice(from, at - from);
+            ++lines;
+        }
+    }
+    report("slices", bytes, lines, clock_type::now() - start, allocated() - before);
+
+    before = allocated();
+    start = clock_type::now();
+    {
+        gc::region r;
+        lines = boost::get<object_list>(eval(split, env)).size() - 1; // after the last newline
+    }
+    report("(split b 10)", bytes, lines, clock_type::now() - start, allocated() - before);
+
+    ::unlink(path.c_str());
+    return 0;
+}
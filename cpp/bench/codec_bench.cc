@@ -0,0 +1,111 @@
+// Times moving a large object through text (pretty_print then parse) against
+// the binary codec (encode then decode).
+//
+//   g++ -O3 -o codec_bench bench/codec_bench.cc reader/parser.cc -lboost_thread
+//   ./codec_bench [rows]
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+
+#include <boost/lexical_cast.hpp>
+
+#include "../reader/parser.hpp"
+#include "../codec/codec.hpp"
+
+using namespace harkon;
+
+typedef std::chrono::steady_clock clock_type;
+
+double millis(clock_type::duration d) {
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+template<typename F>
+double best_of(unsigned runs, F f) {
+    double best = 0;
+    for (unsigned i(0); i < runs; ++i) {
+        clock_type::time_point start = clock_type::now();
+        f();
+        double t = millis(clock_type::now() - start);
+        if (i == 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+// rows of (id name "some longer description text" (flags ...))
+object make_data(unsigned rows) {
+    char const* names[] = { "alpha", "beta", "gamma", "delta", "epsilon" };
+    object_list data;
+    for (unsigned i(0); i < rows; ++i) {
+        std::string text = "row " + boost::lexical_cast<std::string>(i) + " of a moderately long description";
+        object_list flags = object_list().new_push_front(boolean(i % 2 == 0)).new_push_front(int(i * 7919 % 100000));
+
+        object_list row;
+        row = row.new_push_front(flags);
+        row = row.new_push_front(string(string::MakeCopy(), text.data(), text.size()));
+        row = row.new_push_front(symbol(names[i % 5]));
+        row = row.new_push_front(int(i));
+        data = data.new_push_front(row);
+    }
+    return data;
+}
+
+struct text_round_trip {
+    object const* data;
+    std::size_t* bytes;
+    void operator()() const {
+        std::string text = pretty_print(*data);
+        *bytes = text.size();
+        parse(text);
+    }
+};
+
+struct binary_round_trip {
+    object const* data;
+    std::size_t* bytes;
+    void operator()() const {
+        std::string buff = encode(*data);
+        *bytes = buff.size();
+        decode(buff.data(), buff.size());
+    }
+};
+
+struct print_only {
+    object const* data;
+    void operator()() const {
+        pretty_print(*data);
+    }
+};
+
+struct encode_only {
+    object const* data;
+    void operator()() const {
+        encode(*data);
+    }
+};
+
+int main(int argc, char** argv) {
+    unsigned rows = argc > 1 ? std::atoi(argv[1]) : 100000;
+    object data = make_data(rows);
+
+    std::size_t text_bytes = 0, binary_bytes = 0;
+    text_round_trip text = { &data, &text_bytes };
+    binary_round_trip binary = { &data, &binary_bytes };
+    print_only print = { &data };
+    encode_only enc = { &data };
+
+    double text_ms = best_of(3, text);
+    double binary_ms = best_of(3, binary);
+    double print_ms = best_of(3, print);
+    double encode_ms = best_of(3, enc);
+
+    std::cout << std::fixed << std::setprecision(1) << rows << " rows\n"
+            << "  text:   " << std::setw(8) << text_ms << " ms round trip (" << print_ms << " ms printing), "
+            << text_bytes << " bytes\n"
+            << "  binary: " << std::setw(8) << binary_ms << " ms round trip (" << encode_ms << " ms encoding), "
+            << binary_bytes << " bytes\n";
+    return 0;
+}
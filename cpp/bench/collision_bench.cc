@@ -0,0 +1,82 @@
+// Lookup and insert costs for persistent::map with well spread keys, and with
+// adversarial keys that all share a handful of hashes.
+//
+//   g++ -O3 -o collision_bench bench/collision_bench.cc -lboost_thread
+//   ./collision_bench [uniform keys]
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+
+#include <boost/lexical_cast.hpp>
+
+#include "../persistent/list.hpp"
+#include "../persistent/map.hpp"
+
+typedef std::chrono::steady_clock clock_type;
+
+double nanos(clock_type::duration d) {
+    return std::chrono::duration<double, std::nano>(d).count();
+}
+
+// every key hashes to one of `buckets` values
+template<int Buckets>
+struct clashing {
+    clashing(int v) :
+            v(v) {
+    }
+    bool operator==(clashing const& other) const {
+        return v == other.v;
+    }
+    bool operator<(clashing const& other) const {
+        return v < other.v;
+    }
+    int v;
+};
+
+template<int Buckets>
+std::size_t hash_value(clashing<Buckets> const& c) {
+    return c.v % Buckets;
+}
+
+template<typename Key>
+void run(char const* name, int keys) {
+    typedef persistent::map<Key, int> map;
+
+    // a multiplicative shuffle, so insertion order isn't sorted order
+    clock_type::time_point start = clock_type::now();
+    map m;
+    for (int i(0); i < keys; ++i) {
+        m.insert(Key(int(i * 2654435761ULL % keys)), i);
+    }
+    double insert = nanos(clock_type::now() - start) / keys;
+
+    start = clock_type::now();
+    long long found = 0;
+    for (int i(0); i < keys; ++i) {
+        found += *m.find(Key(i));
+    }
+    double lookup = nanos(clock_type::now() - start) / keys;
+
+    if (found < 0 || m.size() != std::size_t(keys))
+        std::abort();
+
+    std::cout << std::setw(20) << name << std::setw(10) << keys << std::fixed << std::setprecision(1)
+            << std::setw(12) << insert << " ns/insert" << std::setw(12) << lookup << " ns/lookup" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    int uniform = argc > 1 ? boost::lexical_cast<int>(argv[1]) : 4000000;
+
+    run<int>("uniform", uniform / 16);
+    run<int>("uniform", uniform);
+
+    // every key in a few collision nodes: binary search keeps lookups logarithmic,
+    // inserts pay for copying the bucket
+    run<clashing<64> >("64 hashes", 10000);
+    run<clashing<64> >("64 hashes", 100000);
+    run<clashing<1> >("one hash", 1000);
+    run<clashing<1> >("one hash", 10000);
+    return 0;
+}
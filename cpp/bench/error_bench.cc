@@ -0,0 +1,55 @@
+// Times evaluating forms that fail on a type mismatch and are caught, the way
+// code that falls back to something else on a mismatch does, with the
+// offending value a small int and then a long list.
+//
+//   g++ -O3 -o error_bench bench/error_bench.cc reader/parser.cc -lboost_thread
+//   ./error_bench [iterations]
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+
+#include "../reader/parser.hpp"
+#include "../interpretter/interpretter.hpp"
+
+using namespace harkon;
+
+typedef std::chrono::steady_clock clock_type;
+
+double micros_each(clock_type::duration d, unsigned n) {
+    return std::chrono::duration<double, std::micro>(d).count() / n;
+}
+
+// (if v 1 2) with v bound to value, which isn't a boolean
+double time_mismatch(object const& value, unsigned iterations) {
+    environment env = create_new_environment().new_insert("v", value);
+    object form = parse("(if v 1 2)");
+
+    unsigned failed = 0;
+    clock_type::time_point start = clock_type::now();
+    for (unsigned i(0); i < iterations; ++i) {
+        if (!try_eval(form, env).ok())
+            ++failed;
+    }
+    double t = micros_each(clock_type::now() - start, iterations);
+
+    if (failed != iterations)
+        std::cerr << "expected every evaluation to fail" << std::endl;
+    return t;
+}
+
+int main(int argc, char** argv) {
+    unsigned iterations = argc > 1 ? std::atoi(argv[1]) : 20000;
+
+    object_list big;
+    for (int i(0); i < 1000; ++i) {
+        big = big.new_push_front(i);
+    }
+
+    std::cout << std::fixed << std::setprecision(2) << iterations << " failed evaluations\n"
+            << "  offending int:           " << std::setw(8) << time_mismatch(42, iterations) << " us each\n"
+            << "  offending 1000 item list: " << std::setw(7) << time_mismatch(object_list(big), iterations)
+            << " us each\n";
+    return 0;
+}
@@ -0,0 +1,73 @@
+// Times the recursive evaluator against the one that keeps its continuation on
+// the heap (interpretter/machine.hpp), on a call heavy fib and on a list of
+// strings built and measured, and then has the machine recurse deeper than
+// the native stack would let eval.
+//
+//   g++ -O3 -o machine_bench bench/machine_bench.cc reader/parser.cc -lboost_thread
+//   ./machine_bench [fib n] [depth]
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "../reader/parser.hpp"
+#include "../interpretter/machine.hpp"
+
+using namespace harkon;
+
+typedef std::chrono::steady_clock clock_type;
+
+double millis(clock_type::duration d) {
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+environment prelude() {
+    environment env = create_new_environment();
+    eval(parse("(def fib (lambda (n) (if (eq n 0) 0 (if (eq n 1) 1 (add (fib (add n -1)) (fib (add n -2)))))))"), env);
+    eval(parse("(def build (lambda (n s) (if (eq n 0) (str-length s) (build (add n -1) (concat s \"abc\")))))"),
+            env);
+    eval(parse("(def depth (lambda (n) (if (eq n 0) 0 (add 1 (depth (add n -1))))))"), env);
+    return env;
+}
+
+double time_form(evaluator ev, std::string const& text, std::string & printed) {
+    environment env = prelude();
+    object form = parse(text);
+
+    clock_type::time_point start = clock_type::now();
+    object result = ev(form, env);
+    double t = millis(clock_type::now() - start);
+    printed = pretty_print(result);
+    return t;
+}
+
+void compare(std::string const& text) {
+    std::string a, b;
+    double recursive = time_form(&eval, text, a);
+    double machine = time_form(&machine_eval, text, b);
+
+    std::cout << std::fixed << std::setprecision(2) << text << "\n"
+            << "  recursive: " << std::setw(9) << recursive << " ms\n"
+            << "  machine:   " << std::setw(9) << machine << " ms  (" << machine / recursive << "x)\n";
+    if (a != b)
+        std::cerr << "results differ: " << a << " and " << b << std::endl;
+}
+
+int main(int argc, char** argv) {
+    int n = argc > 1 ? std::atoi(argv[1]) : 22;
+    int depth = argc > 2 ? std::atoi(argv[2]) : 1000000;
+
+    std::ostringstream fib, build, deep;
+    fib << "(fib " << n << ")";
+    build << "(build " << 400 << " \"\")";
+    deep << "(depth " << depth << ")";
+    compare(fib.str());
+    compare(build.str());
+
+    std::string printed;
+    double t = time_form(&machine_eval, deep.str(), printed);
+    std::cout << deep.str() << " = " << printed << " on the machine in " << t << " ms\n";
+    return 0;
+}
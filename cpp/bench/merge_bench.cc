@@ -0,0 +1,86 @@
+// Times persistent::map merges of two big maps, serially and on thread pools of
+// increasing size.
+//
+//   g++ -O3 -o merge_bench bench/merge_bench.cc -lboost_thread
+//   ./merge_bench [keys per map] [max workers]
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "../persistent/list.hpp"
+#include "../persistent/map.hpp"
+
+typedef persistent::map<int, int> map;
+typedef std::chrono::steady_clock clock_type;
+
+double millis(clock_type::duration d) {
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+template<typename F>
+double best_of(unsigned runs, F f) {
+    double best = 0;
+    for (unsigned i(0); i < runs; ++i) {
+        clock_type::time_point start = clock_type::now();
+        f();
+        double t = millis(clock_type::now() - start);
+        if (i == 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+struct serial_merge {
+    map const* left;
+    map const* right;
+    void operator()() const {
+        map m = left->new_merge(*right);
+        if (m.size() == 0)
+            std::abort();
+    }
+};
+
+struct parallel_merge {
+    map const* left;
+    map const* right;
+    concurrency::thread_pool* pool;
+    void operator()() const {
+        map m = left->new_merge(*right, *pool);
+        if (m.size() == 0)
+            std::abort();
+    }
+};
+
+int main(int argc, char** argv) {
+    int keys = argc > 1 ? boost::lexical_cast<int>(argv[1]) : 2000000;
+    unsigned max_workers = argc > 2 ? boost::lexical_cast<unsigned>(argv[2]) : boost::thread::hardware_concurrency();
+    if (max_workers == 0)
+        max_workers = 1;
+
+    // half the keys overlap, so both sides share slots all the way down
+    map left, right;
+    for (int i(0); i < keys; ++i) {
+        left.insert(i, i);
+        right.insert(i + keys / 2, -i);
+    }
+    std::cout << "merging " << left.size() << " + " << right.size() << " keys" << std::endl;
+
+    serial_merge s = { &left, &right };
+    double serial = best_of(3, s);
+    std::cout << std::setw(8) << "serial" << std::setw(12) << std::fixed << std::setprecision(1) << serial << " ms"
+            << std::endl;
+
+    for (unsigned workers(1); workers <= max_workers; workers *= 2) {
+        concurrency::thread_pool pool(workers);
+        parallel_merge p = { &left, &right, &pool };
+        double t = best_of(3, p);
+        std::cout << std::setw(8) << workers << std::setw(12) << t << " ms  " << std::setprecision(2) << serial / t
+                << "x" << std::setprecision(1) << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,81 @@
+// Times summing, adding and dotting a million ints: as a list folded with add
+// (as a wisp script would without packed arrays), and as packed arrays with
+// each build of the SIMD kernels this CPU runs (see numeric/packed.hpp).
+//
+//   g++ -O3 -o packed_bench bench/packed_bench.cc -lboost_thread
+//   ./packed_bench [elements] [repeats]
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+
+#include "../interpretter/interpretter.hpp"
+
+using namespace harkon;
+
+typedef std::chrono::steady_clock clock_type;
+
+double micros(clock_type::duration d) {
+    return std::chrono::duration<double, std::micro>(d).count();
+}
+
+void report(char const* what, char const* how, clock_type::duration d, int repeats, std::string const& result) {
+    std::cout << std::fixed << std::setprecision(1) << "  " << std::left << std::setw(8) << what << std::setw(8) << how
+            << std::right << std::setw(10) << micros(d) / repeats << " us  = " << result << "\n";
+}
+
+int main(int argc, char** argv) {
+    int n = argc > 1 ? std::atoi(argv[1]) : 1000000;
+    int repeats = argc > 2 ? std::atoi(argv[2]) : 20;
+
+    environment env = create_new_environment();
+    gc::root<environment> env_root(env);
+    packed a(packed::int32, n), b(packed::int32, n);
+    gc::root<packed> a_root(a), b_root(b);
+    object_list listed;
+    for (int i(n); i > 0; --i) {
+        a.data<boost::int32_t>()[i - 1] = i % 1000 - 500;
+        b.data<boost::int32_t>()[i - 1] = i % 7;
+        listed = listed.new_push_front(i % 1000 - 500);
+    }
+    env.insert("listed", listed);
+    std::cout << n << " ints, each averaged over " << repeats << " runs\n";
+
+    {
+        object_list fold = object_list().new_push_front(symbol("listed")).new_push_front(0).new_push_front(symbol(
+                "add")).new_push_front(symbol("fold"));
+        gc::mutator_scope scope;
+        object r = nil();
+        clock_type::time_point start = clock_type::now();
+        for (int i(0); i < repeats; ++i) {
+            r = eval(fold, env);
+        }
+        report("sum", "list", clock_type::now() - start, repeats, pretty_print(r));
+    }
+
+    std::vector<packed_impl::kernels const*> builds = packed_impl::supported();
+    for (std::size_t k(0); k < builds.size(); ++k) {
+        use_packed_kernels(builds[k]->name);
+        __int128 r = 0;
+        clock_type::time_point start = clock_type::now();
+        for (int i(0); i < repeats; ++i) {
+            r = packed_sum(a);
+        }
+        report("sum", builds[k]->name, clock_type::now() - start, repeats, wide_bigint(r).to_string());
+
+        packed sum;
+        start = clock_type::now();
+        for (int i(0); i < repeats; ++i) {
+            packed_add(a, b, sum);
+        }
+        report("add", builds[k]->name, clock_type::now() - start, repeats, "");
+
+        start = clock_type::now();
+        for (int i(0); i < repeats; ++i) {
+            packed_dot(a, b, r);
+        }
+        report("dot", builds[k]->name, clock_type::now() - start, repeats, wide_bigint(r).to_string());
+    }
+    return 0;
+}
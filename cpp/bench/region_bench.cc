@@ -0,0 +1,61 @@
+// Times evaluations that make a lot of garbage and keep little of it, on the
+// heap (collected as the REPL does, with a safepoint after each) and in a
+// region each, and prints how much of what the regions made was promoted.
+//
+//   g++ -O3 -o region_bench bench/region_bench.cc reader/parser.cc -lboost_thread
+//   ./region_bench [iterations]
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+
+#include "../reader/parser.hpp"
+#include "../interpretter/interpretter.hpp"
+
+using namespace harkon;
+
+typedef std::chrono::steady_clock clock_type;
+
+double micros_each(clock_type::duration d, unsigned n) {
+    return std::chrono::duration<double, std::micro>(d).count() / n;
+}
+
+// builds a 200 piece rope and keeps only its length
+double time_evals(bool regions, unsigned iterations) {
+    gc::options opts;
+    opts.regions = regions;
+    gc::configure(opts);
+
+    environment env = create_new_environment();
+    gc::root<environment> env_root(env);
+    eval(parse("(def g (lambda (n s) (if (eq n 0) (str-length s) (g (add n -1) (concat s \"abcdefghijklmnop\")))))"),
+            env);
+    object form = parse("(g 200 \"\")");
+    gc::root<object> form_root(form);
+
+    clock_type::time_point start = clock_type::now();
+    for (unsigned i(0); i < iterations; ++i) {
+        {
+            gc::mutator_scope scope;
+            if (!eval_in_region(form, env).ok())
+                std::cerr << "expected every evaluation to succeed" << std::endl;
+        }
+        gc::safepoint();
+    }
+    return micros_each(clock_type::now() - start, iterations);
+}
+
+int main(int argc, char** argv) {
+    unsigned iterations = argc > 1 ? std::atoi(argv[1]) : 2000;
+
+    double heap = time_evals(false, iterations);
+    double region = time_evals(true, iterations);
+    gc::statistics s = gc::stats();
+
+    std::cout << std::fixed << std::setprecision(2) << iterations << " evaluations\n"
+            << "  on the heap: " << std::setw(8) << heap << " us each\n"
+            << "  in regions:  " << std::setw(8) << region << " us each\n";
+    gc::print(std::cout, s);
+    return 0;
+}
@@ -0,0 +1,89 @@
+// Times a five stage pipeline over a range of ints: with every stage made into
+// a list before the next (as a wisp script would without sequences), fused at
+// runtime by the builtins, and fused at compile time as compiler.hpp writes a
+// fold of a chain it can see whole, and prints the peak RSS after each. The
+// stages keep to ints, so the fused pipelines make no garbage at all.
+//
+//   g++ -O3 -o sequence_bench bench/sequence_bench.cc reader/parser.cc -lboost_thread
+//   ./sequence_bench [elements]
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include <sys/resource.h>
+
+#include "../reader/parser.hpp"
+#include "../compiler/runtime.hpp"
+
+using namespace harkon;
+
+typedef std::chrono::steady_clock clock_type;
+
+double millis(clock_type::duration d) {
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+long peak_rss_kb() {
+    rusage u;
+    ::getrusage(RUSAGE_SELF, &u);
+    return u.ru_maxrss;
+}
+
+environment prelude() {
+    environment env = create_new_environment();
+    eval(parse("(def inc (lambda (x) (add x 1)))"), env);
+    eval(parse("(def not7 (lambda (x) (if (eq x 7) #f #t)))"), env);
+    eval(parse("(def triple (lambda (x) (mul x 3)))"), env);
+    eval(parse("(def dec (lambda (x) (add x -1)))"), env);
+    eval(parse("(def tally (lambda (n x) (add n 1)))"), env);
+    return env;
+}
+
+void report(char const* what, object const& result, clock_type::duration d) {
+    std::cout << std::fixed << std::setprecision(1) << "  " << std::left << std::setw(14) << what << std::right
+            << std::setw(9) << millis(d) << " ms" << std::setw(9) << peak_rss_kb() << " KB peak  = "
+            << pretty_print(result) << "\n";
+}
+
+object time_form(environment & env, std::string const& text, char const* what) {
+    object form = parse(text);
+    gc::mutator_scope scope;
+    clock_type::time_point start = clock_type::now();
+    object result = eval(form, env);
+    report(what, result, clock_type::now() - start);
+    return result;
+}
+
+int main(int argc, char** argv) {
+    int n = argc > 1 ? std::atoi(argv[1]) : 1000000;
+    std::ostringstream range, half;
+    range << "(range 0 " << n << ")";
+    half << n / 2;
+
+    environment env = prelude();
+    gc::root<environment> env_root(env);
+    std::cout << n << " elements through map, filter, map, map and take, then counted\n";
+
+    time_form(env, "(fold tally 0 (take " + half.str() + " (map dec (map triple (filter not7 (map inc " + range.str()
+            + "))))))", "runtime fused");
+    gc::collect();
+
+    {
+        gc::mutator_scope scope;
+        object args[] = { *env.find("tally"), *env.find("dec"), *env.find("triple"), *env.find("not7"), *env.find("inc"),
+                eval(parse(range.str()), env) };
+        clock_type::time_point start = clock_type::now();
+        object result = rt::fold<rt::taken<rt::mapped<rt::mapped<rt::filtered<rt::mapped<rt::source> > > > > >(env, {
+                rt::proc(args[0]), 0, rt::count(n / 2), rt::proc(args[1]), rt::proc(args[2]), rt::proc(args[3]),
+                rt::proc(args[4]), args[5] });
+        report("compile fused", result, clock_type::now() - start);
+    }
+    gc::collect();
+
+    time_form(env, "(fold tally 0 (to-list (take " + half.str() + " (to-list (map dec (to-list (map triple (to-list (filter "
+            "not7 (to-list (map inc (to-list " + range.str() + ")))))))))))))", "a list a stage");
+    return 0;
+}
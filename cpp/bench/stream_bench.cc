@@ -0,0 +1,105 @@
+// Times reading a large file a line at a time: with std::getline, with an
+// io::stream (see io/stream.hpp), and with a stream's lines made into wisp
+// strings the way (next s) does, and prints the peak RSS after each so the
+// streams can be seen to read in constant memory.
+//
+//   g++ -O3 -o stream_bench bench/stream_bench.cc -lboost_thread
+//   ./stream_bench [megabytes] [file]
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include <sys/resource.h>
+
+#include "../interpretter/interpretter.hpp"
+
+using namespace harkon;
+
+typedef std::chrono::steady_clock clock_type;
+
+double seconds(clock_type::duration d) {
+    return std::chrono::duration<double>(d).count();
+}
+
+long peak_rss_kb() {
+    rusage u;
+    ::getrusage(RUSAGE_SELF, &u);
+    return u.ru_maxrss;
+}
+
+void write_log(std::string const& path, std::size_t megabytes) {
+    std::ofstream out(path.c_str());
+    std::size_t written = 0;
+    for (unsigned long i(0); written < megabytes << 20; ++i) {
+        std::ostringstream line;
+        line << "2024-01-01T00:00:" << std::setw(2) << std::setfill('0') << i % 60 << " worker-" << i % 17
+                << " request " << i << " took " << i * 7 % 1000 << "ms status=" << (i % 50 == 0 ? 500 : 200) << '\n';
+        out << line.str();
+        written += line.str().size();
+    }
+}
+
+void report(char const* what, std::size_t bytes, std::size_t lines, clock_type::duration d) {
+    std::cout << std::fixed << std::setprecision(1) << "  " << std::left << std::setw(22) << what << std::right
+            << std::setw(9) << lines << " lines " << std::setw(8) << bytes / seconds(d) / (1 << 20) << " MB/s"
+            << std::setw(9) << peak_rss_kb() << " KB peak\n";
+}
+
+int main(int argc, char** argv) {
+    std::size_t megabytes = argc > 1 ? std::atoi(argv[1]) : 256;
+    std::string path = argc > 2 ? argv[2] : "/tmp/stream_bench.log";
+    write_log(path, megabytes);
+    std::cout << megabytes << "MB of log lines\n";
+
+    {
+        std::ifstream in(path.c_str());
+        std::string line;
+        std::size_t lines = 0, bytes = 0;
+        clock_type::time_point start = clock_type::now();
+        while (std::getline(in, line)) {
+            ++lines;
+            bytes += line.size() + 1;
+        }
+        report("std::getline", bytes, lines, clock_type::now() - start);
+    }
+    {
+        boost::shared_ptr<io::stream> s(io::stream::open(path, io::stream::lines));
+        char const* data;
+        std::size_t size, lines = 0, bytes = 0;
+        clock_type::time_point start = clock_type::now();
+        while (s->next(data, size)) {
+            ++lines;
+            bytes += size + 1;
+        }
+        report("io::stream", bytes, lines, clock_type::now() - start);
+    }
+    {
+        // a region a batch, as evaluating a script a form at a time would
+        environment env;
+        object_list form;
+        stream_ref s(io::stream::open(path, io::stream::lines));
+        std::size_t lines = 0, bytes = 0;
+        bool more = true;
+        clock_type::time_point start = clock_type::now();
+        while (more) {
+            gc::region r;
+            for (unsigned i(0); i < 10000 && more; ++i) {
+                object line = s(form, env);
+                if (string const* l = boost::get<string>(&line)) {
+                    ++lines;
+                    bytes += l->size() + 1;
+                } else {
+                    more = false;
+                }
+            }
+        }
+        report("wisp strings", bytes, lines, clock_type::now() - start);
+    }
+
+    ::unlink(path.c_str());
+    return 0;
+}
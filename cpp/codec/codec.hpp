@@ -0,0 +1,447 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+
+#include "../object.hpp"
+#include "../interpretter/interpretter.hpp"
+
+namespace harkon {
+
+// A compact binary encoding of objects, for moving them between processes
+// without printing and re-parsing them. Integers are varints, every distinct
+// symbol is written once up front and referred to by index, and strings and
+// lists are length prefixed runs. Decoding reads straight out of the buffer:
+// symbols and strings too long to be kept inline point into it rather than
+// being copied, so it must outlive what's decoded from it (decode_file maps the
+// file and never unmaps it, like load_image). Lists are still rebuilt, as list
+// nodes can't live in the buffer.
+//
+// Layout:
+//   magic[4] version (varint)
+//   symbol_count (varint), then each symbol as length (varint) bytes '\0'
+//   object_count (varint), then each object as a tag byte and its payload
+//
+// Strings are followed by a '\0' too, so that c_str() works in place, and bytes
+// are length prefixed but left unterminated, and also decoded in place. Packed
+// arrays are their element type (0 for int32s, 1 for int64s), a count and the
+// elements as zigzag varints. Builtins are written by name, and closures as
+// their lambda's source followed by the (name, value) pairs they captured.
+
+struct codec_error: std::runtime_error {
+    codec_error(std::string const& what) :
+            std::runtime_error("Bad encoding: " + what) {
+    }
+};
+
+std::string encode(object const& o);
+std::string encode_all(std::vector<object> const& forms);
+
+object decode(char const* data, std::size_t size);
+std::vector<object> decode_all(char const* data, std::size_t size);
+std::vector<object> decode_file(std::string const& path);
+char const* map_file(std::string const& path, std::size_t & size);
+
+namespace codec_impl {
+
+typedef boost::uint32_t u32;
+typedef boost::uint64_t u64;
+
+const char magic[4] = { 'H', 'K', 'O', 'B' };
+const u32 version = 2;
+
+enum tag {
+    tag_false, tag_true, tag_char, tag_int, tag_bigint, tag_nil, tag_symbol, tag_string, tag_list, tag_builtin, tag_lambda,
+    tag_packed, tag_bytes
+};
+
+struct writer: boost::static_visitor<void> {
+    void put_u8(unsigned char c) {
+        body += c;
+    }
+
+    void put_varint(u64 v) {
+        while (v >= 0x80) {
+            body += char((v & 0x7f) | 0x80);
+            v >>= 7;
+        }
+        body += char(v);
+    }
+
+    void put_bytes(persistent::string const& s) {
+        put_varint(s.size());
+        std::size_t at = body.size();
+        body.resize(at + s.size() + 1, '\0');
+        s.copy_out(&body[at], 0, s.size());
+    }
+
+    void put_symbol(persistent::string const& s) {
+        std::string key(s.c_str(), s.size());
+        std::map<std::string, u32>::const_iterator it = symbol_index.find(key);
+        u32 index;
+        if (it != symbol_index.end()) {
+            index = it->second;
+        } else {
+            index = symbols.size();
+            symbols.push_back(s);
+            symbol_index[key] = index;
+        }
+        put_varint(index);
+    }
+
+    void operator()(boolean b) {
+        put_u8(b.as_bool() ? tag_true : tag_false);
+    }
+    void operator()(char c) {
+        put_u8(tag_char);
+        put_u8(c);
+    }
+    void operator()(int i) {
+        // zigzag, so small negatives stay small
+        put_u8(tag_int);
+        put_varint((static_cast<u32>(i) << 1) ^ static_cast<u32>(i >> 31));
+    }
+    void operator()(bigint const& i) {
+        std::string digits = i.to_string();
+        put_u8(tag_bigint);
+        put_varint(digits.size());
+        body += digits;
+    }
+    void operator()(packed const& p) {
+        put_u8(tag_packed);
+        put_u8(p.type());
+        put_varint(p.size());
+        for (unsigned i(0); i < p.size(); ++i) {
+            u64 v = p.at(i);
+            put_varint((v << 1) ^ (0 - (v >> 63)));
+        }
+    }
+    void operator()(nil) {
+        put_u8(tag_nil);
+    }
+    void operator()(symbol const& s) {
+        put_u8(tag_symbol);
+        put_symbol(s);
+    }
+    void operator()(string const& s) {
+        put_u8(tag_string);
+        put_bytes(s);
+    }
+    void operator()(persistent::bytes const& b) {
+        put_u8(tag_bytes);
+        put_varint(b.size());
+        body.append(b.data(), b.size());
+    }
+    void operator()(object_list const& l) {
+        put_u8(tag_list);
+        put_varint(l.size());
+        for (object_list::const_iterator e(l.begin()); e != l.end(); ++e) {
+            write(*e);
+        }
+    }
+    void operator()(object_proc const& proc) {
+        if (builtin_func const* f = proc.target<builtin_func>()) {
+            builtin const* b = find_builtin(*f);
+            if (b == NULL)
+                throw std::runtime_error("Unable to encode an unregistered builtin");
+            put_u8(tag_builtin);
+            put_symbol(symbol(b->name));
+            return;
+        }
+
+        if (lambda_closure const* l = proc.target<lambda_closure>()) {
+            std::vector<symbol> const& names = l->code->captures;
+            put_u8(tag_lambda);
+            (*this)(object_list(l->code->lambda));
+            put_varint(names.size());
+            for (std::size_t i(0); i < names.size(); ++i) {
+                put_symbol(names[i]);
+                write(l->captured[i]);
+            }
+            return;
+        }
+
+        throw std::runtime_error("Unable to encode a compiled or foreign procedure");
+    }
+
+    void write(object const& o) {
+        boost::apply_visitor(*this, o);
+    }
+
+    std::string finish(std::vector<object> const& forms) {
+        for (std::size_t i(0); i < forms.size(); ++i) {
+            write(forms[i]);
+        }
+
+        std::string objects;
+        objects.swap(body);
+
+        body.append(magic, sizeof(magic));
+        put_varint(version);
+        put_varint(symbols.size());
+        for (std::size_t i(0); i < symbols.size(); ++i) {
+            put_bytes(symbols[i]);
+        }
+        put_varint(forms.size());
+        return body + objects;
+    }
+
+    std::string body;
+    std::vector<persistent::string> symbols;
+    std::map<std::string, u32> symbol_index;
+};
+
+struct reader {
+    reader(char const* data, std::size_t size) :
+            at(data), end(data + size) {
+    }
+
+    void need(std::size_t len) const {
+        if (len > std::size_t(end - at))
+            throw codec_error("truncated");
+    }
+
+    unsigned char u8() {
+        need(1);
+        return *at++;
+    }
+
+    u64 varint() {
+        u64 v = 0;
+        for (unsigned shift(0); shift < 64; shift += 7) {
+            unsigned char c = u8();
+            v |= u64(c & 0x7f) << shift;
+            if ((c & 0x80) == 0)
+                return v;
+        }
+        throw codec_error("varint too long");
+    }
+
+    u32 length() {
+        u64 len = varint();
+        need(len);
+        return u32(len);
+    }
+
+    // length prefixed and '\0' terminated, left where it is
+    char const* bytes(unsigned & len) {
+        len = length();
+        need(std::size_t(len) + 1);
+        char const* s = at;
+        if (s[len] != '\0')
+            throw codec_error("unterminated string");
+        at += len + 1;
+        return s;
+    }
+
+    symbol const& symbol_ref() {
+        u64 index = varint();
+        if (index >= symbols.size())
+            throw codec_error("symbol index out of range");
+        return symbols[index];
+    }
+
+    object read() {
+        switch (u8()) {
+        case tag_false:
+            return boolean(false);
+        case tag_true:
+            return boolean(true);
+        case tag_char:
+            return static_cast<char>(u8());
+        case tag_int: {
+            u32 z = u32(varint());
+            return static_cast<int>((z >> 1) ^ (0 - (z & 1)));
+        }
+        case tag_bigint: {
+            unsigned len = length();
+            char const* digits = at;
+            at += len;
+            return make_integer(bigint::parse(digits, len));
+        }
+        case tag_packed:
+            return read_packed();
+        case tag_nil:
+            return nil();
+        case tag_symbol:
+            return symbol_ref();
+        case tag_string: {
+            unsigned len;
+            char const* s = bytes(len);
+            return string(s, len);
+        }
+        case tag_bytes: {
+            unsigned len = length();
+            char const* b = at;
+            at += len;
+            return persistent::bytes::borrow(b, len);
+        }
+        case tag_list:
+            return read_list();
+        case tag_builtin: {
+            symbol const& name = symbol_ref();
+            builtin const* b = find_builtin(name.c_str());
+            if (b == NULL)
+                throw codec_error(std::string("no builtin named ") + name.c_str());
+            return object_proc(b->func);
+        }
+        case tag_lambda: {
+            if (u8() != tag_list)
+                throw codec_error("lambda without a body");
+            object_list form = read_list();
+
+            u64 count = varint();
+            need(count);
+            std::vector<symbol> names;
+            std::vector<object> values;
+            for (u64 i(0); i < count; ++i) {
+                names.push_back(symbol_ref());
+                values.push_back(read());
+            }
+            return make_closure(make_lambda_code(form, names), values);
+        }
+        }
+        throw codec_error("unknown tag");
+    }
+
+    object_list read_list() {
+        u64 count = varint();
+        need(count); // every element is at least a tag
+
+        std::vector<object> elements;
+        elements.reserve(count);
+        for (u64 i(0); i < count; ++i) {
+            elements.push_back(read());
+        }
+
+        object_list l;
+        for (std::size_t i(elements.size()); i > 0; --i) {
+            l = l.new_push_front(elements[i - 1]);
+        }
+        return l;
+    }
+
+    packed read_packed() {
+        unsigned char type = u8();
+        if (type > packed::int64)
+            throw codec_error("unknown packed element type");
+        u64 count = varint();
+        need(count); // every element is at least a byte
+
+        packed p(packed::element_type(type), count);
+        for (u64 i(0); i < count; ++i) {
+            u64 z = varint();
+            boost::int64_t v = static_cast<boost::int64_t>((z >> 1) ^ (0 - (z & 1)));
+            if (type == packed::int32) {
+                if (v != boost::int32_t(v))
+                    throw codec_error("packed element out of range");
+                p.data<boost::int32_t>()[i] = boost::int32_t(v);
+            } else {
+                p.data<boost::int64_t>()[i] = v;
+            }
+        }
+        return p;
+    }
+
+    std::vector<object> all() {
+        need(sizeof(magic));
+        if (std::memcmp(at, magic, sizeof(magic)) != 0)
+            throw codec_error("not a harkon encoding");
+        at += sizeof(magic);
+        if (varint() != version)
+            throw codec_error("unsupported version");
+
+        u64 symbol_count = varint();
+        need(symbol_count);
+        symbols.reserve(symbol_count);
+        for (u64 i(0); i < symbol_count; ++i) {
+            unsigned len;
+            char const* s = bytes(len);
+            symbols.push_back(symbol(s, len));
+        }
+
+        u64 count = varint();
+        need(count);
+        std::vector<object> forms;
+        forms.reserve(count);
+        for (u64 i(0); i < count; ++i) {
+            forms.push_back(read());
+        }
+        if (at != end)
+            throw codec_error("trailing bytes");
+        return forms;
+    }
+
+    char const* at;
+    char const* end;
+    std::vector<symbol> symbols;
+};
+
+}
+
+inline std::string encode_all(std::vector<object> const& forms) {
+    codec_impl::writer w;
+    return w.finish(forms);
+}
+
+inline std::string encode(object const& o) {
+    return encode_all(std::vector<object>(1, o));
+}
+
+inline std::vector<object> decode_all(char const* data, std::size_t size) {
+    codec_impl::reader r(data, size);
+    return r.all();
+}
+
+inline object decode(char const* data, std::size_t size) {
+    std::vector<object> forms = decode_all(data, size);
+    if (forms.size() != 1)
+        throw codec_error("expected a single object");
+    return forms[0];
+}
+
+// maps a whole file read-only, for decoding in place
+inline char const* map_file(std::string const& path, std::size_t & size) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw std::runtime_error("Unable to open " + path + ": " + ::strerror(errno));
+
+    struct stat st;
+    if (::fstat(fd, &st) == -1 || st.st_size == 0) {
+        ::close(fd);
+        throw codec_error(path + " is empty");
+    }
+
+    void* mapped = ::mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED)
+        throw std::runtime_error("Unable to map " + path + ": " + ::strerror(errno));
+
+    size = st.st_size;
+    return static_cast<char const*>(mapped);
+}
+
+inline std::vector<object> decode_file(std::string const& path) {
+    std::size_t size;
+    char const* mapped = map_file(path, size);
+    try {
+        return decode_all(mapped, size);
+    } catch (...) {
+        ::munmap(const_cast<char*>(mapped), size);
+        throw;
+    }
+}
+
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+
+#include "codec.hpp"
+#include "../persistent/hash.hpp"
+#include "../reader/parser.hpp"
+#include "../reader/source_span.hpp"
+
+namespace harkon {
+
+// A directory of already parsed source files, so running the same script again
+// skips the reader. Each entry is named after a hash of the file's contents, so
+// an edited file simply misses, and starts with a header recording the full
+// hash, the length and the reader and codec versions it was made with. An entry
+// whose header doesn't match, or that fails to load at all, is stale and is parsed
+// again and rewritten in its place. Entries are written to a temporary file and
+// renamed in, so concurrent runs never see half of one. A hit is one mmap, which
+// (as with decode_file) is never unmapped, and a scan of the text for where its
+// lists are, which the encoding doesn't keep.
+struct module_cache {
+    explicit module_cache(std::string const& dir);
+
+    // the forms in the file at path, from the cache when it's up to date
+    std::vector<object> load(std::string const& path);
+
+    // the forms in text, cached under its contents
+    std::vector<object> load_source(std::string const& text);
+
+    std::string entry_path(std::string const& text) const;
+
+    unsigned hits;
+    unsigned misses;
+    unsigned rebuilt; // misses that replaced a stale entry
+
+private:
+    std::string dir;
+};
+
+namespace module_cache_impl {
+
+typedef boost::uint32_t u32;
+typedef boost::uint64_t u64;
+
+const char magic[4] = { 'H', 'K', 'M', 'C' };
+
+struct header {
+    char magic[4];
+    u32 reader_version;
+    u32 codec_version;
+    u32 source_size;
+    u64 source_hash;
+};
+
+inline u64 source_hash(std::string const& text) {
+    return persistent::hash_bytes(text.data(), text.size(), reader_version);
+}
+
+inline header expected_header(std::string const& text) {
+    header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, magic, sizeof(magic));
+    h.reader_version = reader_version;
+    h.codec_version = codec_impl::version;
+    h.source_size = text.size();
+    h.source_hash = source_hash(text);
+    return h;
+}
+
+inline std::string read_file(std::string const& path) {
+    std::ifstream f(path.c_str(), std::ios::binary);
+    if (!f)
+        throw std::runtime_error("Unable to open " + path);
+    std::stringstream buff;
+    buff << f.rdbuf();
+    return buff.str();
+}
+
+inline void write_entry(std::string const& path, header const& h, std::string const& body) {
+    std::stringstream tmp;
+    tmp << path << ".tmp." << ::getpid();
+
+    {
+        std::ofstream out(tmp.str().c_str(), std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<char const*>(&h), sizeof(h));
+        out.write(body.data(), body.size());
+        if (!out) {
+            ::unlink(tmp.str().c_str());
+            throw std::runtime_error("Unable to write module cache entry " + path);
+        }
+    }
+    if (::rename(tmp.str().c_str(), path.c_str()) == -1) {
+        ::unlink(tmp.str().c_str());
+        throw std::runtime_error("Unable to write module cache entry " + path + ": " + ::strerror(errno));
+    }
+}
+
+}
+
+inline module_cache::module_cache(std::string const& dir) :
+        hits(0), misses(0), rebuilt(0), dir(dir) {
+    if (::mkdir(dir.c_str(), 0777) == -1 && errno != EEXIST)
+        throw std::runtime_error("Unable to create module cache " + dir + ": " + ::strerror(errno));
+}
+
+inline std::string module_cache::entry_path(std::string const& text) const {
+    char name[32];
+    ::snprintf(name, sizeof(name), "%016llx.hkmc", static_cast<unsigned long long>(module_cache_impl::source_hash(text)));
+    return dir + "/" + name;
+}
+
+inline std::vector<object> module_cache::load(std::string const& path) {
+    return load_source(module_cache_impl::read_file(path));
+}
+
+inline std::vector<object> module_cache::load_source(std::string const& text) {
+    using namespace module_cache_impl;
+
+    std::string path = entry_path(text);
+    header want = expected_header(text);
+
+    if (::access(path.c_str(), R_OK) == 0) {
+        std::size_t size = 0;
+        char const* mapped = NULL;
+        try {
+            mapped = map_file(path, size);
+            if (size >= sizeof(header) && std::memcmp(mapped, &want, sizeof(header)) == 0) {
+                std::vector<object> forms = decode_all(mapped + sizeof(header), size - sizeof(header));
+                record_spans(forms, list_spans(text));
+                ++hits;
+                return forms;
+            }
+        } catch (std::exception const&) {
+            // a damaged entry can as well fail past the codec, as a bad bigint or lambda
+        }
+        if (mapped != NULL)
+            ::munmap(const_cast<char*>(mapped), size);
+        ++rebuilt;
+    }
+
+    ++misses;
+    std::vector<object> forms = parse_all(text);
+    write_entry(path, want, encode_all(forms));
+    return forms;
+}
+
+}
@@ -0,0 +1,631 @@
+#pragma once
+
+#include <cstdio>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+
+#include "../object.hpp"
+#include "../interpretter/interpretter.hpp"
+
+namespace harkon {
+
+// Ahead of time compilation of wisp forms into C++ that runs on the same object
+// runtime as the interpretter (see runtime.hpp). The builtins `add`, `mul`, `eq`,
+// `if`, `def` and `lambda` are open coded, with ints added and multiplied
+// unboxed until something overflows or isn't an int, a `fold` or `to-list` of a
+// chain of `map`, `filter` and `take` is fused into one loop, and calls to
+// lambdas the module `def`s itself are made directly (behind a guard that they
+// haven't been rebound). Lambdas close over the enclosing lambdas' variables they use, as
+// the interpretter's do. Anything else is handed back to the interpretter
+// unevaluated, so a compiled module always means the same thing as its source.
+//
+// The generated translation unit exports
+//   unsigned harkon_module_size();
+//   object harkon_module_form(unsigned i, environment & env);
+//   object const* harkon_module_quoted(unsigned i);
+//   bool harkon_module_check(environment const& env, environment const& pristine);
+// and with `standalone` set, a main() which runs and prints every form.
+struct compile_options {
+    compile_options() :
+            standalone(false) {
+    }
+    bool standalone;
+};
+
+std::string compile_to_cpp(std::vector<object> const& forms, compile_options const& opts = compile_options());
+
+namespace compiler_impl {
+
+inline std::string c_literal(char const* s, unsigned len) {
+    std::string r = "\"";
+    for (unsigned i(0); i < len; ++i) {
+        unsigned char c = s[i];
+        if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\' && c != '?') {
+            r += c;
+        } else {
+            char buff[5];
+            std::sprintf(buff, "\\%03o", c);
+            r += buff;
+        }
+    }
+    return r + "\"";
+}
+
+inline std::string join(std::vector<std::string> const& parts) {
+    std::string r;
+    for (std::size_t i(0); i < parts.size(); ++i) {
+        if (i != 0)
+            r += ", ";
+        r += parts[i];
+    }
+    return r;
+}
+
+inline std::vector<object> elements(object_list const& l) {
+    std::vector<object> r;
+    for (object_list::const_iterator it(l.begin()); it != l.end(); ++it) {
+        r.push_back(*it);
+    }
+    return r;
+}
+
+struct scope {
+    std::map<std::string, std::string> locals; // symbol -> c++ variable
+    std::string env; // the c++ environment expression in effect
+};
+
+struct known_lambda {
+    unsigned id;
+    unsigned arity;
+};
+
+struct emitter {
+    emitter() :
+            counter(0) {
+    }
+
+    std::string fresh(std::string const& prefix) {
+        return prefix + boost::lexical_cast<std::string>(counter++);
+    }
+
+    std::string symbol_constant(symbol const& s) {
+        std::string name(s.c_str(), s.size());
+        std::map<std::string, std::string>::const_iterator it = symbols.find(name);
+        if (it != symbols.end())
+            return it->second;
+
+        std::string var = fresh("sym_");
+        constants << "harkon::symbol const " << var << "(" << c_literal(s.c_str(), s.size()) << ", " << s.size()
+                << ");\n";
+        symbols[name] = var;
+        return var;
+    }
+
+    // c++ that rebuilds `o` as data
+    std::string quote_expr(object const& o) {
+        if (int const* i = boost::get<int>(&o))
+            return "harkon::object(int(" + boost::lexical_cast<std::string>(*i) + "))";
+        if (bigint const* i = boost::get<bigint>(&o)) {
+            std::string digits = i->to_string();
+            return "harkon::object(harkon::bigint::parse(\"" + digits + "\", " + boost::lexical_cast<std::string>(
+                    digits.size()) + "))";
+        }
+        if (symbol const* s = boost::get<symbol>(&o))
+            return "harkon::object(" + symbol_constant(*s) + ")";
+        if (string const* s = boost::get<string>(&o))
+            return "harkon::object(harkon::string(" + c_literal(s->c_str(), s->size()) + ", "
+                    + boost::lexical_cast<std::string>(s->size()) + "))";
+        if (object_list const* l = boost::get<object_list>(&o)) {
+            std::vector<std::string> parts;
+            for (object_list::const_iterator it(l->begin()); it != l->end(); ++it) {
+                parts.push_back(quote_expr(*it));
+            }
+            return "harkon::rt::list({" + join(parts) + "})";
+        }
+        throw std::runtime_error("Unable to compile literal " + pretty_print(o));
+    }
+
+    std::string quote_constant(object const& o) {
+        std::string expr = quote_expr(o); // may declare symbols of its own first
+        std::string var = fresh("quote_");
+        constants << "harkon::object const " << var << " = " << expr << ";\n";
+        root(var);
+        return var;
+    }
+
+    // constants live as long as the module, so the collector has to keep what they hold
+    void root(std::string const& var) {
+        constants << "gc::root<harkon::object> const " << var << "_root(" << var << ");\n";
+    }
+
+    std::string quote_list_constant(object const& o) {
+        return "boost::get<harkon::object_list>(" + quote_constant(o) + ")";
+    }
+
+    bool is_local(scope const& sc, symbol const& s) const {
+        return sc.locals.find(std::string(s.c_str(), s.size())) != sc.locals.end();
+    }
+
+    // `name` in head position, when it still means the builtin
+    bool is_builtin(scope const& sc, object const& head, char const* name) const {
+        symbol const* s = boost::get<symbol>(&head);
+        return s != NULL && *s == symbol(name) && !is_local(sc, *s) && redefined.count(name) == 0;
+    }
+
+    bool is_form(scope const& sc, object const& o, char const* name, std::size_t size) const {
+        object_list const* l = boost::get<object_list>(&o);
+        if (l == NULL || l->empty())
+            return false;
+        return is_builtin(sc, l->front(), name) && l->size() == size;
+    }
+
+    bool is_arith(scope const& sc, object const& o, char const* name) const {
+        object_list const* l = boost::get<object_list>(&o);
+        return l != NULL && !l->empty() && is_builtin(sc, l->front(), name);
+    }
+
+    // an int literal, or add or mul of nothing else, which is worked out unboxed
+    // without evaluating anything
+    bool is_int(scope const& sc, object const& o) const {
+        if (boost::get<int>(&o) != NULL)
+            return true;
+        if (!is_arith(sc, o, "add") && !is_arith(sc, o, "mul"))
+            return false;
+        object_list const& l = boost::get<object_list>(o);
+        for (object_list::const_iterator it(l.begin() + 1); it != l.end(); ++it) {
+            if (!is_int(sc, *it))
+                return false;
+        }
+        return true;
+    }
+
+    // an int expression of what is_int, which sets `slow` if anything overflows
+    std::string compile_int(object const& o, scope const& sc) {
+        if (int const* i = boost::get<int>(&o))
+            return boost::lexical_cast<std::string>(*i);
+
+        std::vector<object> xs = elements(boost::get<object_list>(o));
+        std::vector<std::string> parts;
+        for (std::size_t i(1); i < xs.size(); ++i) {
+            parts.push_back(compile_int(xs[i], sc));
+        }
+        return std::string("harkon::rt::") + (is_arith(sc, o, "add") ? "add" : "mul") + "_ints(slow, {" + join(parts)
+                + "})";
+    }
+
+    // add or mul of ints, unboxed: literals as they are, anything else evaluated
+    // once and unboxed when it's an int. only if something isn't, or the result
+    // overflows, is it done again boxed, which promotes it to a bigint
+    std::string compile_arith(object const& o, scope const& sc, char const* name) {
+        std::vector<object> xs = elements(boost::get<object_list>(o));
+        std::string evaluated;
+        std::vector<std::string> unboxed, boxed;
+        for (std::size_t i(1); i < xs.size(); ++i) {
+            if (is_int(sc, xs[i])) {
+                unboxed.push_back(compile_int(xs[i], sc));
+                boxed.push_back(compile(xs[i], sc));
+            } else {
+                std::string var = fresh("operand_");
+                evaluated += "harkon::object const " + var + " = " + compile(xs[i], sc) + "; ";
+                unboxed.push_back("harkon::rt::unboxed(slow, " + var + ")");
+                boxed.push_back(var);
+            }
+        }
+        return "[&]() -> harkon::object { " + evaluated + "bool slow = false; int r = harkon::rt::" + name
+                + "_ints(slow, {" + join(unboxed) + "}); return slow ? harkon::rt::" + name + "({" + join(boxed)
+                + "}) : harkon::object(r); }()";
+    }
+
+    std::string compile_bool(object const& o, scope const& sc) {
+        if (is_form(sc, o, "eq", 3)) {
+            std::vector<object> xs = elements(boost::get<object_list>(o));
+            return "harkon::rt::eq({" + compile(xs[1], sc) + ", " + compile(xs[2], sc) + "})";
+        }
+        return "harkon::rt::as_bool(" + compile(o, sc) + ")";
+    }
+
+    // does evaluating `o` need an environment of the lambda's own? (def, directly
+    // or in something handed to the interpretter, must not leak to the caller)
+    bool needs_env(object const& o, scope const& sc) const {
+        object_list const* l = boost::get<object_list>(&o);
+        if (l == NULL)
+            return false;
+        if (l->empty())
+            return true;
+
+        object const& head = l->front();
+        if (is_builtin(sc, head, "lambda") && valid_lambda(o))
+            return false; // compiled separately, and looks nothing up on creation
+        if (!(is_builtin(sc, head, "add") || is_builtin(sc, head, "mul") || is_form(sc, o, "if", 4) || is_form(sc, o, "eq", 3) || direct_call(sc, o)))
+            return true;
+
+        for (object_list::const_iterator it(l->begin() + 1); it != l->end(); ++it) {
+            if (needs_env(*it, sc))
+                return true;
+        }
+        return false;
+    }
+
+    // the lambda `o` calls, if it's one of ours and can be called directly
+    known_lambda const* direct_call(scope const& sc, object const& o) const {
+        object_list const* l = boost::get<object_list>(&o);
+        if (l == NULL || l->empty())
+            return NULL;
+        symbol const* head = boost::get<symbol>(&l->front());
+        if (head == NULL || is_local(sc, *head))
+            return NULL;
+
+        std::map<std::string, known_lambda>::const_iterator it = lambdas.find(std::string(head->c_str(), head->size()));
+        if (it == lambdas.end() || it->second.arity != l->size() - 1)
+            return NULL;
+        return &it->second;
+    }
+
+    bool valid_lambda(object const& o) const {
+        object_list const* l = boost::get<object_list>(&o);
+        if (l == NULL || l->size() != 3)
+            return false;
+        object_list const* params = boost::get<object_list>(&*(l->begin() + 1));
+        if (params == NULL)
+            return false;
+        for (object_list::const_iterator it(params->begin()); it != params->end(); ++it) {
+            if (boost::get<symbol>(&*it) == NULL)
+                return false;
+        }
+        return true;
+    }
+
+    std::vector<symbol> local_names(scope const& sc) const {
+        std::vector<symbol> names;
+        for (std::map<std::string, std::string>::const_iterator it(sc.locals.begin()); it != sc.locals.end(); ++it) {
+            names.push_back(symbol(it->first.c_str(), it->first.size()));
+        }
+        return names;
+    }
+
+    // a call handing the form to the interpretter, which reads our locals out of a
+    // frame of them, just as an interpretted lambda's body would
+    std::string handed_call(std::string const& proc, object const& o, scope const& sc) {
+        if (sc.locals.empty())
+            return "harkon::rt::call(" + proc + ", " + quote_list_constant(o) + ", " + sc.env + ")";
+
+        std::string quoted = quote_constant(o);
+        std::vector<std::string> names;
+        std::vector<std::string> vars;
+        for (std::map<std::string, std::string>::const_iterator it(sc.locals.begin()); it != sc.locals.end(); ++it) {
+            names.push_back("&" + symbol_constant(symbol(it->first.c_str(), it->first.size())));
+            vars.push_back(it->second);
+        }
+        std::string var = fresh("quote_");
+        constants << "harkon::object const " << var << " = harkon::rt::analysed(" << quoted << ", {" << join(names)
+                << "});\n";
+        root(var);
+        return "harkon::rt::call(" + proc + ", boost::get<harkon::object_list>(" + var + "), " + sc.env + ", {"
+                + join(vars) + "})";
+    }
+
+    // emits the body and functor for a lambda as `body_<id>` and `lambda_<id>`. the
+    // functor holds the captured values, and the body takes them after the arguments
+    void compile_lambda(object const& o, unsigned id, std::vector<symbol> const& captures) {
+        std::vector<object> xs = elements(boost::get<object_list>(o));
+        std::vector<object> params = elements(boost::get<object_list>(xs[1]));
+
+        std::string n = boost::lexical_cast<std::string>(id);
+
+        scope body_scope;
+        body_scope.env = "env";
+
+        std::string signature = "harkon::object body_" + n
+                + "(harkon::environment & env, std::initializer_list<harkon::object> args"
+                + (captures.empty() ? "" : ", std::initializer_list<harkon::object> captured") + ")";
+
+        std::ostringstream body;
+        body << signature << " {\n";
+        for (std::size_t i(0); i < captures.size(); ++i) {
+            std::string var = "c" + n + "_" + boost::lexical_cast<std::string>(i);
+            body << "    harkon::object const& " << var << " = captured.begin()[" << i << "];\n";
+            body_scope.locals[std::string(captures[i].c_str(), captures[i].size())] = var;
+        }
+        for (std::size_t i(0); i < params.size(); ++i) {
+            std::string var = "p" + n + "_" + boost::lexical_cast<std::string>(i);
+            body << "    harkon::object const& " << var << " = args.begin()[" << i << "];\n";
+            symbol const& s = boost::get<symbol>(params[i]);
+            body_scope.locals[std::string(s.c_str(), s.size())] = var;
+        }
+
+        if (needs_env(xs[2], body_scope)) {
+            body << "    harkon::environment local = env;\n";
+            body_scope.env = "local";
+        }
+
+        std::string result = compile(xs[2], body_scope);
+        body << "    return " << result << ";\n}\n\n";
+
+        std::vector<std::string> evaluated;
+        for (std::size_t i(0); i < params.size(); ++i) {
+            evaluated.push_back("harkon::rt::arg(form, " + boost::lexical_cast<std::string>(i + 1) + ", env)");
+        }
+        std::vector<std::string> members;
+        for (std::size_t i(0); i < captures.size(); ++i) {
+            members.push_back("c" + boost::lexical_cast<std::string>(i));
+        }
+
+        std::ostringstream functor;
+        functor << "struct lambda_" << n << " {\n";
+        for (std::size_t i(0); i < members.size(); ++i) {
+            functor << "    harkon::object " << members[i] << ";\n";
+        }
+        functor << "    harkon::object operator()(harkon::object_list const& form, harkon::environment & env) const {\n"
+                << "        harkon::rt::expect_args(form, " << params.size() << ");\n"
+                << "        return body_" << n << "(env, {" << join(evaluated) << "}"
+                << (captures.empty() ? "" : ", {" + join(members) + "}") << ");\n"
+                << "    }\n";
+        if (!members.empty()) {
+            functor << "    friend void gc_visit(lambda_" << n << " const& l, gc::marker & m) {\n";
+            for (std::size_t i(0); i < members.size(); ++i) {
+                functor << "        m.visit(l." << members[i] << ");\n";
+            }
+            functor << "    }\n";
+        }
+        functor << "};\n\n";
+
+        prototypes << signature << ";\n\n" << functor.str();
+        definitions << body.str();
+    }
+
+    std::string compile(object const& o, scope const& sc) {
+        if (boost::get<int>(&o) != NULL || boost::get<bigint>(&o) != NULL || boost::get<string>(&o) != NULL)
+            return quote_constant(o);
+
+        if (symbol const* s = boost::get<symbol>(&o)) {
+            std::map<std::string, std::string>::const_iterator it = sc.locals.find(std::string(s->c_str(), s->size()));
+            if (it != sc.locals.end())
+                return it->second;
+            return "harkon::rt::lookup(" + sc.env + ", " + symbol_constant(*s) + ")";
+        }
+
+        object_list const* l = boost::get<object_list>(&o);
+        if (l == NULL || l->empty())
+            return "harkon::eval(" + quote_constant(o) + ", " + sc.env + ")";
+
+        std::vector<object> xs = elements(*l);
+
+        if (is_arith(sc, o, "add"))
+            return compile_arith(o, sc, "add");
+
+        if (is_arith(sc, o, "mul"))
+            return compile_arith(o, sc, "mul");
+
+        if (is_form(sc, o, "eq", 3))
+            return "harkon::object(harkon::boolean(" + compile_bool(o, sc) + "))";
+
+        if (is_form(sc, o, "if", 4))
+            return "(" + compile_bool(xs[1], sc) + " ? " + compile(xs[2], sc) + " : " + compile(xs[3], sc) + ")";
+
+        if (is_form(sc, o, "def", 3) && boost::get<symbol>(&xs[1]) != NULL)
+            return "harkon::rt::define(" + sc.env + ", " + symbol_constant(boost::get<symbol>(xs[1])) + ", "
+                    + compile(xs[2], sc) + ")";
+
+        if (is_builtin(sc, xs[0], "lambda") && valid_lambda(o)) {
+            unsigned id = counter++;
+            std::vector<symbol> captures = captures_of(o, local_names(sc));
+            compile_lambda(o, id, captures);
+
+            std::vector<std::string> values;
+            for (std::size_t i(0); i < captures.size(); ++i) {
+                values.push_back(compile(captures[i], sc));
+            }
+            return "harkon::object(harkon::object_proc(lambda_" + boost::lexical_cast<std::string>(id) + "{" + join(values)
+                    + "}))";
+        }
+
+        if (is_form(sc, o, "fold", 4) || is_form(sc, o, "to-list", 2))
+            return compile_fused(o, sc);
+
+        if (known_lambda const* k = direct_call(sc, o)) {
+            std::string n = boost::lexical_cast<std::string>(k->id);
+            std::vector<std::string> args;
+            for (std::size_t i(1); i < xs.size(); ++i) {
+                args.push_back(compile(xs[i], sc));
+            }
+            return "(harkon::rt::bound_to<lambda_" + n + ">(" + sc.env + ", " + symbol_constant(boost::get<symbol>(xs[0]))
+                    + ") ? body_" + n + "(" + sc.env + ", {" + join(args) + "}) : " + handed_call(compile(xs[0], sc), o, sc) + ")";
+        }
+
+        return handed_call(compile(xs[0], sc), o, sc);
+    }
+
+    // (fold f init s) or (to-list s), with the map, filter and take stages s is
+    // written as fused into a pipeline type (see rt::source). everything's
+    // evaluated, outermost first, before the pipeline pulls anything, just as
+    // the builtins would build a sequence and then run it
+    std::string compile_fused(object const& o, scope const& sc) {
+        std::vector<object> xs = elements(boost::get<object_list>(o));
+        bool is_fold = xs.size() == 4;
+
+        std::vector<std::string> args;
+        if (is_fold) {
+            args.push_back("harkon::rt::proc(" + compile(xs[1], sc) + ")");
+            args.push_back(compile(xs[2], sc));
+        }
+
+        std::string stages;
+        std::string closing;
+        object s = xs.back();
+        for (;;) {
+            std::string stage = is_form(sc, s, "map", 3) ? "mapped" : is_form(sc, s, "filter", 3) ? "filtered" :
+                    is_form(sc, s, "take", 3) ? "taken" : "";
+            if (stage.empty())
+                break;
+            std::vector<object> ys = elements(boost::get<object_list>(s));
+            args.push_back((stage == "taken" ? "harkon::rt::count(" : "harkon::rt::proc(") + compile(ys[1], sc) + ")");
+            stages += "harkon::rt::" + stage + "<";
+            closing += ">";
+            s = ys[2];
+        }
+        args.push_back(compile(s, sc));
+
+        return std::string("harkon::rt::") + (is_fold ? "fold" : "to_list") + "<" + stages + "harkon::rt::source"
+                + closing + ">(" + sc.env + ", {" + join(args) + "})";
+    }
+
+    // top level `(def name (lambda ...))`s can be called directly, and any def'd
+    // builtin name can no longer be open coded
+    void survey(std::vector<object> const& forms) {
+        std::map<std::string, unsigned> defs;
+
+        for (std::vector<object>::const_iterator it(forms.begin()); it != forms.end(); ++it) {
+            object_list const* l = boost::get<object_list>(&*it);
+            if (l == NULL || l->size() != 3)
+                continue;
+            symbol const* head = boost::get<symbol>(&l->front());
+            symbol const* name = boost::get<symbol>(&*(l->begin() + 1));
+            if (head == NULL || name == NULL || *head != symbol("def"))
+                continue;
+
+            std::string n(name->c_str(), name->size());
+            redefined.insert(n);
+            ++defs[n];
+        }
+
+        scope top;
+        std::vector<std::pair<unsigned, object> > pending;
+        for (std::vector<object>::const_iterator it(forms.begin()); it != forms.end(); ++it) {
+            object_list const* l = boost::get<object_list>(&*it);
+            if (l == NULL || l->size() != 3)
+                continue;
+            symbol const* head = boost::get<symbol>(&l->front());
+            symbol const* name = boost::get<symbol>(&*(l->begin() + 1));
+            object const& val = *(l->begin() + 2);
+            if (head == NULL || name == NULL || *head != symbol("def") || !is_form(top, val, "lambda", 3)
+                    || !valid_lambda(val))
+                continue;
+
+            std::string n(name->c_str(), name->size());
+            if (defs[n] != 1)
+                continue;
+
+            known_lambda k;
+            k.arity = boost::get<object_list>(*(boost::get<object_list>(val).begin() + 1)).size();
+            k.id = counter++;
+            lambdas[n] = k;
+            pending.push_back(std::make_pair(k.id, val));
+        }
+
+        // compiled up front (once they are all known, so they can call each other
+        // directly) and shared by the def in compile_form and every direct call
+        for (std::size_t i(0); i < pending.size(); ++i) {
+            compile_lambda(pending[i].second, pending[i].first, std::vector<symbol>());
+        }
+    }
+
+    std::string compile_form(object const& o) {
+        scope top;
+        top.env = "env";
+
+        // a def of a surveyed lambda reuses the functor compiled in survey()
+        object_list const* l = boost::get<object_list>(&o);
+        if (l != NULL && l->size() == 3 && is_builtin(top, l->front(), "def")) {
+            symbol const* name = boost::get<symbol>(&*(l->begin() + 1));
+            if (name != NULL) {
+                std::map<std::string, known_lambda>::const_iterator it = lambdas.find(std::string(name->c_str(),
+                        name->size()));
+                if (it != lambdas.end())
+                    return "harkon::rt::define(env, " + symbol_constant(*name) + ", harkon::object(harkon::object_proc(lambda_"
+                            + boost::lexical_cast<std::string>(it->second.id) + "())))";
+            }
+        }
+
+        return compile(o, top);
+    }
+
+    std::ostringstream constants;
+    std::ostringstream prototypes;
+    std::ostringstream definitions;
+
+    std::map<std::string, std::string> symbols;
+    std::map<std::string, known_lambda> lambdas;
+    std::set<std::string> redefined;
+    unsigned counter;
+};
+
+}
+
+inline std::string compile_to_cpp(std::vector<object> const& forms, compile_options const& opts) {
+    compiler_impl::emitter e;
+
+    static char const* const builtins[] = { "add", "mul", "eq", "if", "def", "lambda", "map", "filter", "take", "fold",
+            "to-list" };
+    std::vector<std::string> builtin_syms;
+    for (unsigned i(0); i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+        builtin_syms.push_back(e.symbol_constant(symbol(builtins[i])));
+    }
+
+    e.survey(forms);
+
+    std::vector<std::string> bodies;
+    std::vector<std::string> quoted;
+    for (std::vector<object>::const_iterator it(forms.begin()); it != forms.end(); ++it) {
+        bodies.push_back(e.compile_form(*it));
+        quoted.push_back(e.quote_constant(*it));
+    }
+
+    std::ostringstream out;
+    out << "// generated by the harkon compiler, do not edit\n"
+            << "#include \"compiler/runtime.hpp\"\n\n"
+            << "namespace {\n\n"
+            << e.constants.str() << "\n"
+            << e.prototypes.str() << "\n"
+            << e.definitions.str();
+
+    out << "harkon::object const* const quoted[] = { ";
+    for (std::size_t i(0); i < quoted.size(); ++i) {
+        out << "&" << quoted[i] << ", ";
+    }
+    out << "NULL };\n\n";
+
+    for (std::size_t i(0); i < bodies.size(); ++i) {
+        out << "harkon::object form_" << i << "(harkon::environment & env) {\n    return " << bodies[i] << ";\n}\n\n";
+    }
+
+    out << "}\n\n"
+            << "extern \"C\" unsigned harkon_module_size() {\n    return " << forms.size() << ";\n}\n\n"
+            << "extern \"C\" harkon::object harkon_module_form(unsigned i, harkon::environment & env) {\n"
+            << "    switch (i) {\n";
+    for (std::size_t i(0); i < bodies.size(); ++i) {
+        out << "    case " << i << ": return form_" << i << "(env);\n";
+    }
+    out << "    }\n    throw std::out_of_range(\"harkon_module_form\");\n}\n\n"
+            << "extern \"C\" harkon::object const* harkon_module_quoted(unsigned i) {\n"
+            << "    return i < harkon_module_size() ? quoted[i] : NULL;\n}\n\n"
+            << "extern \"C\" bool harkon_module_check(harkon::environment const& env, harkon::environment const& pristine) {\n"
+            << "    return true";
+    for (std::size_t i(0); i < builtin_syms.size(); ++i) {
+        out << "\n        && harkon::rt::same_builtin(env, pristine, " << builtin_syms[i] << ")";
+    }
+    out << ";\n}\n";
+
+    if (opts.standalone) {
+        out << "\n#include <iostream>\n\n"
+                << "int main(int, char**) {\n"
+                << "    harkon::environment env = harkon::create_new_environment();\n"
+                << "    for (unsigned i(0); i < harkon_module_size(); ++i) {\n"
+                << "        try {\n"
+                << "            std::cout << harkon::pretty_print(harkon_module_form(i, env)) << std::endl;\n"
+                << "        } catch (std::exception const& ex) {\n"
+                << "            std::cout << \"Caught exception: \" << ex.what() << std::endl;\n"
+                << "        }\n"
+                << "    }\n"
+                << "    return 0;\n"
+                << "}\n";
+    }
+
+    return out.str();
+}
+
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <dlfcn.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "compiler.hpp"
+
+#ifndef HARKON_INCLUDE_DIR
+#define HARKON_INCLUDE_DIR "."
+#endif
+
+namespace harkon {
+
+// A compiled module loaded with dlopen. It's never unloaded, as its symbols
+// and strings may be referenced from anything it ever returned. The host is
+// linked with -rdynamic, so the module's copies of the collector's state (and
+// the alloc stats) bind to the host's rather than being separate.
+struct compiled_module {
+    unsigned (*size)();
+    object (*form)(unsigned, environment &);
+    object const* (*quoted)(unsigned);
+    bool (*check)(environment const&, environment const&);
+
+    // runs form `i`, or interprets it if the builtins it inlines have been rebound in `env`
+    object run(unsigned i, environment & env, environment const& pristine) const {
+        if (check(env, pristine))
+            return form(i, env);
+        return eval(*quoted(i), env);
+    }
+};
+
+// where the compiler finds the runtime headers, `$HARKON_INCLUDE_DIR` wins over the build time default
+inline std::string include_dir() {
+    char const* dir = std::getenv("HARKON_INCLUDE_DIR");
+    return dir ? dir : HARKON_INCLUDE_DIR;
+}
+
+inline std::string cxx() {
+    char const* c = std::getenv("CXX");
+    return c ? c : "c++";
+}
+
+// `libs` go after the source, so the linker still wants what they define by the time it sees them
+inline void build_cpp(std::string const& source, std::string const& flags, std::string const& out,
+        std::string const& libs = "") {
+    std::string src = out + ".cc";
+    {
+        std::ofstream f(src.c_str());
+        f << source;
+        if (!f)
+            throw std::runtime_error("Unable to write " + src);
+    }
+
+    std::string cmd = cxx() + " -std=c++17 -O2 -w -DBOOST_BIND_GLOBAL_PLACEHOLDERS " + flags + " -I'" + include_dir() + "' '" + src + "' -o '" + out + "' " + libs;
+    if (std::system(cmd.c_str()) != 0)
+        throw std::runtime_error("Compilation failed: " + cmd);
+}
+
+// compiles `forms` to a shared object at `path` and loads it
+inline compiled_module compile_and_load(std::vector<object> const& forms, std::string const& path) {
+    build_cpp(compile_to_cpp(forms), "-shared -fPIC", path);
+
+    void* handle = ::dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL)
+        throw std::runtime_error(std::string("dlopen failed: ") + ::dlerror());
+
+    compiled_module m;
+    m.size = reinterpret_cast<unsigned (*)()>(::dlsym(handle, "harkon_module_size"));
+    m.form = reinterpret_cast<object (*)(unsigned, environment &)>(::dlsym(handle, "harkon_module_form"));
+    m.quoted = reinterpret_cast<object const* (*)(unsigned)>(::dlsym(handle, "harkon_module_quoted"));
+    m.check = reinterpret_cast<bool (*)(environment const&, environment const&)>(::dlsym(handle,
+            "harkon_module_check"));
+
+    if (!m.size || !m.form || !m.quoted || !m.check)
+        throw std::runtime_error("Not a harkon module: " + path);
+
+    return m;
+}
+
+// compiles `forms` to a standalone executable at `path`, which prints each result
+inline void compile_executable(std::vector<object> const& forms, std::string const& path) {
+    compile_options opts;
+    opts.standalone = true;
+    // the runtime's collector and streams use boost threads, which a shared object
+    // leaves for the host to provide but an executable has to link itself
+    build_cpp(compile_to_cpp(forms, opts), "", path, "-lboost_thread -lpthread");
+}
+
+}
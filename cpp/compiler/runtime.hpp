@@ -0,0 +1,267 @@
+#pragma once
+
+// Helpers that code generated by compiler.hpp calls into. Everything here is
+// small and inline, so the system compiler can see straight through it.
+
+#include <initializer_list>
+#include <stdexcept>
+
+#include "../object.hpp"
+#include "../interpretter/interpretter.hpp"
+
+namespace harkon {
+
+namespace rt {
+
+inline bool as_bool(object const& o) {
+    return expect_as<boolean>(o).as_bool();
+}
+
+// the int `o` is, or 0 and `slow` set if it's anything else
+inline int unboxed(bool & slow, object const& o) {
+    if (int const* i = boost::get<int>(&o))
+        return *i;
+    slow = true;
+    return 0;
+}
+
+// unboxed, setting `slow` if the result doesn't fit, for add or mul to do it again
+inline int add_ints(bool & slow, std::initializer_list<int> xs) {
+    int cum = 0;
+    for (int const* it(xs.begin()); it != xs.end(); ++it) {
+        slow |= __builtin_add_overflow(cum, *it, &cum);
+    }
+    return cum;
+}
+
+inline int mul_ints(bool & slow, std::initializer_list<int> xs) {
+    int cum = 1;
+    for (int const* it(xs.begin()); it != xs.end(); ++it) {
+        slow |= __builtin_mul_overflow(cum, *it, &cum);
+    }
+    return cum;
+}
+
+// arguments in a braced list are evaluated left to right, which a plain call would not promise
+inline object add(std::initializer_list<object> xs) {
+    integer_sum cum;
+    for (object const* it(xs.begin()); it != xs.end(); ++it) {
+        cum.add(*it);
+    }
+    return cum.result();
+}
+
+inline object mul(std::initializer_list<object> xs) {
+    integer_product cum;
+    for (object const* it(xs.begin()); it != xs.end(); ++it) {
+        cum.mul(*it);
+    }
+    return cum.result();
+}
+
+inline bool eq(std::initializer_list<object> xs) {
+    return xs.begin()[0] == xs.begin()[1];
+}
+
+inline object lookup(environment const& env, symbol const& s) {
+    object const* resolved = env.find(s);
+    if (resolved == NULL)
+        throw eval_error(unresolved_symbol, s);
+
+    return *resolved;
+}
+
+inline object define(environment & env, symbol const& s, object const& v) {
+    env.insert(s, v);
+    return nil();
+}
+
+// a call the compiler knew nothing about, handed the unevaluated form just like the interpretter would
+inline object call(object const& proc, object_list const& form, environment & env) {
+    return expect_as<object_proc>(proc)(form, env);
+}
+
+// one whose form reads the caller's locals out of a frame (see handed_call)
+inline object call(object const& proc, object_list const& form, environment & env, std::initializer_list<object> frame) {
+    frame_scope scope(frame.begin());
+    return expect_as<object_proc>(proc)(form, env);
+}
+
+// a form for the interpretter, analysed against a frame of the named locals
+inline object analysed(object const& form, std::initializer_list<symbol const*> names) {
+    std::vector<symbol> locals;
+    for (symbol const* const* it(names.begin()); it != names.end(); ++it) {
+        locals.push_back(**it);
+    }
+    object r = form;
+    analyse(form, locals, r);
+    return r;
+}
+
+inline object list(std::initializer_list<object> xs) {
+    object_list l;
+    for (object const* it(xs.end()); it != xs.begin();) {
+        l = l.new_push_front(*--it);
+    }
+    return l;
+}
+
+// the n-th argument of a call form, evaluated in the caller's environment
+inline object arg(object_list const& form, unsigned n, environment & env) {
+    return eval(*(form.begin() + n), env);
+}
+
+inline void expect_args(object_list const& form, unsigned n) {
+    if (form.size() < n + 1)
+        throw eval_error(bad_form, form, "Too few arguments provided when eval lambda result");
+}
+
+// is `s` still bound to the compiled lambda `Lambda` we would otherwise call directly?
+template<typename Lambda>
+inline bool bound_to(environment const& env, symbol const& s) {
+    object const* resolved = env.find(s);
+    if (resolved == NULL)
+        return false;
+    object_proc const* p = boost::get<object_proc>(resolved);
+    return p != NULL && p->target<Lambda>() != NULL;
+}
+
+// Sequence pipelines fused at compile time: a fold or to-list of map, filter
+// and take stages the compiler can see whole is a type, source at the bottom,
+// each stage pulling from the one inside it, so the system compiler makes one
+// loop of them. Each takes its argument from a braced list of them, outermost
+// first, which is the order the builtins would have evaluated and checked them
+// in (see proc and count).
+struct source {
+    source(object const*& args, environment & env) :
+            cursor(as_sequence(*args++), env) {
+    }
+
+    object const* next() {
+        return cursor.next();
+    }
+
+    unsigned arity() const {
+        return cursor.arity();
+    }
+
+    sequence_cursor cursor;
+};
+
+template<typename Inner>
+struct mapped {
+    mapped(object const*& args, environment & env) :
+            fn(*args++), inner(args, env), call(fn, inner.arity()), env(env), value(nil()) {
+    }
+
+    object const* next() {
+        object const* v = inner.next();
+        if (v == NULL)
+            return NULL;
+        value = call(v, env);
+        return &value;
+    }
+
+    unsigned arity() const {
+        return 1;
+    }
+
+    object const& fn;
+    Inner inner;
+    prepared_call call;
+    environment & env;
+    object value;
+};
+
+template<typename Inner>
+struct filtered {
+    filtered(object const*& args, environment & env) :
+            fn(*args++), inner(args, env), call(fn, inner.arity()), env(env) {
+    }
+
+    object const* next() {
+        while (object const* v = inner.next()) {
+            if (expect_as<boolean>(call(v, env)).as_bool())
+                return v;
+        }
+        return NULL;
+    }
+
+    unsigned arity() const {
+        return inner.arity();
+    }
+
+    object const& fn;
+    Inner inner;
+    prepared_call call;
+    environment & env;
+};
+
+template<typename Inner>
+struct taken {
+    taken(object const*& args, environment & env) :
+            left(boost::get<int>(*args++)), inner(args, env) {
+    }
+
+    object const* next() {
+        if (left == 0)
+            return NULL;
+        object const* v = inner.next();
+        if (v != NULL)
+            --left;
+        return v;
+    }
+
+    unsigned arity() const {
+        return inner.arity();
+    }
+
+    int left;
+    Inner inner;
+};
+
+// a stage's procedure, or take's count, checked when it's evaluated as the builtin would
+inline object proc(object const& o) {
+    expect_as<object_proc>(o);
+    return o;
+}
+
+inline object count(object const& o) {
+    return expect_count(o);
+}
+
+// (fold f init pipeline...)
+template<typename Pipeline>
+inline object fold(environment & env, std::initializer_list<object> args) {
+    object const* it = args.begin() + 2;
+    Pipeline p(it, env);
+    return fold_elements(p, args.begin()[0], args.begin()[1], env);
+}
+
+template<typename Pipeline>
+inline object to_list(environment & env, std::initializer_list<object> args) {
+    object const* it = args.begin();
+    Pipeline p(it, env);
+    return list_elements(p);
+}
+
+// compiled code inlines the builtins, which is only right while they haven't been rebound
+inline bool same_builtin(environment const& env, environment const& pristine, symbol const& s) {
+    object const* now = env.find(s);
+    object const* then = pristine.find(s);
+    if (now == NULL || then == NULL)
+        return false;
+
+    object_proc const* a = boost::get<object_proc>(now);
+    object_proc const* b = boost::get<object_proc>(then);
+    if (a == NULL || b == NULL)
+        return false;
+
+    builtin_func const* fa = a->target<builtin_func>();
+    builtin_func const* fb = b->target<builtin_func>();
+    return fa != NULL && fb != NULL && *fa == *fb;
+}
+
+}
+
+}
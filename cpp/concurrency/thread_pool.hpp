@@ -0,0 +1,93 @@
+#pragma once
+
+#include <deque>
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+namespace concurrency {
+
+// a plain fixed size pool of workers pulling tasks off a shared fifo
+struct thread_pool: boost::noncopyable {
+    typedef boost::function<void()> task;
+
+    explicit thread_pool(unsigned workers);
+    ~thread_pool();
+
+    void submit(task const& t);
+    unsigned size() const;
+
+    // runs what's queued, then stops and waits for every worker. nothing may be
+    // submitted after
+    void join();
+
+private:
+    void work();
+
+    boost::mutex lock;
+    boost::condition_variable ready;
+    std::deque<task> queue;
+    bool stopping;
+    bool joined;
+    unsigned workers;
+    boost::thread_group threads;
+};
+
+inline thread_pool::thread_pool(unsigned w) :
+        stopping(false), joined(false), workers(w == 0 ? 1 : w) {
+    for (unsigned i(0); i < workers; ++i) {
+        threads.create_thread(boost::bind(&thread_pool::work, this));
+    }
+}
+
+inline thread_pool::~thread_pool() {
+    join();
+}
+
+inline void thread_pool::join() {
+    if (joined)
+        return;
+    {
+        boost::mutex::scoped_lock l(lock);
+        stopping = true;
+    }
+    ready.notify_all();
+    threads.join_all();
+    joined = true;
+}
+
+inline void thread_pool::submit(task const& t) {
+    {
+        boost::mutex::scoped_lock l(lock);
+        queue.push_back(t);
+    }
+    ready.notify_one();
+}
+
+inline unsigned thread_pool::size() const {
+    return workers;
+}
+
+inline void thread_pool::work() {
+    for (;;) {
+        task t;
+        {
+            boost::mutex::scoped_lock l(lock);
+            while (queue.empty() && !stopping) {
+                ready.wait(l);
+            }
+            if (queue.empty())
+                return; // stopping, and nothing left to drain
+
+            t = queue.front();
+            queue.pop_front();
+        }
+        t();
+    }
+}
+
+}
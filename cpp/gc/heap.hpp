@@ -0,0 +1,843 @@
+#pragma once
+
+// A precise mark-sweep collector for everything allocated through GC_NEW and
+// GC_ALLOC_AS (see alloc.hpp).
+//
+// Every block has a header recording its size, the cycle that last found it
+// reachable and how to trace and destroy it, and is linked into a list kept by
+// the thread that allocated it, so allocating takes no locks. What a block
+// holds is found by argument dependent lookup, like alloc_name: a type declares
+// `gc_visit(T const&, gc::marker&)` next to it, calling m.visit() on the values
+// it holds and m.mark() on the blocks it points at. A type without one holds
+// nothing the collector needs to know about. Untyped blocks are traced and
+// destroyed by `gc_visit_block`/`gc_destroy_block` overloads for their tag.
+//
+// Roots are explicit: gc::root registers something C++ holds (an environment,
+// a module's constants) for as long as it's in scope. Nothing else is scanned,
+// so collections only start at a safepoint, when no thread is inside a
+// mutator_scope (evaluating a REPL line, a request or a form), as that's when
+// nothing but the roots holds on to anything. The REPL, the server and --run
+// open a scope around each evaluation and call safepoint() after it; code that
+// never does is never collected under.
+//
+// A cycle marks everything reachable from the roots as they were when it
+// started, and then sweeps what it didn't reach. Both are done a step
+// (options::step_budget blocks) at a time, at later safepoints, while other
+// threads carry on evaluating. That's safe without barriers because blocks are
+// never changed to point at older ones once made (the heap is made of
+// persistent structures), and blocks made during a cycle count as marked.
+// A cycle starts once the heap has grown by options::growth since the last one
+// left it, and is finished in one go if allocation gets too far ahead of it.
+//
+// An evaluation can instead allocate in a region (see region.hpp), which is
+// bump allocated and thrown away whole once what survives is copied out.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <new>
+#include <ostream>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/type_traits/has_trivial_destructor.hpp>
+
+namespace gc {
+
+struct marker;
+struct root_base;
+
+struct descriptor {
+    void (*trace)(void const* block, std::size_t bytes, marker & m); // NULL if it holds no pointers
+    void (*destroy)(void* block, std::size_t bytes); // NULL if there's nothing to do
+};
+
+struct header {
+    header* next;
+    descriptor const* type;
+    std::size_t bytes;
+    unsigned mark; // the last cycle to find it reachable, or the one it was made in
+    unsigned region; // the region it was made in, 0 for the heap
+};
+
+// so blocks are as aligned as malloc's
+BOOST_STATIC_ASSERT(sizeof(header) % 16 == 0);
+
+inline header* header_of(void const* block) {
+    return const_cast<header*>(static_cast<header const*>(block) - 1);
+}
+
+struct options {
+    options() :
+            growth(2.0), min_heap(8 << 20), step_budget(100000), regions(true) {
+    }
+
+    double growth; // the heap can reach this times what the last cycle left before another starts
+    std::size_t min_heap; // and at least this many bytes
+    std::size_t step_budget; // blocks marked or swept a safepoint, bounding the pause
+    bool regions; // whether evaluations that can use a region (region.hpp) do
+};
+
+struct statistics {
+    statistics() :
+            cycles(0), live_bytes(0), live_blocks(0), freed_bytes(0), freed_blocks(0), longest_pause_us(0), regions(
+                    0), region_bytes(0), promoted_bytes(0) {
+    }
+
+    unsigned long long cycles; // completed
+    std::size_t live_bytes; // what the last cycle left
+    std::size_t live_blocks;
+    unsigned long long freed_bytes; // in total
+    unsigned long long freed_blocks;
+    double longest_pause_us; // at a safepoint
+    unsigned long long regions; // closed
+    unsigned long long region_bytes; // allocated in them
+    unsigned long long promoted_bytes; // and copied out to the heap
+};
+
+// finds what's reachable, a block at a time. when evacuating a region (see
+// region.hpp) it instead copies the region's blocks it's shown out to the heap,
+// pointing what it was shown them through at the copies
+struct marker {
+    marker() :
+            epoch(1), evacuating(0), promoted_bytes(0), promoted_blocks(0) {
+    }
+
+    // marks a block (or NULL), to have its contents traced later
+    template<typename T>
+    void mark(T const* const& block) {
+        if (block == NULL)
+            return;
+        header* h = header_of(block);
+        if (evacuating != 0) {
+            if (h->region == evacuating)
+                const_cast<T const*&>(block) = static_cast<T const*>(evacuate(h));
+            return;
+        }
+        if (h->mark == epoch)
+            return;
+        h->mark = epoch;
+        if (h->type->trace != NULL)
+            gray.push_back(h);
+    }
+
+    // the blocks a value (held by a root or a block) points at
+    template<typename T>
+    void visit(T const& v);
+
+    // a region's blocks aren't the collector's to judge, they're dealt with when it closes
+    bool marked(void const* block) const {
+        header const* h = header_of(block);
+        return h->region != 0 || h->mark == epoch;
+    }
+
+    void drain() {
+        while (!gray.empty()) {
+            header* h = gray.back();
+            gray.pop_back();
+            h->type->trace(h + 1, h->bytes, *this);
+        }
+    }
+
+    std::vector<header*> gray;
+    unsigned epoch;
+
+    unsigned evacuating; // the region, or 0
+    std::size_t promoted_bytes;
+    std::size_t promoted_blocks;
+
+private:
+    void* evacuate(header* h);
+};
+
+namespace detail {
+
+typedef std::integral_constant<bool, true> yes;
+typedef std::integral_constant<bool, false> no;
+
+struct no_hook {
+};
+
+// the fallbacks take things that convert, so any real hook is a better match
+struct any_value {
+    template<typename T>
+    any_value(T const&) {
+    }
+};
+
+struct any_marker {
+    any_marker(marker &) {
+    }
+};
+
+struct any_size {
+    any_size(std::size_t) {
+    }
+};
+
+no_hook gc_visit(any_value, any_marker);
+template<typename Tag>
+no_hook gc_visit_block(Tag const*, void const*, std::size_t, any_marker);
+template<typename Tag>
+no_hook gc_destroy_block(Tag const*, void*, any_size);
+
+template<typename T, typename A>
+inline void gc_visit(std::vector<T, A> const& v, marker & m);
+template<typename A, typename B>
+inline void gc_visit(std::pair<A, B> const& p, marker & m);
+
+template<typename T>
+struct has_visit: std::integral_constant<bool,
+        !std::is_same<decltype(gc_visit(std::declval<T const&>(), std::declval<marker&>())), no_hook>::value> {
+};
+
+template<typename T>
+inline void visit(T const& v, marker & m, yes) {
+    gc_visit(v, m);
+}
+
+template<typename T>
+inline void visit(T const&, marker &, no) {
+}
+
+}
+
+template<typename T>
+inline void marker::visit(T const& v) {
+    detail::visit(v, *this, detail::has_visit<T>());
+}
+
+namespace detail {
+
+template<typename T, typename A>
+inline void gc_visit(std::vector<T, A> const& v, marker & m) {
+    for (std::size_t i(0); i < v.size(); ++i) {
+        m.visit(v[i]);
+    }
+}
+
+template<typename A, typename B>
+inline void gc_visit(std::pair<A, B> const& p, marker & m) {
+    m.visit(p.first);
+    m.visit(p.second);
+}
+
+template<typename T>
+void trace_value(void const* block, std::size_t, marker & m) {
+    m.visit(*static_cast<T const*>(block));
+}
+
+template<typename T>
+void destroy_value(void* block, std::size_t) {
+    static_cast<T*>(block)->~T();
+}
+
+template<typename T>
+inline descriptor const* descriptor_of() {
+    static const descriptor d = { has_visit<T>::value ? &trace_value<T> : NULL,
+            boost::has_trivial_destructor<T>::value ? NULL : &destroy_value<T> };
+    return &d;
+}
+
+// untyped blocks are traced and destroyed by hooks for their alloc_stats tag, if it has them
+template<typename Tag>
+struct has_visit_block: std::integral_constant<bool,
+        !std::is_same<
+                decltype(gc_visit_block(std::declval<Tag const*>(), std::declval<void const*>(), std::size_t(),
+                                std::declval<marker&>())), no_hook>::value> {
+};
+
+template<typename Tag>
+struct has_destroy_block: std::integral_constant<bool,
+        !std::is_same<
+                decltype(gc_destroy_block(std::declval<Tag const*>(), std::declval<void*>(), std::size_t())), no_hook>::value> {
+};
+
+template<typename Tag>
+void trace_block(void const* block, std::size_t bytes, marker & m) {
+    gc_visit_block(static_cast<Tag const*>(NULL), block, bytes, m);
+}
+
+template<typename Tag>
+void destroy_block(void* block, std::size_t bytes) {
+    gc_destroy_block(static_cast<Tag const*>(NULL), block, bytes);
+}
+
+template<typename Tag>
+inline void (*block_tracer(yes))(void const*, std::size_t, marker &) {
+    return &trace_block<Tag>;
+}
+
+template<typename Tag>
+inline void (*block_tracer(no))(void const*, std::size_t, marker &) {
+    return NULL;
+}
+
+template<typename Tag>
+inline void (*block_destroyer(yes))(void*, std::size_t) {
+    return &destroy_block<Tag>;
+}
+
+template<typename Tag>
+inline void (*block_destroyer(no))(void*, std::size_t) {
+    return NULL;
+}
+
+template<typename Tag>
+inline descriptor const* block_descriptor_of() {
+    static const descriptor d = { block_tracer<Tag>(has_visit_block<Tag>()),
+            block_destroyer<Tag>(has_destroy_block<Tag>()) };
+    return &d;
+}
+
+
+// the blocks a thread has made since they were last collected
+struct thread_heap {
+    thread_heap() :
+            blocks(NULL), tail(NULL), allocated(0), in_use(true), next_heap(NULL) {
+    }
+
+    header* blocks;
+    header* tail;
+    std::size_t allocated; // bytes, ever. written by the owner only
+    bool in_use; // by a live thread, else waiting to be picked up by a new one
+    thread_heap* next_heap;
+};
+
+typedef void (*weak_hook)(marker const& m);
+typedef void (*weak_move)(void const* from, void const* to);
+
+const unsigned forwarded = ~0u; // a region block's mark once it's been copied out, to header::next
+
+// a thread's region blocks, bump allocated from chunks that are kept for the next region
+struct arena: boost::noncopyable {
+    static const std::size_t chunk_bytes = 256 << 10;
+    static const std::size_t chunks_kept = 4;
+
+    struct chunk {
+        char* begin;
+        char* top;
+        char* end;
+    };
+
+    arena() :
+            id(0), used(0), allocated_bytes(0), allocated_blocks(0) {
+    }
+
+    ~arena() {
+        for (std::size_t i(0); i < chunks.size(); ++i) {
+            std::free(chunks[i].begin);
+        }
+    }
+
+    static std::size_t footprint(std::size_t bytes) {
+        return (sizeof(header) + bytes + 15) & ~std::size_t(15);
+    }
+
+    void* allocate(std::size_t bytes, descriptor const* type) {
+        std::size_t need = footprint(bytes);
+        if (used == 0 || chunks[used - 1].top + need > chunks[used - 1].end)
+            next_chunk(need);
+
+        chunk & c = chunks[used - 1];
+        header* h = reinterpret_cast<header*>(c.top);
+        c.top += need;
+        h->next = NULL;
+        h->type = type;
+        h->bytes = bytes;
+        h->mark = 0;
+        h->region = id;
+        allocated_bytes += bytes;
+        ++allocated_blocks;
+        return h + 1;
+    }
+
+    // finalizes what wasn't copied out and starts again from the first chunk
+    void reset() {
+        for (std::size_t i(0); i < used; ++i) {
+            for (char* p(chunks[i].begin); p < chunks[i].top;) {
+                header* h = reinterpret_cast<header*>(p);
+                if (h->mark != forwarded && h->type->destroy != NULL)
+                    h->type->destroy(h + 1, h->bytes);
+                p += footprint(h->bytes);
+            }
+            chunks[i].top = chunks[i].begin;
+        }
+        used = 0;
+        weak.clear();
+        allocated_bytes = allocated_blocks = 0;
+
+        // big blocks got chunks of their own, which aren't worth keeping
+        std::size_t kept = 0;
+        for (std::size_t i(0); i < chunks.size(); ++i) {
+            if (kept < chunks_kept && std::size_t(chunks[i].end - chunks[i].begin) == chunk_bytes)
+                chunks[kept++] = chunks[i];
+            else
+                std::free(chunks[i].begin);
+        }
+        chunks.resize(kept);
+    }
+
+    unsigned id; // of the region using it, 0 if none is
+    std::vector<chunk> chunks;
+    std::size_t used; // chunks[used - 1] is being allocated from
+    std::size_t allocated_bytes;
+    std::size_t allocated_blocks;
+    std::vector<std::pair<void const*, weak_move> > weak; // table keys to fix up at the end
+
+private:
+    void next_chunk(std::size_t need) {
+        if (used < chunks.size() && std::size_t(chunks[used].end - chunks[used].top) >= need) {
+            ++used;
+            return;
+        }
+
+        std::size_t size = std::max(chunk_bytes, need);
+        char* p = static_cast<char*>(std::malloc(size));
+        if (p == NULL)
+            throw std::bad_alloc();
+        chunk c = { p, p, p + size };
+        chunks.insert(chunks.begin() + used, c);
+        ++used;
+    }
+};
+
+// the arena this thread's allocations go to, when it has a region open
+inline arena*& active_arena() {
+    static __thread arena* a = NULL;
+    return a;
+}
+
+struct collector {
+    collector() :
+            active(0), snapshot_pending(false), phase(idle), survivors(NULL), condemned(NULL), kept_bytes(0), kept_blocks(
+                    0), allocated_at_cycle(0), heaps(NULL), roots(NULL), use_regions(true), last_region(0), regions(0), region_bytes(0), promoted_bytes(
+                    0) {
+    }
+
+    enum phase_type {
+        idle, marking, sweeping
+    };
+
+    // between mutators and the snapshot
+    boost::mutex quiesce_lock;
+    boost::condition_variable quiet;
+    unsigned active;
+    bool snapshot_pending;
+
+    // the cycle
+    boost::mutex lock;
+    phase_type phase;
+    marker m;
+    header* survivors; // what earlier cycles kept
+    header* condemned; // what this one is deciding about
+    std::size_t kept_bytes;
+    std::size_t kept_blocks;
+    std::size_t allocated_at_cycle;
+    options opts;
+    statistics stats;
+
+    // taken by mutators too, so not c.lock
+    boost::mutex weak_lock;
+    std::vector<weak_hook> weak_hooks;
+
+    // every thread's blocks
+    boost::mutex heaps_lock;
+    thread_heap* heaps;
+
+    boost::mutex roots_lock;
+    root_base* roots;
+
+    // regions keep to their own thread but for these
+    bool use_regions; // opts.regions, read without the lock
+    boost::mutex regions_lock;
+    unsigned last_region;
+    unsigned long long regions;
+    unsigned long long region_bytes;
+    unsigned long long promoted_bytes;
+};
+
+inline collector & global() {
+    static collector c;
+    return c;
+}
+
+inline void release_heap(thread_heap* h) {
+    boost::mutex::scoped_lock l(global().heaps_lock);
+    h->in_use = false;
+}
+
+inline thread_heap* acquire_heap() {
+    collector & c = global();
+    boost::mutex::scoped_lock l(c.heaps_lock);
+    for (thread_heap* h(c.heaps); h != NULL; h = h->next_heap) {
+        if (!h->in_use) {
+            h->in_use = true;
+            return h;
+        }
+    }
+    thread_heap* h = new thread_heap();
+    h->next_heap = c.heaps;
+    c.heaps = h;
+    return h;
+}
+
+inline thread_heap* local_heap() {
+    static __thread thread_heap* mine = NULL;
+    if (mine == NULL) {
+        static boost::thread_specific_ptr<thread_heap> owner(&release_heap);
+        mine = acquire_heap();
+        owner.reset(mine);
+    }
+    return mine;
+}
+
+inline std::size_t total_allocated(collector & c) {
+    std::size_t total = 0;
+    boost::mutex::scoped_lock l(c.heaps_lock);
+    for (thread_heap* h(c.heaps); h != NULL; h = h->next_heap) {
+        total += __atomic_load_n(&h->allocated, __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+inline void* heap_allocate(std::size_t bytes, descriptor const* type) {
+    header* h = static_cast<header*>(std::malloc(sizeof(header) + bytes));
+    if (h == NULL)
+        throw std::bad_alloc();
+    h->type = type;
+    h->bytes = bytes;
+    h->mark = __atomic_load_n(&global().m.epoch, __ATOMIC_RELAXED);
+    h->region = 0;
+
+    thread_heap* t = local_heap();
+    h->next = t->blocks;
+    if (t->blocks == NULL)
+        t->tail = h;
+    t->blocks = h;
+    __atomic_store_n(&t->allocated, t->allocated + bytes, __ATOMIC_RELAXED);
+    return h + 1;
+}
+
+inline void* allocate(std::size_t bytes, descriptor const* type) {
+    if (arena* a = active_arena())
+        return a->allocate(bytes, type);
+    return heap_allocate(bytes, type);
+}
+
+}
+
+inline void* marker::evacuate(header* h) {
+    if (h->mark == detail::forwarded)
+        return h->next + 1;
+
+    void* moved = detail::heap_allocate(h->bytes, h->type);
+    std::memcpy(moved, h + 1, h->bytes);
+    h->mark = detail::forwarded;
+    h->next = header_of(moved);
+    promoted_bytes += h->bytes;
+    ++promoted_blocks;
+    if (h->type->trace != NULL)
+        gray.push_back(h->next);
+    return moved;
+}
+
+// allocations in here go to the heap even with a region open, for blocks that
+// something older than the region will point at
+struct heap_scope: boost::noncopyable {
+    heap_scope() :
+            saved(detail::active_arena()) {
+        detail::active_arena() = NULL;
+    }
+    ~heap_scope() {
+        detail::active_arena() = saved;
+    }
+
+private:
+    detail::arena* saved;
+};
+
+// for weak tables: if block is in this thread's open region, moved(block, copy)
+// is called when the region closes, with copy NULL if it wasn't promoted
+inline void note_weak(void const* block, detail::weak_move moved) {
+    detail::arena* a = detail::active_arena();
+    if (a != NULL && header_of(block)->region == a->id)
+        a->weak.push_back(std::make_pair(block, moved));
+}
+
+// something C++ holds on to, kept (along with everything it reaches) while this is in scope
+struct root_base: boost::noncopyable {
+    root_base(void const* value, void (*trace)(void const*, marker &)) :
+            value(value), trace(trace), prev(NULL) {
+        detail::collector & c = detail::global();
+        boost::mutex::scoped_lock l(c.roots_lock);
+        next = c.roots;
+        if (next != NULL)
+            next->prev = this;
+        c.roots = this;
+    }
+
+    ~root_base() {
+        detail::collector & c = detail::global();
+        boost::mutex::scoped_lock l(c.roots_lock);
+        if (prev != NULL)
+            prev->next = next;
+        else
+            c.roots = next;
+        if (next != NULL)
+            next->prev = prev;
+    }
+
+    void const* value;
+    void (*trace)(void const*, marker &);
+    root_base* prev;
+    root_base* next;
+};
+
+template<typename T>
+struct root: root_base {
+    explicit root(T const& value) :
+            root_base(&value, &trace_root) {
+    }
+
+private:
+    static void trace_root(void const* value, marker & m) {
+        m.visit(*static_cast<T const*>(value));
+    }
+};
+
+// called with the cycle's marks once it's done marking, before anything is
+// freed, to drop entries keyed by blocks that aren't going to survive
+inline void on_weak(detail::weak_hook hook) {
+    detail::collector & c = detail::global();
+    boost::mutex::scoped_lock l(c.weak_lock);
+    c.weak_hooks.push_back(hook);
+}
+
+namespace detail {
+
+// how much can be allocated between one cycle starting and the next
+inline std::size_t allowance(collector const& c) {
+    return std::max(c.opts.min_heap, std::size_t(c.stats.live_bytes * (c.opts.growth - 1)));
+}
+
+inline std::size_t allocated_since_cycle(collector & c) {
+    return total_allocated(c) - c.allocated_at_cycle;
+}
+
+// the roots as they are now, with nobody evaluating. c.lock is held
+inline void begin_cycle(collector & c) {
+    {
+        boost::mutex::scoped_lock q(c.quiesce_lock);
+        c.snapshot_pending = true;
+        while (c.active > 0) {
+            c.quiet.wait(q);
+        }
+    }
+
+    c.condemned = c.survivors;
+    c.survivors = NULL;
+    {
+        boost::mutex::scoped_lock l(c.heaps_lock);
+        for (thread_heap* h(c.heaps); h != NULL; h = h->next_heap) {
+            if (h->blocks == NULL)
+                continue;
+            h->tail->next = c.condemned;
+            c.condemned = h->blocks;
+            h->blocks = h->tail = NULL;
+        }
+    }
+
+    __atomic_store_n(&c.m.epoch, c.m.epoch + 1, __ATOMIC_RELAXED);
+    {
+        boost::mutex::scoped_lock l(c.roots_lock);
+        for (root_base* r(c.roots); r != NULL; r = r->next) {
+            r->trace(r->value, c.m);
+        }
+    }
+    c.allocated_at_cycle = total_allocated(c);
+    c.kept_bytes = c.kept_blocks = 0;
+    c.phase = collector::marking;
+
+    {
+        boost::mutex::scoped_lock q(c.quiesce_lock);
+        c.snapshot_pending = false;
+    }
+    c.quiet.notify_all();
+}
+
+// up to budget blocks of marking or sweeping. c.lock is held
+inline void step(collector & c, std::size_t budget) {
+    if (c.phase == collector::marking) {
+        while (budget > 0 && !c.m.gray.empty()) {
+            header* h = c.m.gray.back();
+            c.m.gray.pop_back();
+            h->type->trace(h + 1, h->bytes, c.m);
+            --budget;
+        }
+        if (c.m.gray.empty()) {
+            boost::mutex::scoped_lock l(c.weak_lock);
+            for (std::size_t i(0); i < c.weak_hooks.size(); ++i) {
+                c.weak_hooks[i](c.m);
+            }
+            c.phase = collector::sweeping;
+        }
+    }
+
+    if (c.phase == collector::sweeping) {
+        while (budget > 0 && c.condemned != NULL) {
+            header* h = c.condemned;
+            c.condemned = h->next;
+            if (h->mark == c.m.epoch) {
+                h->next = c.survivors;
+                c.survivors = h;
+                c.kept_bytes += h->bytes;
+                ++c.kept_blocks;
+            } else {
+                if (h->type->destroy != NULL)
+                    h->type->destroy(h + 1, h->bytes);
+                c.stats.freed_bytes += h->bytes;
+                ++c.stats.freed_blocks;
+                std::free(h);
+            }
+            --budget;
+        }
+        if (c.condemned == NULL) {
+            c.stats.live_bytes = c.kept_bytes;
+            c.stats.live_blocks = c.kept_blocks;
+            ++c.stats.cycles;
+            c.phase = collector::idle;
+        }
+    }
+}
+
+inline unsigned & scope_depth() {
+    static __thread unsigned depth = 0;
+    return depth;
+}
+
+}
+
+// around anything that evaluates, so no cycle starts while it holds objects the
+// roots don't. allocating doesn't synchronise with the collector, so a thread
+// has to be inside one to allocate while another might be collecting
+struct mutator_scope: boost::noncopyable {
+    mutator_scope() {
+        if (detail::scope_depth()++ > 0)
+            return;
+        detail::collector & c = detail::global();
+        boost::mutex::scoped_lock q(c.quiesce_lock);
+        while (c.snapshot_pending) {
+            c.quiet.wait(q);
+        }
+        ++c.active;
+    }
+
+    ~mutator_scope() {
+        if (--detail::scope_depth() > 0)
+            return;
+        detail::collector & c = detail::global();
+        {
+            boost::mutex::scoped_lock q(c.quiesce_lock);
+            --c.active;
+        }
+        c.quiet.notify_all();
+    }
+};
+
+// a step of collection, if one's due. only outside a mutator_scope, with
+// everything this thread holds registered as a root
+inline void safepoint() {
+    if (detail::scope_depth() > 0)
+        return;
+
+    detail::collector & c = detail::global();
+    boost::mutex::scoped_try_lock l(c.lock);
+    if (!l)
+        return; // someone else is on it
+
+    if (c.phase == detail::collector::idle && detail::allocated_since_cycle(c) < detail::allowance(c))
+        return;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (c.phase == detail::collector::idle)
+        detail::begin_cycle(c);
+
+    // allocation running well ahead of the cycle: catch up rather than fall further behind
+    bool behind = detail::allocated_since_cycle(c) >= 2 * detail::allowance(c);
+    detail::step(c, behind ? std::size_t(-1) : c.opts.step_budget);
+
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    c.stats.longest_pause_us = std::max(c.stats.longest_pause_us, us);
+}
+
+// a whole cycle now, finishing any that's under way first. as for safepoint
+inline void collect() {
+    if (detail::scope_depth() > 0)
+        return;
+
+    detail::collector & c = detail::global();
+    boost::mutex::scoped_lock l(c.lock);
+    if (c.phase != detail::collector::idle)
+        detail::step(c, std::size_t(-1));
+    detail::begin_cycle(c);
+    detail::step(c, std::size_t(-1));
+}
+
+inline statistics stats() {
+    detail::collector & c = detail::global();
+    statistics s;
+    {
+        boost::mutex::scoped_lock l(c.lock);
+        s = c.stats;
+    }
+    boost::mutex::scoped_lock l(c.regions_lock);
+    s.regions = c.regions;
+    s.region_bytes = c.region_bytes;
+    s.promoted_bytes = c.promoted_bytes;
+    return s;
+}
+
+inline void print(std::ostream & out, statistics const& s) {
+    out << std::setw(12) << s.live_bytes << " bytes " << std::setw(10) << s.live_blocks << " blocks  live\n"
+            << std::setw(12) << s.freed_bytes << " bytes " << std::setw(10) << s.freed_blocks << " blocks  freed\n"
+            << s.cycles << " cycles, the longest pause " << s.longest_pause_us << " us\n";
+    if (s.regions != 0) {
+        std::streamsize precision = out.precision(3);
+        out << s.regions << " regions, " << 100.0 * s.promoted_bytes / std::max(s.region_bytes, 1ull) << "% of their "
+                << s.region_bytes << " bytes promoted\n";
+        out.precision(precision);
+    }
+    out.flush();
+}
+
+inline void configure(options const& opts) {
+    detail::collector & c = detail::global();
+    boost::mutex::scoped_lock l(c.lock);
+    c.opts = opts;
+    __atomic_store_n(&c.use_regions, opts.regions, __ATOMIC_RELAXED);
+}
+
+inline bool regions_enabled() {
+    return __atomic_load_n(&detail::global().use_regions, __ATOMIC_RELAXED);
+}
+
+template<typename T>
+inline void* allocate() {
+    return detail::allocate(sizeof(T), detail::descriptor_of<T>());
+}
+
+template<typename Tag>
+inline void* allocate_block(std::size_t bytes) {
+    return detail::allocate(bytes, detail::block_descriptor_of<Tag>());
+}
+
+}
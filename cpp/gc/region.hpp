@@ -0,0 +1,110 @@
+#pragma once
+
+// Regions: while one is open, everything its thread allocates is bumped out of
+// an arena of that thread's instead of being put on the heap, which is most of
+// what an evaluation makes and then drops. When it's done, promote() copies
+// out to the heap the region's blocks a value reaches (its result, the
+// environment it changed), pointing the value at the copies, and closing the
+// region finalizes what's left and hands the arena's chunks to the next one.
+// Nothing but the promoted values may hold on to the region's blocks.
+//
+// That only works if nothing older points into the region, which holds as the
+// heap is persistent, with two exceptions: flattened ropes, whose bytes go on
+// the heap (see heap_scope), and weak tables keyed by blocks, which are told
+// where their region keys went (see note_weak). Blocks are copied with memcpy,
+// so whatever's allocated in one has to be bitwise relocatable, as everything
+// made through GC_NEW is. Other threads don't share a region: a block made in
+// one must not be handed to another thread before it's promoted.
+//
+// A region opened inside another (on the same thread) does nothing, and what
+// it promotes stays in the outer one.
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/tss.hpp>
+
+#include "heap.hpp"
+
+namespace gc {
+
+namespace detail {
+
+inline arena* local_arena() {
+    static __thread arena* mine = NULL;
+    if (mine == NULL) {
+        static boost::thread_specific_ptr<arena> owner;
+        mine = new arena();
+        owner.reset(mine);
+    }
+    return mine;
+}
+
+inline unsigned next_region_id() {
+    collector & c = global();
+    boost::mutex::scoped_lock l(c.regions_lock);
+    if (++c.last_region == 0)
+        ++c.last_region;
+    return c.last_region;
+}
+
+}
+
+struct region: boost::noncopyable {
+    region() :
+            arena(detail::active_arena() == NULL ? detail::local_arena() : NULL) {
+        if (arena != NULL) {
+            arena->id = detail::next_region_id();
+            detail::active_arena() = arena;
+            m.evacuating = arena->id;
+        }
+    }
+
+    ~region() {
+        if (arena == NULL)
+            return;
+        detail::active_arena() = NULL;
+
+        for (std::size_t i(0); i < arena->weak.size(); ++i) {
+            void const* key = arena->weak[i].first;
+            header const* h = header_of(key);
+            arena->weak[i].second(key, h->mark == detail::forwarded ? h->next + 1 : NULL);
+        }
+
+        detail::collector & c = detail::global();
+        {
+            boost::mutex::scoped_lock l(c.regions_lock);
+            ++c.regions;
+            c.region_bytes += arena->allocated_bytes;
+            c.promoted_bytes += m.promoted_bytes;
+        }
+        arena->reset();
+        arena->id = 0;
+    }
+
+    // copies the region's blocks value reaches to the heap, and points it at them
+    template<typename T>
+    void promote(T & value) {
+        if (arena == NULL)
+            return;
+        m.visit(value);
+        m.drain();
+    }
+
+    bool active() const {
+        return arena != NULL;
+    }
+
+    std::size_t allocated_bytes() const {
+        return arena == NULL ? 0 : arena->allocated_bytes;
+    }
+
+    std::size_t promoted_bytes() const {
+        return m.promoted_bytes;
+    }
+
+private:
+    mutator_scope scope;
+    detail::arena* arena; // NULL when nested
+    marker m;
+};
+
+}
@@ -0,0 +1,478 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "../object.hpp"
+#include "../interpretter/interpretter.hpp"
+
+namespace harkon {
+
+// Heap images: an environment, and everything reachable from it, written out as
+// one relocatable file. Every reference inside the image is an offset from its
+// start, so loading it is a read-only mmap and a single pass over the bindings.
+// Strings and symbols too long to be kept inline are used straight out of the
+// mapping (which is why it's never unmapped), lists are rebuilt keeping whatever
+// sharing they had, and builtins are stored by name and re-bound to this
+// process's natives on load. Closures are their lambda's source and the values
+// they captured. Packed arrays are their raw elements, copied out on load, and
+// bytes are used out of the mapping like long strings.
+//
+// Layout, all integers native endian:
+//   header  magic[8] version size bindings binding_count
+//   records tag (u8) followed by a tag specific payload
+//   binding table  binding_count * (key offset, value offset)
+
+struct image_error: std::runtime_error {
+    image_error(std::string const& what) :
+            std::runtime_error("Bad image: " + what) {
+    }
+};
+
+void save_image(environment const& env, std::string const& path);
+environment load_image(std::string const& path);
+
+namespace image_impl {
+
+typedef boost::uint32_t u32;
+
+const char magic[8] = { 'H', 'K', 'I', 'M', 'A', 'G', 'E', '\0' };
+const u32 version = 2;
+
+enum tag {
+    tag_false, tag_true, tag_char, tag_int, tag_nil, tag_symbol, tag_string, tag_list, tag_builtin, tag_lambda, tag_bigint,
+    tag_packed, tag_bytes
+};
+
+struct header {
+    char magic[8];
+    u32 version;
+    u32 size;
+    u32 bindings;
+    u32 binding_count;
+};
+
+struct writer: boost::static_visitor<u32> {
+    writer() :
+            buff(sizeof(header), '\0'), limit(std::numeric_limits<u32>::max()) {
+    }
+
+    // every offset and size is a u32, so checking here, which every record and
+    // finish() call after they've written, keeps all of them in range
+    u32 here() const {
+        if (buff.size() > limit)
+            throw std::runtime_error("Unable to image more than " + boost::lexical_cast<std::string>(limit) + " bytes");
+        return buff.size();
+    }
+
+    void put_u8(unsigned char c) {
+        buff += c;
+    }
+
+    void put_u32(u32 v) {
+        buff.append(reinterpret_cast<char const*>(&v), sizeof(v));
+    }
+
+    // strings and symbols are interned, so each distinct one is written once
+    u32 put_text(tag t, persistent::string const& s) {
+        std::map<std::string, u32> & seen = (t == tag_symbol) ? symbols : strings;
+        std::string key(s.c_str(), s.size());
+
+        std::map<std::string, u32>::const_iterator it = seen.find(key);
+        if (it != seen.end())
+            return it->second;
+
+        u32 off = here();
+        put_u8(t);
+        put_u32(s.size());
+        buff.append(s.c_str(), s.size());
+        put_u8('\0'); // so c_str() works straight off the mapping
+        seen[key] = off;
+        return off;
+    }
+
+    u32 operator()(boolean b) {
+        u32 off = here();
+        put_u8(b.as_bool() ? tag_true : tag_false);
+        return off;
+    }
+    u32 operator()(char c) {
+        u32 off = here();
+        put_u8(tag_char);
+        put_u8(c);
+        return off;
+    }
+    u32 operator()(int i) {
+        u32 off = here();
+        put_u8(tag_int);
+        put_u32(static_cast<u32>(i));
+        return off;
+    }
+    u32 operator()(bigint const& i) {
+        std::string digits = i.to_string();
+        u32 off = here();
+        put_u8(tag_bigint);
+        put_u32(digits.size());
+        buff.append(digits);
+        put_u8('\0');
+        return off;
+    }
+    u32 operator()(packed const& p) {
+        u32 off = here();
+        put_u8(tag_packed);
+        put_u8(p.type());
+        put_u32(p.size());
+        for (unsigned i(0); i < p.size(); ++i) {
+            if (p.type() == packed::int32) {
+                boost::int32_t v = p.at(i);
+                buff.append(reinterpret_cast<char const*>(&v), sizeof(v));
+            } else {
+                boost::int64_t v = p.at(i);
+                buff.append(reinterpret_cast<char const*>(&v), sizeof(v));
+            }
+        }
+        return off;
+    }
+    u32 operator()(nil) {
+        u32 off = here();
+        put_u8(tag_nil);
+        return off;
+    }
+    u32 operator()(persistent::bytes const& b) {
+        u32 off = here();
+        put_u8(tag_bytes);
+        put_u32(b.size());
+        buff.append(b.data(), b.size());
+        return off;
+    }
+    u32 operator()(symbol const& s) {
+        return put_text(tag_symbol, s);
+    }
+    u32 operator()(string const& s) {
+        return put_text(tag_string, s);
+    }
+    u32 operator()(object_list const& l) {
+        void const* identity = l.begin().pointing_at;
+        std::map<void const*, u32>::const_iterator it = lists.find(identity);
+        if (it != lists.end())
+            return it->second;
+
+        std::vector<u32> elements;
+        for (object_list::const_iterator e(l.begin()); e != l.end(); ++e) {
+            elements.push_back(write(*e));
+        }
+
+        u32 off = here();
+        put_u8(tag_list);
+        put_u32(elements.size());
+        for (std::size_t i(0); i < elements.size(); ++i) {
+            put_u32(elements[i]);
+        }
+        lists[identity] = off;
+        return off;
+    }
+    u32 operator()(object_proc const& proc) {
+        if (builtin_func const* f = proc.target<builtin_func>()) {
+            builtin const* b = find_builtin(*f);
+            if (b == NULL)
+                throw std::runtime_error("Unable to image an unregistered builtin");
+
+            u32 name = put_text(tag_string, string(b->name));
+            u32 off = here();
+            put_u8(tag_builtin);
+            put_u32(name);
+            return off;
+        }
+
+        if (lambda_closure const* l = proc.target<lambda_closure>()) {
+            std::vector<symbol> const& names = l->code->captures;
+            u32 form = (*this)(object_list(l->code->lambda));
+            std::vector<std::pair<u32, u32> > captured;
+            for (std::size_t i(0); i < names.size(); ++i) {
+                u32 name = put_text(tag_symbol, names[i]);
+                captured.push_back(std::make_pair(name, write(l->captured[i])));
+            }
+
+            u32 off = here();
+            put_u8(tag_lambda);
+            put_u32(form);
+            put_u32(captured.size());
+            for (std::size_t i(0); i < captured.size(); ++i) {
+                put_u32(captured[i].first);
+                put_u32(captured[i].second);
+            }
+            return off;
+        }
+
+        throw std::runtime_error("Unable to image a compiled or foreign procedure");
+    }
+
+    u32 write(object const& o) {
+        return boost::apply_visitor(*this, o);
+    }
+
+    struct binding_writer {
+        binding_writer(writer & w, std::vector<std::pair<u32, u32> > & out) :
+                w(w), out(out) {
+        }
+        void operator()(symbol const& k, object const& v) const {
+            u32 key = w.put_text(tag_symbol, k);
+            out.push_back(std::make_pair(key, w.write(v)));
+        }
+        writer & w;
+        std::vector<std::pair<u32, u32> > & out;
+    };
+
+    std::string const& finish(environment const& env) {
+        std::vector<std::pair<u32, u32> > bindings;
+        env.for_each(binding_writer(*this, bindings));
+
+        while (here() % sizeof(u32) != 0) {
+            put_u8(0);
+        }
+
+        header h;
+        std::memcpy(h.magic, magic, sizeof(magic));
+        h.version = version;
+        h.bindings = here();
+        h.binding_count = bindings.size();
+
+        for (std::size_t i(0); i < bindings.size(); ++i) {
+            put_u32(bindings[i].first);
+            put_u32(bindings[i].second);
+        }
+
+        h.size = here();
+        buff.replace(0, sizeof(h), reinterpret_cast<char const*>(&h), sizeof(h));
+        return buff;
+    }
+
+    std::string buff;
+    std::size_t limit; // how big the image may get, less than a u32 allows only to test
+    std::map<std::string, u32> symbols;
+    std::map<std::string, u32> strings;
+    std::map<void const*, u32> lists;
+};
+
+struct reader {
+    reader(char const* base, std::size_t size) :
+            base(base), size(size) {
+    }
+
+    void need(u32 off, std::size_t len) const {
+        if (off > size || len > size - off)
+            throw image_error("record out of bounds");
+    }
+
+    unsigned char u8(u32 off) const {
+        need(off, 1);
+        return base[off];
+    }
+
+    u32 u32_at(u32 off) const {
+        need(off, sizeof(u32));
+        u32 v;
+        std::memcpy(&v, base + off, sizeof(v));
+        return v;
+    }
+
+    // what a record refers to is always written before it, so a damaged
+    // reference can't make a cycle the reader would follow forever
+    u32 child(u32 entry, u32 parent) const {
+        u32 off = u32_at(entry);
+        if (off >= parent)
+            throw image_error("forward reference");
+        return off;
+    }
+
+    char const* text(u32 off, unsigned & len) const {
+        len = u32_at(off + 1);
+        need(off + 5, std::size_t(len) + 1);
+        if (base[off + 5 + len] != '\0')
+            throw image_error("unterminated string");
+        return base + off + 5;
+    }
+
+    object read(u32 off) {
+        switch (u8(off)) {
+        case tag_false:
+            return boolean(false);
+        case tag_true:
+            return boolean(true);
+        case tag_char:
+            return static_cast<char>(u8(off + 1));
+        case tag_int:
+            return static_cast<int>(u32_at(off + 1));
+        case tag_nil:
+            return nil();
+        case tag_bigint: {
+            unsigned len;
+            char const* digits = text(off, len);
+            return make_integer(bigint::parse(digits, len));
+        }
+        case tag_bytes: {
+            u32 len = u32_at(off + 1);
+            need(off + 5, len);
+            return persistent::bytes::borrow(base + off + 5, len);
+        }
+        case tag_packed: {
+            // copied out, as the collector can only mark its own blocks
+            unsigned char type = u8(off + 1);
+            if (type > packed::int64)
+                throw image_error("unknown packed element type");
+            u32 count = u32_at(off + 2);
+            std::size_t bytes = std::size_t(count) * (type == packed::int32 ? 4 : 8);
+            need(off + 6, bytes);
+            packed p(packed::element_type(type), count);
+            if (type == packed::int32)
+                std::memcpy(p.data<boost::int32_t>(), base + off + 6, bytes);
+            else
+                std::memcpy(p.data<boost::int64_t>(), base + off + 6, bytes);
+            return p;
+        }
+        case tag_symbol: {
+            unsigned len;
+            char const* s = text(off, len);
+            return symbol(s, len);
+        }
+        case tag_string: {
+            unsigned len;
+            char const* s = text(off, len);
+            return string(s, len);
+        }
+        case tag_list:
+            return read_list(off);
+        case tag_builtin: {
+            unsigned len;
+            char const* name = text(child(off + 1, off), len);
+            builtin const* b = find_builtin(name);
+            if (b == NULL)
+                throw image_error(std::string("no builtin named ") + name);
+            return object_proc(b->func);
+        }
+        case tag_lambda: {
+            u32 form = child(off + 1, off);
+            if (u8(form) != tag_list)
+                throw image_error("lambda without a body");
+
+            u32 count = u32_at(off + 5);
+            need(off + 9, std::size_t(count) * 2 * sizeof(u32));
+            std::vector<symbol> names;
+            std::vector<object> values;
+            for (u32 i(0); i < count; ++i) {
+                u32 entry = off + 9 + i * 2 * sizeof(u32);
+                u32 key = child(entry, off);
+                if (u8(key) != tag_symbol)
+                    throw image_error("captured variable without a name");
+                unsigned len;
+                char const* name = text(key, len);
+                names.push_back(symbol(name, len));
+                values.push_back(read(child(entry + sizeof(u32), off)));
+            }
+            return make_closure(make_lambda_code(read_list(form), names), values);
+        }
+        }
+        throw image_error("unknown tag");
+    }
+
+    object_list read_list(u32 off) {
+        std::map<u32, object_list>::const_iterator it = lists.find(off);
+        if (it != lists.end())
+            return it->second;
+
+        u32 count = u32_at(off + 1);
+        need(off + 5, std::size_t(count) * sizeof(u32));
+
+        object_list l;
+        for (u32 i(count); i > 0; --i) {
+            l = l.new_push_front(read(child(off + 5 + (i - 1) * sizeof(u32), off)));
+        }
+        lists.insert(std::make_pair(off, l));
+        return l;
+    }
+
+    environment bindings() {
+        header h;
+        need(0, sizeof(h));
+        std::memcpy(&h, base, sizeof(h));
+
+        if (std::memcmp(h.magic, magic, sizeof(magic)) != 0)
+            throw image_error("not a harkon image");
+        if (h.version != version)
+            throw image_error("unsupported version");
+        if (h.size != size)
+            throw image_error("truncated");
+
+        need(h.bindings, std::size_t(h.binding_count) * 2 * sizeof(u32));
+
+        environment env;
+        for (u32 i(0); i < h.binding_count; ++i) {
+            u32 entry = h.bindings + i * 2 * sizeof(u32);
+            u32 key = u32_at(entry);
+            if (u8(key) != tag_symbol)
+                throw image_error("binding without a symbol");
+
+            unsigned len;
+            char const* name = text(key, len);
+            env.insert(symbol(name, len), read(u32_at(entry + sizeof(u32))));
+        }
+        return env;
+    }
+
+    char const* base;
+    std::size_t size;
+    std::map<u32, object_list> lists;
+};
+
+}
+
+inline void save_image(environment const& env, std::string const& path) {
+    image_impl::writer w;
+    std::string const& buff = w.finish(env);
+
+    std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+    out.write(buff.data(), buff.size());
+    if (!out)
+        throw std::runtime_error("Unable to write image " + path);
+}
+
+inline environment load_image(std::string const& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw std::runtime_error("Unable to open image " + path + ": " + ::strerror(errno));
+
+    struct stat st;
+    if (::fstat(fd, &st) == -1 || st.st_size == 0) {
+        ::close(fd);
+        throw image_error(path + " is empty");
+    }
+
+    void* mapped = ::mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED)
+        throw std::runtime_error("Unable to map image " + path + ": " + ::strerror(errno));
+
+    try {
+        image_impl::reader r(static_cast<char const*>(mapped), st.st_size);
+        return r.bindings();
+    } catch (...) {
+        ::munmap(mapped, st.st_size);
+        throw;
+    }
+}
+
+}
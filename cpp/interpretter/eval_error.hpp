@@ -0,0 +1,149 @@
+#pragma once
+
+#include <cstring>
+#include <exception>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
+
+#include "../object.hpp"
+#include "../reader/source_span.hpp"
+
+namespace harkon {
+
+// the forms being evaluated on this thread, innermost first, so an error can
+// tell where it happened without anything being caught on the way out
+struct form_scope: boost::noncopyable {
+    explicit form_scope(persistent::list<object> const& form) :
+            form(form), outer(innermost()) {
+        innermost() = this;
+    }
+    ~form_scope() {
+        innermost() = outer;
+    }
+
+    static form_scope*& innermost() {
+        static __thread form_scope* scope = NULL;
+        return scope;
+    }
+
+    persistent::list<object> const& form;
+    form_scope* outer;
+};
+
+enum error_kind {
+    unexpected_type, // offending isn't an `expected`
+    unresolved_symbol, // offending is the symbol
+    out_of_range, // offending is the index
+    bad_form, // the form was the wrong shape for what it calls; `expected` says how
+    io_failure // offending is (path errno), `expected` what couldn't be done to it
+};
+
+// What goes wrong evaluating something. Making one costs little more than
+// copying the offending object: the message (which prints it) is only made if
+// what() is asked for, as code that catches a mismatch and tries something
+// else never looks. The same goes for the span, that of the innermost form
+// being evaluated that the reader saw, looked for no further out than
+// search_depth forms: only which forms they were is noted when it's made.
+struct eval_error: std::exception {
+    static const unsigned search_depth = 64;
+
+    eval_error(error_kind kind, object const& offending, char const* expected = "") :
+            kind(kind), offending(offending), expected(expected), forms(0), span_found(false) {
+        form_scope const* scope = form_scope::innermost();
+        for (; scope != NULL && forms < search_depth; scope = scope->outer) {
+            form_ids[forms++] = scope->form.identity();
+        }
+    }
+
+    virtual ~eval_error() throw () {
+    }
+
+    virtual char const* what() const throw () {
+        if (message.empty()) {
+            try {
+                message = format();
+            } catch (...) {
+                return "Unable to describe an evaluation error";
+            }
+        }
+        return message.c_str();
+    }
+
+    error_kind kind;
+    object offending;
+    char const* expected; // the type's name, or for bad_form the whole complaint
+
+    // the forms are only known by identity, so ask before they can be collected
+    // (eval_in_region does before its region goes)
+    boost::optional<source_span> const& span() const {
+        if (!span_found) {
+            for (unsigned i(0); !found && i < forms; ++i) {
+                found = find_span(form_ids[i]);
+            }
+            span_found = true;
+        }
+        return found;
+    }
+
+private:
+    std::string format() const {
+        // the offending object could be huge, and only needs recognising
+        print_options opts;
+        opts.max_depth = 4;
+        opts.max_length = 16;
+
+        switch (kind) {
+        case unexpected_type:
+            return "Unexpected " + pretty_print(offending, opts) + " was found";
+        case unresolved_symbol:
+            return "Unable to resolve symbol: " + pretty_print(offending, opts);
+        case out_of_range:
+            return "Index " + pretty_print(offending, opts) + " is out of range";
+        case io_failure: {
+            object_list const& l = boost::get<object_list>(offending);
+            return std::string("Unable to ") + expected + " " + pretty_print(l.front(), opts) + ": " + ::strerror(
+                    boost::get<int>(*(l.begin() + 1)));
+        }
+        case bad_form:
+            break;
+        }
+        return expected;
+    }
+
+    mutable std::string message;
+    void const* form_ids[search_depth];
+    unsigned forms;
+    mutable bool span_found;
+    mutable boost::optional<source_span> found;
+};
+
+// what expect_as says it wanted
+template<typename T> inline char const* type_name();
+template<> inline char const* type_name<boolean>() {
+    return "boolean";
+}
+template<> inline char const* type_name<int>() {
+    return "int";
+}
+template<> inline char const* type_name<packed>() {
+    return "packed array";
+}
+template<> inline char const* type_name<symbol>() {
+    return "symbol";
+}
+template<> inline char const* type_name<string>() {
+    return "string";
+}
+template<> inline char const* type_name<persistent::bytes>() {
+    return "bytes";
+}
+template<> inline char const* type_name<object_list>() {
+    return "list";
+}
+template<> inline char const* type_name<object_proc>() {
+    return "procedure";
+}
+
+}
@@ -1,41 +1,196 @@
 #pragma once
+#include <algorithm>
 #include <stdexcept>
+#include <cstring>
+#include <limits>
+#include <vector>
 
+#include "../gc/region.hpp"
+#include "../io/stream.hpp"
 #include "../object.hpp"
 #include "../persistent/map.hpp"
-#include <boost/bind.hpp>
+#include "eval_error.hpp"
+
+#include <boost/aligned_storage.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/type_traits/alignment_of.hpp>
 
 namespace harkon {
 
 object eval(object const& o, environment & env);
 
+typedef object (*builtin_func)(persistent::list<object> const& args, environment & env);
+
 template<typename T>
 T expect_as(object const& o) {
     T const* v = boost::get<T>(&o);
-    if (v == NULL) {
-        throw std::runtime_error("Unexpected " + pretty_print(o) + " was found"); // TODO: lol...
+    if (v == NULL)
+        throw eval_error(unexpected_type, o, type_name<T>());
+    return *v;
+}
+
+// a packed array element or an integer that doesn't fit an int64
+inline eval_error packed_overflow(object const& o) {
+    return eval_error(bad_form, o, "Packed array elements only go up to an int64");
+}
+
+// a packed array's elements added to (or multiplied by) another's
+inline packed combine_packed(packed const& a, packed const& b, bool multiply) {
+    if (a.size() != b.size())
+        throw eval_error(bad_form, b, "Packed arrays of different lengths were combined");
+    packed r;
+    if (!(multiply ? packed_mul(a, b, r) : packed_add(a, b, r)))
+        throw packed_overflow(a);
+    return r;
+}
+
+// an integer combined with every element, as adding or multiplying one by a packed array does
+inline packed broadcast(packed const& a, object const& scalar, bool multiply) {
+    long long v;
+    if (int const* i = boost::get<int>(&scalar)) {
+        v = *i;
     } else {
-        return *v;
+        bigint const& b = boost::get<bigint>(scalar);
+        if (!b.fits_int64())
+            throw packed_overflow(scalar);
+        v = b.to_int64();
     }
+    return combine_packed(a, packed_fill(a.size(), v), multiply);
 }
 
+// Sums integers in an int, until the first overflow promotes it to a bigint.
+// Packed arrays are summed apart an element at a time, and anything else added
+// to every element of that at the end
+struct integer_sum {
+    integer_sum() :
+            small(0), promoted(false), vectored(false) {
+    }
+
+    void add(object const& o) {
+        if (int const* i = boost::get<int>(&o)) {
+            if (!promoted) {
+                int r;
+                if (!__builtin_add_overflow(small, *i, &r)) {
+                    small = r;
+                    return;
+                }
+                promote();
+            }
+            big = big + bigint(*i);
+        } else if (bigint const* b = boost::get<bigint>(&o)) {
+            promote();
+            big = big + *b;
+        } else if (packed const* p = boost::get<packed>(&o)) {
+            vec = vectored ? combine_packed(vec, *p, false) : *p;
+            vectored = true;
+        } else {
+            expect_as<int>(o); // throws
+        }
+    }
+
+    object result() const {
+        object scalar = promoted ? make_integer(big) : object(small);
+        if (!vectored)
+            return scalar;
+        return scalar == object(0) ? vec : broadcast(vec, scalar, false);
+    }
+
+private:
+    void promote() {
+        if (!promoted) {
+            big = bigint(small);
+            promoted = true;
+        }
+    }
+
+    int small;
+    bool promoted;
+    bigint big;
+    bool vectored;
+    packed vec;
+};
+
+// and the same for products
+struct integer_product {
+    integer_product() :
+            small(1), promoted(false), vectored(false) {
+    }
+
+    void mul(object const& o) {
+        if (int const* i = boost::get<int>(&o)) {
+            if (!promoted) {
+                int r;
+                if (!__builtin_mul_overflow(small, *i, &r)) {
+                    small = r;
+                    return;
+                }
+                promote();
+            }
+            big = big * bigint(*i);
+        } else if (bigint const* b = boost::get<bigint>(&o)) {
+            promote();
+            big = big * *b;
+        } else if (packed const* p = boost::get<packed>(&o)) {
+            vec = vectored ? combine_packed(vec, *p, true) : *p;
+            vectored = true;
+        } else {
+            expect_as<int>(o); // throws
+        }
+    }
+
+    object result() const {
+        object scalar = promoted ? make_integer(big) : object(small);
+        if (!vectored)
+            return scalar;
+        return scalar == object(1) ? vec : broadcast(vec, scalar, true);
+    }
+
+private:
+    void promote() {
+        if (!promoted) {
+            big = bigint(small);
+            promoted = true;
+        }
+    }
+
+    int small;
+    bool promoted;
+    bigint big;
+    bool vectored;
+    packed vec;
+};
+
 inline object builtin_add(persistent::list<object> const& args, environment & env) {
     assert(!args.empty());
 
-    int cum = 0;
+    integer_sum cum;
+
+    for (persistent::list<object>::const_iterator it(args.begin() + 1); it != args.end(); ++it) {
+        cum.add(eval(*it, env));
+    }
+
+    return cum.result();
+}
+
+inline object builtin_mul(persistent::list<object> const& args, environment & env) {
+    assert(!args.empty());
+
+    integer_product cum;
 
     for (persistent::list<object>::const_iterator it(args.begin() + 1); it != args.end(); ++it) {
-        cum += expect_as<int>(eval(*it, env));
+        cum.mul(eval(*it, env));
     }
 
-    return cum;
+    return cum.result();
 }
 
 inline object builtin_def(persistent::list<object> const& args, environment & env) {
     assert(!args.empty());
 
     if (args.size() != 3)
-        throw std::runtime_error("__builtin_def expected 2 args");
+        throw eval_error(bad_form, object_list(args), "__builtin_def expected 2 args");
 
     persistent::list<object>::const_iterator it(args.begin() + 1);
     assert(it != args.end());
@@ -50,56 +205,376 @@ inline object builtin_def(persistent::list<object> const& args, environment & en
     return nil();
 }
 
-inline object eval_lambda(environment & captured_env, persistent::list<object> const& lambda,
-        persistent::list<object> const& args, environment & env) {
+// Lambdas. A lambda's body is analysed once, when the lambda is made. The
+// variables of enclosing lambdas that it uses are captured, by value, and
+// those and its parameters are given slots in a frame, with the references to
+// them rewritten as reads of their slots. Nested lambdas become makers. A call
+// lays the captured values and its arguments out in a frame on the native
+// stack and evaluates the body against that, leaving the environment to
+// globals (and so to the HAMT), anything free that no enclosing lambda binds
+// being looked up where it's called. Frames never need to outlive their call,
+// as a closure copies what it captures out of its maker's frame.
 
-    assert(!args.empty());
-    assert(!lambda.empty());
+// the slots of the frame being evaluated against, on this thread
+inline object const*& current_frame() {
+    static __thread object const* slots = NULL;
+    return slots;
+}
 
-    environment captured_copy = env;
-    // captured_copy.insert("recur", object_proc(boost::bind(&eval_lambda, captured_env, lambda, _1, _2)));
-    //captured_copy.merge(captured_env);
+// makes slots the current frame while it's in scope
+struct frame_scope: boost::noncopyable {
+    explicit frame_scope(object const* slots) :
+            saved(current_frame()) {
+        current_frame() = slots;
+    }
+    ~frame_scope() {
+        current_frame() = saved;
+    }
 
-    persistent::list<object>::const_iterator lit(lambda.begin() + 1);
+    object const* saved;
+};
 
-    object_list lambda_arg_names = expect_as<object_list>(*lit);
+// what a reference to a local is rewritten as, in head position of a form of its own
+struct slot_ref {
+    explicit slot_ref(unsigned index) :
+            index(index) {
+    }
 
-    persistent::list<object>::const_iterator vit(args.begin());
+    object operator()(object_list const&, environment &) const {
+        return current_frame()[index];
+    }
 
-    for (object_list::const_iterator arg_it(lambda_arg_names.begin()); arg_it != lambda_arg_names.end() ; ++arg_it) {
-        ++vit;
-        if (vit == args.end()) {
-            throw std::runtime_error("Too few arguments provided when eval lambda result");
+    unsigned index;
+};
+
+// a frame's slots, on the stack unless there are a lot of them
+struct frame_buffer: boost::noncopyable {
+    static const unsigned inline_slots = 4;
+
+    explicit frame_buffer(unsigned size) :
+            count(0), slots(size <= inline_slots ? reinterpret_cast<object*>(&storage) : static_cast<object*>(::operator new(
+                    size * sizeof(object)))) {
+    }
+
+    ~frame_buffer() {
+        for (unsigned i(0); i < count; ++i) {
+            slots[i].~object();
         }
-        symbol arg = expect_as<symbol>(*arg_it);
+        if (slots != reinterpret_cast<object*>(&storage))
+            ::operator delete(slots);
+    }
 
-        captured_copy.insert(arg, eval(*vit, env));
+    void push(object const& o) {
+        new (slots + count) object(o);
+        ++count;
     }
 
-    ++lit;
-    if (lit == lambda.end()) {
-        throw std::runtime_error("Error, no body in evaluated lambda");
+    object const* data() const {
+        return slots;
     }
 
-    object r = eval(*lit, captured_copy);
-    // std::cout << "Func result: " << pretty_print(r) << std::endl;
-    return r;
+private:
+    boost::aligned_storage<inline_slots * sizeof(object), boost::alignment_of<object>::value>::type storage;
+    unsigned count;
+    object* slots;
+};
+
+struct lambda_code {
+    lambda_code(persistent::list<object> const& lambda, std::vector<symbol> const& captures) :
+            lambda(lambda), captures(captures), body(nil()) {
+    }
+
+    unsigned frame_size() const {
+        return captures.size() + params.size();
+    }
+
+    persistent::list<object> lambda; // as written, for images and the like
+    std::vector<symbol> params;
+    std::vector<symbol> captures; // free variables an enclosing lambda binds
+    std::vector<unsigned> capture_slots; // where each is in the enclosing lambda's frame, for its maker
+    object body; // analysed, against a frame of the captures then the parameters
+
+    friend char const* alloc_name(lambda_code const*) {
+        return "lambda code";
+    }
+
+    friend void gc_visit(lambda_code const& c, gc::marker & m) {
+        m.visit(c.lambda);
+        m.visit(c.params);
+        m.visit(c.captures);
+        m.visit(c.body);
+    }
+};
+
+// what a closure's captured values are accounted against in alloc_stats
+struct closure_values {
+};
+
+inline char const* alloc_name(closure_values const*) {
+    return "closure values";
 }
 
-inline object builtin_lambda(persistent::list<object> const& args, environment & env) {
-    assert(!args.empty());
+inline void gc_visit_block(closure_values const*, void const* block, std::size_t bytes, gc::marker & m) {
+    object const* values = static_cast<object const*>(block);
+    for (std::size_t i(0); i < bytes / sizeof(object); ++i) {
+        m.visit(values[i]);
+    }
+}
 
-    if (args.size() != 3)
-        throw std::runtime_error("__builtin_lambda expected 2 args");
+inline void gc_destroy_block(closure_values const*, void* block, std::size_t bytes) {
+    object* values = static_cast<object*>(block);
+    for (std::size_t i(0); i < bytes / sizeof(object); ++i) {
+        values[i].~object();
+    }
+}
+
+inline bool contains(std::vector<symbol> const& names, symbol const& s) {
+    return std::find(names.begin(), names.end(), s) != names.end();
+}
+
+// the parameters of `(lambda (params...) body)`, unless `lambda` is one of bound
+inline object_list const* lambda_params(object_list const& l, std::vector<symbol> const& bound) {
+    if (l.size() != 3)
+        return NULL;
+    symbol const* head = boost::get<symbol>(&l.front());
+    object_list const* params = boost::get<object_list>(&*(l.begin() + 1));
+    if (head == NULL || params == NULL || *head != symbol("lambda") || contains(bound, *head))
+        return NULL;
+    for (object_list::const_iterator it(params->begin()); it != params->end(); ++it) {
+        if (boost::get<symbol>(&*it) == NULL)
+            return NULL;
+    }
+    return params;
+}
+
+// the symbols o refers to that aren't bound, around it or by lambdas inside it,
+// in the order they're first seen
+inline void free_symbols(object const& o, std::vector<symbol> & bound, std::vector<symbol> & out) {
+    if (symbol const* s = boost::get<symbol>(&o)) {
+        if (!contains(bound, *s) && !contains(out, *s))
+            out.push_back(*s);
+        return;
+    }
+
+    object_list const* l = boost::get<object_list>(&o);
+    if (l == NULL)
+        return;
+
+    if (object_list const* params = lambda_params(*l, bound)) {
+        std::size_t mark = bound.size();
+        for (object_list::const_iterator it(params->begin()); it != params->end(); ++it) {
+            bound.push_back(boost::get<symbol>(*it));
+        }
+        free_symbols(*(l->begin() + 2), bound, out);
+        bound.erase(bound.begin() + mark, bound.end());
+        return;
+    }
+
+    for (object_list::const_iterator it(l->begin()); it != l->end(); ++it) {
+        free_symbols(*it, bound, out);
+    }
+}
+
+// which of the lambda's free variables are among locals
+inline std::vector<symbol> captures_of(object const& lambda, std::vector<symbol> const& locals) {
+    std::vector<symbol> bound;
+    std::vector<symbol> free;
+    free_symbols(lambda, bound, free);
+
+    std::vector<symbol> captures;
+    for (std::size_t i(0); i < free.size(); ++i) {
+        if (contains(locals, free[i]))
+            captures.push_back(free[i]);
+    }
+    return captures;
+}
+
+lambda_code* make_lambda_code(persistent::list<object> const& lambda, std::vector<symbol> const& captures);
+
+// a closure: its code and the values of code->captures
+struct lambda_closure {
+    lambda_closure(lambda_code const* code, object const* captured) :
+            code(code), captured(captured) {
+    }
+
+    object operator()(object_list const& form, environment & env) const {
+        lambda_code const& c = *code;
+
+        frame_buffer slots(c.frame_size());
+        for (std::size_t i(0); i < c.captures.size(); ++i) {
+            slots.push(captured[i]);
+        }
+
+        // arguments are evaluated by the caller, against its own frame
+        persistent::list<object>::const_iterator vit(form.begin());
+        for (std::size_t i(0); i < c.params.size(); ++i) {
+            ++vit;
+            if (vit == form.end())
+                throw eval_error(bad_form, form, "Too few arguments provided when eval lambda result");
+            slots.push(eval(*vit, env));
+        }
+
+        frame_scope scope(slots.data());
+        environment local = env; // so a def in the body stays there
+        return eval(c.body, local);
+    }
+
+    // a call with its arguments already evaluated, n of them
+    object call(object const* args, std::size_t n, environment & env) const {
+        lambda_code const& c = *code;
+        if (n < c.params.size())
+            throw eval_error(bad_form, object_list(c.lambda), "Too few arguments provided when eval lambda result");
+
+        frame_buffer slots(c.frame_size());
+        for (std::size_t i(0); i < c.captures.size(); ++i) {
+            slots.push(captured[i]);
+        }
+        for (std::size_t i(0); i < c.params.size(); ++i) {
+            slots.push(args[i]);
+        }
+
+        frame_scope scope(slots.data());
+        environment local = env;
+        return eval(c.body, local);
+    }
+
+    lambda_code const* code;
+    object const* captured;
+
+    friend void gc_visit(lambda_closure const& c, gc::marker & m) {
+        m.mark(c.code);
+        m.mark(c.captured);
+    }
+};
+
+inline object* alloc_captured(std::size_t n) {
+    return n == 0 ? NULL : static_cast<object*>(GC_ALLOC_AS(closure_values, n * sizeof(object)));
+}
+
+inline object make_closure(lambda_code const* code, std::vector<object> const& values) {
+    object* captured = alloc_captured(values.size());
+    for (std::size_t i(0); i < values.size(); ++i) {
+        new (captured + i) object(values[i]);
+    }
+    return object_proc(lambda_closure(code, captured));
+}
+
+// what a lambda nested in another's body is rewritten as: makes the closure,
+// copying what it captures out of the enclosing call's frame
+struct lambda_maker {
+    explicit lambda_maker(lambda_code const* code) :
+            code(code) {
+    }
+
+    object operator()(object_list const&, environment &) const {
+        object const* frame = current_frame();
+        std::vector<unsigned> const& from = code->capture_slots;
+
+        object* captured = alloc_captured(from.size());
+        for (std::size_t i(0); i < from.size(); ++i) {
+            new (captured + i) object(frame[from[i]]);
+        }
+        return object_proc(lambda_closure(code, captured));
+    }
+
+    lambda_code const* code;
 
-    return object_proc(boost::bind(&eval_lambda, env, args, _1, _2));
+    friend void gc_visit(lambda_maker const& maker, gc::marker & m) {
+        m.mark(maker.code);
+    }
+};
+
+// the slot of s among locals, the innermost if it's there twice
+inline int slot_of(std::vector<symbol> const& locals, symbol const& s) {
+    for (std::size_t i(locals.size()); i > 0; --i) {
+        if (locals[i - 1] == s)
+            return i - 1;
+    }
+    return -1;
+}
+
+inline object call_form(object_proc const& proc) {
+    return object_list(object_list().new_push_front(proc));
+}
+
+// o with its references to locals (each held in the slot at its index) rewritten
+// as slot reads and the lambdas nested in it as makers, or false if it has none
+inline bool analyse(object const& o, std::vector<symbol> const& locals, object & out) {
+    if (symbol const* s = boost::get<symbol>(&o)) {
+        int slot = slot_of(locals, *s);
+        if (slot < 0)
+            return false;
+        out = call_form(slot_ref(slot));
+        return true;
+    }
+
+    object_list const* l = boost::get<object_list>(&o);
+    if (l == NULL || l->empty())
+        return false;
+
+    if (lambda_params(*l, locals)) {
+        lambda_code* code = make_lambda_code(*l, captures_of(o, locals));
+        for (std::size_t i(0); i < code->captures.size(); ++i) {
+            code->capture_slots.push_back(slot_of(locals, code->captures[i]));
+        }
+        out = call_form(lambda_maker(code));
+        return true;
+    }
+
+    // the name in (def name value) is bound rather than referred to
+    symbol const* head = boost::get<symbol>(&l->front());
+    bool is_def = l->size() == 3 && head != NULL && *head == symbol("def") && slot_of(locals, *head) < 0;
+
+    std::vector<object> parts;
+    bool changed = false;
+    for (object_list::const_iterator it(l->begin()); it != l->end(); ++it) {
+        parts.push_back(*it);
+        if (!(is_def && parts.size() == 2))
+            changed |= analyse(*it, locals, parts.back());
+    }
+    if (!changed)
+        return false;
+
+    object_list rebuilt;
+    for (std::size_t i(parts.size()); i > 0; --i) {
+        rebuilt = rebuilt.new_push_front(parts[i - 1]);
+    }
+    copy_span(*l, rebuilt);
+    out = rebuilt;
+    return true;
+}
+
+inline lambda_code* make_lambda_code(persistent::list<object> const& lambda, std::vector<symbol> const& captures) {
+    if (lambda.size() != 3)
+        throw eval_error(bad_form, object_list(lambda), "__builtin_lambda expected 2 args");
+
+    lambda_code* code = GC_NEW(lambda_code)(lambda, captures);
+
+    object_list names = expect_as<object_list>(*(lambda.begin() + 1));
+    for (object_list::const_iterator it(names.begin()); it != names.end(); ++it) {
+        code->params.push_back(expect_as<symbol>(*it));
+    }
+
+    std::vector<symbol> locals(captures);
+    locals.insert(locals.end(), code->params.begin(), code->params.end());
+
+    object const& body = *(lambda.begin() + 2);
+    if (!analyse(body, locals, code->body))
+        code->body = body;
+    return code;
+}
+
+inline object builtin_lambda(persistent::list<object> const& args, environment &) {
+    assert(!args.empty());
+
+    return make_closure(make_lambda_code(args, std::vector<symbol>()), std::vector<object>());
 }
 
 inline object builtin_eq(persistent::list<object> const& args, environment & env) {
     assert(!args.empty());
 
     if (args.size() < 3)
-        throw std::runtime_error("__builtin_eq needs at least 2 args");
+        throw eval_error(bad_form, object_list(args), "__builtin_eq needs at least 2 args");
 
     for (persistent::list<object>::const_iterator it(args.begin() + 1); (it+1) != args.end(); ++it) {
         if (eval(*it, env) != eval(*(it + 1), env))
@@ -112,7 +587,7 @@ inline object builtin_if(persistent::list<object> const& args, environment & env
     assert(!args.empty());
 
     if (args.size() != 4)
-        throw std::runtime_error("__builtin_if expected 3 args");
+        throw eval_error(bad_form, object_list(args), "__builtin_if expected 3 args");
 
     persistent::list<object>::const_iterator it(args.begin() + 1);
     assert(it != args.end());
@@ -131,15 +606,985 @@ inline object builtin_if(persistent::list<object> const& args, environment & env
     return eval(*it, env);
 }
 
+inline object builtin_env_size(persistent::list<object> const& args, environment & env) {
+    assert(!args.empty());
+
+    if (args.size() != 1)
+        throw eval_error(bad_form, object_list(args), "__builtin_env_size expected no args");
+
+    return static_cast<int>(env.size());
+}
+
+inline object_list cons_key(object_list acc, symbol const& key, object const&) {
+    return acc.new_push_front(key);
+}
+
+// the names bound in the current environment, in no particular order
+inline object builtin_env_keys(persistent::list<object> const& args, environment & env) {
+    assert(!args.empty());
+
+    if (args.size() != 1)
+        throw eval_error(bad_form, object_list(args), "__builtin_env_keys expected no args");
+
+    return env.fold(object_list(), &cons_key);
+}
+
+inline object builtin_concat(persistent::list<object> const& args, environment & env) {
+    assert(!args.empty());
+
+    persistent::string cum("");
+
+    for (persistent::list<object>::const_iterator it(args.begin() + 1); it != args.end(); ++it) {
+        cum = cum + expect_as<string>(eval(*it, env));
+    }
+
+    return string(cum);
+}
+
+inline unsigned expect_index(object const& o, unsigned limit) {
+    int i = expect_as<int>(o);
+    if (i < 0 || unsigned(i) > limit)
+        throw eval_error(out_of_range, o);
+    return i;
+}
+
+// (substr s start length)
+inline object builtin_substr(persistent::list<object> const& args, environment & env) {
+    assert(!args.empty());
+
+    if (args.size() != 4)
+        throw eval_error(bad_form, object_list(args), "__builtin_substr expected 3 args");
+
+    persistent::list<object>::const_iterator it(args.begin() + 1);
+    string s = expect_as<string>(eval(*it, env));
+    unsigned start = expect_index(eval(*++it, env), s.size());
+    unsigned len = expect_index(eval(*++it, env), s.size() - start);
+
+    return string(s.substr(start, len));
+}
+
+inline object builtin_char_at(persistent::list<object> const& args, environment & env) {
+    assert(!args.empty());
+
+    if (args.size() != 3)
+        throw eval_error(bad_form, object_list(args), "__builtin_char_at expected 2 args");
+
+    persistent::list<object>::const_iterator it(args.begin() + 1);
+    string s = expect_as<string>(eval(*it, env));
+    object index = eval(*++it, env);
+    if (s.size() == 0)
+        throw eval_error(out_of_range, index);
+
+    return s.at(expect_index(index, s.size() - 1));
+}
+
+inline object builtin_str_length(persistent::list<object> const& args, environment & env) {
+    assert(!args.empty());
+
+    if (args.size() != 2)
+        throw eval_error(bad_form, object_list(args), "__builtin_str_length expected 1 arg");
+
+    return static_cast<int>(expect_as<string>(eval(*(args.begin() + 1), env)).size());
+}
+
+// an io::error from using `what`, as an eval_error keeping the errno
+inline eval_error io_error(io::error const& e, object const& what, char const* doing) {
+    return eval_error(io_failure, object_list(object_list().new_push_front(e.code).new_push_front(what)), doing);
+}
+
+// Streams: the lines or chunks of a file or stdin, read ahead on a thread of
+// their own (see io/stream.hpp). A stream is a procedure, so it needs no object
+// type of its own: (next s), or just (s), is its next item as a string, or #f
+// once there are no more. The file's closed when the last copy is collected.
+struct stream_ref {
+    explicit stream_ref(io::stream* s, std::string const& name = "stream") :
+            s(s), name(name) {
+    }
+
+    object operator()(object_list const&, environment &) const {
+        char const* data;
+        std::size_t size;
+        try {
+            if (!s->next(data, size))
+                return boolean(false);
+        } catch (io::error const& e) {
+            throw io_error(e, string(string::MakeCopy(), name.c_str(), name.size()), "read");
+        }
+        return string(string::MakeCopy(), data, size);
+    }
+
+    boost::shared_ptr<io::stream> s;
+    std::string name; // what's read, for errors
+};
+
+inline object open_stream(string const& path, io::stream::split_type split, std::size_t chunk_bytes = 0) {
+    try {
+        return object_proc(stream_ref(io::stream::open(path.c_str(), split, chunk_bytes), std::string(path.c_str(),
+                path.size())));
+    } catch (io::error const& e) {
+        throw io_error(e, path, "open");
+    }
+}
+
+inline object_proc const& expect_stream(object const& o) {
+    object_proc const* p = boost::get<object_proc>(&o);
+    if (p == NULL || p->target<stream_ref>() == NULL)
+        throw eval_error(unexpected_type, o, "stream");
+    return *p;
+}
+
+// (open-lines path)
+inline object builtin_open_lines(persistent::list<object> const& args, environment & env) {
+    assert(!args.empty());
+
+    if (args.size() != 2)
+        throw eval_error(bad_form, object_list(args), "__builtin_open_lines expected 1 arg");
+
+    return open_stream(expect_as<string>(eval(*(args.begin() + 1), env)), io::stream::lines);
+}
+
+// (open-chunks path bytes)
+inline object builtin_open_chunks(persistent::list<object> const& args, environment & env) {
+    assert(!args.empty());
+
+    if (args.size() != 3)
+        throw eval_error(bad_form, object_list(args), "__builtin_open_chunks expected 2 args");
+
+    persistent::list<object>::const_iterator it(args.begin() + 1);
+    string path = expect_as<string>(eval(*it, env));
+    object bytes = eval(*++it, env);
+    if (expect_as<int>(bytes) <= 0)
+        throw eval_error(out_of_range, bytes);
+    return open_stream(path, io::stream::chunks, boost::get<int>(bytes));
+}
+
+inline object builtin_stdin_lines(persistent::list<object> const& args, environment &) {
+    assert(!args.empty());
+
+    if (args.size() != 1)
+        throw eval_error(bad_form, object_list(args), "__builtin_stdin_lines expected no args");
+    if (io::stdin_reserved())
+        throw eval_error(bad_form, object_list(args),
+                "__builtin_stdin_lines can't read stdin, it's the REPL's input. Run the script with --run to read it");
+
+    return object_proc(stream_ref(new io::stream(STDIN_FILENO, false, io::stream::lines), "stdin"));
+}
+
+inline object builtin_next(persistent::list<object> const& args, environment & env) {
+    assert(!args.empty());
+
+    if (args.size() != 2)
+        throw eval_error(bad_form, object_list(args), "__builtin_next expected 1 arg");
+
+    return expect_stream(eval(*(args.begin() + 1), env))(object_list(args), env);
+}
+
+// Sequences: lazy pipelines of map, filter and take stages over a list, a
+// stream, a range of ints, a packed array or sequences zipped together. Nothing is computed
+// until a fold or to-list pulls the elements through, and a stage added to a
+// sequence extends its pipeline rather than wrapping it, so however many are
+// chained an element passes through all of them before the next is pulled,
+// with nothing in between made into a list. An element is one value, or one
+// from each of the sequences zipped, which the next procedure is called with
+// as separate arguments. compiler.hpp fuses chains it can see whole the same
+// way at compile time (see rt::source).
+struct sequence_stage {
+    enum kind_type {
+        map, filter, take
+    };
+
+    sequence_stage(kind_type kind, object const& arg) :
+            kind(kind), arg(arg) {
+    }
+
+    kind_type kind;
+    object arg; // the procedure, or how many to take
+
+    friend void gc_visit(sequence_stage const& s, gc::marker & m) {
+        m.visit(s.arg);
+    }
+};
+
+struct sequence_code {
+    enum source_type {
+        list_source, stream_source, range_source, packed_source, zip_source
+    };
+
+    explicit sequence_code(source_type type) :
+            type(type), source(nil()), from(0), to(0) {
+    }
+
+    // how many values each element is
+    unsigned arity() const {
+        unsigned n = 1;
+        if (type == zip_source) {
+            n = 0;
+            for (std::size_t i(0); i < zipped.size(); ++i) {
+                n += zipped[i]->arity();
+            }
+        }
+        for (std::size_t i(0); i < stages.size(); ++i) {
+            if (stages[i].kind == sequence_stage::map)
+                n = 1;
+        }
+        return n;
+    }
+
+    source_type type;
+    object source; // the list, stream or packed array
+    int from, to; // the range
+    std::vector<sequence_code const*> zipped;
+    std::vector<sequence_stage> stages;
+
+    friend char const* alloc_name(sequence_code const*) {
+        return "sequence code";
+    }
+
+    friend void gc_visit(sequence_code const& c, gc::marker & m) {
+        m.visit(c.source);
+        for (std::size_t i(0); i < c.zipped.size(); ++i) {
+            m.mark(c.zipped[i]);
+        }
+        m.visit(c.stages);
+    }
+};
+
+// what o's elements are pulled from, made up for a list, stream or packed array
+inline sequence_code const* as_sequence(object const& o);
+
+// calling a sequence, like (to-list s), gives its elements as a list
+struct sequence {
+    explicit sequence(sequence_code const* code) :
+            code(code) {
+    }
+
+    object operator()(object_list const&, environment & env) const;
+
+    sequence_code const* code;
+
+    friend void gc_visit(sequence const& s, gc::marker & m) {
+        m.mark(s.code);
+    }
+};
+
+// a procedure to call with values already evaluated: a closure directly, and
+// anything else with a form of reads of them from a frame, made once
+struct prepared_call {
+    prepared_call(object const& fn, unsigned arity) :
+            proc(expect_as<object_proc>(fn)), arity(arity) {
+        if (proc.target<lambda_closure>() != NULL)
+            return;
+        for (unsigned i(arity); i > 0; --i) {
+            form = form.new_push_front(call_form(slot_ref(i - 1)));
+        }
+        form = form.new_push_front(proc);
+    }
+
+    object operator()(object const* args, environment & env) const {
+        if (lambda_closure const* l = proc.target<lambda_closure>())
+            return l->call(args, arity, env);
+        frame_scope scope(args);
+        return proc(form, env);
+    }
+
+    object_proc proc;
+    unsigned arity;
+    object_list form;
+};
+
+// pulls a sequence's elements, each through all its stages before the next
+struct sequence_cursor: boost::noncopyable {
+    sequence_cursor(sequence_code const* code, environment & env);
+
+    // the next element's arity() values, good until the next call, or NULL after the last
+    object const* next();
+
+    unsigned arity() const {
+        return width;
+    }
+
+private:
+    bool pull();
+
+    sequence_code const* code;
+    environment & env;
+    object_list::const_iterator at; // in the list
+    int counter; // in the range, or the packed array
+    std::vector<boost::shared_ptr<sequence_cursor> > zipped;
+    std::vector<object> values; // as pulled
+    std::vector<object> mapped; // by each stage, if it maps
+    std::vector<prepared_call> calls; // for each stage that maps or filters, in order
+    std::vector<int> taken; // by each stage, if it takes
+    unsigned width;
+    bool done;
+};
+
+inline sequence_cursor::sequence_cursor(sequence_code const* code, environment & env) :
+        code(code), env(env), at(object_list().begin()), counter(code->from), mapped(code->stages.size(), nil()), taken(
+                code->stages.size(), 0), width(1), done(false) {
+    if (code->type == sequence_code::list_source)
+        at = boost::get<object_list>(code->source).begin();
+
+    unsigned pulled = 1;
+    if (code->type == sequence_code::zip_source) {
+        pulled = 0;
+        for (std::size_t i(0); i < code->zipped.size(); ++i) {
+            zipped.push_back(boost::shared_ptr<sequence_cursor>(new sequence_cursor(code->zipped[i], env)));
+            pulled += zipped.back()->arity();
+        }
+    }
+    values.resize(pulled, nil());
+
+    width = pulled;
+    for (std::size_t i(0); i < code->stages.size(); ++i) {
+        sequence_stage const& s = code->stages[i];
+        if (s.kind == sequence_stage::take) {
+            done |= boost::get<int>(s.arg) == 0;
+            continue;
+        }
+        calls.push_back(prepared_call(s.arg, width));
+        if (s.kind == sequence_stage::map)
+            width = 1;
+    }
+}
+
+inline bool sequence_cursor::pull() {
+    switch (code->type) {
+    case sequence_code::list_source:
+        if (at == object_list().end())
+            return false;
+        values[0] = *at;
+        ++at;
+        return true;
+    case sequence_code::stream_source: {
+        values[0] = boost::get<object_proc>(code->source)(object_list(), env);
+        boolean const* b = boost::get<boolean>(&values[0]);
+        return b == NULL || b->as_bool();
+    }
+    case sequence_code::range_source:
+        if (counter >= code->to)
+            return false;
+        values[0] = counter++;
+        return true;
+    case sequence_code::packed_source: {
+        packed const& p = boost::get<packed>(code->source);
+        if (unsigned(counter) >= p.size())
+            return false;
+        values[0] = make_integer(p.at(counter++));
+        return true;
+    }
+    case sequence_code::zip_source: {
+        std::size_t n = 0;
+        for (std::size_t i(0); i < zipped.size(); ++i) {
+            object const* v = zipped[i]->next();
+            if (v == NULL)
+                return false;
+            std::copy(v, v + zipped[i]->arity(), values.begin() + n);
+            n += zipped[i]->arity();
+        }
+        return true;
+    }
+    }
+    return false;
+}
+
+inline object const* sequence_cursor::next() {
+    while (!done) {
+        if (!pull()) {
+            done = true;
+            break;
+        }
+
+        object const* v = &values[0];
+        std::size_t call = 0;
+        std::size_t i = 0;
+        for (; i < code->stages.size(); ++i) {
+            sequence_stage const& s = code->stages[i];
+            if (s.kind == sequence_stage::map) {
+                mapped[i] = calls[call++](v, env);
+                v = &mapped[i];
+            } else if (s.kind == sequence_stage::filter) {
+                if (!expect_as<boolean>(calls[call++](v, env)).as_bool())
+                    break;
+            } else if (++taken[i] == boost::get<int>(s.arg)) {
+                done = true; // this element is the last to get past it
+            }
+        }
+        if (i == code->stages.size())
+            return v;
+    }
+    return NULL;
+}
+
+// f called with the result so far and each element's values in turn, for a
+// sequence_cursor or one of compiler.hpp's fused pipelines
+template<typename Cursor>
+inline object fold_elements(Cursor & c, object const& f, object acc, environment & env) {
+    prepared_call call(f, c.arity() + 1);
+    std::vector<object> args(c.arity() + 1, nil());
+    while (object const* v = c.next()) {
+        args[0] = acc;
+        std::copy(v, v + c.arity(), args.begin() + 1);
+        acc = call(&args[0], env);
+    }
+    return acc;
+}
+
+// an element of more than one value becomes a list of them
+template<typename Cursor>
+inline object list_elements(Cursor & c) {
+    std::vector<object> elements;
+    while (object const* v = c.next()) {
+        if (c.arity() == 1) {
+            elements.push_back(*v);
+            continue;
+        }
+        object_list l;
+        for (std::size_t i(c.arity()); i > 0; --i) {
+            l = l.new_push_front(v[i - 1]);
+        }
+        elements.push_back(l);
+    }
+
+    object_list r;
+    for (std::size_t i(elements.size()); i > 0; --i) {
+        r = r.new_push_front(elements[i - 1]);
+    }
+    return r;
+}
+
+inline object sequence::operator()(object_list const&, environment & env) const {
+    sequence_cursor c(code, env);
+    return list_elements(c);
+}
+
+inline sequence_code const* as_sequence(object const& o) {
+    if (object_proc const* p = boost::get<object_proc>(&o)) {
+        if (sequence const* s = p->target<sequence>())
+            return s->code;
+        if (p->target<stream_ref>() != NULL) {
+            sequence_code* code = GC_NEW(sequence_code)(sequence_code::stream_source);
+            code->source = o;
+            return code;
+        }
+    }
+    if (boost::get<object_list>(&o) != NULL) {
+        sequence_code* code = GC_NEW(sequence_code)(sequence_code::list_source);
+        code->source = o;
+        return code;
+    }
+    if (boost::get<packed>(&o) != NULL) {
+        sequence_code* code = GC_NEW(sequence_code)(sequence_code::packed_source);
+        code->source = o;
+        return code;
+    }
+    throw eval_error(unexpected_type, o, "sequence");
+}
+
+// what take is given, checked as the builtin and compiled code both do
+inline object expect_count(object const& o) {
+    if (expect_as<int>(o) < 0)
+        throw eval_error(out_of_range, o);
+    return o;
+}
+
+// (map f s), (filter p s) and (take n s): s with a stage more
+inline object add_stage(persistent::list<object> const& args, environment & env, sequence_stage::kind_type kind,
+        char const* complaint) {
+    assert(!args.empty());
+
+    if (args.size() != 3)
+        throw eval_error(bad_form, object_list(args), complaint);
+
+    persistent::list<object>::const_iterator it(args.begin() + 1);
+    object arg = eval(*it, env);
+    if (kind == sequence_stage::take)
+        expect_count(arg);
+    else
+        expect_as<object_proc>(arg);
+    sequence_code const* from = as_sequence(eval(*++it, env));
+
+    sequence_code* code = GC_NEW(sequence_code)(*from);
+    code->stages.push_back(sequence_stage(kind, arg));
+    return object_proc(sequence(code));
+}
+
+inline object builtin_map(persistent::list<object> const& args, environment & env) {
+    return add_stage(args, env, sequence_stage::map, "__builtin_map expected 2 args");
+}
+
+inline object builtin_filter(persistent::list<object> const& args, environment & env) {
+    return add_stage(args, env, sequence_stage::filter, "__builtin_filter expected 2 args");
+}
+
+inline object builtin_take(persistent::list<object> const& args, environment & env) {
+    return add_stage(args, env, sequence_stage::take, "__builtin_take expected 2 args");
+}
+
+// (zip s...): elements of a value from each, until the shortest runs out
+inline object builtin_zip(persistent::list<object> const& args, environment & env) {
+    assert(!args.empty());
+
+    if (args.size() < 2)
+        throw eval_error(bad_form, object_list(args), "__builtin_zip needs at least 1 arg");
+
+    sequence_code* code = GC_NEW(sequence_code)(sequence_code::zip_source);
+    for (persistent::list<object>::const_iterator it(args.begin() + 1); it != args.end(); ++it) {
+        code->zipped.push_back(as_sequence(eval(*it, env)));
+    }
+    return object_proc(sequence(code));
+}
+
+// (range from to): the ints from `from` up to but not including `to`
+inline object builtin_range(persistent::list<object> const& args, environment & env) {
+    assert(!args.empty());
+
+    if (args.size() != 3)
+        throw eval_error(bad_form, object_list(args), "__builtin_range expected 2 args");
+
+    persistent::list<object>::const_iterator it(args.begin() + 1);
+    sequence_code* code = GC_NEW(sequence_code)(sequence_code::range_source);
+    code->from = expect_as<int>(eval(*it, env));
+    code->to = expect_as<int>(eval(*++it, env));
+    return object_proc(sequence(code));
+}
+
+// (fold f init s)
+inline object builtin_fold(persistent::list<object> const& args, environment & env) {
+    assert(!args.empty());
+
+    if (args.size() != 4)
+        throw eval_error(bad_form, object_list(args), "__builtin_fold expected 3 args");
+
+    persistent::list<object>::const_iterator it(args.begin() + 1);
+    object f = eval(*it, env);
+    expect_as<object_proc>(f);
+    object init = eval(*++it, env);
+    sequence_cursor c(as_sequence(eval(*++it, env)), env);
+    return fold_elements(c, f, init, env);
+}
+
+inline object builtin_to_list(persistent::list<object> const& args, environment & env) {
+    assert(!args.empty());
+
+    if (args.size() != 2)
+        throw eval_error(bad_form, object_list(args), "__builtin_to_list expected 1 arg");
+
+    sequence_cursor c(as_sequence(eval(*(args.begin() + 1), env)), env);
+    return list_elements(c);
+}
+
+// Packed arrays (see numeric/packed.hpp) are made from any sequence of
+// integers, and then worked on a SIMD register at a time: add and mul take them
+// elementwise, and these reduce and compare them. Anywhere two are expected an
+// integer can stand in for one, as though every element were it.
+inline long long packed_element(object const& o, packed::element_type type) {
+    if (int const* i = boost::get<int>(&o))
+        return *i;
+    bigint const* b = boost::get<bigint>(&o);
+    if (b == NULL)
+        return expect_as<int>(o); // throws
+    if (type == packed::int32 || !b->fits_int64())
+        throw eval_error(out_of_range, o);
+    return b->to_int64();
+}
+
+// (pack32 s) and (pack64 s)
+inline object pack(persistent::list<object> const& args, environment & env, packed::element_type type,
+        char const* complaint) {
+    assert(!args.empty());
+
+    if (args.size() != 2)
+        throw eval_error(bad_form, object_list(args), complaint);
+
+    object o = eval(*(args.begin() + 1), env);
+    sequence_cursor c(as_sequence(o), env);
+    if (c.arity() != 1)
+        throw eval_error(unexpected_type, o, "sequence of integers");
+    std::vector<long long> elements;
+    while (object const* v = c.next()) {
+        elements.push_back(packed_element(*v, type));
+    }
+
+    packed p(type, elements.size());
+    for (std::size_t i(0); i < elements.size(); ++i) {
+        if (type == packed::int32)
+            p.data<boost::int32_t>()[i] = elements[i];
+        else
+            p.data<boost::int64_t>()[i] = elements[i];
+    }
+    return p;
+}
+
+inline object builtin_pack32(persistent::list<object> const& args, environment & env) {
+    return pack(args, env, packed::int32, "__builtin_pack32 expected 1 arg");
+}
+
+inline object builtin_pack64(persistent::list<object> const& args, environment & env) {
+    return pack(args, env, packed::int64, "__builtin_pack64 expected 1 arg");
+}
+
+// the single packed array argument of a builtin
+inline packed packed_arg(persistent::list<object> const& args, environment & env, char const* complaint) {
+    assert(!args.empty());
+
+    if (args.size() != 2)
+        throw eval_error(bad_form, object_list(args), complaint);
+
+    return expect_as<packed>(eval(*(args.begin() + 1), env));
+}
+
+// both arguments of a builtin as packed arrays of the same length, an integer broadcast to the other's
+inline void packed_pair(persistent::list<object> const& args, environment & env, char const* complaint, packed & a,
+        packed & b) {
+    assert(!args.empty());
+
+    if (args.size() != 3)
+        throw eval_error(bad_form, object_list(args), complaint);
+
+    persistent::list<object>::const_iterator it(args.begin() + 1);
+    object x = eval(*it, env);
+    object y = eval(*++it, env);
+    packed const* px = boost::get<packed>(&x);
+    packed const* py = boost::get<packed>(&y);
+    if (px == NULL && py == NULL)
+        expect_as<packed>(x); // throws
+    a = px != NULL ? *px : packed_fill(py->size(), packed_element(x, packed::int64));
+    b = py != NULL ? *py : packed_fill(px->size(), packed_element(y, packed::int64));
+    if (a.size() != b.size())
+        throw eval_error(bad_form, y, "Packed arrays of different lengths were combined");
+}
+
+inline object builtin_sum(persistent::list<object> const& args, environment & env) {
+    return make_integer(wide_bigint(packed_sum(packed_arg(args, env, "__builtin_sum expected 1 arg"))));
+}
+
+inline object extreme_element(persistent::list<object> const& args, environment & env, bool most, char const* complaint) {
+    packed p = packed_arg(args, env, complaint);
+    if (p.size() == 0)
+        throw eval_error(unexpected_type, p, "non empty packed array");
+    return make_integer(packed_extreme(p, most));
+}
+
+inline object builtin_min(persistent::list<object> const& args, environment & env) {
+    return extreme_element(args, env, false, "__builtin_min expected 1 arg");
+}
+
+inline object builtin_max(persistent::list<object> const& args, environment & env) {
+    return extreme_element(args, env, true, "__builtin_max expected 1 arg");
+}
+
+// (dot a b): the sum of their elements' products
+inline object builtin_dot(persistent::list<object> const& args, environment & env) {
+    packed a, b;
+    packed_pair(args, env, "__builtin_dot expected 2 args", a, b);
+    __int128 r;
+    if (packed_dot(a, b, r))
+        return make_integer(wide_bigint(r));
+
+    // past 128 bits, which only elements near the int64 limits can reach
+    bigint big;
+    for (unsigned i(0); i < a.size(); ++i) {
+        big = big + bigint(a.at(i)) * bigint(b.at(i));
+    }
+    return make_integer(big);
+}
+
+// (mask-lt a b), (mask-gt a b) and (mask-eq a b): an int32 array of 1 where it holds, 0 where it doesn't
+inline object builtin_mask_lt(persistent::list<object> const& args, environment & env) {
+    packed a, b;
+    packed_pair(args, env, "__builtin_mask_lt expected 2 args", a, b);
+    return packed_compare(a, b, false);
+}
+
+inline object builtin_mask_gt(persistent::list<object> const& args, environment & env) {
+    packed a, b;
+    packed_pair(args, env, "__builtin_mask_gt expected 2 args", a, b);
+    return packed_compare(b, a, false);
+}
+
+inline object builtin_mask_eq(persistent::list<object> const& args, environment & env) {
+    packed a, b;
+    packed_pair(args, env, "__builtin_mask_eq expected 2 args", a, b);
+    return packed_compare(a, b, true);
+}
+
+// Bytes (see persistent/bytes.hpp) are binary data that's never copied once
+// it's in: (open-bytes path) maps a file, slices share their buffer, and
+// searching, splitting and decoding integers all read it where it is. Offsets
+// are integers like any other, so past 2GB they're bigints.
+inline std::size_t expect_offset(object const& o, std::size_t limit) {
+    long long i;
+    if (bigint const* b = boost::get<bigint>(&o)) {
+        if (!b->fits_int64())
+            throw eval_error(out_of_range, o);
+        i = b->to_int64();
+    } else {
+        i = expect_as<int>(o);
+    }
+    if (i < 0 || static_cast<unsigned long long>(i) > limit)
+        throw eval_error(out_of_range, o);
+    return i;
+}
+
+inline object make_offset(std::size_t i) {
+    return make_integer(static_cast<long long>(i));
+}
+
+// the first argument of a builtin, which must be bytes, and the rest evaluated
+inline persistent::bytes bytes_args(persistent::list<object> const& args, environment & env, std::size_t least,
+        std::size_t most, char const* complaint, std::vector<object> & rest) {
+    assert(!args.empty());
+
+    if (args.size() < least + 1 || args.size() > most + 1)
+        throw eval_error(bad_form, object_list(args), complaint);
+
+    persistent::list<object>::const_iterator it(args.begin() + 1);
+    persistent::bytes b = expect_as<persistent::bytes>(eval(*it, env));
+    for (++it; it != args.end(); ++it) {
+        rest.push_back(eval(*it, env));
+    }
+    return b;
+}
+
+// what's searched for or split on: a byte, given as an int, or a run of bytes or a string
+struct needle {
+    explicit needle(object const& o) :
+            single(-1), data(NULL), size(0) {
+        if (int const* i = boost::get<int>(&o)) {
+            if (*i < 0 || *i > 255)
+                throw eval_error(out_of_range, o);
+            single = *i;
+            size = 1;
+        } else if (persistent::bytes const* b = boost::get<persistent::bytes>(&o)) {
+            data = b->data();
+            size = b->size();
+        } else if (string const* s = boost::get<string>(&o)) {
+            data = s->c_str();
+            size = s->size();
+        } else {
+            throw eval_error(unexpected_type, o, "byte, bytes or string");
+        }
+    }
+
+    std::size_t in(persistent::bytes const& b, std::size_t from) const {
+        return single >= 0 ? b.find(single, from) : b.find(data, size, from);
+    }
+
+    int single;
+    char const* data;
+    std::size_t size;
+};
+
+// (open-bytes path): a file, mapped rather than read
+inline object builtin_open_bytes(persistent::list<object> const& args, environment & env) {
+    assert(!args.empty());
+
+    if (args.size() != 2)
+        throw eval_error(bad_form, object_list(args), "__builtin_open_bytes expected 1 arg");
+
+    string path = expect_as<string>(eval(*(args.begin() + 1), env));
+    try {
+        return persistent::bytes::map(std::string(path.c_str(), path.size()));
+    } catch (io::error const& e) {
+        throw io_error(e, path, "open");
+    }
+}
+
+// (to-bytes s) and (bytes-str b), copying between strings and bytes
+inline object builtin_to_bytes(persistent::list<object> const& args, environment & env) {
+    assert(!args.empty());
+
+    if (args.size() != 2)
+        throw eval_error(bad_form, object_list(args), "__builtin_to_bytes expected 1 arg");
+
+    string s = expect_as<string>(eval(*(args.begin() + 1), env));
+    return persistent::bytes(s.c_str(), s.size());
+}
+
+inline object builtin_bytes_str(persistent::list<object> const& args, environment & env) {
+    std::vector<object> rest;
+    persistent::bytes b = bytes_args(args, env, 1, 1, "__builtin_bytes_str expected 1 arg", rest);
+    if (b.size() > std::numeric_limits<unsigned>::max())
+        throw eval_error(out_of_range, make_offset(b.size()));
+    return string(string::MakeCopy(), b.data(), b.size());
+}
+
+inline object builtin_bytes_length(persistent::list<object> const& args, environment & env) {
+    std::vector<object> rest;
+    return make_offset(bytes_args(args, env, 1, 1, "__builtin_bytes_length expected 1 arg", rest).size());
+}
+
+// (slice b start length), sharing b's buffer
+inline object builtin_slice(persistent::list<object> const& args, environment & env) {
+    std::vector<object> rest;
+    persistent::bytes b = bytes_args(args, env, 3, 3, "__builtin_slice expected 3 args", rest);
+    std::size_t start = expect_offset(rest[0], b.size());
+    return b.slice(start, expect_offset(rest[1], b.size() - start));
+}
+
+inline object builtin_byte_at(persistent::list<object> const& args, environment & env) {
+    std::vector<object> rest;
+    persistent::bytes b = bytes_args(args, env, 2, 2, "__builtin_byte_at expected 2 args", rest);
+    if (b.empty())
+        throw eval_error(out_of_range, rest[0]);
+    return int(b[expect_offset(rest[0], b.size() - 1)]);
+}
+
+// (find b needle [from]): where needle next is, or #f
+inline object builtin_find(persistent::list<object> const& args, environment & env) {
+    std::vector<object> rest;
+    persistent::bytes b = bytes_args(args, env, 2, 3, "__builtin_find expected 2 or 3 args", rest);
+    needle n(rest[0]);
+    std::size_t at = n.in(b, rest.size() > 1 ? expect_offset(rest[1], b.size()) : 0);
+    return at == persistent::bytes::npos ? object(boolean(false)) : make_offset(at);
+}
+
+// (split b separator): the slices between each separator, as a list
+inline object builtin_split(persistent::list<object> const& args, environment & env) {
+    std::vector<object> rest;
+    persistent::bytes b = bytes_args(args, env, 2, 2, "__builtin_split expected 2 args", rest);
+    needle n(rest[0]);
+    if (n.size == 0)
+        throw eval_error(unexpected_type, rest[0], "non empty separator");
+
+    std::vector<object> pieces;
+    std::size_t from = 0;
+    for (std::size_t at; (at = n.in(b, from)) != persistent::bytes::npos; from = at + n.size) {
+        pieces.push_back(b.slice(from, at - from));
+    }
+    pieces.push_back(b.slice(from, b.size() - from));
+
+    object_list r;
+    for (std::size_t i(pieces.size()); i > 0; --i) {
+        r = r.new_push_front(pieces[i - 1]);
+    }
+    return r;
+}
+
+// (read-uint b offset width) and friends: the width (1, 2, 4 or 8) bytes at
+// offset as an integer, little endian unless they're -be, two's complement
+// if they're read-int
+inline object read_integer(persistent::list<object> const& args, environment & env, bool is_signed, bool big_endian,
+        char const* complaint) {
+    std::vector<object> rest;
+    persistent::bytes b = bytes_args(args, env, 3, 3, complaint, rest);
+    int width = expect_as<int>(rest[1]);
+    if (width != 1 && width != 2 && width != 4 && width != 8)
+        throw eval_error(out_of_range, rest[1]);
+    if (b.size() < std::size_t(width))
+        throw eval_error(out_of_range, rest[0]);
+    std::size_t offset = expect_offset(rest[0], b.size() - width);
+
+    boost::uint64_t v = 0;
+    unsigned char const* p = reinterpret_cast<unsigned char const*>(b.data()) + offset;
+    for (int i(0); i < width; ++i) {
+        v |= boost::uint64_t(p[big_endian ? width - 1 - i : i]) << (8 * i);
+    }
+    if (is_signed) {
+        unsigned unused = 64 - 8 * width;
+        return make_integer(static_cast<long long>(v << unused) >> unused);
+    }
+    return make_integer(wide_bigint(static_cast<__int128>(v)));
+}
+
+inline object builtin_read_uint(persistent::list<object> const& args, environment & env) {
+    return read_integer(args, env, false, false, "__builtin_read_uint expected 3 args");
+}
+
+inline object builtin_read_int(persistent::list<object> const& args, environment & env) {
+    return read_integer(args, env, true, false, "__builtin_read_int expected 3 args");
+}
+
+inline object builtin_read_uint_be(persistent::list<object> const& args, environment & env) {
+    return read_integer(args, env, false, true, "__builtin_read_uint_be expected 3 args");
+}
+
+inline object builtin_read_int_be(persistent::list<object> const& args, environment & env) {
+    return read_integer(args, env, true, true, "__builtin_read_int_be expected 3 args");
+}
+
+struct builtin {
+    char const* name;
+    builtin_func func;
+};
+
+// every native procedure, by the name it's bound to. terminated by a NULL name
+inline builtin const* builtins() {
+    static const builtin table[] = {
+            { "add", &builtin_add },
+            { "mul", &builtin_mul },
+            { "def", &builtin_def },
+            { "if", &builtin_if },
+            { "lambda", &builtin_lambda },
+            { "eq", &builtin_eq },
+            { "env-size", &builtin_env_size },
+            { "env-keys", &builtin_env_keys },
+            { "concat", &builtin_concat },
+            { "substr", &builtin_substr },
+            { "char-at", &builtin_char_at },
+            { "str-length", &builtin_str_length },
+            { "open-lines", &builtin_open_lines },
+            { "open-chunks", &builtin_open_chunks },
+            { "stdin-lines", &builtin_stdin_lines },
+            { "next", &builtin_next },
+            { "map", &builtin_map },
+            { "filter", &builtin_filter },
+            { "take", &builtin_take },
+            { "zip", &builtin_zip },
+            { "range", &builtin_range },
+            { "fold", &builtin_fold },
+            { "to-list", &builtin_to_list },
+            { "pack32", &builtin_pack32 },
+            { "pack64", &builtin_pack64 },
+            { "sum", &builtin_sum },
+            { "min", &builtin_min },
+            { "max", &builtin_max },
+            { "dot", &builtin_dot },
+            { "mask-lt", &builtin_mask_lt },
+            { "mask-gt", &builtin_mask_gt },
+            { "mask-eq", &builtin_mask_eq },
+            { "open-bytes", &builtin_open_bytes },
+            { "to-bytes", &builtin_to_bytes },
+            { "bytes-str", &builtin_bytes_str },
+            { "bytes-length", &builtin_bytes_length },
+            { "slice", &builtin_slice },
+            { "byte-at", &builtin_byte_at },
+            { "find", &builtin_find },
+            { "split", &builtin_split },
+            { "read-uint", &builtin_read_uint },
+            { "read-int", &builtin_read_int },
+            { "read-uint-be", &builtin_read_uint_be },
+            { "read-int-be", &builtin_read_int_be },
+            { NULL, NULL } };
+    return table;
+}
+
+inline builtin const* find_builtin(char const* name) {
+    for (builtin const* b(builtins()); b->name != NULL; ++b) {
+        if (::strcmp(b->name, name) == 0)
+            return b;
+    }
+    return NULL;
+}
+
+inline builtin const* find_builtin(builtin_func f) {
+    for (builtin const* b(builtins()); b->name != NULL; ++b) {
+        if (b->func == f)
+            return b;
+    }
+    return NULL;
+}
+
 inline environment create_new_environment() {
-    return environment().new_insert("author", string("Eric Springer")).
+    environment env = environment().new_insert("author", string("Eric Springer")).
             new_insert("#t", boolean(true)).
-            new_insert("#f", boolean(false)).
-            new_insert("add", object_proc(&builtin_add)).
-            new_insert("def", object_proc(&builtin_def)).
-            new_insert("if", object_proc(&builtin_if)).
-            new_insert("lambda", object_proc(&builtin_lambda)).
-            new_insert("eq", object_proc(&builtin_eq));
+            new_insert("#f", boolean(false));
+
+    for (builtin const* b(builtins()); b->name != NULL; ++b) {
+        env.insert(b->name, object_proc(b->func));
+    }
+    return env;
 }
 
 struct eval_visitor: boost::static_visitor<object> {
@@ -156,32 +1601,46 @@ struct eval_visitor: boost::static_visitor<object> {
     object operator()(int i) {
         return i;
     }
+    object operator()(bigint const& i) {
+        return i;
+    }
+    object operator()(packed const& p) {
+        return p;
+    }
     object operator()(nil) {
         return nil();
     }
     object operator()(symbol const& s) {
         object const* resolved = env.find(s);
         if (resolved == NULL)
-            throw std::runtime_error(std::string("Unable to resolve symbol: ") + s.c_str());
+            throw eval_error(unresolved_symbol, s);
 
         return *resolved;
     }
     object operator()(string const& s) {
         return s;
     }
+    object operator()(persistent::bytes const& b) {
+        return b;
+    }
     object operator()(persistent::list<object> const& pl) {
+        form_scope scope(pl);
 
         if (pl.empty()) {
-            throw std::runtime_error("Invalid to try evaluate an empty list");
+            throw eval_error(bad_form, object_list(pl), "Invalid to try evaluate an empty list");
         }
 
+        // slot reads and makers are procedures in place, with nothing to look up
+        if (object_proc const* p = boost::get<object_proc>(&pl.front()))
+            return (*p)(pl, env);
+
         object_proc proc = expect_as<object_proc>(eval(*pl.begin(), env));
 
         return proc(pl, env);
     }
 
     object operator()(object_proc const& proc) {
-        return string("<function call>");
+        return proc;
     }
 
     environment & env;
@@ -193,4 +1652,60 @@ object eval(object const& o, environment & env) {
     return boost::apply_visitor(ev, o);
 }
 
+// what try_eval makes of something: its value, or the error evaluating it
+struct eval_result {
+    explicit eval_result(object const& value) :
+            value(value) {
+    }
+    explicit eval_result(eval_error const& error) :
+            value(nil()), error(error) {
+    }
+
+    bool ok() const {
+        return !error;
+    }
+
+    object value; // nil unless ok
+    boost::optional<eval_error> error;
+};
+
+// eval, or another evaluator (see machine.hpp)
+typedef object (*evaluator)(object const& o, environment & env);
+
+// eval, for callers that expect it to fail and have something else to try: an
+// eval_error is returned rather than thrown, and as nothing has asked for its
+// message it's never formatted. anything else still throws
+inline eval_result try_eval(object const& o, environment & env, evaluator ev = &eval) {
+    try {
+        return eval_result(ev(o, env));
+    } catch (eval_error const& e) {
+        return eval_result(e);
+    }
+}
+
+// try_eval for a top level evaluation, in a region (see gc/region.hpp) unless
+// gc::options::regions is off: what it makes is thrown away in one go after,
+// except what the result and env reach, which is promoted to the heap
+inline eval_result eval_in_region(object const& o, environment & env, evaluator ev = &eval) {
+    if (!gc::regions_enabled())
+        return try_eval(o, env, ev);
+
+    gc::region r;
+    boost::optional<eval_result> result;
+    try {
+        result = try_eval(o, env, ev);
+    } catch (...) {
+        r.promote(env);
+        throw;
+    }
+    r.promote(env);
+    if (result->error) {
+        r.promote(result->error->offending);
+        result->error->span(); // while the forms it names are still where they were
+    } else {
+        r.promote(result->value);
+    }
+    return *result;
+}
+
 }
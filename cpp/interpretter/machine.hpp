@@ -0,0 +1,458 @@
+#pragma once
+
+// An evaluator that keeps its continuation on the heap. eval recurses through
+// the native stack, several frames per wisp call, so deep enough non-tail
+// recursion overflows it. machine_eval gives the same results (and errors,
+// with the same spans) but keeps a frame per form being evaluated in a deque
+// that grows as it needs to, and the slots of the lambda calls in progress in a
+// stack of fixed chunks, so recursion is only limited by memory.
+//
+// The machine does the builtins that evaluate their arguments itself, an
+// argument at a time, as they would have: if, def and eq, and add, mul,
+// concat, substr, char-at and str-length. Every other procedure (lambda,
+// env-size and env-keys, slot reads and makers, compiled code) is called as
+// it is by eval, and anything it evaluates recurses as usual.
+
+#include <deque>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+#include "interpretter.hpp"
+
+namespace harkon {
+
+namespace machine_impl {
+
+// where a form is up to
+enum frame_kind {
+    head, // evaluating the procedure
+    if_test,
+    tail, // evaluating what gives the form its value
+    def_value,
+    eq_left, // evaluating the left side of a pair
+    eq_right,
+    strict_args, // evaluating the next argument of a builtin
+    closure_args, // evaluating the next argument of a lambda
+    closure_body // evaluating the body, against the call's own frame and environment
+};
+
+// the builtins the machine evaluates the arguments of
+enum strict_kind {
+    not_strict, strict_add, strict_mul, strict_concat, strict_substr, strict_char_at, strict_str_length
+};
+
+inline strict_kind strict_kind_of(builtin_func f) {
+    if (f == &builtin_add)
+        return strict_add;
+    if (f == &builtin_mul)
+        return strict_mul;
+    if (f == &builtin_concat)
+        return strict_concat;
+    if (f == &builtin_substr)
+        return strict_substr;
+    if (f == &builtin_char_at)
+        return strict_char_at;
+    if (f == &builtin_str_length)
+        return strict_str_length;
+    return not_strict;
+}
+
+// a form being evaluated, which is what errors look for spans in, as with eval
+struct frame: boost::noncopyable {
+    frame(object_list const& form, unsigned env) :
+            form(form), scope(this->form), kind(head), next(this->form.begin()), env(env), strict(not_strict), acc(
+                    nil()), count(0), start(0), code(NULL), captured(NULL), base(0), slots(NULL), saved_frame(NULL) {
+    }
+
+    object_list form;
+    form_scope scope;
+    frame_kind kind;
+    object_list::const_iterator next; // the argument being evaluated
+    unsigned env; // what it's evaluated against, see machine::env_at
+
+    // a builtin's arguments so far
+    strict_kind strict;
+    object acc;
+    unsigned count;
+    unsigned start; // substr's
+
+    // a lambda's
+    lambda_code const* code;
+    object const* captured;
+    std::size_t base; // where its arguments start on the value stack
+    object* slots;
+    object const* saved_frame;
+};
+
+// frames' slots, in chunks that never move so current_frame() stays good
+struct slot_stack: boost::noncopyable {
+    static const std::size_t chunk_slots = 4096;
+
+    struct chunk {
+        object* slots;
+        std::size_t used;
+        std::size_t capacity;
+    };
+
+    slot_stack() :
+            top(0) {
+    }
+
+    ~slot_stack() {
+        for (std::size_t i(0); i < chunks.size(); ++i) {
+            for (std::size_t j(0); j < chunks[i].used; ++j) {
+                chunks[i].slots[j].~object();
+            }
+            ::operator delete(chunks[i].slots);
+        }
+    }
+
+    // room for n slots, constructed as they're pushed by the caller
+    object* allocate(std::size_t n) {
+        if (chunks.empty() || chunks[top].used + n > chunks[top].capacity) {
+            if (!chunks.empty() && chunks[top].used != 0)
+                ++top;
+            if (top == chunks.size()) {
+                chunk c = { NULL, 0, 0 };
+                chunks.push_back(c);
+            }
+            chunk & c = chunks[top];
+            if (c.capacity < n) {
+                ::operator delete(c.slots);
+                c.slots = NULL;
+                c.capacity = std::max(chunk_slots, n);
+                c.slots = static_cast<object*>(::operator new(c.capacity * sizeof(object)));
+            }
+        }
+        return chunks[top].slots + chunks[top].used;
+    }
+
+    void push(object const& o) {
+        chunk & c = chunks[top];
+        new (c.slots + c.used) object(o);
+        ++c.used;
+    }
+
+    void pop(std::size_t n) {
+        chunk & c = chunks[top];
+        for (std::size_t i(0); i < n; ++i) {
+            c.slots[--c.used].~object();
+        }
+        if (c.used == 0 && top > 0)
+            --top;
+    }
+
+private:
+    std::vector<chunk> chunks;
+    std::size_t top; // the chunk being pushed to
+};
+
+struct machine: boost::noncopyable {
+    explicit machine(environment & env) :
+            global(env), entry_frame(current_frame()) {
+    }
+
+    ~machine() {
+        // in order, as their scopes and frames nest
+        while (!frames.empty()) {
+            frames.pop_back();
+        }
+        current_frame() = entry_frame;
+    }
+
+    object run(object const& o) {
+        object const* expr = &o;
+        unsigned env = 0;
+        object value = nil();
+
+        for (;;) {
+            // evaluate expr, or carry on with the innermost form
+            if (expr != NULL) {
+                if (object_list const* l = boost::get<object_list>(expr)) {
+                    frames.emplace_back(*l, env);
+                    frame & f = frames.back();
+                    if (f.form.empty())
+                        throw eval_error(bad_form, f.form, "Invalid to try evaluate an empty list");
+                    // a procedure in place or named by a symbol is used where it is, uncopied
+                    object const* head = &f.form.front();
+                    if (symbol const* s = boost::get<symbol>(head)) {
+                        head = env_at(env).find(*s);
+                        if (head == NULL)
+                            throw eval_error(unresolved_symbol, *s);
+                        expr = apply(f, expect_ref<object_proc>(*head), value, env);
+                    } else if (object_proc const* p = boost::get<object_proc>(head)) {
+                        expr = apply(f, *p, value, env);
+                    } else {
+                        expr = head;
+                    }
+                    continue;
+                }
+                if (symbol const* s = boost::get<symbol>(expr)) {
+                    object const* resolved = env_at(env).find(*s);
+                    if (resolved == NULL)
+                        throw eval_error(unresolved_symbol, *s);
+                    value = *resolved;
+                } else {
+                    value = *expr;
+                }
+                expr = NULL;
+            }
+
+            if (frames.empty())
+                return value;
+            expr = resume(frames.back(), value, env);
+        }
+    }
+
+private:
+    template<typename T>
+    static T const& expect_ref(object const& o) {
+        T const* v = boost::get<T>(&o);
+        if (v == NULL)
+            throw eval_error(unexpected_type, o, type_name<T>());
+        return *v;
+    }
+
+    environment & env_at(unsigned i) {
+        return i == 0 ? global : locals[i - 1];
+    }
+
+    // the form's done, with result as its value
+    object const* finish(object & value, object const& result) {
+        value = result;
+        frames.pop_back();
+        return NULL;
+    }
+
+    // starts f off calling proc, returning what to evaluate next (NULL if value's its result)
+    object const* apply(frame & f, object_proc const& proc, object & value, unsigned & env) {
+        if (builtin_func const* b = proc.target<builtin_func>()) {
+            if (*b == &builtin_if) {
+                if (f.form.size() != 4)
+                    throw eval_error(bad_form, f.form, "__builtin_if expected 3 args");
+                f.kind = if_test;
+                return &*++f.next;
+            }
+            if (*b == &builtin_def) {
+                if (f.form.size() != 3)
+                    throw eval_error(bad_form, f.form, "__builtin_def expected 2 args");
+                expect_as<symbol>(*++f.next);
+                f.kind = def_value;
+                return &*++f.next;
+            }
+            if (*b == &builtin_eq) {
+                if (f.form.size() < 3)
+                    throw eval_error(bad_form, f.form, "__builtin_eq needs at least 2 args");
+                f.kind = eq_left;
+                return &*++f.next;
+            }
+
+            f.strict = strict_kind_of(*b);
+            if (f.strict != not_strict)
+                return start_strict(f, value);
+        } else if (lambda_closure const* c = proc.target<lambda_closure>()) {
+            f.kind = closure_args;
+            f.code = c->code;
+            f.captured = c->captured;
+            f.base = values.size();
+            return next_argument(f, env);
+        }
+
+        return finish(value, proc(f.form, env_at(f.env)));
+    }
+
+    object const* resume(frame & f, object & value, unsigned & env) {
+        env = f.env;
+        switch (f.kind) {
+        case head:
+            return apply(f, expect_ref<object_proc>(value), value, env);
+
+        case if_test:
+            ++f.next;
+            if (!expect_as<boolean>(value).as_bool())
+                ++f.next;
+            f.kind = tail;
+            return &*f.next;
+
+        case tail:
+            return finish(value, value);
+
+        case def_value:
+            env_at(f.env).insert(boost::get<symbol>(*(f.form.begin() + 1)), value);
+            return finish(value, nil());
+
+        case eq_left:
+            values.push_back(value);
+            f.kind = eq_right;
+            return &*(f.next + 1);
+
+        case eq_right: {
+            bool same = values.back() == value;
+            values.pop_back();
+            if (!same)
+                return finish(value, boolean(false));
+            ++f.next;
+            if (f.next + 1 == f.form.end())
+                return finish(value, boolean(true));
+            f.kind = eq_left;
+            return &*f.next;
+        }
+
+        case strict_args:
+            step_strict(f, value);
+            return next_strict(f, value);
+
+        case closure_args:
+            values.push_back(value);
+            return next_argument(f, env);
+
+        case closure_body:
+            current_frame() = f.saved_frame;
+            frame_slots.pop(f.code->frame_size());
+            locals.pop_back();
+            return finish(value, value);
+        }
+        return NULL;
+    }
+
+    object const* start_strict(frame & f, object & value) {
+        switch (f.strict) {
+        case strict_add:
+            f.acc = 0;
+            break;
+        case strict_mul:
+            f.acc = 1;
+            break;
+        case strict_concat:
+            f.acc = string(persistent::string(""));
+            break;
+        case strict_substr:
+            if (f.form.size() != 4)
+                throw eval_error(bad_form, f.form, "__builtin_substr expected 3 args");
+            break;
+        case strict_char_at:
+            if (f.form.size() != 3)
+                throw eval_error(bad_form, f.form, "__builtin_char_at expected 2 args");
+            break;
+        case strict_str_length:
+            if (f.form.size() != 2)
+                throw eval_error(bad_form, f.form, "__builtin_str_length expected 1 arg");
+            break;
+        case not_strict:
+            break;
+        }
+        f.kind = strict_args;
+        return next_strict(f, value);
+    }
+
+    object const* next_strict(frame & f, object & value) {
+        if (++f.next == f.form.end())
+            return finish(value, f.acc);
+        return &*f.next;
+    }
+
+    // takes in the value of argument f.count, checking it as the builtin would
+    void step_strict(frame & f, object const& v) {
+        unsigned i = f.count++;
+        switch (f.strict) {
+        case strict_add: {
+            int const* x = boost::get<int>(&f.acc);
+            int const* y = boost::get<int>(&v);
+            int r;
+            if (x != NULL && y != NULL && !__builtin_add_overflow(*x, *y, &r)) {
+                f.acc = r;
+                break;
+            }
+            integer_sum cum;
+            cum.add(f.acc);
+            cum.add(v);
+            f.acc = cum.result();
+            break;
+        }
+        case strict_mul: {
+            integer_product cum;
+            cum.mul(f.acc);
+            cum.mul(v);
+            f.acc = cum.result();
+            break;
+        }
+        case strict_concat:
+            f.acc = string(expect_as<string>(f.acc) + expect_as<string>(v));
+            break;
+        case strict_substr:
+            if (i == 0) {
+                f.acc = expect_as<string>(v);
+            } else {
+                string const& s = boost::get<string>(f.acc);
+                if (i == 1) {
+                    f.start = expect_index(v, s.size());
+                } else {
+                    unsigned len = expect_index(v, s.size() - f.start);
+                    f.acc = string(s.substr(f.start, len));
+                }
+            }
+            break;
+        case strict_char_at:
+            if (i == 0) {
+                f.acc = expect_as<string>(v);
+            } else {
+                string const& s = boost::get<string>(f.acc);
+                if (s.size() == 0)
+                    throw eval_error(out_of_range, v);
+                f.acc = s.at(expect_index(v, s.size() - 1));
+            }
+            break;
+        case strict_str_length:
+            f.acc = static_cast<int>(expect_as<string>(v).size());
+            break;
+        case not_strict:
+            break;
+        }
+    }
+
+    // evaluates the lambda's next argument, or once it has them all, its body
+    object const* next_argument(frame & f, unsigned & env) {
+        lambda_code const& c = *f.code;
+        std::size_t have = values.size() - f.base;
+        if (have < c.params.size()) {
+            if (++f.next == f.form.end())
+                throw eval_error(bad_form, f.form, "Too few arguments provided when eval lambda result");
+            return &*f.next;
+        }
+
+        object* slots = frame_slots.allocate(c.frame_size());
+        for (std::size_t i(0); i < c.captures.size(); ++i) {
+            frame_slots.push(f.captured[i]);
+        }
+        for (std::size_t i(f.base); i < values.size(); ++i) {
+            frame_slots.push(values[i]);
+        }
+        values.erase(values.begin() + f.base, values.end());
+
+        locals.push_back(env_at(f.env)); // so a def in the body stays there
+        f.kind = closure_body;
+        f.slots = slots;
+        f.saved_frame = current_frame();
+        current_frame() = slots;
+        env = locals.size();
+        return &c.body;
+    }
+
+    environment & global;
+    object const* entry_frame;
+    std::deque<frame> frames;
+    std::vector<object> values; // arguments being gathered
+    std::vector<environment> locals; // the calls' environments, env_at(1) up
+    slot_stack frame_slots;
+};
+
+}
+
+// eval, with the continuation on the heap rather than the native stack
+inline object machine_eval(object const& o, environment & env) {
+    machine_impl::machine m(env);
+    return m.run(o);
+}
+
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace io {
+
+// a file that couldn't be opened, mapped or read, with the errno saying why
+struct error: std::runtime_error {
+    error(std::string const& what, int code) :
+            std::runtime_error(what + ": " + ::strerror(code)), code(code) {
+    }
+
+    int code;
+};
+
+}
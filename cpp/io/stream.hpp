@@ -0,0 +1,312 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "error.hpp"
+
+namespace io {
+
+// Reads a file descriptor a large buffer at a time on a thread of its own, up
+// to `depth` buffers ahead of whoever's taking them, so reading the next one
+// overlaps with using this one and memory stays at (depth + 1) buffers however
+// much is read. Regular files fill whole buffers; pipes and terminals hand over
+// whatever a read gets, so a stream over stdin isn't held up waiting for more,
+// and are polled so the reader can be stopped while nothing's arriving.
+struct prefetcher: boost::noncopyable {
+    struct buffer {
+        std::vector<char> bytes;
+        std::size_t size;
+    };
+
+    prefetcher(int fd, bool owned, std::size_t buffer_bytes, unsigned depth);
+    ~prefetcher();
+
+    // the next buffer read, or NULL at the end. it's good until the next call,
+    // which hands it back to be read into again
+    buffer const* next();
+
+private:
+    void run();
+    bool wait_readable();
+
+    int fd;
+    bool owned;
+    bool regular;
+
+    boost::mutex lock;
+    boost::condition_variable space; // a buffer's free
+    boost::condition_variable ready; // one's filled, or there'll be no more
+    std::vector<buffer> buffers;
+    std::deque<std::size_t> free_buffers;
+    std::deque<std::size_t> filled;
+    std::size_t held; // by the caller of next(), or npos
+    bool finished;
+    int error; // errno, once finished
+    bool stopping;
+
+    boost::thread reader;
+};
+
+// The lines (without their '\n') or fixed size chunks of what a prefetcher
+// reads. An item is a view into the current buffer unless it runs over into
+// the next, when it's put together in a buffer of its own. Not for reading
+// from more than one thread at once.
+struct stream: boost::noncopyable {
+    enum split_type {
+        lines, chunks
+    };
+
+    static const std::size_t default_buffer_bytes = 1 << 20;
+    static const unsigned default_depth = 2;
+
+    // takes fd, closing it when done if it's owned
+    stream(int fd, bool owned, split_type split, std::size_t chunk_bytes = 0, std::size_t buffer_bytes =
+            default_buffer_bytes, unsigned depth = default_depth);
+
+    static stream* open(std::string const& path, split_type split, std::size_t chunk_bytes = 0);
+
+    // the next item, good until the next call, or false at the end
+    bool next(char const*& data, std::size_t & size);
+
+private:
+    bool next_line(char const*& data, std::size_t & size);
+    bool next_chunk(char const*& data, std::size_t & size);
+    bool refill();
+
+    split_type split;
+    std::size_t chunk_bytes;
+    prefetcher source;
+    char const* pos; // what's left of the current buffer
+    char const* end;
+    bool done;
+    std::string carry; // an item that spans buffers
+};
+
+// Set by whatever reads stdin itself, as the REPL does its commands. A stream
+// over stdin reads ahead of what's asked of it, so it would take those too.
+inline bool& stdin_reserved() {
+    static bool reserved = false;
+    return reserved;
+}
+
+inline prefetcher::prefetcher(int fd, bool owned, std::size_t buffer_bytes, unsigned depth) :
+        fd(fd), owned(owned), regular(false), buffers(depth + 1), held(std::size_t(-1)), finished(false), error(0), stopping(
+                false) {
+    struct stat st;
+    regular = ::fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (regular)
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    for (std::size_t i(0); i < buffers.size(); ++i) {
+        buffers[i].bytes.resize(buffer_bytes == 0 ? 1 : buffer_bytes);
+        buffers[i].size = 0;
+        free_buffers.push_back(i);
+    }
+    reader = boost::thread(boost::bind(&prefetcher::run, this));
+}
+
+inline prefetcher::~prefetcher() {
+    {
+        boost::mutex::scoped_lock l(lock);
+        __atomic_store_n(&stopping, true, __ATOMIC_RELAXED);
+    }
+    space.notify_all();
+    reader.join();
+    if (owned)
+        ::close(fd);
+}
+
+inline prefetcher::buffer const* prefetcher::next() {
+    boost::mutex::scoped_lock l(lock);
+    if (held != std::size_t(-1)) {
+        free_buffers.push_back(held);
+        held = std::size_t(-1);
+        space.notify_one();
+    }
+    while (filled.empty() && !finished) {
+        ready.wait(l);
+    }
+    if (!filled.empty()) {
+        held = filled.front();
+        filled.pop_front();
+        return &buffers[held];
+    }
+    if (error != 0)
+        throw io::error("Unable to read", error);
+    return NULL;
+}
+
+inline bool prefetcher::wait_readable() {
+    pollfd p;
+    p.fd = fd;
+    p.events = POLLIN;
+    while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+        p.revents = 0;
+        if (::poll(&p, 1, 100) > 0)
+            return true;
+    }
+    return false;
+}
+
+inline void prefetcher::run() {
+    for (;;) {
+        std::size_t i;
+        {
+            boost::mutex::scoped_lock l(lock);
+            while (free_buffers.empty() && !stopping) {
+                space.wait(l);
+            }
+            if (stopping)
+                return;
+            i = free_buffers.front();
+            free_buffers.pop_front();
+        }
+
+        buffer & b = buffers[i];
+        b.size = 0;
+        bool eof = false;
+        int failed = 0;
+        while (b.size < b.bytes.size()) {
+            if (!regular && !wait_readable())
+                return;
+            ssize_t r = ::read(fd, &b.bytes[b.size], b.bytes.size() - b.size);
+            if (r > 0) {
+                b.size += r;
+                if (!regular)
+                    break;
+            } else if (r == 0) {
+                eof = true;
+                break;
+            } else if (errno != EINTR && errno != EAGAIN) {
+                failed = errno;
+                break;
+            }
+        }
+
+        {
+            boost::mutex::scoped_lock l(lock);
+            if (b.size > 0)
+                filled.push_back(i);
+            else
+                free_buffers.push_back(i);
+            if (eof || failed != 0) {
+                finished = true;
+                error = failed;
+            }
+        }
+        ready.notify_one();
+        if (eof || failed != 0)
+            return;
+    }
+}
+
+inline stream::stream(int fd, bool owned, split_type split, std::size_t chunk_bytes, std::size_t buffer_bytes,
+        unsigned depth) :
+        split(split), chunk_bytes(chunk_bytes == 0 ? 1 : chunk_bytes), source(fd, owned, buffer_bytes, depth), pos(
+                NULL), end(NULL), done(false) {
+}
+
+inline stream* stream::open(std::string const& path, split_type split, std::size_t chunk_bytes) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        throw io::error("Unable to open " + path, errno);
+    try {
+        return new stream(fd, true, split, chunk_bytes);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+}
+
+inline bool stream::next(char const*& data, std::size_t & size) {
+    return split == lines ? next_line(data, size) : next_chunk(data, size);
+}
+
+inline bool stream::refill() {
+    if (done)
+        return false;
+    prefetcher::buffer const* b = source.next();
+    if (b == NULL) {
+        done = true;
+        pos = end = NULL;
+        return false;
+    }
+    pos = &b->bytes[0];
+    end = pos + b->size;
+    return true;
+}
+
+inline bool stream::next_line(char const*& data, std::size_t & size) {
+    bool carrying = false;
+    for (;;) {
+        if (pos == end && !refill()) {
+            if (!carrying)
+                return false;
+            data = carry.data();
+            size = carry.size();
+            return true;
+        }
+
+        char const* nl = static_cast<char const*>(::memchr(pos, '\n', end - pos));
+        if (nl != NULL) {
+            if (carrying) {
+                carry.append(pos, nl);
+                data = carry.data();
+                size = carry.size();
+            } else {
+                data = pos;
+                size = nl - pos;
+            }
+            pos = nl + 1;
+            return true;
+        }
+
+        if (!carrying) {
+            carry.clear();
+            carrying = true;
+        }
+        carry.append(pos, end);
+        pos = end;
+    }
+}
+
+inline bool stream::next_chunk(char const*& data, std::size_t & size) {
+    if (pos == end && !refill())
+        return false;
+
+    if (std::size_t(end - pos) >= chunk_bytes) {
+        data = pos;
+        size = chunk_bytes;
+        pos += chunk_bytes;
+        return true;
+    }
+
+    carry.assign(pos, end);
+    pos = end;
+    while (carry.size() < chunk_bytes && refill()) {
+        std::size_t n = std::min(chunk_bytes - carry.size(), std::size_t(end - pos));
+        carry.append(pos, n);
+        pos += n;
+    }
+    data = carry.data();
+    size = carry.size();
+    return true;
+}
+
+}
@@ -55,9 +55,13 @@ public:
         return std::numeric_limits<std::size_t>::max() / sizeof(T);
     }
 
-    // allocate but don't initialize num elements of type T
+    // allocate but don't initialize num elements of type T. the container owns
+    // this, so it's counted but not collected, and isn't scanned for roots either
     pointer allocate(size_type num, const void* = 0) {
-        return (pointer) (GC_ALLOC(num * sizeof(T)));
+        void* p = std::malloc(num * sizeof(T));
+        if (p == NULL)
+            throw std::bad_alloc();
+        return (pointer) alloc_stats::record<alloc_stats::raw_bytes>(p, num * sizeof(T));
     }
 
     // initialize elements of allocated storage p with value value
@@ -73,6 +77,7 @@ public:
 
     // deallocate storage p of deleted elements
     void deallocate(pointer p, size_type num) {
+        std::free(p);
     }
 };
 
@@ -119,13 +124,13 @@ inline std::size_t hash_value(object const& o) {
 
 inline std::size_t hash_value(symbol const& s) {
     std::size_t seed = 0x3BB65E2A; // random arbitrary number
-    boost::hash_combine(seed, hash_value(static_cast<persistent::string>(s)));
+    boost::hash_combine(seed, s.hash());
     return seed;
 }
 
 inline std::size_t hash_value(string const& s) {
     std::size_t seed = 0xEF13F20E; // random arbitrary number
-    boost::hash_combine(seed, hash_value(static_cast<persistent::string>(s)));
+    boost::hash_combine(seed, s.hash());
     return seed;
 }
 
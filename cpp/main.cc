@@ -1,28 +1,299 @@
+#include <algorithm>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include <unistd.h>
+
+#include <boost/thread/thread.hpp>
 
 #include "reader/parser.hpp"
 #include "interpretter/interpretter.hpp"
+#include "interpretter/machine.hpp"
+#include "server/server.hpp"
+#include "compiler/loader.hpp"
+#include "image/image.hpp"
+#include "codec/module_cache.hpp"
+
+static std::string read_file(char const* path) {
+	std::ifstream f(path);
+	if (!f)
+		throw std::runtime_error(std::string("Unable to open ") + path);
+	std::stringstream buff;
+	buff << f.rdbuf();
+	return buff.str();
+}
+
+static std::string run_printed(harkon::object const& form, harkon::environment & env, harkon::compiled_module const* m,
+		unsigned i, harkon::environment const& pristine) {
+	try {
+		return harkon::pretty_print(m ? m->run(i, env, pristine) : harkon::eval(form, env));
+	} catch (std::exception const& ex) {
+		return std::string("Caught exception: ") + ex.what();
+	}
+}
 
-int main(int, char**) {
+// runs every form of a file both interpreted and compiled, reporting any difference
+static int compare_aot(char const* path) {
+	std::vector<harkon::object> forms = harkon::parse_all(read_file(path));
+
+	std::stringstream so;
+	so << "/tmp/harkon_aot_" << ::getpid() << ".so";
+	harkon::compiled_module m = harkon::compile_and_load(forms, so.str());
+
+	harkon::environment pristine = harkon::create_new_environment();
+	harkon::environment interpreted = pristine;
+	harkon::environment compiled = pristine;
+
+	unsigned mismatches = 0;
+	std::clock_t interpreted_time = 0;
+	std::clock_t compiled_time = 0;
+
+	std::string expected_output; // what the standalone executable should print
+	for (unsigned i(0); i < forms.size(); ++i) {
+		std::clock_t start = std::clock();
+		std::string a = run_printed(forms[i], interpreted, NULL, i, pristine);
+		expected_output += a + "\n";
+		std::clock_t mid = std::clock();
+		std::string b = run_printed(forms[i], compiled, &m, i, pristine);
+		std::clock_t end = std::clock();
+
+		interpreted_time += mid - start;
+		compiled_time += end - mid;
+
+		if (a != b) {
+			++mismatches;
+			std::cout << "MISMATCH " << harkon::pretty_print(forms[i]) << "\n  interpreted: " << a << "\n  compiled:    "
+					<< b << std::endl;
+		}
+	}
+
+	::unlink(so.str().c_str());
+	::unlink((so.str() + ".cc").c_str());
+
+	// and as --compile would, which has to link, run on its own and print what the interpretter did
+	std::stringstream exe;
+	exe << "/tmp/harkon_aot_" << ::getpid();
+	harkon::compile_executable(forms, exe.str());
+	std::string output;
+	FILE* run = ::popen(("'" + exe.str() + "'").c_str(), "r");
+	if (run != NULL) {
+		char buff[4096];
+		for (std::size_t n; (n = std::fread(buff, 1, sizeof(buff), run)) != 0;) {
+			output.append(buff, n);
+		}
+	}
+	int status = run != NULL ? ::pclose(run) : -1;
+	::unlink(exe.str().c_str());
+	::unlink((exe.str() + ".cc").c_str());
+	if (status != 0) {
+		std::cout << "Compiled executable failed with status " << status << std::endl;
+		++mismatches;
+	} else if (output != expected_output) {
+		std::size_t at = 0;
+		while (at < output.size() && at < expected_output.size() && output[at] == expected_output[at]) {
+			++at;
+		}
+		std::size_t line = std::count(expected_output.begin(), expected_output.begin() + at, '\n');
+		std::cout << "MISMATCH compiled executable's output, from the result of form " << line + 1 << std::endl;
+		++mismatches;
+	}
+
+	std::cout << forms.size() << " forms, " << mismatches << " mismatches. interpreted " << interpreted_time * 1000.0
+			/ CLOCKS_PER_SEC << "ms, compiled " << compiled_time * 1000.0 / CLOCKS_PER_SEC << "ms" << std::endl;
+	return mismatches == 0 ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+
+	if (argc >= 3 && std::string(argv[1]) == "--server") {
+		unsigned workers = boost::thread::hardware_concurrency();
+		if (argc >= 4) {
+			char* end;
+			long n = std::strtol(argv[3], &end, 10);
+			if (*argv[3] == '\0' || *end != '\0' || n <= 0 || n > 1024) {
+				std::cerr << "Usage: --server <socket-path> [workers], workers from 1 to 1024" << std::endl;
+				return 1;
+			}
+			workers = n;
+		}
+		if (workers == 0)
+			workers = 1; // hardware_concurrency couldn't tell
+		return harkon::run_server(argv[2], harkon::create_new_environment(), workers);
+	}
+
+	try {
+		if (argc == 3 && std::string(argv[1]) == "--emit-cpp") {
+			harkon::compile_options opts;
+			opts.standalone = true;
+			std::cout << harkon::compile_to_cpp(harkon::parse_all(read_file(argv[2])), opts);
+			return 0;
+		}
+		if (argc == 4 && std::string(argv[1]) == "--compile") {
+			harkon::compile_executable(harkon::parse_all(read_file(argv[2])), argv[3]);
+			return 0;
+		}
+		if (argc == 3 && std::string(argv[1]) == "--compare-aot") {
+			return compare_aot(argv[2]);
+		}
+		if ((argc == 3 || argc == 4) && std::string(argv[1]) == "--run") {
+			// evaluates a file, printing each result, with its parse cached under argv[3] if given
+			std::vector<harkon::object> forms;
+			if (argc == 4) {
+				harkon::module_cache cache(argv[3]);
+				forms = cache.load(argv[2]);
+			} else {
+				forms = harkon::parse_all(read_file(argv[2]));
+			}
+
+			harkon::environment env = harkon::create_new_environment();
+			gc::root<std::vector<harkon::object> > forms_root(forms);
+			gc::root<harkon::environment> env_root(env);
+			harkon::ostream_sink out(std::cout);
+			for (std::size_t i(0); i < forms.size(); ++i) {
+				{
+					gc::mutator_scope scope;
+					harkon::eval_result r = harkon::eval_in_region(forms[i], env);
+					if (!r.ok()) {
+						std::cout.flush();
+						std::cerr << argv[2];
+						if (r.error->span())
+							std::cerr << ":" << r.error->span()->line << ":" << r.error->span()->column;
+						std::cerr << ": " << r.error->what() << std::endl;
+						return 1;
+					}
+					harkon::print(r.value, out);
+					std::cout << '\n';
+				}
+				gc::safepoint();
+			}
+			return 0;
+		}
+		if (argc == 4 && std::string(argv[1]) == "--build-image") {
+			harkon::environment env = harkon::create_new_environment();
+			std::vector<harkon::object> forms = harkon::parse_all(read_file(argv[2]));
+			for (std::size_t i(0); i < forms.size(); ++i) {
+				harkon::eval(forms[i], env);
+			}
+			harkon::save_image(env, argv[3]);
+			return 0;
+		}
+	} catch (std::exception const& ex) {
+		std::cerr << ex.what() << std::endl;
+		return 1;
+	}
+
+	harkon::environment env = harkon::create_new_environment();
+	gc::root<harkon::environment> env_root(env);
+
+	if (argc == 3 && std::string(argv[1]) == "--image") {
+		try {
+			env = harkon::load_image(argv[2]);
+		} catch (std::exception const& ex) {
+			std::cerr << ex.what() << std::endl;
+			return 1;
+		}
+	}
 
 	std::cout << "Welcome to Harkon. :exit to quit\n\n";
 
+	// the commands come from stdin, so (stdin-lines) mustn't read ahead of them
+	io::stdin_reserved() = true;
+
 	std::string in;
+	harkon::ostream_sink out(std::cout);
+	harkon::print_options print_opts;
+	harkon::evaluator ev = &harkon::eval;
 
 	std::cout << "~> ";
 
-	harkon::environment env = harkon::create_new_environment();
-
 
 	while (std::getline(std::cin, in)) {
 
 		if (in == ":exit") break;
 
+		// between lines, only env holds anything
+		if (in == ":gc") {
+			gc::collect();
+			gc::print(std::cout, gc::stats());
+			std::cout << "~> ";
+			continue;
+		}
+		gc::safepoint();
+
 		try {
+			gc::mutator_scope scope;
+
+			if (in == ":stats") {
+				alloc_stats::print(std::cout, alloc_stats::take());
+				std::cout << "~> ";
+				continue;
+			}
+			if (in.compare(0, 7, ":stats ") == 0) {
+				// what evaluating just this one form allocates
+				harkon::object r = harkon::parse(in.substr(7));
+				alloc_stats::snapshot before = alloc_stats::take();
+				harkon::object result = harkon::eval(r, env);
+				alloc_stats::snapshot after = alloc_stats::take();
+
+				harkon::print(result, out, print_opts);
+				std::cout << std::endl;
+				alloc_stats::print(std::cout, alloc_stats::diff(before, after));
+				std::cout << "~> ";
+				continue;
+			}
+			if (in.compare(0, 12, ":save-image ") == 0) {
+				harkon::save_image(env, in.substr(12));
+				std::cout << "~> ";
+				continue;
+			}
+
+			if (in.compare(0, 11, ":evaluator ") == 0) {
+				// the machine keeps its continuation on the heap, for deep recursion
+				std::string which = in.substr(11);
+				if (which == "machine")
+					ev = &harkon::machine_eval;
+				else if (which == "recursive")
+					ev = &harkon::eval;
+				else
+					throw std::runtime_error("Usage: :evaluator machine|recursive");
+				std::cout << "~> ";
+				continue;
+			}
+
+			if (in.compare(0, 14, ":print-limits ") == 0) {
+				// depth and length, 0 for no limit
+				std::istringstream limits(in.substr(14));
+				if (!(limits >> print_opts.max_depth >> print_opts.max_length))
+					throw std::runtime_error("Usage: :print-limits <depth> <length>");
+				std::cout << "~> ";
+				continue;
+			}
+
+			if (in.compare(0, 14, ":label-shared ") == 0) {
+				// off by default, as finding what's shared walks the whole result first
+				std::string which = in.substr(14);
+				if (which == "on")
+					print_opts.label_shared = true;
+				else if (which == "off")
+					print_opts.label_shared = false;
+				else
+					throw std::runtime_error("Usage: :label-shared on|off");
+				std::cout << "~> ";
+				continue;
+			}
+
 			harkon::object r = harkon::parse(in);
 
 			//std::cout << "Parsed: " << harkon::pretty_print(r) << std::endl;
-			std::cout << harkon::pretty_print(harkon::eval(r, env)) << std::endl;
+			harkon::eval_result result = harkon::eval_in_region(r, env, ev);
+			if (!result.ok())
+				throw *result.error;
+			harkon::print(result.value, out, print_opts);
+			std::cout << std::endl;
 
 
 		} catch (std::exception const& ex) {
@@ -1,2 +1,2 @@
 set -eux
-printf '#include "%s"\n' *.cc reader/*.cc | g++ -O3 -o repl -xc++ -
+printf '#include "%s"\n' *.cc reader/*.cc server/*.cc | g++ -O3 -DHARKON_INCLUDE_DIR="\"$(pwd)\"" -rdynamic -o repl -xc++ - -xnone -lboost_thread -ldl
@@ -0,0 +1,373 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+
+#include "../alloc.hpp"
+
+namespace harkon {
+
+// An immutable arbitrary precision integer. Only ever used for values that don't
+// fit in an int (see integer_sum and friends), small values stay unboxed in the
+// object variant. Sign and magnitude, with the magnitude as base 2^32 limbs,
+// least significant first and without leading zero limbs.
+struct bigint {
+    typedef boost::uint32_t limb;
+
+    bigint() :
+            negative(false), length(0), limbs(NULL) {
+    }
+
+    explicit bigint(long long v);
+
+    // decimal, with an optional leading '-'
+    static bigint parse(char const* s, unsigned len);
+
+    bool is_zero() const {
+        return length == 0;
+    }
+
+    bool fits_int() const;
+    int to_int() const;
+    bool fits_int64() const;
+    boost::int64_t to_int64() const;
+    std::string to_string() const;
+
+    int compare(bigint const& other) const;
+
+    bool operator==(bigint const& other) const {
+        return compare(other) == 0;
+    }
+    bool operator<(bigint const& other) const {
+        return compare(other) < 0;
+    }
+
+    bigint operator-() const {
+        bigint r(*this);
+        r.negative = !negative && length != 0;
+        return r;
+    }
+
+    friend bigint operator+(bigint const& a, bigint const& b);
+    friend bigint operator-(bigint const& a, bigint const& b);
+    friend bigint operator*(bigint const& a, bigint const& b);
+
+private:
+    static bigint from_magnitude(bool negative, std::vector<limb> & mag);
+
+    bool negative;
+    unsigned length;
+    limb const* limbs; // a GC block, or NULL for zero
+
+    friend void gc_visit(bigint const& b, gc::marker & m) {
+        m.mark(b.limbs);
+    }
+};
+
+namespace bigint_impl {
+
+typedef bigint::limb limb;
+typedef boost::uint64_t wide;
+
+// what the limbs are accounted against in alloc_stats
+struct limbs {
+};
+
+inline char const* alloc_name(limbs const*) {
+    return "bigint limbs";
+}
+
+// below this many limbs schoolbook multiplication beats karatsuba
+const unsigned karatsuba_threshold = 32;
+
+inline unsigned trimmed(limb const* a, unsigned n) {
+    while (n > 0 && a[n - 1] == 0) {
+        --n;
+    }
+    return n;
+}
+
+inline int compare(limb const* a, unsigned an, limb const* b, unsigned bn) {
+    if (an != bn)
+        return an < bn ? -1 : 1;
+    for (unsigned i(an); i > 0; --i) {
+        if (a[i - 1] != b[i - 1])
+            return a[i - 1] < b[i - 1] ? -1 : 1;
+    }
+    return 0;
+}
+
+// out += a << (32 * shift), out being long enough to absorb the carry
+inline void add_into(limb* out, unsigned on, limb const* a, unsigned an, unsigned shift) {
+    wide carry = 0;
+    unsigned i(0);
+    for (; i < an; ++i) {
+        carry += wide(out[i + shift]) + a[i];
+        out[i + shift] = limb(carry);
+        carry >>= 32;
+    }
+    for (i += shift; carry != 0 && i < on; ++i) {
+        carry += out[i];
+        out[i] = limb(carry);
+        carry >>= 32;
+    }
+}
+
+// out -= a, where out >= a
+inline void sub_from(limb* out, unsigned on, limb const* a, unsigned an) {
+    boost::int64_t borrow = 0;
+    unsigned i(0);
+    for (; i < an; ++i) {
+        boost::int64_t d = boost::int64_t(out[i]) - a[i] - borrow;
+        borrow = d < 0;
+        out[i] = limb(d + (borrow << 32));
+    }
+    for (; borrow != 0 && i < on; ++i) {
+        boost::int64_t d = boost::int64_t(out[i]) - borrow;
+        borrow = d < 0;
+        out[i] = limb(d + (borrow << 32));
+    }
+}
+
+// out (an + bn limbs, zeroed) = a * b
+inline void mul_schoolbook(limb const* a, unsigned an, limb const* b, unsigned bn, limb* out) {
+    for (unsigned i(0); i < an; ++i) {
+        wide carry = 0;
+        for (unsigned j(0); j < bn; ++j) {
+            carry += wide(a[i]) * b[j] + out[i + j];
+            out[i + j] = limb(carry);
+            carry >>= 32;
+        }
+        out[i + bn] = limb(carry);
+    }
+}
+
+// out (an + bn limbs, zeroed) = a * b
+inline void mul(limb const* a, unsigned an, limb const* b, unsigned bn, limb* out) {
+    if (an < bn) {
+        std::swap(a, b);
+        std::swap(an, bn);
+    }
+    if (bn == 0)
+        return;
+
+    if (bn < karatsuba_threshold) {
+        mul_schoolbook(a, an, b, bn, out);
+        return;
+    }
+
+    unsigned m = (an + 1) / 2;
+
+    if (bn <= m) {
+        // too lopsided to split both, so multiply b by a a chunk at a time
+        std::vector<limb> part(bn + bn);
+        for (unsigned off(0); off < an; off += bn) {
+            unsigned len = std::min(bn, an - off);
+            std::fill(part.begin(), part.end(), 0);
+            mul(a + off, len, b, bn, &part[0]);
+            add_into(out, an + bn, &part[0], trimmed(&part[0], len + bn), off);
+        }
+        return;
+    }
+
+    // karatsuba: a = a1 B^m + a0, b = b1 B^m + b0
+    limb const* a0 = a;
+    limb const* a1 = a + m;
+    limb const* b0 = b;
+    limb const* b1 = b + m;
+    unsigned a0n = trimmed(a0, m), a1n = an - m;
+    unsigned b0n = trimmed(b0, m), b1n = bn - m;
+
+    std::vector<limb> z0(2 * m + 1, 0);
+    std::vector<limb> z2(a1n + b1n + 1, 0);
+    mul(a0, a0n, b0, b0n, &z0[0]);
+    mul(a1, a1n, b1, b1n, &z2[0]);
+
+    std::vector<limb> sa(m + 2, 0);
+    std::vector<limb> sb(m + 2, 0);
+    std::copy(a0, a0 + a0n, sa.begin());
+    add_into(&sa[0], sa.size(), a1, a1n, 0);
+    std::copy(b0, b0 + b0n, sb.begin());
+    add_into(&sb[0], sb.size(), b1, b1n, 0);
+
+    unsigned san = trimmed(&sa[0], sa.size());
+    unsigned sbn = trimmed(&sb[0], sb.size());
+    std::vector<limb> z1(san + sbn + 1, 0);
+    mul(&sa[0], san, &sb[0], sbn, &z1[0]);
+
+    // z1 = (a0 + a1)(b0 + b1) - z0 - z2
+    sub_from(&z1[0], z1.size(), &z0[0], trimmed(&z0[0], z0.size()));
+    sub_from(&z1[0], z1.size(), &z2[0], trimmed(&z2[0], z2.size()));
+
+    add_into(out, an + bn, &z0[0], trimmed(&z0[0], z0.size()), 0);
+    add_into(out, an + bn, &z1[0], trimmed(&z1[0], z1.size()), m);
+    add_into(out, an + bn, &z2[0], trimmed(&z2[0], z2.size()), 2 * m);
+}
+
+// a /= d in place, returning the remainder
+inline limb div_small(std::vector<limb> & a, limb d) {
+    wide rem = 0;
+    for (std::size_t i(a.size()); i > 0; --i) {
+        wide cur = (rem << 32) | a[i - 1];
+        a[i - 1] = limb(cur / d);
+        rem = cur % d;
+    }
+    a.resize(trimmed(&a[0], a.size()));
+    return limb(rem);
+}
+
+// a = a * m + add
+inline void mul_add_small(std::vector<limb> & a, limb m, limb add) {
+    wide carry = add;
+    for (std::size_t i(0); i < a.size(); ++i) {
+        carry += wide(a[i]) * m;
+        a[i] = limb(carry);
+        carry >>= 32;
+    }
+    if (carry != 0)
+        a.push_back(limb(carry));
+}
+
+}
+
+inline bigint bigint::from_magnitude(bool negative, std::vector<limb> & mag) {
+    bigint r;
+    r.length = mag.empty() ? 0 : bigint_impl::trimmed(&mag[0], mag.size());
+    r.negative = negative && r.length != 0;
+    if (r.length != 0) {
+        limb* l = static_cast<limb*>(GC_ALLOC_AS(bigint_impl::limbs, r.length * sizeof(limb)));
+        std::memcpy(l, &mag[0], r.length * sizeof(limb));
+        r.limbs = l;
+    }
+    return r;
+}
+
+inline bigint::bigint(long long v) :
+        negative(v < 0), length(0), limbs(NULL) {
+    // negate as unsigned, so LLONG_MIN is fine
+    boost::uint64_t mag = negative ? 0 - static_cast<boost::uint64_t>(v) : v;
+    std::vector<limb> m;
+    m.push_back(limb(mag));
+    m.push_back(limb(mag >> 32));
+    *this = from_magnitude(negative, m);
+}
+
+inline bigint bigint::parse(char const* s, unsigned len) {
+    bool neg = len > 0 && s[0] == '-';
+    unsigned i = neg ? 1 : 0;
+    if (i == len)
+        throw std::runtime_error("Invalid integer: " + std::string(s, len));
+
+    std::vector<limb> mag;
+    while (i < len) {
+        // nine digits at a time
+        limb chunk = 0;
+        limb scale = 1;
+        for (unsigned n(0); n < 9 && i < len; ++n, ++i) {
+            if (s[i] < '0' || s[i] > '9')
+                throw std::runtime_error("Invalid integer: " + std::string(s, len));
+            chunk = chunk * 10 + (s[i] - '0');
+            scale *= 10;
+        }
+        bigint_impl::mul_add_small(mag, scale, chunk);
+    }
+    return from_magnitude(neg, mag);
+}
+
+inline bool bigint::fits_int() const {
+    if (length == 0)
+        return true;
+    if (length > 1)
+        return false;
+    return negative ? limbs[0] <= 0x80000000u : limbs[0] <= 0x7fffffffu;
+}
+
+inline int bigint::to_int() const {
+    assert(fits_int());
+    if (length == 0)
+        return 0;
+    return negative ? static_cast<int>(0 - static_cast<boost::int64_t>(limbs[0])) : static_cast<int>(limbs[0]);
+}
+
+inline bool bigint::fits_int64() const {
+    if (length <= 1)
+        return true;
+    if (length > 2)
+        return false;
+    boost::uint64_t mag = (boost::uint64_t(limbs[1]) << 32) | limbs[0];
+    return negative ? mag <= (boost::uint64_t(1) << 63) : mag < (boost::uint64_t(1) << 63);
+}
+
+inline boost::int64_t bigint::to_int64() const {
+    assert(fits_int64());
+    boost::uint64_t mag = 0;
+    for (unsigned i(length); i > 0; --i) {
+        mag = (mag << 32) | limbs[i - 1];
+    }
+    return negative ? static_cast<boost::int64_t>(0 - mag) : static_cast<boost::int64_t>(mag);
+}
+
+inline std::string bigint::to_string() const {
+    if (length == 0)
+        return "0";
+
+    std::vector<limb> mag(limbs, limbs + length);
+    std::string digits;
+    while (!mag.empty()) {
+        limb chunk = bigint_impl::div_small(mag, 1000000000u);
+        for (unsigned n(0); n < 9 && (chunk != 0 || !mag.empty()); ++n) {
+            digits += char('0' + chunk % 10);
+            chunk /= 10;
+        }
+    }
+    if (negative)
+        digits += '-';
+    std::reverse(digits.begin(), digits.end());
+    return digits;
+}
+
+inline int bigint::compare(bigint const& other) const {
+    if (negative != other.negative)
+        return negative ? -1 : 1;
+    int c = bigint_impl::compare(limbs, length, other.limbs, other.length);
+    return negative ? -c : c;
+}
+
+inline bigint operator+(bigint const& a, bigint const& b) {
+    using namespace bigint_impl;
+
+    if (a.negative == b.negative) {
+        std::vector<limb> sum(std::max(a.length, b.length) + 1, 0);
+        std::copy(a.limbs, a.limbs + a.length, sum.begin());
+        add_into(&sum[0], sum.size(), b.limbs, b.length, 0);
+        return bigint::from_magnitude(a.negative, sum);
+    }
+
+    // opposite signs: the smaller magnitude comes off the larger
+    bool a_larger = compare(a.limbs, a.length, b.limbs, b.length) >= 0;
+    bigint const& big = a_larger ? a : b;
+    bigint const& small = a_larger ? b : a;
+
+    std::vector<limb> diff(big.limbs, big.limbs + big.length);
+    if (!diff.empty())
+        sub_from(&diff[0], diff.size(), small.limbs, small.length);
+    return bigint::from_magnitude(big.negative, diff);
+}
+
+inline bigint operator-(bigint const& a, bigint const& b) {
+    return a + -b;
+}
+
+inline bigint operator*(bigint const& a, bigint const& b) {
+    std::vector<bigint::limb> product(a.length + b.length + 1, 0);
+    bigint_impl::mul(a.limbs, a.length, b.limbs, b.length, &product[0]);
+    return bigint::from_magnitude(a.negative != b.negative, product);
+}
+
+}
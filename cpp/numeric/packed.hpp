@@ -0,0 +1,609 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+
+#include "../alloc.hpp"
+#include "bigint.hpp"
+
+namespace harkon {
+
+// An immutable array of int32s or int64s, packed one after another in a GC
+// block rather than boxed an object each, so whole arrays can be summed,
+// compared and combined a SIMD register at a time (see packed_impl). Results
+// are exact, as integers are everywhere else: int32 elements that would
+// overflow widen to int64, and sums and dot products are as wide as they need
+// to be. Only int64 elements that would overflow are an error.
+struct packed {
+    enum element_type {
+        int32, int64
+    };
+
+    packed() :
+            elements(int32), length(0), block(NULL) {
+    }
+
+    // n elements, left for whoever's making it to fill in through data()
+    packed(element_type type, unsigned n);
+
+    element_type type() const {
+        return elements;
+    }
+
+    unsigned size() const {
+        return length;
+    }
+
+    template<typename T>
+    T const* data() const {
+        assert(sizeof(T) == (elements == int32 ? 4 : 8));
+        return static_cast<T const*>(block);
+    }
+
+    // only while it's being made
+    template<typename T>
+    T* data() {
+        assert(sizeof(T) == (elements == int32 ? 4 : 8));
+        return static_cast<T*>(const_cast<void*>(block));
+    }
+
+    long long at(unsigned i) const {
+        assert(i < length);
+        return elements == int32 ? data<boost::int32_t>()[i] : data<boost::int64_t>()[i];
+    }
+
+    // the same values, whichever width they're packed at
+    bool operator==(packed const& other) const;
+
+private:
+    element_type elements;
+    unsigned length;
+    void const* block; // a GC block, or NULL when empty
+
+    friend void gc_visit(packed const& p, gc::marker & m) {
+        m.mark(p.block);
+    }
+};
+
+namespace packed_impl {
+
+typedef boost::int32_t i32;
+typedef boost::int64_t i64;
+typedef boost::uint32_t u32;
+typedef boost::uint64_t u64;
+
+// what the elements are accounted against in alloc_stats
+struct elements {
+};
+
+inline char const* alloc_name(elements const*) {
+    return "packed elements";
+}
+
+// The kernels are written once, over GCC vector types a register wide, and
+// compiled once per instruction set by inlining them into a wrapper with that
+// target: 16 byte registers for SSE2, which every x86-64 has, 32 for AVX2 and 64
+// for AVX-512. The best the CPU has is picked the first time any are used.
+// int32s are widened to int64s half a register at a time, so that no vector is
+// ever wider than the registers it's meant for, which GCC would spill.
+template<int Bytes>
+struct vec;
+
+#define HARKON_PACKED_VEC(bytes) \
+    template<> \
+    struct vec<bytes> { \
+        typedef i32 s32 __attribute__((vector_size(bytes))); \
+        typedef u32 w32 __attribute__((vector_size(bytes))); \
+        typedef i64 s64 __attribute__((vector_size(bytes))); \
+        typedef u64 w64 __attribute__((vector_size(bytes))); \
+    };
+
+HARKON_PACKED_VEC(8)
+HARKON_PACKED_VEC(16)
+HARKON_PACKED_VEC(32)
+HARKON_PACKED_VEC(64)
+
+#undef HARKON_PACKED_VEC
+
+// vectors of T a register of R bytes wide, and their unsigned counterparts (for arithmetic that wraps)
+template<typename T, int R>
+struct lanes;
+
+template<int R>
+struct lanes<i32, R> {
+    typedef typename vec<R>::s32 type;
+    typedef typename vec<R>::w32 wrapping;
+    static const unsigned count = R / 4;
+};
+
+template<int R>
+struct lanes<i64, R> {
+    typedef typename vec<R>::s64 type;
+    typedef typename vec<R>::w64 wrapping;
+    static const unsigned count = R / 8;
+};
+
+#define HARKON_KERNEL template<int R> inline __attribute__((always_inline))
+
+// int32s from a, widened to a register of int64s. out rather than returned,
+// as vectors in signatures are compiled for the caller's target, not the kernel's
+template<int R>
+inline __attribute__((always_inline)) void load_wide(i32 const* a, typename vec<R>::s64 & out) {
+    typename vec<R / 2>::s32 x;
+    std::memcpy(&x, a, sizeof(x));
+    out = __builtin_convertvector(x, typename vec<R>::s64);
+}
+
+// exact, as int32s can't overflow an int64 lane in fewer than 2^32 of them
+HARKON_KERNEL long long sum32(i32 const* a, std::size_t n) {
+    typedef typename vec<R>::s64 v64;
+    const unsigned N = R / 8;
+    v64 acc = { }, acc2 = { };
+    std::size_t i = 0;
+    for (; i + 2 * N <= n; i += 2 * N) {
+        v64 x, y;
+        load_wide<R>(a + i, x);
+        load_wide<R>(a + i + N, y);
+        acc += x;
+        acc2 += y;
+    }
+    acc += acc2;
+    long long r = 0;
+    for (unsigned j(0); j < N; ++j) {
+        r += acc[j];
+    }
+    for (; i < n; ++i) {
+        r += a[i];
+    }
+    return r;
+}
+
+// false if it overflowed (or a lane did on the way), for the caller to do exactly
+HARKON_KERNEL bool sum64(i64 const* a, std::size_t n, long long & out) {
+    typedef typename vec<R>::s64 v64;
+    typedef typename vec<R>::w64 w64;
+    const unsigned N = R / 8;
+    v64 acc = { };
+    v64 over = { };
+    std::size_t i = 0;
+    for (; i + N <= n; i += N) {
+        v64 x;
+        std::memcpy(&x, a + i, sizeof(x));
+        v64 s = (v64) ((w64) acc + (w64) x);
+        over |= (acc ^ s) & (x ^ s);
+        acc = s;
+    }
+    long long r = 0;
+    for (unsigned j(0); j < N; ++j) {
+        if (over[j] < 0 || __builtin_add_overflow(r, acc[j], &r))
+            return false;
+    }
+    for (; i < n; ++i) {
+        if (__builtin_add_overflow(r, a[i], &r))
+            return false;
+    }
+    out = r;
+    return true;
+}
+
+// out = a + b, wrapping, and whether nothing overflowed
+template<int R, typename T>
+inline __attribute__((always_inline)) bool add(T const* a, T const* b, T* out, std::size_t n) {
+    typedef typename lanes<T, R>::type v;
+    typedef typename lanes<T, R>::wrapping w;
+    const unsigned N = lanes<T, R>::count;
+    v over = { };
+    std::size_t i = 0;
+    for (; i + N <= n; i += N) {
+        v x, y;
+        std::memcpy(&x, a + i, sizeof(x));
+        std::memcpy(&y, b + i, sizeof(y));
+        v s = (v) ((w) x + (w) y);
+        over |= (x ^ s) & (y ^ s);
+        std::memcpy(out + i, &s, sizeof(s));
+    }
+    bool ok = true;
+    for (unsigned j(0); j < N; ++j) {
+        ok &= over[j] >= 0;
+    }
+    for (; i < n; ++i) {
+        ok &= !__builtin_add_overflow(a[i], b[i], out + i);
+    }
+    return ok;
+}
+
+// exact, as the product of two int32s always fits an int64
+HARKON_KERNEL void mul32(i32 const* a, i32 const* b, i64* out, std::size_t n) {
+    typedef typename vec<R>::s64 v64;
+    const unsigned N = R / 8;
+    std::size_t i = 0;
+    for (; i + N <= n; i += N) {
+        v64 x, y;
+        load_wide<R>(a + i, x);
+        load_wide<R>(b + i, y);
+        v64 p = x * y;
+        std::memcpy(out + i, &p, sizeof(p));
+    }
+    for (; i < n; ++i) {
+        out[i] = i64(a[i]) * b[i];
+    }
+}
+
+HARKON_KERNEL void widen(i32 const* a, i64* out, std::size_t n) {
+    typedef typename vec<R>::s64 v64;
+    const unsigned N = R / 8;
+    std::size_t i = 0;
+    for (; i + N <= n; i += N) {
+        v64 y;
+        load_wide<R>(a + i, y);
+        std::memcpy(out + i, &y, sizeof(y));
+    }
+    for (; i < n; ++i) {
+        out[i] = a[i];
+    }
+}
+
+// out = a as int32s, and whether they all fit
+HARKON_KERNEL bool narrow(i64 const* a, i32* out, std::size_t n) {
+    typedef typename vec<R / 2>::s32 h32;
+    typedef typename vec<R>::s64 v64;
+    const unsigned N = R / 8;
+    v64 misfit = { };
+    std::size_t i = 0;
+    for (; i + N <= n; i += N) {
+        v64 x;
+        std::memcpy(&x, a + i, sizeof(x));
+        h32 y = __builtin_convertvector(x, h32);
+        misfit |= x ^ __builtin_convertvector(y, v64);
+        std::memcpy(out + i, &y, sizeof(y));
+    }
+    bool ok = true;
+    for (unsigned j(0); j < N; ++j) {
+        ok &= misfit[j] == 0;
+    }
+    for (; i < n; ++i) {
+        out[i] = i32(a[i]);
+        ok &= out[i] == a[i];
+    }
+    return ok;
+}
+
+// the least (or with Most, the greatest) of n > 0
+template<int R, bool Most, typename T>
+inline __attribute__((always_inline)) T extreme(T const* a, std::size_t n) {
+    typedef typename lanes<T, R>::type v;
+    const unsigned N = lanes<T, R>::count;
+    T r = a[0];
+    std::size_t i = 0;
+    if (n >= N) {
+        v m;
+        std::memcpy(&m, a, sizeof(m));
+        for (i = N; i + N <= n; i += N) {
+            v x;
+            std::memcpy(&x, a + i, sizeof(x));
+            m = (Most ? x > m : x < m) ? x : m;
+        }
+        for (unsigned j(0); j < N; ++j) {
+            r = (Most ? m[j] > r : m[j] < r) ? m[j] : r;
+        }
+    }
+    for (; i < n; ++i) {
+        r = (Most ? a[i] > r : a[i] < r) ? a[i] : r;
+    }
+    return r;
+}
+
+// out[i] = a[i] < b[i] (or with Equal, ==) as 1 or 0
+template<int R, bool Equal, typename T>
+inline __attribute__((always_inline)) void compare(T const* a, T const* b, i32* out, std::size_t n) {
+    typedef typename lanes<T, R>::type v;
+    typedef typename lanes<i32, R * 4 / sizeof(T)>::type v32; // as many int32s as there are Ts
+    const unsigned N = lanes<T, R>::count;
+    std::size_t i = 0;
+    for (; i + N <= n; i += N) {
+        v x, y;
+        std::memcpy(&x, a + i, sizeof(x));
+        std::memcpy(&y, b + i, sizeof(y));
+        v32 r = __builtin_convertvector((Equal ? x == y : x < y) & 1, v32);
+        std::memcpy(out + i, &r, sizeof(r));
+    }
+    for (; i < n; ++i) {
+        out[i] = Equal ? a[i] == b[i] : a[i] < b[i];
+    }
+}
+
+// false if the sum overflowed an int64 (or a lane did on the way)
+HARKON_KERNEL bool dot32(i32 const* a, i32 const* b, std::size_t n, long long & out) {
+    typedef typename vec<R>::s64 v64;
+    typedef typename vec<R>::w64 w64;
+    const unsigned N = R / 8;
+    v64 acc = { };
+    v64 over = { };
+    std::size_t i = 0;
+    for (; i + N <= n; i += N) {
+        v64 x, y;
+        load_wide<R>(a + i, x);
+        load_wide<R>(b + i, y);
+        v64 p = x * y;
+        v64 s = (v64) ((w64) acc + (w64) p);
+        over |= (acc ^ s) & (p ^ s);
+        acc = s;
+    }
+    long long r = 0;
+    for (unsigned j(0); j < N; ++j) {
+        if (over[j] < 0 || __builtin_add_overflow(r, acc[j], &r))
+            return false;
+    }
+    for (; i < n; ++i) {
+        if (__builtin_add_overflow(r, i64(a[i]) * b[i], &r))
+            return false;
+    }
+    out = r;
+    return true;
+}
+
+#undef HARKON_KERNEL
+
+// one instruction set's build of every kernel
+struct kernels {
+    char const* name;
+    long long (*sum32)(i32 const*, std::size_t);
+    bool (*sum64)(i64 const*, std::size_t, long long &);
+    bool (*add32)(i32 const*, i32 const*, i32*, std::size_t);
+    bool (*add64)(i64 const*, i64 const*, i64*, std::size_t);
+    void (*mul32)(i32 const*, i32 const*, i64*, std::size_t);
+    void (*widen)(i32 const*, i64*, std::size_t);
+    bool (*narrow)(i64 const*, i32*, std::size_t);
+    i32 (*min32)(i32 const*, std::size_t);
+    i32 (*max32)(i32 const*, std::size_t);
+    i64 (*min64)(i64 const*, std::size_t);
+    i64 (*max64)(i64 const*, std::size_t);
+    void (*less32)(i32 const*, i32 const*, i32*, std::size_t);
+    void (*less64)(i64 const*, i64 const*, i32*, std::size_t);
+    void (*equal32)(i32 const*, i32 const*, i32*, std::size_t);
+    void (*equal64)(i64 const*, i64 const*, i32*, std::size_t);
+    bool (*dot32)(i32 const*, i32 const*, std::size_t, long long &);
+};
+
+// wrappers for each kernel, compiled for `target` with `bytes` byte registers, and their table
+#define HARKON_PACKED_KERNELS(isa, target, bytes) \
+    namespace isa { \
+    target inline long long sum32(i32 const* a, std::size_t n) { return packed_impl::sum32<bytes>(a, n); } \
+    target inline bool sum64(i64 const* a, std::size_t n, long long & out) { return packed_impl::sum64<bytes>(a, n, out); } \
+    target inline bool add32(i32 const* a, i32 const* b, i32* out, std::size_t n) { return add<bytes>(a, b, out, n); } \
+    target inline bool add64(i64 const* a, i64 const* b, i64* out, std::size_t n) { return add<bytes>(a, b, out, n); } \
+    target inline void mul32(i32 const* a, i32 const* b, i64* out, std::size_t n) { packed_impl::mul32<bytes>(a, b, out, n); } \
+    target inline void widen(i32 const* a, i64* out, std::size_t n) { packed_impl::widen<bytes>(a, out, n); } \
+    target inline bool narrow(i64 const* a, i32* out, std::size_t n) { return packed_impl::narrow<bytes>(a, out, n); } \
+    target inline i32 min32(i32 const* a, std::size_t n) { return extreme<bytes, false>(a, n); } \
+    target inline i32 max32(i32 const* a, std::size_t n) { return extreme<bytes, true>(a, n); } \
+    target inline i64 min64(i64 const* a, std::size_t n) { return extreme<bytes, false>(a, n); } \
+    target inline i64 max64(i64 const* a, std::size_t n) { return extreme<bytes, true>(a, n); } \
+    target inline void less32(i32 const* a, i32 const* b, i32* out, std::size_t n) { compare<bytes, false>(a, b, out, n); } \
+    target inline void less64(i64 const* a, i64 const* b, i32* out, std::size_t n) { compare<bytes, false>(a, b, out, n); } \
+    target inline void equal32(i32 const* a, i32 const* b, i32* out, std::size_t n) { compare<bytes, true>(a, b, out, n); } \
+    target inline void equal64(i64 const* a, i64 const* b, i32* out, std::size_t n) { compare<bytes, true>(a, b, out, n); } \
+    target inline bool dot32(i32 const* a, i32 const* b, std::size_t n, long long & out) { return packed_impl::dot32<bytes>(a, b, n, out); } \
+    inline kernels const* table() { \
+        static const kernels k = { #isa, &sum32, &sum64, &add32, &add64, &mul32, &widen, &narrow, &min32, &max32, \
+                &min64, &max64, &less32, &less64, &equal32, &equal64, &dot32 }; \
+        return &k; \
+    } \
+    }
+
+HARKON_PACKED_KERNELS(sse2, , 16)
+#if defined(__x86_64__) || defined(__i386__)
+HARKON_PACKED_KERNELS(avx2, __attribute__((target("avx2"))), 32)
+HARKON_PACKED_KERNELS(avx512, __attribute__((target("avx512f,avx512dq,avx512bw,avx512vl"))), 64)
+#endif
+
+#undef HARKON_PACKED_KERNELS
+
+// the builds this CPU can run, best first
+inline std::vector<kernels const*> supported() {
+    std::vector<kernels const*> r;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512bw")
+            && __builtin_cpu_supports("avx512vl"))
+        r.push_back(avx512::table());
+    if (__builtin_cpu_supports("avx2"))
+        r.push_back(avx2::table());
+#endif
+    r.push_back(sse2::table());
+    return r;
+}
+
+inline kernels const*& active() {
+    static kernels const* k = supported().front();
+    return k;
+}
+
+inline kernels const& use() {
+    return *active();
+}
+
+}
+
+// which kernels packed arrays are worked on with: "avx512", "avx2" or "sse2".
+// picking one the CPU doesn't have is ignored, and returns false
+inline bool use_packed_kernels(char const* name) {
+    std::vector<packed_impl::kernels const*> k = packed_impl::supported();
+    for (std::size_t i(0); i < k.size(); ++i) {
+        if (std::strcmp(k[i]->name, name) == 0) {
+            packed_impl::active() = k[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+inline char const* packed_kernels() {
+    return packed_impl::use().name;
+}
+
+inline packed::packed(element_type type, unsigned n) :
+        elements(type), length(n), block(NULL) {
+    std::size_t bytes = std::size_t(n) * (type == int32 ? 4 : 8);
+    if (n != 0)
+        block = GC_ALLOC_AS(packed_impl::elements, bytes);
+}
+
+inline bool packed::operator==(packed const& other) const {
+    if (length != other.length)
+        return false;
+    if (elements == other.elements)
+        return length == 0 || std::memcmp(block, other.block, std::size_t(length) * (elements == int32 ? 4 : 8)) == 0;
+    for (unsigned i(0); i < length; ++i) {
+        if (at(i) != other.at(i))
+            return false;
+    }
+    return true;
+}
+
+// n copies of v, as int32s if it fits one
+inline packed packed_fill(unsigned n, long long v) {
+    if (v == boost::int32_t(v)) {
+        packed r(packed::int32, n);
+        std::fill(r.data<boost::int32_t>(), r.data<boost::int32_t>() + n, boost::int32_t(v));
+        return r;
+    }
+    packed r(packed::int64, n);
+    std::fill(r.data<boost::int64_t>(), r.data<boost::int64_t>() + n, boost::int64_t(v));
+    return r;
+}
+
+inline packed packed_widen(packed const& a) {
+    if (a.type() == packed::int64)
+        return a;
+    packed r(packed::int64, a.size());
+    packed_impl::use().widen(a.data<boost::int32_t>(), r.data<boost::int64_t>(), a.size());
+    return r;
+}
+
+// a + b an element at a time, or false if an int64 overflowed. int32s that
+// overflow are done again as int64s
+inline bool packed_add(packed const& a, packed const& b, packed & out) {
+    assert(a.size() == b.size());
+    packed_impl::kernels const& k = packed_impl::use();
+    if (a.type() == packed::int32 && b.type() == packed::int32) {
+        packed r(packed::int32, a.size());
+        if (k.add32(a.data<boost::int32_t>(), b.data<boost::int32_t>(), r.data<boost::int32_t>(), a.size())) {
+            out = r;
+            return true;
+        }
+    }
+    packed x = packed_widen(a);
+    packed y = packed_widen(b);
+    packed r(packed::int64, a.size());
+    if (!k.add64(x.data<boost::int64_t>(), y.data<boost::int64_t>(), r.data<boost::int64_t>(), a.size()))
+        return false;
+    out = r;
+    return true;
+}
+
+// a * b the same way. int64 products have no SIMD multiply that notices
+// overflow, so they're done an element at a time
+inline bool packed_mul(packed const& a, packed const& b, packed & out) {
+    assert(a.size() == b.size());
+    packed_impl::kernels const& k = packed_impl::use();
+    if (a.type() == packed::int32 && b.type() == packed::int32) {
+        packed wide(packed::int64, a.size());
+        k.mul32(a.data<boost::int32_t>(), b.data<boost::int32_t>(), wide.data<boost::int64_t>(), a.size());
+        packed narrow(packed::int32, a.size());
+        out = k.narrow(wide.data<boost::int64_t>(), narrow.data<boost::int32_t>(), a.size()) ? narrow : wide;
+        return true;
+    }
+    packed x = packed_widen(a);
+    packed y = packed_widen(b);
+    packed r(packed::int64, a.size());
+    boost::int64_t const* xs = x.data<boost::int64_t>();
+    boost::int64_t const* ys = y.data<boost::int64_t>();
+    boost::int64_t* rs = r.data<boost::int64_t>();
+    for (unsigned i(0); i < a.size(); ++i) {
+        if (__builtin_mul_overflow(xs[i], ys[i], rs + i))
+            return false;
+    }
+    out = r;
+    return true;
+}
+
+inline __int128 packed_sum(packed const& a) {
+    packed_impl::kernels const& k = packed_impl::use();
+    if (a.type() == packed::int32)
+        return k.sum32(a.data<boost::int32_t>(), a.size());
+
+    long long r;
+    if (k.sum64(a.data<boost::int64_t>(), a.size(), r))
+        return r;
+    // fewer than 2^32 int64s can't overflow 128 bits
+    __int128 wide = 0;
+    for (unsigned i(0); i < a.size(); ++i) {
+        wide += a.data<boost::int64_t>()[i];
+    }
+    return wide;
+}
+
+// the sum of the products, or false if it doesn't fit 128 bits (which only
+// int64s near their limits can manage)
+inline bool packed_dot(packed const& a, packed const& b, __int128 & out) {
+    assert(a.size() == b.size());
+    if (a.type() == packed::int32 && b.type() == packed::int32) {
+        long long r;
+        if (packed_impl::use().dot32(a.data<boost::int32_t>(), b.data<boost::int32_t>(), a.size(), r)) {
+            out = r;
+            return true;
+        }
+    }
+    __int128 r = 0;
+    for (unsigned i(0); i < a.size(); ++i) {
+        if (__builtin_add_overflow(r, __int128(a.at(i)) * b.at(i), &r))
+            return false;
+    }
+    out = r;
+    return true;
+}
+
+// the least element (or with most, the greatest) of a non empty array
+inline long long packed_extreme(packed const& a, bool most) {
+    assert(a.size() > 0);
+    packed_impl::kernels const& k = packed_impl::use();
+    if (a.type() == packed::int32)
+        return (most ? k.max32 : k.min32)(a.data<boost::int32_t>(), a.size());
+    return (most ? k.max64 : k.min64)(a.data<boost::int64_t>(), a.size());
+}
+
+// 1 where a's element is less than b's (or with equal, the same), 0 elsewhere
+inline packed packed_compare(packed const& a, packed const& b, bool equal) {
+    assert(a.size() == b.size());
+    packed_impl::kernels const& k = packed_impl::use();
+    packed r(packed::int32, a.size());
+    if (a.type() == packed::int32 && b.type() == packed::int32) {
+        (equal ? k.equal32 : k.less32)(a.data<boost::int32_t>(), b.data<boost::int32_t>(), r.data<boost::int32_t>(),
+                a.size());
+        return r;
+    }
+    packed x = packed_widen(a);
+    packed y = packed_widen(b);
+    (equal ? k.equal64 : k.less64)(x.data<boost::int64_t>(), y.data<boost::int64_t>(), r.data<boost::int32_t>(),
+            a.size());
+    return r;
+}
+
+// exactly, for sums and dot products
+inline bigint wide_bigint(__int128 v) {
+    if (v == static_cast<long long>(v))
+        return bigint(static_cast<long long>(v));
+    unsigned __int128 mag = v < 0 ? 0 - static_cast<unsigned __int128>(v) : v;
+    bigint word(1LL << 32);
+    bigint r = bigint(static_cast<long long>(mag >> 96)) * word + bigint(static_cast<long long>((mag >> 64) & 0xffffffffu));
+    r = r * word + bigint(static_cast<long long>((mag >> 32) & 0xffffffffu));
+    r = r * word + bigint(static_cast<long long>(mag & 0xffffffffu));
+    return v < 0 ? -r : r;
+}
+
+}
@@ -1,15 +1,20 @@
 #pragma once
 
+#include <iostream>
 #include <string>
+#include <typeinfo>
 #include <vector>
-#include <sstream>
-#include <boost/function.hpp>
+#include <boost/type_traits/is_same.hpp>
+#include <boost/utility/enable_if.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/static_assert.hpp>
 
 #include "persistent/string.hpp"
 #include "persistent/list.hpp"
 #include "persistent/map.hpp"
+#include "persistent/bytes.hpp"
+#include "numeric/bigint.hpp"
+#include "numeric/packed.hpp"
 
 #include <boost/functional/hash.hpp>
 #include <boost/variant.hpp>
@@ -39,6 +44,9 @@ struct string: persistent::string {
     string(string::MakeCopy, char const* c_str, unsigned len) :
             persistent::string(persistent::string::MakeCopy(), c_str, len) {
     }
+    explicit string(persistent::string const& s) :
+            persistent::string(s) {
+    }
 };
 
 struct boolean {
@@ -65,14 +73,35 @@ struct nil {
 struct object_list;
 struct object_proc;
 
-typedef boost::variant<boolean, char, int, nil, symbol, string, boost::recursive_wrapper<object_list>,
-        boost::recursive_wrapper<object_proc> > object;
+typedef boost::variant<boolean, char, int, bigint, packed, nil, symbol, string, persistent::bytes,
+        boost::recursive_wrapper<object_list>, boost::recursive_wrapper<object_proc> > object;
+
+// for alloc_stats, the values boxed by the map
+inline char const* alloc_name(object const*) {
+    return "boxed object";
+}
+
+struct object_visitor: boost::static_visitor<> {
+    explicit object_visitor(gc::marker & m) :
+            m(m) {
+    }
+    template<typename T>
+    void operator()(T const& v) const {
+        m.visit(v);
+    }
+    gc::marker & m;
+};
+
+// only for objects themselves, not everything that converts to one
+template<typename T>
+inline typename boost::enable_if<boost::is_same<T, object> >::type gc_visit(T const& o, gc::marker & m) {
+    boost::apply_visitor(object_visitor(m), o);
+}
 
 inline std::size_t hash_value(symbol const& symb) {
-    return boost::hash_range(symb.c_str(), symb.c_str() + symb.size());
+    return symb.hash();
 }
 
-std::string pretty_print(object const& o);
 
 typedef persistent::map<symbol, object> environment;
 
@@ -83,73 +112,185 @@ struct object_list: persistent::list<object> {
     object_list() :
             persistent::list<object>() {
     } // unshadow
+
+    // only ever heap allocated as the copy inside a recursive_wrapper, which is worth counting
+    static void* operator new(std::size_t size) {
+        return alloc_stats::record<boost::recursive_wrapper<object_list> >(::operator new(size), size);
+    }
+    static void operator delete(void* p) {
+        ::operator delete(p);
+    }
     bool operator==(object_list const& other) const {
         std::cout << "Warning: object_list comparison not implemented yet!" << std::endl; // TODO: implement..
         return false;
     }
 };
 
-typedef boost::function<object(object_list args, environment & env)> object_proc_func;
+// Anything callable as object(object_list const& form, environment & env): a
+// builtin, a closure or a compiled lambda. Callables no bigger than
+// inline_capacity (function pointers and closures) are kept in place rather
+// than on the heap, and a call is one indirect call through a per type table.
+struct object_proc {
+    static const std::size_t inline_capacity = 3 * sizeof(void*);
 
-struct object_proc: object_proc_func {
-    object_proc(object_proc_func f) :
-            object_proc_func(f) {
+    template<typename F>
+    object_proc(F f, typename boost::disable_if<boost::is_same<F, object_proc> >::type* = 0) :
+            ops(&model<F>::table) {
+        model<F>::create(storage, f);
     }
-    bool operator==(object_proc const& other) const {
-        std::cout << "Warning: object_proc comparison not implemented yet!" << std::endl; // TODO: implement..
-        return false;
+
+    object_proc(object_proc const& other) :
+            ops(other.ops) {
+        ops->copy(storage, other.storage);
     }
-};
 
-struct pretty_print_visitor: boost::static_visitor<std::string> {
-    std::string operator()(boolean b) const {
-        if (b.as_bool())
-            return "#t";
-        else
-            return "#f";
+    object_proc & operator=(object_proc const& other) {
+        if (this != &other) {
+            ops->destroy(storage);
+            ops = other.ops;
+            ops->copy(storage, other.storage);
+        }
+        return *this;
     }
-    std::string operator()(char) const {
-        return "<char>";
+
+    ~object_proc() {
+        ops->destroy(storage);
     }
-    std::string operator()(int i) const {
-        return boost::lexical_cast<std::string>(i);
+
+    object operator()(object_list const& form, environment & env) const;
+
+    // the callable, if it's a T
+    template<typename T>
+    T const* target() const {
+        if (ops->type() != typeid(T))
+            return NULL;
+        return static_cast<T const*>(model<T>::get(storage));
     }
-    std::string operator()(nil) const {
-        return "NIL";
+
+    static void* operator new(std::size_t size) {
+        return alloc_stats::record<boost::recursive_wrapper<object_proc> >(::operator new(size), size);
     }
-    std::string operator()(symbol const& s) const {
-        return s.c_str(); // TODO: escaping..
+    static void operator delete(void* p) {
+        ::operator delete(p);
     }
-    std::string operator()(string const& ps) {
-        return std::string("\"") + ps.c_str() + "\""; // TODO: escaping
+    bool operator==(object_proc const& other) const {
+        std::cout << "Warning: object_proc comparison not implemented yet!" << std::endl; // TODO: implement..
+        return false;
     }
-    std::string operator()(object_list const& pl) const {
-        std::stringstream buff;
-        buff << "(";
-        for (object_list::const_iterator it(pl.begin()); it != pl.end(); ++it) {
-            buff << pretty_print(*it);
-            if (it + 1 != pl.end()) {
-                buff << " ";
-            }
+
+private:
+    union buffer {
+        void* heap;
+        char bytes[inline_capacity];
+        long double align;
+    };
+
+    struct operations {
+        object (*call)(buffer const& b, object_list const& form, environment & env);
+        void (*copy)(buffer & to, buffer const& from);
+        void (*destroy)(buffer & b);
+        std::type_info const& (*type)();
+        void (*trace)(buffer const& b, gc::marker & m);
+    };
+
+    template<typename F, bool Inline = (sizeof(F) <= inline_capacity)>
+    struct model {
+        static void create(buffer & b, F const& f) {
+            new (b.bytes) F(f);
         }
-        buff << ")";
-        return buff.str();
-    }
+        static void const* get(buffer const& b) {
+            return b.bytes;
+        }
+        static void copy(buffer & to, buffer const& from) {
+            create(to, *static_cast<F const*>(get(from)));
+        }
+        static void destroy(buffer & b) {
+            static_cast<F*>(static_cast<void*>(b.bytes))->~F();
+        }
+        static object call(buffer const& b, object_list const& form, environment & env);
+        static std::type_info const& type() {
+            return typeid(F);
+        }
+        static void trace(buffer const& b, gc::marker & m) {
+            m.visit(*static_cast<F const*>(get(b)));
+        }
+        static const operations table;
+    };
 
-    std::string operator()(object_proc const& proc) const {
-        return "<PROC>";
-    }
+    template<typename F>
+    struct model<F, false> {
+        static void create(buffer & b, F const& f) {
+            b.heap = new F(f);
+        }
+        static void const* get(buffer const& b) {
+            return b.heap;
+        }
+        static void copy(buffer & to, buffer const& from) {
+            create(to, *static_cast<F const*>(get(from)));
+        }
+        static void destroy(buffer & b) {
+            delete static_cast<F*>(b.heap);
+        }
+        static object call(buffer const& b, object_list const& form, environment & env);
+        static std::type_info const& type() {
+            return typeid(F);
+        }
+        static void trace(buffer const& b, gc::marker & m) {
+            m.visit(*static_cast<F const*>(get(b)));
+        }
+        static const operations table;
+    };
+
+    operations const* ops;
+    buffer storage;
 
+    // what the callable holds, found by its own gc_visit. not for everything
+    // that converts to a procedure, as the callable itself may be one
+    template<typename T>
+    friend typename boost::enable_if<boost::is_same<T, object_proc> >::type gc_visit(T const& p, gc::marker & m) {
+        p.ops->trace(p.storage, m);
+    }
 };
 
-inline std::string pretty_print(object const& o) {
-    pretty_print_visitor visitor;
-    return boost::apply_visitor(visitor, o);
+template<typename F, bool Inline>
+const object_proc::operations object_proc::model<F, Inline>::table = { &model::call, &model::copy, &model::destroy,
+        &model::type, &model::trace };
+
+template<typename F>
+const object_proc::operations object_proc::model<F, false>::table = { &model::call, &model::copy, &model::destroy,
+        &model::type, &model::trace };
+
+template<typename F, bool Inline>
+object object_proc::model<F, Inline>::call(buffer const& b, object_list const& form, environment & env) {
+    return (*static_cast<F const*>(get(b)))(form, env);
 }
 
+template<typename F>
+object object_proc::model<F, false>::call(buffer const& b, object_list const& form, environment & env) {
+    return (*static_cast<F const*>(get(b)))(form, env);
+}
+
+inline object object_proc::operator()(object_list const& form, environment & env) const {
+    return ops->call(storage, form, env);
+}
+
+// an integer result, unboxed whenever it fits in an int
+inline object make_integer(bigint const& b) {
+    if (b.fits_int())
+        return b.to_int();
+    return b;
+}
+
+inline object make_integer(long long v) {
+    if (v == static_cast<int>(v))
+        return static_cast<int>(v);
+    return bigint(v);
+}
 
 inline bool operator!=(object const& a, object const& b) {
     return !(a == b);
 }
 
 }
+
+#include "printer/printer.hpp"
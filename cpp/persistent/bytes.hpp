@@ -0,0 +1,184 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include "../alloc.hpp"
+#include "../io/error.hpp"
+
+namespace persistent {
+
+// what bytes copied onto the heap are accounted against
+struct heap_bytes {
+};
+
+inline char const* alloc_name(heap_bytes const*) {
+    return "heap bytes";
+}
+
+namespace bytes_impl {
+
+// bytes that live outside the heap: a file mapped for as long as this block is
+// reachable, or a buffer someone else keeps alive (owned false)
+struct external {
+    external(char const* data, std::size_t size, bool owned) :
+            data(data), size(size), owned(owned) {
+    }
+    ~external() {
+        if (owned)
+            ::munmap(const_cast<char*>(data), size);
+    }
+
+    char const* data;
+    std::size_t size;
+    bool owned;
+
+    friend char const* alloc_name(external const*) {
+        return "mapped bytes";
+    }
+};
+
+}
+
+// an immutable run of bytes, binary or not, with no terminator. a slice is the
+// same block with a different start and length, so slicing never copies
+// however big the buffer is, and a file can be mapped rather than read in.
+// the block is either the bytes themselves on the heap, or a bytes_impl::external
+// pointing at them, which for a mapped file unmaps it once nothing refers to it.
+struct bytes {
+    static const std::size_t npos = std::size_t(-1);
+
+    bytes() :
+            block(NULL), external(false), start(0), length(0) {
+    }
+
+    // copies them onto the heap
+    bytes(char const* data, std::size_t size) :
+            block(NULL), external(false), start(0), length(size) {
+        if (size != 0) {
+            char* b = static_cast<char*>(GC_ALLOC_AS(heap_bytes, size));
+            ::memcpy(b, data, size);
+            block = b;
+        }
+    }
+
+    // used where they are, which whoever has them keeps alive
+    static bytes borrow(char const* data, std::size_t size) {
+        return size == 0 ? bytes() : bytes(GC_NEW(bytes_impl::external)(data, size, false), size);
+    }
+
+    // a whole file, mapped read only. throws io::error if it can't be
+    static bytes map(std::string const& path);
+
+    std::size_t size() const {
+        return length;
+    }
+
+    bool empty() const {
+        return length == 0;
+    }
+
+    // good for as long as these bytes (or a slice of them) are reachable
+    char const* data() const {
+        if (block == NULL)
+            return NULL;
+        char const* base = external ? static_cast<bytes_impl::external const*>(block)->data
+                : static_cast<char const*>(block);
+        return base + start;
+    }
+
+    unsigned char operator[](std::size_t i) const {
+        assert(i < length);
+        return data()[i];
+    }
+
+    bytes slice(std::size_t from, std::size_t n) const {
+        assert(from <= length && n <= length - from);
+        bytes r(*this);
+        r.start += from;
+        r.length = n;
+        return r;
+    }
+
+    // where c or needle first is at or after from, or npos
+    std::size_t find(unsigned char c, std::size_t from = 0) const {
+        if (from >= length)
+            return npos;
+        char const* d = data();
+        void const* at = ::memchr(d + from, c, length - from);
+        return at == NULL ? npos : static_cast<char const*>(at) - d;
+    }
+
+    std::size_t find(char const* needle, std::size_t n, std::size_t from = 0) const {
+        if (from > length)
+            return npos;
+        if (n == 0)
+            return from;
+        char const* d = data();
+        void const* at = ::memmem(d + from, length - from, needle, n);
+        return at == NULL ? npos : static_cast<char const*>(at) - d;
+    }
+
+    bool operator==(bytes const& other) const {
+        return length == other.length && (length == 0 || ::memcmp(data(), other.data(), length) == 0);
+    }
+
+    bool operator!=(bytes const& other) const {
+        return !(*this == other);
+    }
+
+private:
+    bytes(bytes_impl::external const* e, std::size_t size) :
+            block(e), external(true), start(0), length(size) {
+    }
+
+    void const* block; // a GC block, or NULL when empty
+    bool external; // block is a bytes_impl::external rather than the bytes
+    std::size_t start;
+    std::size_t length;
+
+    // marked as it is, so it's moved in place when evacuated, whichever it is
+    friend void gc_visit(bytes const& b, gc::marker & m) {
+        m.mark(b.block);
+    }
+};
+
+inline bytes bytes::map(std::string const& path) {
+    // made before there's a descriptor or a mapping to undo if it can't be
+    bytes_impl::external* e = GC_NEW(bytes_impl::external)(NULL, 0, false);
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw io::error("Unable to open " + path, errno);
+
+    struct stat st;
+    if (::fstat(fd, &st) == -1) {
+        int error = errno;
+        ::close(fd);
+        throw io::error("Unable to stat " + path, error);
+    }
+    if (st.st_size == 0) {
+        ::close(fd); // there's nothing to map
+        return bytes();
+    }
+
+    void* mapped = ::mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int error = errno;
+    ::close(fd);
+    if (mapped == MAP_FAILED)
+        throw io::error("Unable to map " + path, error);
+
+    e->data = static_cast<char const*>(mapped);
+    e->size = st.st_size;
+    e->owned = true;
+    return bytes(e, st.st_size);
+}
+
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstring>
+
+#include <boost/cstdint.hpp>
+
+namespace persistent {
+
+namespace hash_impl {
+
+typedef boost::uint64_t u64;
+
+const u64 secret0 = 0xa0761d6478bd642fULL;
+const u64 secret1 = 0xe7037ed1a0b428dbULL;
+const u64 secret2 = 0x8ebc6af09c88c6e3ULL;
+const u64 secret3 = 0x589965cc75374cc3ULL;
+
+// the 128 bit product of a and b, folded
+inline u64 mum(u64 a, u64 b) {
+    unsigned __int128 r = static_cast<unsigned __int128>(a) * b;
+    return u64(r) ^ u64(r >> 64);
+}
+
+inline u64 read64(char const* p) {
+    u64 v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline u64 read32(char const* p) {
+    boost::uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// 1 to 3 bytes
+inline u64 read_small(char const* p, std::size_t k) {
+    unsigned char const* u = reinterpret_cast<unsigned char const*>(p);
+    return (u64(u[0]) << 16) | (u64(u[k >> 1]) << 8) | u[k - 1];
+}
+
+}
+
+// wyhash (final version 4): reads the bytes a word at a time, and is strong
+// enough that the map can use its bits directly
+inline boost::uint64_t hash_bytes(char const* p, std::size_t len, boost::uint64_t seed = 0) {
+    using namespace hash_impl;
+
+    seed ^= mum(seed ^ secret0, secret1);
+    u64 a, b;
+
+    if (len <= 16) {
+        if (len >= 4) {
+            std::size_t mid = (len >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + mid);
+            b = (read32(p + len - 4) << 32) | read32(p + len - 4 - mid);
+        } else if (len > 0) {
+            a = read_small(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        std::size_t i = len;
+        if (i > 48) {
+            u64 see1 = seed, see2 = seed;
+            do {
+                seed = mum(read64(p) ^ secret1, read64(p + 8) ^ seed);
+                see1 = mum(read64(p + 16) ^ secret2, read64(p + 24) ^ see1);
+                see2 = mum(read64(p + 32) ^ secret3, read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = mum(read64(p) ^ secret1, read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+
+    unsigned __int128 r = static_cast<unsigned __int128>(a ^ secret1) * (b ^ seed);
+    return mum(u64(r) ^ secret0 ^ len, u64(r >> 64) ^ secret1);
+}
+
+}
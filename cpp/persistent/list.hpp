@@ -16,6 +16,15 @@ private:
         }
         T payload;
         node const* next;
+
+        friend char const* alloc_name(node const*) {
+            return "list node";
+        }
+
+        friend void gc_visit(node const& n, gc::marker & m) {
+            m.visit(n.payload);
+            m.mark(n.next);
+        }
     };
 public:
     struct iterator {
@@ -23,15 +32,15 @@ public:
                 pointing_at(pointing_at) {
         }
 
-        T const& operator*() {
+        T const& operator*() const {
             return pointing_at->payload;
         }
 
-        bool operator==(iterator other) {
+        bool operator==(iterator other) const {
             return pointing_at == other.pointing_at;
         }
 
-        bool operator!=(iterator other) {
+        bool operator!=(iterator other) const {
             return !(*this == other);
         }
 
@@ -85,6 +94,11 @@ public:
         return list<T>(new_first);
     }
 
+    // the same for lists that are the same nodes, as a key for keeping things beside them
+    void const* identity() const {
+        return first;
+    }
+
     list<T> new_pop_front() const {
         assert(size() > 0);
         return list(first->next);
@@ -96,6 +110,10 @@ private:
     }
 
     node const* first;
+
+    friend void gc_visit(list const& l, gc::marker & m) {
+        m.mark(l.first);
+    }
 };
 
 }
@@ -3,37 +3,74 @@
 #include <algorithm>
 #include <typeinfo>
 #include <bitset>
+#include <new>
 #include <vector>
 
 #include <boost/static_assert.hpp>
 #include <boost/functional/hash.hpp>
 #include <boost/array.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include "../alloc.hpp"
+#include "../concurrency/thread_pool.hpp"
 
 namespace persistent {
 
 namespace map_impl {
 template<typename K, typename V>
 struct i_node;
+template<typename K, typename V>
+struct iterator;
 }
 
 template<typename K, typename V>
 struct map {
     map();
     map(map const& other);
+    map & operator=(map const& other);
 
     V const* find(K const& k) const;
     bool empty() const;
+    std::size_t size() const; // O(1), every node knows how many keys are under it
 
     void insert(K const& k, V const& v);
     map<K, V> new_insert(K const& k, V const& v) const;
 
+    // removes k, if it's there
+    void erase(K const& k);
+    map<K, V> new_erase(K const& k) const;
+
     void merge(map<K, V> other);
     map<K, V> new_merge(map<K, V> other) const;
+    // the same, but with the big subtrees under the root merged in parallel on
+    // `pool`. inside a gc::region it's merged serially, as the helpers would put
+    // what they make on the heap, pointing out of it into the region
+    map<K, V> new_merge(map<K, V> other, concurrency::thread_pool & pool) const;
+
+    // walks every binding, in no particular order, without allocating
+    typedef map_impl::iterator<K, V> const_iterator;
+    const_iterator begin() const;
+    const_iterator end() const;
+
+    // calls f(key, value) for every binding
+    template<typename F>
+    void for_each(F f) const;
+
+    // acc = f(acc, key, value) for every binding
+    template<typename T, typename F>
+    T fold(T acc, F f) const;
 private:
     map(map_impl::i_node<K, V> const*);
     map_impl::i_node<K, V> const* root;
+
+    friend void gc_visit(map const& m, gc::marker & marker) {
+        marker.mark(m.root);
+    }
 };
 
 namespace map_impl {
@@ -41,19 +78,32 @@ namespace map_impl {
 const unsigned BITS = 32;
 
 typedef boost::uint32_t u32;
+typedef boost::uint64_t hash_t;
 
+// 5 bits of hash a level, so a 64 bit hash is used up after 13 levels and
+// anything still sharing a path at this level goes into a collision node
+const unsigned MAX_LEVEL = 13;
+
+// boost::hash of an integer is the integer itself, which would put most of the
+// entropy in the first few levels. so mix it up (the splitmix64 finaliser)
 template<typename K>
-inline u32 calc_hash(K const& k) {
+inline hash_t calc_hash(K const& k) {
     boost::hash<K> h;
-    return h(k);
+    hash_t x = h(k);
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
 }
 
-inline std::size_t mask(unsigned level, u32 hash) {
+inline std::size_t mask(unsigned level, hash_t hash) {
     return (hash >> (level * 5)) & 31;
 }
 
-inline std::size_t bitpos(unsigned level, u32 hash) {
-    return 1 << mask(level, hash);
+inline u32 bitpos(unsigned level, hash_t hash) {
+    return u32(1) << mask(level, hash);
 }
 
 inline std::size_t index(u32 bitmap, unsigned bit) {
@@ -63,23 +113,46 @@ inline std::size_t index(u32 bitmap, unsigned bit) {
 
 template<typename K, typename V>
 struct i_node {
-    virtual V const* find(unsigned level, u32 hash, K const& key) const = 0;
-    virtual i_node const* new_insert(unsigned level, u32 hash, K const& key, V const& val) const = 0;
+    i_node(std::size_t count) :
+            count(count) {
+    }
+
+    virtual V const* find(unsigned level, hash_t hash, K const& key) const = 0;
+    virtual i_node const* new_insert(unsigned level, hash_t hash, K const& key, V const& val) const = 0;
+    // `this` if key isn't here, NULL if nothing would be left
+    virtual i_node const* new_erase(unsigned level, hash_t hash, K const& key) const = 0;
     virtual ~i_node() {
     }
+
+    std::size_t count; // keys in this subtree
 };
 
+template<typename K, typename V, std::size_t N>
+inline std::size_t subtree_count(boost::array<i_node<K, V> const*, N> const& children) {
+    std::size_t c = 0;
+    for (std::size_t i(0); i < N; ++i) {
+        c += children[i]->count;
+    }
+    return c;
+}
+
 template<typename K, typename V>
 struct leaf_node: i_node<K, V> {
     leaf_node(K const& key, V const& val);
     leaf_node(K const& key, V const* val);
     virtual ~leaf_node();
 
-    virtual V const* find(unsigned level, u32 hash, K const& key) const;
-    virtual i_node<K, V> const* new_insert(unsigned level, u32 hash, K const& key, V const& val) const;
+    virtual V const* find(unsigned level, hash_t hash, K const& key) const;
+    virtual i_node<K, V> const* new_insert(unsigned level, hash_t hash, K const& key, V const& val) const;
+    virtual i_node<K, V> const* new_erase(unsigned level, hash_t hash, K const& key) const;
 
     K key;
     V const* val;
+
+    friend void gc_visit(leaf_node const& n, gc::marker & m) {
+        m.visit(n.key);
+        m.mark(n.val);
+    }
 };
 
 template<typename K, typename V>
@@ -97,6 +170,10 @@ struct bitmap_data {
 
 template<typename K, typename V>
 struct i_bitmap_node: i_node<K, V> {
+    i_bitmap_node(std::size_t count) :
+            i_node<K, V>(count) {
+    }
+
     virtual bitmap_data<K, V> get_vals() const = 0;
 };
 
@@ -105,13 +182,21 @@ struct array_node: i_bitmap_node<K, V> {
     array_node(u32 bitmap, boost::array<i_node<K, V> const*, Children> const& d);
     virtual ~array_node();
 
-    virtual V const* find(unsigned level, u32 hash, K const& key) const;
-    virtual i_node<K, V> const* new_insert(unsigned level, u32 hash, K const& key, V const& val) const;
+    virtual V const* find(unsigned level, hash_t hash, K const& key) const;
+    virtual i_node<K, V> const* new_insert(unsigned level, hash_t hash, K const& key, V const& val) const;
+    virtual i_node<K, V> const* new_erase(unsigned level, hash_t hash, K const& key) const;
 
     virtual bitmap_data<K, V> get_vals() const;
 private:
     u32 bitmap;
     boost::array<i_node<K, V> const*, Children> data;
+
+    // a node's address is its i_node's: they only ever inherit singly
+    friend void gc_visit(array_node const& n, gc::marker & m) {
+        for (int i(0); i < Children; ++i) {
+            m.mark(n.data[i]);
+        }
+    }
 };
 
 template<typename K, typename V>
@@ -121,38 +206,131 @@ struct array_node<K, V, BITS> : i_bitmap_node<K, V> {
     array_node(boost::array<i_node<K, V> const*, BITS> const& d);
     virtual ~array_node();
 
-    virtual V const* find(unsigned level, u32 hash, K const& key) const;
-    virtual i_node<K, V> const* new_insert(unsigned level, u32 hash, K const& key, V const& val) const;
+    virtual V const* find(unsigned level, hash_t hash, K const& key) const;
+    virtual i_node<K, V> const* new_insert(unsigned level, hash_t hash, K const& key, V const& val) const;
+    virtual i_node<K, V> const* new_erase(unsigned level, hash_t hash, K const& key) const;
 
     virtual bitmap_data<K, V> get_vals() const;
 private:
     boost::array<i_node<K, V> const*, BITS> data;
+
+    friend void gc_visit(array_node const& n, gc::marker & m) {
+        for (unsigned i(0); i < BITS; ++i) {
+            m.mark(n.data[i]);
+        }
+    }
 };
 
+// what collision node entries are accounted against. a block of them is
+// always full, so the collector can tell how many there are from its size
+template<typename K, typename V>
+struct collision_entries {
+    typedef std::pair<K, V const*> entry;
+};
+
+template<typename K, typename V>
+inline char const* alloc_name(collision_entries<K, V> const*) {
+    return "map collision entries";
+}
+
+template<typename K, typename V>
+inline void gc_visit_block(collision_entries<K, V> const*, void const* block, std::size_t bytes, gc::marker & m) {
+    typedef typename collision_entries<K, V>::entry entry;
+    entry const* entries = static_cast<entry const*>(block);
+    for (std::size_t i(0); i < bytes / sizeof(entry); ++i) {
+        m.visit(entries[i].first);
+        m.mark(entries[i].second);
+    }
+}
+
+template<typename K, typename V>
+inline void gc_destroy_block(collision_entries<K, V> const*, void* block, std::size_t bytes) {
+    typedef typename collision_entries<K, V>::entry entry;
+    entry* entries = static_cast<entry*>(block);
+    for (std::size_t i(0); i < bytes / sizeof(entry); ++i) {
+        entries[i].~entry();
+    }
+}
+
+// keys whose hashes are identical, as an array sorted by key
 template<typename K, typename V>
 struct collision_node: i_node<K, V> {
-    collision_node(list<std::pair<K, V const*> > const& values);
-    collision_node(K const& k1, V const& v1, K const& k2, V const* v2);
+    typedef std::pair<K, V const*> entry;
+
+    // takes ownership of `sorted`, which has no duplicate keys
+    collision_node(entry const* sorted, std::size_t n);
     virtual ~collision_node();
 
-    virtual V const* find(unsigned level, u32 hash, K const& key) const;
-    virtual i_node<K, V> const* new_insert(unsigned level, u32 hash, K const& key, V const& val) const;
+    virtual V const* find(unsigned level, hash_t hash, K const& key) const;
+    virtual i_node<K, V> const* new_insert(unsigned level, hash_t hash, K const& key, V const& val) const;
+    virtual i_node<K, V> const* new_erase(unsigned level, hash_t hash, K const& key) const;
+
+    // the first entry whose key isn't less than `key`
+    std::size_t lower_bound(K const& key) const;
+
+    entry const* entries;
 
-    list<std::pair<K, V const*> > vals;
+    friend void gc_visit(collision_node const& n, gc::marker & m) {
+        m.mark(n.entries);
+    }
 };
 
 template<typename K, typename V>
 i_node<K, V> const* merge(unsigned level, i_node<K, V> const* left, i_node<K, V> const* right);
 
+// names for alloc_stats
+template<typename K, typename V, int Children>
+inline std::string alloc_name(array_node<K, V, Children> const*) {
+    return "map array_node/" + boost::lexical_cast<std::string>(Children);
+}
+
+template<typename K, typename V>
+inline char const* alloc_name(leaf_node<K, V> const*) {
+    return "map leaf_node";
+}
+
+template<typename K, typename V>
+inline char const* alloc_name(collision_node<K, V> const*) {
+    return "map collision_node";
+}
+
+// a bitmap node's worth of children, gathered on the stack
+template<typename K, typename V>
+struct child_buffer {
+    child_buffer() :
+            n(0) {
+    }
+
+    void push_back(i_node<K, V> const* c) {
+        assert(n < BITS);
+        data[n++] = c;
+    }
+
+    std::size_t size() const {
+        return n;
+    }
+
+    i_node<K, V> const* & operator[](std::size_t i) {
+        return data[i];
+    }
+
+    i_node<K, V> const* const * begin() const {
+        return &data[0];
+    }
+
+    boost::array<i_node<K, V> const*, BITS> data;
+    std::size_t n;
+};
+
 #define GEN_ARRAY_CASE(NUM) case NUM: { \
     typedef array_node<K,V,NUM> arr_nd; \
     boost::array<i_node<K,V> const*, NUM> array; \
-    std::copy(data.begin(), data.end(), array.begin()); \
+    std::copy(data.begin(), data.begin() + NUM, array.begin()); \
     return GC_NEW(arr_nd)(bitmap, array); \
   }
 
 template<typename K, typename V>
-i_node<K, V> const* create_array_node(u32 bitmap, std::vector<i_node<K, V> const*> const& data) {
+i_node<K, V> const* create_array_node(u32 bitmap, child_buffer<K, V> const& data) {
 
     assert(std::bitset<BITS>(bitmap).count() == data.size());
 
@@ -193,15 +371,58 @@ i_node<K, V> const* create_array_node(u32 bitmap, std::vector<i_node<K, V> const
     assert(!"Oh crap, something went really wrong");
 }
 
+// what's left of a bitmap node when child `dex` becomes `replacement` (NULL to
+// drop it). a node left holding just a leaf is replaced by the leaf, which is
+// still findable from the level above; collision nodes stay where they are,
+// as they're only valid at the bottom level.
+template<typename K, typename V>
+i_node<K, V> const* compact(bitmap_data<K, V> const& old, std::size_t dex, i_node<K, V> const* replacement) {
+    std::size_t n = old.size();
+
+    if (replacement == NULL) {
+        if (n == 1)
+            return NULL;
+
+        if (n == 2) {
+            i_node<K, V> const* other = old.data_array[1 - dex];
+            if (dynamic_cast<leaf_node<K, V> const*>(other))
+                return other;
+        }
+
+        u32 bitmap = old.bitmap;
+        u32 bit = 1;
+        for (std::size_t seen(0);; bit <<= 1) {
+            if ((bitmap & bit) && seen++ == dex)
+                break;
+        }
+
+        child_buffer<K, V> new_data;
+        for (std::size_t i(0); i < n; ++i) {
+            if (i != dex)
+                new_data.push_back(old.data_array[i]);
+        }
+        return create_array_node(bitmap & ~bit, new_data);
+    }
+
+    if (n == 1 && dynamic_cast<leaf_node<K, V> const*>(replacement))
+        return replacement;
+
+    child_buffer<K, V> new_data;
+    for (std::size_t i(0); i < n; ++i) {
+        new_data.push_back((i == dex) ? replacement : old.data_array[i]);
+    }
+    return create_array_node(old.bitmap, new_data);
+}
+
 template<typename K, typename V>
 inline i_node<K, V> const* merge_leaf_bitmap(unsigned level, leaf_node<K, V> const* left
         , i_bitmap_node<K, V> const* right) {
-    u32 hash = calc_hash(left->key);
+    hash_t hash = calc_hash(left->key);
 
     std::size_t new_bit = bitpos(level, hash);
 
     bitmap_data<K, V> right_data = right->get_vals();
-    std::vector<i_node<K, V> const*> new_data;
+    child_buffer<K, V> new_data;
 
     for (u32 bit(1); bit; bit <<= 1) {
         if (right_data.bitmap & bit & new_bit) {
@@ -216,22 +437,67 @@ inline i_node<K, V> const* merge_leaf_bitmap(unsigned level, leaf_node<K, V> con
     return create_array_node(right_data.bitmap | new_bit, new_data);
 }
 
+// the union of two sorted runs of entries, the right hand side winning ties. one
+// is usually a single leaf's binding
+template<typename K, typename V>
+i_node<K, V> const* merge_entries(std::pair<K, V const*> const* left, std::size_t ln,
+        std::pair<K, V const*> const* right, std::size_t rn) {
+    typedef std::pair<K, V const*> entry;
+    typedef collision_entries<K, V> entries_tag;
+
+    // sized exactly, keys in both only appearing once
+    std::size_t n = ln + rn;
+    for (std::size_t l(0), r(0); l < ln && r < rn;) {
+        if (left[l].first < right[r].first) {
+            ++l;
+        } else if (right[r].first < left[l].first) {
+            ++r;
+        } else {
+            --n;
+            ++l;
+            ++r;
+        }
+    }
+
+    if (n == 1) {
+        entry const& only = (rn == 1) ? right[0] : left[0];
+        typedef leaf_node<K, V> l_nde;
+        return GC_NEW(l_nde)(only.first, only.second);
+    }
+
+    entry* out = static_cast<entry*>(GC_ALLOC_AS(entries_tag, n * sizeof(entry)));
+    n = 0;
+    std::size_t l = 0, r = 0;
+
+    while (l < ln || r < rn) {
+        if (r == rn || (l < ln && left[l].first < right[r].first)) {
+            new (out + n++) entry(left[l++]);
+        } else {
+            if (l < ln && left[l].first == right[r].first)
+                ++l;
+            new (out + n++) entry(right[r++]);
+        }
+    }
+
+    typedef collision_node<K, V> col_nd;
+    return GC_NEW(col_nd)(out, n);
+}
+
 template<typename K, typename V>
 inline i_node<K, V> const* merge_leaf_leaf(unsigned level, leaf_node<K, V> const* left, leaf_node<K, V> const* right) {
     if (left->key == right->key)
         return right;
 
-    if (level == 6) {
-        typedef collision_node<K, V> col_node;
-        return GC_NEW(col_node)(
-                list<std::pair<K, V const*> >().new_push_front(std::make_pair(left->key, left->val)).new_push_front(
-                        std::make_pair(left->key, left->val)));
+    if (level == MAX_LEVEL) {
+        std::pair<K, V const*> l(left->key, left->val);
+        std::pair<K, V const*> r(right->key, right->val);
+        return merge_entries(&l, 1, &r, 1);
     }
 
-    assert(level < 6);
+    assert(level < MAX_LEVEL);
 
-    u32 h = calc_hash(right->key);
-    u32 hash = calc_hash(left->key);
+    hash_t h = calc_hash(right->key);
+    hash_t hash = calc_hash(left->key);
 
     std::size_t b = bitpos(level, h);
     std::size_t bit = bitpos(level, hash);
@@ -263,16 +529,16 @@ inline i_node<K, V> const* merge_leaf_leaf(unsigned level, leaf_node<K, V> const
 template<typename K, typename V>
 inline i_node<K, V> const* merge_bitmap_leaf(unsigned level, i_bitmap_node<K, V> const* left
         , leaf_node<K, V> const* right) {
-    u32 hash = calc_hash(right->key);
+    hash_t hash = calc_hash(right->key);
 
     std::size_t new_bit = bitpos(level, hash);
 
     bitmap_data<K, V> left_data = left->get_vals();
-    std::vector<i_node<K, V> const*> new_data;
+    child_buffer<K, V> new_data;
 
     for (u32 bit(1); bit; bit <<= 1) {
         if (left_data.bitmap & bit & new_bit) {
-            new_data.push_back(merge(level + 1, right, left_data.data_array[index(left_data.bitmap, bit)]));
+            new_data.push_back(merge(level + 1, left_data.data_array[index(left_data.bitmap, bit)], right));
         } else if (left_data.bitmap & bit) {
             new_data.push_back(left_data.data_array[index(left_data.bitmap, bit)]);
         } else if (bit == new_bit) {
@@ -287,50 +553,114 @@ inline i_node<K, V> const* merge_bitmap_leaf(unsigned level, i_bitmap_node<K, V>
 template<typename K, typename V>
 inline i_node<K, V> const* merge_leaf_coll(unsigned level, leaf_node<K, V> const* left
         , collision_node<K, V> const* right) {
-    // TODO: should be pushed at the back, not front
-    typedef collision_node<K, V> col_nd;
-    return GC_NEW(col_nd)(right->vals.new_push_front(std::make_pair(left->key, left->val)));
+    std::pair<K, V const*> l(left->key, left->val);
+    return merge_entries(&l, 1, right->entries, right->count);
 }
 
 template<typename K, typename V>
 inline i_node<K, V> const* merge_coll_coll(unsigned level, collision_node<K, V> const* left
         , collision_node<K, V> const* right) {
-
-    list<std::pair<K, V const*> > values = left->vals;
-
-    for (typename list<std::pair<K, V const*> >::const_iterator it(right->vals.begin()); it != right->vals.end();
-            ++it) {
-        values = values.new_push_front(*it);
-    }
-
-    typedef collision_node<K, V> col_nd;
-    return GC_NEW(col_nd)(values);
+    return merge_entries(left->entries, left->count, right->entries, right->count);
 }
 
 template<typename K, typename V>
 inline i_node<K, V> const* merge_coll_leaf(unsigned level, collision_node<K, V> const* left
         , leaf_node<K, V> const* right) {
-    typedef collision_node<K, V> col_nd;
-    return GC_NEW(col_nd)(left->vals.new_push_front(std::make_pair(right->key, right->val)));
+    std::pair<K, V const*> r(right->key, right->val);
+    return merge_entries(left->entries, left->count, &r, 1);
 }
 
+// pairs of subtrees to merge, claimed one at a time by whichever threads are
+// helping. shared, as a helper may only get round to looking after it's all done
+template<typename K, typename V>
+struct merge_jobs: boost::noncopyable {
+    merge_jobs(unsigned level) :
+            level(level), count(0), next(0), done(0) {
+    }
+
+    void add(std::size_t slot, i_node<K, V> const* left, i_node<K, V> const* right) {
+        slots[count] = slot;
+        lefts[count] = left;
+        rights[count] = right;
+        ++count;
+    }
+
+    void work() {
+        for (;;) {
+            std::size_t job;
+            {
+                boost::mutex::scoped_lock l(lock);
+                if (next == count)
+                    return;
+                job = next++;
+            }
+
+            results[job] = merge(level, lefts[job], rights[job]);
+
+            boost::mutex::scoped_lock l(lock);
+            if (++done == count)
+                finished.notify_all();
+        }
+    }
+
+    // the calling thread works too, so this can't deadlock even when it's one of the pool's
+    void run(boost::shared_ptr<merge_jobs> const& self, concurrency::thread_pool & pool) {
+        std::size_t helpers = std::min<std::size_t>(pool.size(), count - 1);
+        for (std::size_t i(0); i < helpers; ++i) {
+            pool.submit(boost::bind(&merge_jobs::work, self));
+        }
+        work();
+
+        boost::mutex::scoped_lock l(lock);
+        while (done != count) {
+            finished.wait(l);
+        }
+    }
+
+    unsigned level;
+    std::size_t count;
+    boost::array<std::size_t, BITS> slots;
+    boost::array<i_node<K, V> const*, BITS> lefts;
+    boost::array<i_node<K, V> const*, BITS> rights;
+    boost::array<i_node<K, V> const*, BITS> results;
+
+    boost::mutex lock;
+    boost::condition_variable finished;
+    std::size_t next;
+    std::size_t done;
+};
+
+// with a pool, pairs of children holding more than this many keys between them
+// are merged in parallel
+const std::size_t PARALLEL_MERGE_THRESHOLD = 1 << 14;
+
 template<typename K, typename V>
 inline i_node<K, V> const* merge_bitmap_bitmap(unsigned level, i_bitmap_node<K, V> const* left
-        , i_bitmap_node<K, V> const* right) {
+        , i_bitmap_node<K, V> const* right, concurrency::thread_pool * pool = NULL) {
     bitmap_data<K, V> left_data = left->get_vals();
     bitmap_data<K, V> right_data = right->get_vals();
 
     u32 new_bitmap = left_data.bitmap | right_data.bitmap;
 
-    std::vector<i_node<K, V> const*> new_data;
+    child_buffer<K, V> new_data;
+    boost::shared_ptr<merge_jobs<K, V> > jobs;
 
     for (u32 bit(1); bit; bit <<= 1) {
         if (left_data.bitmap & bit & right_data.bitmap) {
             unsigned left_dex = index(left_data.bitmap, bit);
             unsigned right_dex = index(right_data.bitmap, bit);
 
-            i_node<K, V> const* n = merge(level + 1, left_data.data_array[left_dex], right_data.data_array[right_dex]);
-            new_data.push_back(n);
+            i_node<K, V> const* l = left_data.data_array[left_dex];
+            i_node<K, V> const* r = right_data.data_array[right_dex];
+
+            if (pool != NULL && l != r && l->count + r->count >= PARALLEL_MERGE_THRESHOLD) {
+                if (!jobs)
+                    jobs = boost::make_shared<merge_jobs<K, V> >(level + 1);
+                jobs->add(new_data.size(), l, r);
+                new_data.push_back(NULL); // filled in below
+            } else {
+                new_data.push_back(merge(level + 1, l, r));
+            }
         } else if (left_data.bitmap & bit) {
             unsigned dex = index(left_data.bitmap, bit);
 
@@ -344,6 +674,13 @@ inline i_node<K, V> const* merge_bitmap_bitmap(unsigned level, i_bitmap_node<K,
         }
     }
 
+    if (jobs) {
+        jobs->run(jobs, *pool);
+        for (std::size_t i(0); i < jobs->count; ++i) {
+            new_data[jobs->slots[i]] = jobs->results[i];
+        }
+    }
+
     return create_array_node(new_bitmap, new_data);
 }
 
@@ -398,6 +735,94 @@ i_node<K, V> const* merge(unsigned level, i_node<K, V> const* left, i_node<K, V>
     }
 }
 
+// bitmap nodes can nest at levels 0 to MAX_LEVEL - 1
+const unsigned MAX_DEPTH = MAX_LEVEL;
+
+// a depth first walk with its own fixed size stack of bitmap nodes
+template<typename K, typename V>
+struct iterator {
+    iterator() :
+            depth(0), leaf(NULL), coll(NULL), pos(0) {
+    }
+
+    explicit iterator(i_node<K, V> const* root) :
+            depth(0), leaf(NULL), coll(NULL), pos(0) {
+        if (root != NULL)
+            descend(root);
+    }
+
+    K const& key() const {
+        return leaf ? leaf->key : coll->entries[pos].first;
+    }
+
+    V const& value() const {
+        return leaf ? *leaf->val : *coll->entries[pos].second;
+    }
+
+    iterator & operator++() {
+        if (coll != NULL) {
+            if (++pos < coll->count)
+                return *this;
+            coll = NULL;
+            pos = 0;
+        }
+        leaf = NULL;
+
+        while (depth > 0) {
+            frame & f = stack[depth - 1];
+            if (f.next < f.size) {
+                descend(f.children[f.next++]);
+                return *this;
+            }
+            --depth;
+        }
+        return *this;
+    }
+
+    bool operator==(iterator const& other) const {
+        return leaf == other.leaf && coll == other.coll && pos == other.pos;
+    }
+
+    bool operator!=(iterator const& other) const {
+        return !(*this == other);
+    }
+
+private:
+    struct frame {
+        i_node<K, V> const* const * children;
+        std::size_t next;
+        std::size_t size;
+    };
+
+    // down the leftmost path to the first binding under n
+    void descend(i_node<K, V> const* n) {
+        for (;;) {
+            if (i_bitmap_node<K, V> const* bn = dynamic_cast<i_bitmap_node<K, V> const*>(n)) {
+                bitmap_data<K, V> data = bn->get_vals();
+                assert(depth < MAX_DEPTH);
+                frame & f = stack[depth++];
+                f.children = data.data_array;
+                f.next = 1;
+                f.size = data.size();
+                n = data.data_array[0];
+            } else if (leaf_node<K, V> const* ln = dynamic_cast<leaf_node<K, V> const*>(n)) {
+                leaf = ln;
+                return;
+            } else {
+                coll = dynamic_cast<collision_node<K, V> const*>(n);
+                assert(coll);
+                pos = 0;
+                return;
+            }
+        }
+    }
+
+    frame stack[MAX_DEPTH];
+    unsigned depth;
+    leaf_node<K, V> const* leaf;
+    collision_node<K, V> const* coll;
+    std::size_t pos;
+};
 }
 
 template<typename K, typename V>
@@ -410,6 +835,12 @@ inline map<K, V>::map(map<K, V> const& other) :
         root(other.root) {
 }
 
+template<typename K, typename V>
+inline map<K, V> & map<K, V>::operator=(map<K, V> const& other) {
+    root = other.root;
+    return *this;
+}
+
 template<typename K, typename V>
 inline map<K, V>::map(map_impl::i_node<K, V> const* r) :
         root(r) {
@@ -425,6 +856,21 @@ inline bool map<K, V>::empty() const {
     return (root == NULL);
 }
 
+template<typename K, typename V>
+inline std::size_t map<K, V>::size() const {
+    return (root == NULL) ? 0 : root->count;
+}
+
+template<typename K, typename V>
+inline typename map<K, V>::const_iterator map<K, V>::begin() const {
+    return const_iterator(root);
+}
+
+template<typename K, typename V>
+inline typename map<K, V>::const_iterator map<K, V>::end() const {
+    return const_iterator();
+}
+
 template<typename K, typename V>
 inline void map<K, V>::insert(K const& k, V const& v) {
     if (root == NULL) {
@@ -469,11 +915,54 @@ inline map<K, V> map<K, V>::new_merge(map<K, V> other) const {
     }
 }
 
+template<typename K, typename V>
+inline map<K, V> map<K, V>::new_merge(map<K, V> other, concurrency::thread_pool & pool) const {
+    typedef map_impl::i_bitmap_node<K, V> bitmap_node;
+
+    bitmap_node const* left = dynamic_cast<bitmap_node const*>(root);
+    bitmap_node const* right = dynamic_cast<bitmap_node const*>(other.root);
+
+    if (left == NULL || right == NULL || left == right || gc::detail::active_arena() != NULL)
+        return new_merge(other);
+
+    return map<K, V>(map_impl::merge_bitmap_bitmap(0, left, right, &pool));
+}
+
+template<typename K, typename V>
+inline void map<K, V>::erase(K const& k) {
+    if (root != NULL)
+        root = root->new_erase(0, map_impl::calc_hash(k), k);
+}
+
+template<typename K, typename V>
+inline map<K, V> map<K, V>::new_erase(K const& k) const {
+    map<K, V> m(*this);
+    m.erase(k);
+    return m;
+}
+
+template<typename K, typename V>
+template<typename F>
+inline void map<K, V>::for_each(F f) const {
+    for (const_iterator it(begin()); it != end(); ++it) {
+        f(it.key(), it.value());
+    }
+}
+
+template<typename K, typename V>
+template<typename T, typename F>
+inline T map<K, V>::fold(T acc, F f) const {
+    for (const_iterator it(begin()); it != end(); ++it) {
+        acc = f(acc, it.key(), it.value());
+    }
+    return acc;
+}
+
 namespace map_impl {
 
 template<typename K, typename V, int Children>
 inline array_node<K, V, Children>::array_node(u32 bitmap, boost::array<i_node<K, V> const*, Children> const& d) :
-        bitmap(bitmap), data(d) {
+        i_bitmap_node<K, V>(subtree_count(d)), bitmap(bitmap), data(d) {
 }
 
 template<typename K, typename V, int Children>
@@ -481,7 +970,7 @@ inline array_node<K, V, Children>::~array_node() {
 }
 
 template<typename K, typename V, int Children>
-V const* array_node<K, V, Children>::find(unsigned level, u32 hash, K const& key) const {
+V const* array_node<K, V, Children>::find(unsigned level, hash_t hash, K const& key) const {
     std::size_t bit = bitpos(level, hash);
 
     if (bitmap & bit)
@@ -491,7 +980,7 @@ V const* array_node<K, V, Children>::find(unsigned level, u32 hash, K const& key
 }
 
 template<typename K, typename V, int Children>
-inline i_node<K, V> const* array_node<K, V, Children>::new_insert(unsigned level, u32 hash, K const& key,
+inline i_node<K, V> const* array_node<K, V, Children>::new_insert(unsigned level, hash_t hash, K const& key,
         V const& val) const {
 
     std::size_t bit = bitpos(level, hash);
@@ -536,6 +1025,21 @@ inline i_node<K, V> const* array_node<K, V, Children>::new_insert(unsigned level
     }
 }
 
+template<typename K, typename V, int Children>
+i_node<K, V> const* array_node<K, V, Children>::new_erase(unsigned level, hash_t hash, K const& key) const {
+    std::size_t bit = bitpos(level, hash);
+
+    if (!(bitmap & bit))
+        return this;
+
+    std::size_t dex = index(bitmap, bit);
+    i_node<K, V> const* child = data[dex]->new_erase(level + 1, hash, key);
+    if (child == data[dex])
+        return this;
+
+    return compact(get_vals(), dex, child);
+}
+
 template<typename K, typename V, int Children>
 inline bitmap_data<K, V> array_node<K, V, Children>::get_vals() const {
     return bitmap_data<K, V>(bitmap, &data[0]);
@@ -543,12 +1047,12 @@ inline bitmap_data<K, V> array_node<K, V, Children>::get_vals() const {
 
 template<typename K, typename V>
 inline array_node<K, V, BITS>::array_node(u32, boost::array<i_node<K, V> const*, BITS> const& d) :
-        data(d) {
+        i_bitmap_node<K, V>(subtree_count(d)), data(d) {
 }
 
 template<typename K, typename V>
 inline array_node<K, V, BITS>::array_node(boost::array<i_node<K, V> const*, BITS> const& d) :
-        data(d) {
+        i_bitmap_node<K, V>(subtree_count(d)), data(d) {
 }
 
 template<typename K, typename V>
@@ -556,7 +1060,7 @@ inline array_node<K, V, BITS>::~array_node() {
 }
 
 template<typename K, typename V>
-inline V const* array_node<K, V, BITS>::find(unsigned level, u32 hash, K const& key) const {
+inline V const* array_node<K, V, BITS>::find(unsigned level, hash_t hash, K const& key) const {
     i_node<K, V> const* p = data[mask(level, hash)];
     assert(p != NULL);
 
@@ -564,7 +1068,7 @@ inline V const* array_node<K, V, BITS>::find(unsigned level, u32 hash, K const&
 }
 
 template<typename K, typename V>
-inline i_node<K, V> const* array_node<K, V, BITS>::new_insert(unsigned level, u32 hash, K const& key,
+inline i_node<K, V> const* array_node<K, V, BITS>::new_insert(unsigned level, hash_t hash, K const& key,
         V const& val) const {
 
     u32 dex = mask(level, hash);
@@ -584,6 +1088,16 @@ inline i_node<K, V> const* array_node<K, V, BITS>::new_insert(unsigned level, u3
     return GC_NEW(nde)(new_data);
 }
 
+template<typename K, typename V>
+i_node<K, V> const* array_node<K, V, BITS>::new_erase(unsigned level, hash_t hash, K const& key) const {
+    u32 dex = mask(level, hash);
+    i_node<K, V> const* child = data[dex]->new_erase(level + 1, hash, key);
+    if (child == data[dex])
+        return this;
+
+    return compact(get_vals(), dex, child);
+}
+
 template<typename K, typename V>
 inline bitmap_data<K, V> array_node<K, V, BITS>::get_vals() const {
 
@@ -596,79 +1110,80 @@ inline bitmap_data<K, V> array_node<K, V, BITS>::get_vals() const {
 
 template<typename K, typename V>
 inline leaf_node<K, V>::leaf_node(K const& k, V const& v) :
-        key(k), val(GC_NEW(V)(v)) {
+        i_node<K, V>(1), key(k), val(GC_NEW(V)(v)) {
 }
 
 template<typename K, typename V>
 inline leaf_node<K, V>::leaf_node(K const& k, V const* v) :
-        key(k), val(v) {
+        i_node<K, V>(1), key(k), val(v) {
 }
 
 template<typename K, typename V>
-inline V const* leaf_node<K, V>::find(unsigned /*level*/, u32 /*hash*/, K const& k) const {
+inline V const* leaf_node<K, V>::find(unsigned /*level*/, hash_t /*hash*/, K const& k) const {
     return (k == key) ? val : NULL;
 }
 
 template<typename K, typename V>
-inline i_node<K, V> const* leaf_node<K, V>::new_insert(unsigned level, u32 h, K const& k, V const& v) const {
-
-    if (level != 6) {
-        assert(level < 6);
-        if (k == key) {
-            typedef leaf_node<K, V> nde;
-            return GC_NEW(nde)(k, v);
-        } else {
-            std::size_t b = bitpos(level, h);
-            std::size_t bit = bitpos(level, calc_hash(key));
+inline i_node<K, V> const* leaf_node<K, V>::new_insert(unsigned level, hash_t h, K const& k, V const& v) const {
 
-            u32 new_bitmap = b | bit;
+    if (k == key) {
+        typedef leaf_node<K, V> nde;
+        return GC_NEW(nde)(k, v);
+    }
 
-            if (b == bit) {
-                assert(std::bitset<BITS>(new_bitmap).count() == 1);
-                boost::array<i_node<K, V> const*, 1> new_data;
+    if (level == MAX_LEVEL) {
+        std::pair<K, V const*> existing(key, val);
+        std::pair<K, V const*> added(k, GC_NEW(V)(v));
+        return merge_entries(&existing, 1, &added, 1);
+    }
 
-                // ok, this is being tricksy. verify it works...
-                new_data[0] = new_insert(level + 1, h, k, v);
-                //new_data[0] = leaf_node<K, V>(key, val).new_insert(h, k, v);
+    assert(level < MAX_LEVEL);
 
-                typedef array_node<K, V, 1> nde;
-                return GC_NEW(nde)(new_bitmap, new_data);
-            } else {
-                assert(std::bitset<32>(new_bitmap).count() == 2);
-                boost::array<i_node<K, V> const*, 2> new_data;
+    std::size_t b = bitpos(level, h);
+    std::size_t bit = bitpos(level, calc_hash(key));
 
-                typedef leaf_node<K, V> l_nde;
+    u32 new_bitmap = b | bit;
 
-                l_nde const* l = GC_NEW(l_nde)(k, v);
-                l_nde const* leaf = GC_NEW(l_nde)(key, val);
+    if (b == bit) {
+        assert(std::bitset<BITS>(new_bitmap).count() == 1);
+        boost::array<i_node<K, V> const*, 1> new_data;
 
-                new_data[0] = (b < bit) ? l : leaf;
-                new_data[1] = (b < bit) ? leaf : l;
+        // ok, this is being tricksy. verify it works...
+        new_data[0] = new_insert(level + 1, h, k, v);
+        //new_data[0] = leaf_node<K, V>(key, val).new_insert(h, k, v);
 
-                typedef array_node<K, V, 2> nde;
-                return GC_NEW(nde)(new_bitmap, new_data);
-            }
-        }
+        typedef array_node<K, V, 1> nde;
+        return GC_NEW(nde)(new_bitmap, new_data);
     } else {
-        typedef collision_node<K, V> col_node;
-        return GC_NEW(col_node)(k, v, key, val);
+        assert(std::bitset<32>(new_bitmap).count() == 2);
+        boost::array<i_node<K, V> const*, 2> new_data;
+
+        typedef leaf_node<K, V> l_nde;
+
+        l_nde const* l = GC_NEW(l_nde)(k, v);
+        l_nde const* leaf = GC_NEW(l_nde)(key, val);
+
+        new_data[0] = (b < bit) ? l : leaf;
+        new_data[1] = (b < bit) ? leaf : l;
+
+        typedef array_node<K, V, 2> nde;
+        return GC_NEW(nde)(new_bitmap, new_data);
     }
 }
 
 template<typename K, typename V>
-inline leaf_node<K, V>::~leaf_node() {
+inline i_node<K, V> const* leaf_node<K, V>::new_erase(unsigned /*level*/, hash_t /*hash*/, K const& k) const {
+    return (k == key) ? NULL : this;
 }
 
 template<typename K, typename V>
-inline collision_node<K, V>::collision_node(persistent::list<std::pair<K, V const*> > const& values) :
-        vals(values) {
+inline leaf_node<K, V>::~leaf_node() {
 }
 
 template<typename K, typename V>
-inline collision_node<K, V>::collision_node(K const& k1, V const& v1, K const& k2, V const* v2) :
-        vals(
-                list<std::pair<K, V const*> >().new_push_front(std::make_pair(k2, v2)).new_push_front(
-                        std::make_pair(k1, GC_NEW(V)(v1)))) {
+inline collision_node<K, V>::collision_node(entry const* sorted, std::size_t n) :
+        i_node<K, V>(n), entries(sorted) {
+    assert(n >= 2);
 }
 
 template<typename K, typename V>
@@ -676,22 +1191,51 @@ inline collision_node<K, V>::~collision_node() {
 }
 
 template<typename K, typename V>
-inline V const* collision_node<K, V>::find(unsigned /*level*/, u32 /*hash*/, K const& key) const {
-
-    for (typename list<std::pair<K, V const*> >::const_iterator it(vals.begin()); it != vals.end(); ++it) {
-        if ((*it).first == key) // TODO add operator->
-            return (*it).second;
+inline std::size_t collision_node<K, V>::lower_bound(K const& key) const {
+    std::size_t lo = 0, hi = this->count;
+    while (lo < hi) {
+        std::size_t mid = lo + (hi - lo) / 2;
+        if (entries[mid].first < key)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    return lo;
+}
 
-    return NULL;
+template<typename K, typename V>
+inline V const* collision_node<K, V>::find(unsigned /*level*/, hash_t /*hash*/, K const& key) const {
+    std::size_t i = lower_bound(key);
+    return (i < this->count && entries[i].first == key) ? entries[i].second : NULL;
 }
 
 template<typename K, typename V>
-inline i_node<K, V> const* collision_node<K, V>::new_insert(unsigned /*level*/, u32 /*hash*/, K const& key,
+inline i_node<K, V> const* collision_node<K, V>::new_insert(unsigned /*level*/, hash_t /*hash*/, K const& key,
         V const& val) const {
-    V const* new_val = GC_NEW(V)(val);
-    return GC_NEW(collision_node)(vals.new_push_front(std::make_pair(key, new_val)));
+    entry added(key, GC_NEW(V)(val));
+    return merge_entries(entries, this->count, &added, 1);
+}
+
+template<typename K, typename V>
+i_node<K, V> const* collision_node<K, V>::new_erase(unsigned /*level*/, hash_t /*hash*/, K const& key) const {
+    std::size_t dex = lower_bound(key);
+    if (dex == this->count || !(entries[dex].first == key))
+        return this;
+
+    std::size_t n = this->count - 1;
+    if (n == 1) {
+        entry const& other = entries[1 - dex];
+        typedef leaf_node<K, V> l_nde;
+        return GC_NEW(l_nde)(other.first, other.second);
+    }
+
+    typedef collision_entries<K, V> entries_tag;
+    entry* out = static_cast<entry*>(GC_ALLOC_AS(entries_tag, n * sizeof(entry)));
+    for (std::size_t i(0), j(0); i < this->count; ++i) {
+        if (i != dex)
+            new (out + j++) entry(entries[i]);
+    }
+    return GC_NEW(collision_node)(out, n);
 }
 }
 }
-
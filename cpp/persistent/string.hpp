@@ -1,80 +1,452 @@
 #pragma once
 #include "../alloc.hpp"
+#include "hash.hpp"
+#include <algorithm>
+#include <cassert>
 #include <cstring>
 #include <boost/functional/hash.hpp>
 
 namespace persistent {
 
+// what string contents are accounted against
+struct string_bytes {
+};
+
+inline char const* alloc_name(string_bytes const*) {
+    return "string bytes";
+}
+
+namespace string_impl {
+struct rope_node;
+}
+
+// up to inline_capacity bytes are kept in the string itself (with a terminator),
+// anything longer points at its bytes, or is a rope: a balanced tree of
+// concatenations and slices of other strings, so that + and substr don't have
+// to copy. a rope is only flattened (once) when its c_str() or hash is needed.
+//
+// flat strings are hashed when they're made, so maps and comparisons never have
+// to rescan them. comparisons go by the length, so embedded NULs are fine.
+//
+// a flat string's bytes are only traced by the collector when it allocated
+// them (`owned`): strings made from a pointer use it in place, wherever it is.
 struct string {
+    static const unsigned inline_capacity = 15;
+    // results up to this long are copied into a flat string, longer ones are roped
+    static const unsigned leaf_capacity = 256;
+
+    // longer strings use c_str in place, without copying
     string(char const* c_str, unsigned size) :
-            val(c_str), length(size) {
+            length(size), roped(false), owned(false), hashed(hash_bytes(c_str, size)) {
+        if (is_inline())
+            store_inline(c_str);
+        else
+            rep.ptr = c_str;
     }
 
     string(char const* c_str) :
-            val(c_str), length(::strlen(c_str)) {
+            length(::strlen(c_str)), roped(false), owned(false), hashed(hash_bytes(c_str, length)) {
+        if (is_inline())
+            store_inline(c_str);
+        else
+            rep.ptr = c_str;
     }
 
     struct MakeCopy {
     };
 
     string(MakeCopy, char const* from, unsigned len) :
-            val(alloc_and_copy(from, len)), length(len) {
+            length(len), roped(false), owned(!is_inline()), hashed(hash_bytes(from, len)) {
+        if (is_inline())
+            store_inline(from);
+        else
+            rep.ptr = alloc_and_copy(from, len);
     }
 
-    string operator+(string const& other) const {
-        char *s = (char*) GC_ALLOC(size() + other.size() + 1);
-        ::memcpy(s, c_str(), size());
-        ::memcpy(s + size(), other.c_str(), other.size() + 1); // copy the null terminator as well
-        return string(s, size() + other.size());
-    }
+    string operator+(string const& other) const;
+
+    // the len bytes from start
+    string substr(unsigned start, unsigned len) const;
+
+    char at(unsigned i) const;
 
     unsigned size() const {
         return length;
     }
 
-    char const* c_str() const {
-        return val;
-    }
+    // flattens a rope, the first time
+    char const* c_str() const;
+
+    boost::uint64_t hash() const;
+
+    // how many concatenations deep this is, 0 for a flat string
+    unsigned depth() const;
+
+    // copies len bytes from start to out, without flattening anything
+    void copy_out(char* out, unsigned start, unsigned len) const;
 
     int compareTo(string const& other) const {
-        return ::strcmp(c_str(), other.c_str());
+        unsigned common = (length < other.length) ? length : other.length;
+        int c = ::memcmp(c_str(), other.c_str(), common);
+        if (c != 0)
+            return c;
+        return (length < other.length) ? -1 : (length > other.length) ? 1 : 0;
     }
 
     bool operator==(string const& other) const {
-        return ::strcmp(c_str(), other.c_str()) == 0;
+        return length == other.length && hash() == other.hash() && ::memcmp(c_str(), other.c_str(), length) == 0;
     }
 
     bool operator!=(string const& other) const {
-        return ::strcmp(c_str(), other.c_str()) != 0;
+        return !(*this == other);
     }
 
     bool operator<(string const& other) const {
-        return ::strcmp(c_str(), other.c_str()) < 0;
+        return compareTo(other) < 0;
     }
 
     bool operator<=(string const& other) const {
-        return ::strcmp(c_str(), other.c_str()) <= 0;
+        return compareTo(other) <= 0;
     }
 
     bool operator>(string const& other) const {
-        return ::strcmp(c_str(), other.c_str()) > 0;
+        return compareTo(other) > 0;
     }
 
     bool operator>=(string const& other) const {
-        return ::strcmp(c_str(), other.c_str()) >= 0;
+        return compareTo(other) >= 0;
     }
 
 private:
+    friend struct string_impl::rope_node;
+
+    explicit string(string_impl::rope_node const* node);
+
+    struct Adopt {
+    };
+
+    // takes over bytes from GC_ALLOC_AS, or copies short ones in
+    string(Adopt, char const* s, unsigned len) :
+            length(len), roped(false), owned(!is_inline()), hashed(hash_bytes(s, len)) {
+        if (is_inline())
+            store_inline(s);
+        else
+            rep.ptr = s;
+    }
+
+    bool is_inline() const {
+        return !roped && length <= inline_capacity;
+    }
+
+    string_impl::rope_node const* concat_node() const;
+
+    static string flat_copy(string const& a, string const& b);
+    static string join(string const& left, string const& right);
+    static string join_right(string const& left, string const& right);
+    static string join_left(string const& left, string const& right);
+    static string rotate_left(string const& s);
+    static string rotate_right(string const& s);
+
+    void store_inline(char const* from) {
+        ::memcpy(rep.chars, from, length);
+        rep.chars[length] = '\0';
+    }
+
     static char const* alloc_and_copy(char const* source, unsigned len) {
-        char* s = (char*) GC_ALLOC(len + 1);
+        char* s = (char*) GC_ALLOC_AS(string_bytes, len + 1);
         ::memcpy(s, source, len);
         s[len] = '\0';
 
         return s;
     }
 
-    char const* val;
-    const unsigned length;
+    union {
+        char const* ptr;
+        string_impl::rope_node const* node;
+        char chars[inline_capacity + 1];
+    } rep;
+    unsigned length;
+    bool roped;
+    bool owned; // rep.ptr is a GC block
+    boost::uint64_t hashed; // of a flat string, ropes keep theirs in the node
+
+    friend void gc_visit(string const& s, gc::marker & m) {
+        if (s.roped)
+            m.mark(s.rep.node);
+        else if (s.owned)
+            m.mark(s.rep.ptr);
+    }
+};
+
+inline std::size_t hash_value(string const& s) {
+    return s.hash();
+}
+
+namespace string_impl {
+
+// either left ++ right, or (when `slice`) the length bytes of left from start
+struct rope_node {
+    rope_node(string const& left, string const& right) :
+            left(left), right(right), start(0), length(left.size() + right.size()), depth(
+                    1 + std::max(left.depth(), right.depth())), slice(false), flat(NULL), hashed(0), have_hash(
+                    false) {
+    }
+
+    rope_node(string const& base, unsigned start, unsigned length) :
+            left(base), right(""), start(start), length(length), depth(0), slice(true), flat(NULL), hashed(0), have_hash(
+                    false) {
+    }
+
+    void copy_out(char* out, unsigned from, unsigned len) const {
+        if (slice) {
+            left.copy_out(out, start + from, len);
+            return;
+        }
+
+        if (from < left.size()) {
+            unsigned n = std::min(len, left.size() - from);
+            left.copy_out(out, from, n);
+            out += n;
+            len -= n;
+            from = 0;
+        } else {
+            from -= left.size();
+        }
+        if (len > 0)
+            right.copy_out(out, from, len);
+    }
+
+    // racing threads may both flatten, but they'd write the same bytes. the
+    // node may be older than a region that's open, so the bytes can't be in it
+    char const* flatten() const {
+        char const* f = __atomic_load_n(&flat, __ATOMIC_ACQUIRE);
+        if (f == NULL) {
+            gc::heap_scope outside_region;
+            char* buff = (char*) GC_ALLOC_AS(string_bytes, length + 1);
+            copy_out(buff, 0, length);
+            buff[length] = '\0';
+            __atomic_store_n(&flat, buff, __ATOMIC_RELEASE);
+            f = buff;
+        }
+        return f;
+    }
+
+    boost::uint64_t hash() const {
+        if (!__atomic_load_n(&have_hash, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&hashed, hash_bytes(flatten(), length), __ATOMIC_RELAXED);
+            __atomic_store_n(&have_hash, true, __ATOMIC_RELEASE);
+        }
+        return __atomic_load_n(&hashed, __ATOMIC_RELAXED);
+    }
+
+    string left;
+    string right;
+    unsigned start;
+    unsigned length;
+    unsigned depth;
+    bool slice;
+
+    mutable char const* flat;
+    mutable boost::uint64_t hashed;
+    mutable bool have_hash;
+
+    friend char const* alloc_name(rope_node const*) {
+        return "rope node";
+    }
+
+    // flat is set at most once, to a block made since any cycle began
+    friend void gc_visit(rope_node const& n, gc::marker & m) {
+        m.visit(n.left);
+        m.visit(n.right);
+        m.mark(__atomic_load_n(&n.flat, __ATOMIC_ACQUIRE));
+    }
 };
 
 }
+
+inline string::string(string_impl::rope_node const* node) :
+        length(node->length), roped(true), owned(false), hashed(0) {
+    rep.node = node;
+}
+
+inline char const* string::c_str() const {
+    if (is_inline())
+        return rep.chars;
+    return roped ? rep.node->flatten() : rep.ptr;
+}
+
+inline boost::uint64_t string::hash() const {
+    return roped ? rep.node->hash() : hashed;
+}
+
+inline unsigned string::depth() const {
+    return roped ? rep.node->depth : 0;
+}
+
+inline string_impl::rope_node const* string::concat_node() const {
+    return (roped && !rep.node->slice) ? rep.node : NULL;
+}
+
+inline void string::copy_out(char* out, unsigned start, unsigned len) const {
+    assert(start + len <= length);
+
+    if (!roped) {
+        ::memcpy(out, c_str() + start, len);
+        return;
+    }
+
+    char const* f = __atomic_load_n(&rep.node->flat, __ATOMIC_ACQUIRE);
+    if (f != NULL)
+        ::memcpy(out, f + start, len);
+    else
+        rep.node->copy_out(out, start, len);
+}
+
+inline char string::at(unsigned i) const {
+    assert(i < length);
+
+    string const* s = this;
+    while (s->roped) {
+        string_impl::rope_node const* n = s->rep.node;
+        char const* f = __atomic_load_n(&n->flat, __ATOMIC_ACQUIRE);
+        if (f != NULL)
+            return f[i];
+
+        if (n->slice) {
+            i += n->start;
+            s = &n->left;
+        } else if (i < n->left.size()) {
+            s = &n->left;
+        } else {
+            i -= n->left.size();
+            s = &n->right;
+        }
+    }
+    return s->c_str()[i];
+}
+
+inline string string::flat_copy(string const& a, string const& b) {
+    unsigned len = a.size() + b.size();
+    char inline_buff[inline_capacity + 1];
+
+    char *s = (len <= inline_capacity) ? inline_buff : (char*) GC_ALLOC_AS(string_bytes, len + 1);
+    a.copy_out(s, 0, a.size());
+    b.copy_out(s + a.size(), 0, b.size());
+    s[len] = '\0';
+    return string(Adopt(), s, len); // copied in again when it's short enough to be inline
+}
+
+inline string string::operator+(string const& other) const {
+    if (other.size() == 0)
+        return *this;
+    if (size() == 0)
+        return other;
+
+    if (size() + other.size() <= leaf_capacity)
+        return flat_copy(*this, other);
+
+    // appending or prepending a little at a time grows the leaf at that end,
+    // rather than making a new one each time
+    string_impl::rope_node const* n = concat_node();
+    if (n != NULL && !other.roped && n->right.depth() == 0 && n->right.size() + other.size() <= leaf_capacity)
+        return join(n->left, flat_copy(n->right, other));
+
+    n = other.concat_node();
+    if (n != NULL && !roped && n->left.depth() == 0 && size() + n->left.size() <= leaf_capacity)
+        return join(flat_copy(*this, n->left), n->right);
+
+    return join(*this, other);
+}
+
+inline string string::substr(unsigned start, unsigned len) const {
+    assert(start + len <= length);
+
+    if (start == 0 && len == length)
+        return *this;
+
+    if (len <= leaf_capacity) {
+        char inline_buff[inline_capacity + 1];
+        char *s = (len <= inline_capacity) ? inline_buff : (char*) GC_ALLOC_AS(string_bytes, len + 1);
+        copy_out(s, start, len);
+        s[len] = '\0';
+        return string(Adopt(), s, len);
+    }
+
+    if (string_impl::rope_node const* n = concat_node()) {
+        unsigned left_len = n->left.size();
+        if (start + len <= left_len)
+            return n->left.substr(start, len);
+        if (start >= left_len)
+            return n->right.substr(start - left_len, len);
+        return n->left.substr(start, left_len - start) + n->right.substr(0, start + len - left_len);
+    }
+
+    if (roped) // a slice of a slice
+        return rep.node->left.substr(rep.node->start + start, len);
+
+    return string(GC_NEW(string_impl::rope_node)(*this, start, len));
+}
+
+// AVL style: a concatenation's halves differ in depth by at most one
+inline string string::join(string const& left, string const& right) {
+    if (left.depth() > right.depth() + 1)
+        return join_right(left, right);
+    if (right.depth() > left.depth() + 1)
+        return join_left(left, right);
+    return string(GC_NEW(string_impl::rope_node)(left, right));
+}
+
+inline string string::rotate_left(string const& s) {
+    string_impl::rope_node const* n = s.concat_node();
+    string_impl::rope_node const* r = n->right.concat_node();
+    assert(n && r);
+    return string(GC_NEW(string_impl::rope_node)(string(GC_NEW(string_impl::rope_node)(n->left, r->left)), r->right));
+}
+
+inline string string::rotate_right(string const& s) {
+    string_impl::rope_node const* n = s.concat_node();
+    string_impl::rope_node const* l = n->left.concat_node();
+    assert(n && l);
+    return string(GC_NEW(string_impl::rope_node)(l->left, string(GC_NEW(string_impl::rope_node)(l->right, n->right))));
+}
+
+// left is deeper: walk down its right spine to where right fits, rebalancing on the way back up
+inline string string::join_right(string const& left, string const& right) {
+    typedef string_impl::rope_node node;
+    node const* n = left.concat_node();
+    assert(n);
+
+    if (n->right.depth() <= right.depth() + 1) {
+        string t(GC_NEW(node)(n->right, right));
+        if (t.depth() <= n->left.depth() + 1)
+            return string(GC_NEW(node)(n->left, t));
+        return rotate_left(string(GC_NEW(node)(n->left, rotate_right(t))));
+    }
+
+    string t = join_right(n->right, right);
+    string joined(GC_NEW(node)(n->left, t));
+    if (t.depth() <= n->left.depth() + 1)
+        return joined;
+    return rotate_left(joined);
+}
+
+inline string string::join_left(string const& left, string const& right) {
+    typedef string_impl::rope_node node;
+    node const* n = right.concat_node();
+    assert(n);
+
+    if (n->left.depth() <= left.depth() + 1) {
+        string t(GC_NEW(node)(left, n->left));
+        if (t.depth() <= n->right.depth() + 1)
+            return string(GC_NEW(node)(t, n->right));
+        return rotate_right(string(GC_NEW(node)(rotate_left(t), n->right)));
+    }
+
+    string t = join_left(left, n->left);
+    string joined(GC_NEW(node)(t, n->right));
+    if (t.depth() <= n->right.depth() + 1)
+        return joined;
+    return rotate_right(joined);
+}
+
+}
@@ -0,0 +1,328 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "../object.hpp"
+
+namespace harkon {
+
+// where printed output goes
+struct sink {
+    virtual void write(char const* s, std::size_t n) = 0;
+    virtual ~sink() {
+    }
+
+    void put(char const* s) {
+        write(s, ::strlen(s));
+    }
+    void put(std::string const& s) {
+        write(s.data(), s.size());
+    }
+};
+
+struct ostream_sink: sink {
+    explicit ostream_sink(std::ostream & out) :
+            out(out) {
+    }
+    void write(char const* s, std::size_t n) {
+        out.write(s, n);
+    }
+    std::ostream & out;
+};
+
+struct string_sink: sink {
+    explicit string_sink(std::string & out) :
+            out(out) {
+    }
+    void write(char const* s, std::size_t n) {
+        out.append(s, n);
+    }
+    std::string & out;
+};
+
+// buffered writes straight to a file descriptor
+struct fd_sink: sink, boost::noncopyable {
+    explicit fd_sink(int fd) :
+            fd(fd) {
+        buff.reserve(capacity);
+    }
+    ~fd_sink() {
+        try {
+            flush();
+        } catch (...) {
+        }
+    }
+
+    void write(char const* s, std::size_t n) {
+        if (buff.size() + n > capacity)
+            flush();
+        if (n >= capacity)
+            write_all(s, n);
+        else
+            buff.insert(buff.end(), s, s + n);
+    }
+
+    void flush() {
+        if (!buff.empty())
+            write_all(&buff[0], buff.size());
+        buff.clear();
+    }
+
+private:
+    static const std::size_t capacity = 64 * 1024;
+
+    void write_all(char const* s, std::size_t n) {
+        while (n > 0) {
+            ssize_t done = ::write(fd, s, n);
+            if (done < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error(std::string("Unable to write output: ") + ::strerror(errno));
+            }
+            s += done;
+            n -= done;
+        }
+    }
+
+    int fd;
+    std::vector<char> buff;
+};
+
+struct print_options {
+    print_options() :
+            max_depth(0), max_length(0), label_shared(false) {
+    }
+
+    unsigned max_depth; // lists nested deeper than this print as ..., 0 for no limit
+    unsigned max_length; // list elements past this many print as ..., 0 for no limit
+    bool label_shared; // a list reachable more than once prints as #n=(...) and then #n#
+};
+
+void print(object const& o, sink & out, print_options const& opts = print_options());
+
+namespace printer_impl {
+
+// everything but lists
+struct atom_printer: boost::static_visitor<void> {
+    atom_printer(sink & out, unsigned max_length = 0) :
+            out(out), max_length(max_length) {
+    }
+
+    void operator()(boolean b) const {
+        out.put(b.as_bool() ? "#t" : "#f");
+    }
+    void operator()(char) const {
+        out.put("<char>");
+    }
+    void operator()(int i) const {
+        char buff[16];
+        int n = ::snprintf(buff, sizeof(buff), "%d", i);
+        out.write(buff, n);
+    }
+    void operator()(bigint const& i) const {
+        out.put(i.to_string());
+    }
+    // #i32(1 2 3), or #i64(...) when packed wider, cut short as a list would be
+    void operator()(packed const& p) const {
+        out.put(p.type() == packed::int32 ? "#i32(" : "#i64(");
+        for (unsigned i(0); i < p.size(); ++i) {
+            if (i != 0)
+                out.put(" ");
+            if (max_length != 0 && i == max_length) {
+                out.put("...");
+                break;
+            }
+            char buff[24];
+            int n = ::snprintf(buff, sizeof(buff), "%lld", p.at(i));
+            out.write(buff, n);
+        }
+        out.put(")");
+    }
+    void operator()(nil) const {
+        out.put("NIL");
+    }
+    void operator()(symbol const& s) const {
+        write_text(s); // TODO: escaping..
+    }
+    void operator()(string const& s) const {
+        out.put("\"");
+        write_text(s); // TODO: escaping
+        out.put("\"");
+    }
+    // #b"..." with anything unprintable escaped, cut short as a list would be
+    void operator()(persistent::bytes const& b) const {
+        std::size_t n = max_length != 0 && b.size() > max_length ? max_length : b.size();
+        std::string text("#b\"");
+        for (std::size_t i(0); i < n; ++i) {
+            unsigned char c = b[i];
+            if (c >= ' ' && c < 0x7f && c != '"' && c != '\\') {
+                text += char(c);
+            } else {
+                char buff[8];
+                ::snprintf(buff, sizeof(buff), "\\x%02x", c);
+                text += buff;
+            }
+        }
+        out.put(text + (n < b.size() ? "...\"" : "\""));
+    }
+    void operator()(object_list const&) const {
+        assert(!"lists are printed by print()");
+    }
+    void operator()(object_proc const&) const {
+        out.put("<PROC>");
+    }
+
+    // a chunk at a time, so a rope isn't flattened just to be printed
+    void write_text(persistent::string const& s) const {
+        char chunk[4096];
+        for (unsigned at(0); at < s.size(); at += sizeof(chunk)) {
+            unsigned n = std::min<unsigned>(sizeof(chunk), s.size() - at);
+            s.copy_out(chunk, at, n);
+            out.write(chunk, n);
+        }
+    }
+
+    sink & out;
+    unsigned max_length;
+};
+
+inline void const* identity(object_list const& l) {
+    return l.begin().pointing_at;
+}
+
+// how many times each non empty list is reachable, without going into any twice
+inline void count_lists(object const& root, std::map<void const*, unsigned> & seen) {
+    std::vector<object const*> todo(1, &root);
+
+    while (!todo.empty()) {
+        object const* o = todo.back();
+        todo.pop_back();
+
+        object_list const* l = boost::get<object_list>(o);
+        if (l == NULL || l->empty())
+            continue;
+        if (seen[identity(*l)]++ > 0)
+            continue;
+
+        for (object_list::const_iterator it(l->begin()); it != l->end(); ++it) {
+            todo.push_back(&*it);
+        }
+    }
+}
+
+struct printer {
+    printer(sink & out, print_options const& opts) :
+            out(out), opts(opts), atoms(out, opts.max_length), next_label(0) {
+    }
+
+    struct frame {
+        object_list::const_iterator it;
+        unsigned depth;
+        unsigned printed;
+    };
+
+    void run(object const& root) {
+        if (opts.label_shared)
+            count_lists(root, counts);
+
+        start(root, 1);
+        while (!stack.empty()) {
+            frame & f = stack.back();
+
+            if (f.it == object_list::const_iterator(NULL)) {
+                out.put(")");
+                stack.pop_back();
+                continue;
+            }
+            if (f.printed > 0)
+                out.put(" ");
+            if (opts.max_length != 0 && f.printed == opts.max_length) {
+                out.put("...)");
+                stack.pop_back();
+                continue;
+            }
+
+            object const& o = *f.it;
+            ++f.it;
+            ++f.printed;
+            start(o, f.depth + 1); // may push, so f is done with
+        }
+    }
+
+    // prints an atom, or opens a list and leaves its elements to run()
+    void start(object const& o, unsigned depth) {
+        object_list const* l = boost::get<object_list>(&o);
+        if (l == NULL) {
+            boost::apply_visitor(atoms, o);
+            return;
+        }
+        if (l->empty()) {
+            out.put("()");
+            return;
+        }
+        if (opts.max_depth != 0 && depth > opts.max_depth) {
+            out.put("...");
+            return;
+        }
+
+        if (opts.label_shared && counts[identity(*l)] > 1) {
+            std::map<void const*, unsigned>::const_iterator it = labels.find(identity(*l));
+            if (it != labels.end()) {
+                out.put("#" + boost::lexical_cast<std::string>(it->second) + "#");
+                return;
+            }
+            unsigned label = next_label++;
+            labels[identity(*l)] = label;
+            out.put("#" + boost::lexical_cast<std::string>(label) + "=");
+        }
+
+        out.put("(");
+        frame f = { l->begin(), depth, 0 };
+        stack.push_back(f);
+    }
+
+    sink & out;
+    print_options const& opts;
+    atom_printer atoms;
+
+    std::vector<frame> stack;
+    std::map<void const*, unsigned> counts;
+    std::map<void const*, unsigned> labels;
+    unsigned next_label;
+};
+
+}
+
+// writes o to out as it goes, with an explicit stack rather than recursion, so
+// neither the size of o nor how deeply it's nested matters
+inline void print(object const& o, sink & out, print_options const& opts) {
+    printer_impl::printer p(out, opts);
+    p.run(o);
+}
+
+inline std::string pretty_print(object const& o, print_options const& opts) {
+    std::string s;
+    string_sink out(s);
+    print(o, out, opts);
+    return s;
+}
+
+inline std::string pretty_print(object const& o) {
+    return pretty_print(o, print_options());
+}
+
+}
@@ -7,6 +7,17 @@ namespace harkon {
 
 struct pim_val_converter: boost::static_visitor<object> {
 
+    static bool is_integer(std::vector<char> const& symb) {
+        std::size_t i = (symb[0] == '-') ? 1 : 0;
+        if (i == symb.size())
+            return false;
+        for (; i < symb.size(); ++i) {
+            if (symb[i] < '0' || symb[i] > '9')
+                return false;
+        }
+        return true;
+    }
+
     object operator()(const int x) const {
         return x;
     }
@@ -17,6 +28,8 @@ struct pim_val_converter: boost::static_visitor<object> {
 
         if (len == 0)
             return symbol("", 0);
+        else if (is_integer(symb))
+            return make_integer(bigint::parse(&symb[0], len)); // too big for int_
         else
             return symbol(symbol::MakeCopy(), &symb[0], len);
     }
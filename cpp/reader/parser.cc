@@ -2,6 +2,7 @@
 
 #include "parser.hpp"
 #include "conversion.hpp"
+#include "source_span.hpp"
 
 namespace harkon {
 
@@ -70,7 +71,31 @@ object parse(std::string const& str) {
 		throw reader_exception("Parse error. Stopped at: " + std::string(iter, end));
 	}
 
-    return object_from_prim_val(result.front());
+    object form = object_from_prim_val(result.front());
+    record_spans(std::vector<object>(1, form), list_spans(str));
+    return form;
+}
+
+std::vector<object> parse_all(std::string const& str) {
+
+	std::string::const_iterator iter = str.begin();
+	std::string::const_iterator end = str.end();
+
+	std::vector<prim_val> result;
+
+	bool r = harkon::harkon_parse(iter, end, result);
+
+	if (!r || iter != end) {
+		throw reader_exception("Parse error. Stopped at: " + std::string(iter, end));
+	}
+
+	std::vector<object> forms;
+	forms.reserve(result.size());
+	for (std::vector<prim_val>::const_iterator it(result.begin()); it != result.end(); ++it) {
+		forms.push_back(object_from_prim_val(*it));
+	}
+	record_spans(forms, list_spans(str));
+	return forms;
 }
 
 }
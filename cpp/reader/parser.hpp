@@ -1,5 +1,6 @@
 #pragma once
 
+#include <vector>
 #include <boost/variant.hpp>
 
 #include "../object.hpp"
@@ -23,7 +24,14 @@ private:
 	std::string msg;
 };
 
+// bumped whenever what parse makes of the same text changes, so anything cached
+// from an older reader is thrown away
+const unsigned reader_version = 1;
+
 object parse(std::string const& str);
 
+// parses every form in `str`, for reading whole files
+std::vector<object> parse_all(std::string const& str);
+
 }
 
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <boost/optional.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "../object.hpp"
+
+namespace harkon {
+
+// Where a list was read from. Objects have no room for one, so the spans the
+// reader finds are kept to one side, keyed by the list's first node, which is
+// never shared with another list as read. Lists made at run time have none.
+// The table holds its keys weakly: a list's span goes when it's collected, and
+// follows it when a region (see gc/region.hpp) promotes it.
+struct source_span {
+    source_span() :
+            offset(0), length(0), line(0), column(0) {
+    }
+
+    unsigned offset;
+    unsigned length;
+    unsigned line; // from 1
+    unsigned column; // from 1
+};
+
+namespace source_span_impl {
+
+typedef boost::unordered_map<void const*, source_span> table;
+
+inline table & spans() {
+    static table t;
+    return t;
+}
+
+inline boost::mutex & spans_lock() {
+    static boost::mutex m;
+    return m;
+}
+
+inline void collect(object const& o, std::vector<source_span> const& found, std::size_t & next,
+        std::vector<std::pair<void const*, source_span> > & out) {
+    object_list const* l = boost::get<object_list>(&o);
+    if (l == NULL)
+        return;
+
+    source_span const& s = found[next++];
+    if (!l->empty())
+        out.push_back(std::make_pair(l->identity(), s));
+    for (object_list::const_iterator it(l->begin()); it != l->end() && next < found.size(); ++it) {
+        collect(*it, found, next, out);
+    }
+}
+
+// drops the spans of lists the collector isn't keeping
+inline void purge(gc::marker const& m) {
+    boost::mutex::scoped_lock lock(spans_lock());
+    for (table::iterator it(spans().begin()); it != spans().end();) {
+        if (m.marked(it->first))
+            ++it;
+        else
+            it = spans().erase(it);
+    }
+}
+
+// a key made in a region has been promoted to `to`, or dropped if that's NULL
+inline void moved(void const* from, void const* to) {
+    boost::mutex::scoped_lock lock(spans_lock());
+    table::iterator it = spans().find(from);
+    if (it == spans().end())
+        return;
+    if (to != NULL)
+        spans()[to] = it->second;
+    spans().erase(it);
+}
+
+inline void watch_collections() {
+    static bool registered = (gc::on_weak(&purge), true);
+    (void) registered;
+}
+
+inline std::size_t count_lists(object const& o) {
+    object_list const* l = boost::get<object_list>(&o);
+    if (l == NULL)
+        return 0;
+    std::size_t n = 1;
+    for (object_list::const_iterator it(l->begin()); it != l->end(); ++it) {
+        n += count_lists(*it);
+    }
+    return n;
+}
+
+}
+
+// the span of every list in text, in the order they open. this follows the
+// reader's rules: comments and strings only start a token, and everything up
+// to a space or a paren is a symbol
+inline std::vector<source_span> list_spans(std::string const& text) {
+    std::vector<source_span> found;
+    std::vector<std::size_t> open;
+
+    unsigned line = 1, column = 1;
+    bool token_start = true;
+
+    for (std::size_t i(0); i < text.size(); ++i, ++column) {
+        char c = text[i];
+        if (c == '\n') {
+            ++line;
+            column = 0;
+            token_start = true;
+        } else if (c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f') {
+            token_start = true;
+        } else if (c == '(') {
+            open.push_back(found.size());
+            found.push_back(source_span());
+            found.back().offset = i;
+            found.back().line = line;
+            found.back().column = column;
+            token_start = true;
+        } else if (c == ')') {
+            if (!open.empty()) {
+                source_span & s = found[open.back()];
+                s.length = i + 1 - s.offset;
+                open.pop_back();
+            }
+            token_start = true;
+        } else if (token_start && c == ';') {
+            while (i + 1 < text.size() && text[i + 1] != '\n') {
+                ++i;
+            }
+        } else if (token_start && c == '"') {
+            for (++i, ++column; i < text.size() && text[i] != '"'; ++i, ++column) {
+                if (text[i] == '\n') {
+                    ++line;
+                    column = 0;
+                } else if (text[i] == '\\' && i + 1 < text.size()) {
+                    ++i;
+                    ++column;
+                }
+            }
+        } else {
+            token_start = false;
+        }
+    }
+    return found;
+}
+
+// remembers the spans of the lists in forms, as list_spans found them in their
+// text. if the two don't line up, nothing is remembered rather than the wrong thing
+inline void record_spans(std::vector<object> const& forms, std::vector<source_span> const& found) {
+    using namespace source_span_impl;
+
+    std::size_t lists = 0;
+    for (std::size_t i(0); i < forms.size(); ++i) {
+        lists += count_lists(forms[i]);
+    }
+    if (lists != found.size())
+        return;
+
+    std::vector<std::pair<void const*, source_span> > entries;
+    entries.reserve(lists);
+    std::size_t next = 0;
+    for (std::size_t i(0); i < forms.size(); ++i) {
+        collect(forms[i], found, next, entries);
+    }
+
+    watch_collections();
+    {
+        boost::mutex::scoped_lock lock(spans_lock());
+        spans().insert(entries.begin(), entries.end());
+    }
+    for (std::size_t i(0); i < entries.size(); ++i) {
+        gc::note_weak(entries[i].first, &moved);
+    }
+}
+
+// where the list with this identity was read from, if it was
+inline boost::optional<source_span> find_span(void const* identity) {
+    if (identity == NULL)
+        return boost::none;
+
+    using namespace source_span_impl;
+    boost::mutex::scoped_lock lock(spans_lock());
+    table::const_iterator it = spans().find(identity);
+    if (it == spans().end())
+        return boost::none;
+    return it->second;
+}
+
+// where l was read from, if it was
+inline boost::optional<source_span> find_span(object_list const& l) {
+    return find_span(l.identity());
+}
+
+// for a list rebuilt from one that was read, so it's still found
+inline void copy_span(object_list const& from, object_list const& to) {
+    if (from.empty() || to.empty())
+        return;
+
+    using namespace source_span_impl;
+    {
+        boost::mutex::scoped_lock lock(spans_lock());
+        table::const_iterator it = spans().find(from.identity());
+        if (it == spans().end())
+            return;
+        source_span s = it->second;
+        spans()[to.identity()] = s;
+    }
+    gc::note_weak(to.identity(), &moved);
+}
+
+}
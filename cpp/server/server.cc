@@ -0,0 +1,419 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "server.hpp"
+#include "../concurrency/thread_pool.hpp"
+#include "../reader/parser.hpp"
+#include "../interpretter/interpretter.hpp"
+
+namespace harkon {
+
+namespace server_impl {
+
+struct session {
+	session(int fd, environment const& env) :
+			fd(fd), env(env), env_root(this->env), busy(false), closed(false), exiting(false), writing(false), watched(
+					EPOLLIN) {
+	}
+
+	int fd;
+	environment env; // only ever touched by the worker currently evaluating for us
+	gc::root<environment> env_root;
+
+	std::string in;
+	std::string out;
+	std::deque<std::string> pending;
+
+	bool busy; // a line is with a worker
+	bool closed; // the client went away, drop us once the worker is done
+	bool exiting; // :exit was seen, close once the output is flushed
+	bool writing; // waiting on EPOLLOUT
+	unsigned watched; // the events epoll has for us
+};
+
+// past these a session's input is refused, or left unread until it catches up
+const std::size_t max_line_bytes = 1 << 20;
+const std::size_t max_backlog = 64; // lines
+const std::size_t max_unsent_bytes = 1 << 20; // of answers the client hasn't read
+
+typedef boost::shared_ptr<session> session_ptr;
+
+struct completion {
+	completion(session_ptr s, std::string const& r) :
+			s(s), result(r) {
+	}
+	session_ptr s;
+	std::string result;
+};
+
+inline void throw_errno(std::string const& what) {
+	throw std::runtime_error(what + ": " + ::strerror(errno));
+}
+
+inline void set_nonblocking(int fd) {
+	int flags = ::fcntl(fd, F_GETFL, 0);
+	if (flags == -1 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		throw_errno("fcntl");
+}
+
+inline std::string evaluate_line(std::string const& line, environment & env) {
+	try {
+		eval_result r = eval_in_region(parse(line), env);
+		if (!r.ok())
+			return std::string("Caught exception: ") + r.error->what();
+		return pretty_print(r.value);
+	} catch (std::exception const& ex) {
+		return std::string("Caught exception: ") + ex.what();
+	}
+}
+
+struct server: boost::noncopyable {
+	server(std::string const& path, environment const& base, unsigned workers) :
+			path(path), base(base), base_root(this->base), listener(-1), epoll(-1), wakeup(-1), stopping(false), pool(
+					workers) {
+	}
+
+	~server() {
+		// a worker still evaluating would tell wakeup it's done, which mustn't be closed
+		// (or be some other fd by then), and what they finish has no one left to go to
+		pool.join();
+		completed.clear();
+
+		for (std::map<int, session_ptr>::iterator it(sessions.begin()); it != sessions.end(); ++it) {
+			::close(it->first);
+		}
+		if (listener != -1) {
+			::close(listener);
+			::unlink(path.c_str());
+		}
+		if (wakeup != -1)
+			::close(wakeup);
+		if (epoll != -1)
+			::close(epoll);
+	}
+
+	void listen() {
+		sockaddr_un addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+
+		if (path.size() >= sizeof(addr.sun_path))
+			throw std::runtime_error("Socket path too long: " + path);
+		std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+		listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener == -1)
+			throw_errno("socket");
+
+		::unlink(path.c_str()); // a stale socket from a previous run
+		if (::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1)
+			throw_errno("bind " + path);
+		if (::listen(listener, SOMAXCONN) == -1)
+			throw_errno("listen");
+		set_nonblocking(listener);
+
+		wakeup = ::eventfd(0, EFD_NONBLOCK);
+		if (wakeup == -1)
+			throw_errno("eventfd");
+
+		epoll = ::epoll_create1(0);
+		if (epoll == -1)
+			throw_errno("epoll_create1");
+
+		watch(listener, EPOLLIN, EPOLL_CTL_ADD);
+		watch(wakeup, EPOLLIN, EPOLL_CTL_ADD);
+	}
+
+	void run() {
+		const int max_events = 256;
+		epoll_event events[max_events];
+
+		for (;;) {
+			int n = ::epoll_wait(epoll, events, max_events, -1);
+			if (n == -1) {
+				if (errno == EINTR)
+					continue;
+				throw_errno("epoll_wait");
+			}
+
+			for (int i(0); i < n; ++i) {
+				int fd = events[i].data.fd;
+
+				if (fd == listener) {
+					accept_all();
+				} else if (fd == wakeup) {
+					drain_completions();
+					if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+						return;
+				} else {
+					std::map<int, session_ptr>::iterator it = sessions.find(fd);
+					if (it == sessions.end())
+						continue; // closed earlier in this batch
+
+					session_ptr s = it->second;
+					if (events[i].events & EPOLLOUT)
+						flush(s);
+					if (s->closed)
+						continue; // by flush, and its fd may already be someone else's
+					if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+						continue;
+					if (s->watched & EPOLLIN)
+						receive(s);
+					else if (events[i].events & (EPOLLHUP | EPOLLERR))
+						close(s); // hung up while we weren't reading, so there's no one to answer
+				}
+			}
+		}
+	}
+
+	// from any thread, makes run() return
+	void stop() {
+		__atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+		boost::uint64_t one = 1;
+		ssize_t r = ::write(wakeup, &one, sizeof(one));
+		(void) r;
+	}
+
+private:
+	void watch(int fd, unsigned flags, int op) {
+		epoll_event ev;
+		std::memset(&ev, 0, sizeof(ev));
+		ev.events = flags;
+		ev.data.fd = fd;
+		if (::epoll_ctl(epoll, op, fd, &ev) == -1)
+			throw_errno("epoll_ctl");
+	}
+
+	void accept_all() {
+		for (;;) {
+			int fd = ::accept4(listener, NULL, NULL, SOCK_NONBLOCK);
+			if (fd == -1) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return;
+				if (errno == EINTR || errno == ECONNABORTED)
+					continue;
+				std::cerr << "accept failed: " << ::strerror(errno) << std::endl;
+				return;
+			}
+
+			sessions[fd] = boost::make_shared<session>(fd, base);
+			watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+		}
+	}
+
+	// reads what's there, up to a backlog's worth of lines. the rest stays in the
+	// socket, where it's picked up again once they're done
+	void receive(session_ptr const& s) {
+		char buff[4096];
+
+		while (!backlogged(s)) {
+			ssize_t got = ::read(s->fd, buff, sizeof(buff));
+			if (got > 0) {
+				std::string::size_type start = s->in.size();
+				s->in.append(buff, got);
+				split_lines(s, start);
+				if (s->in.size() > max_line_bytes) {
+					refuse(s, "Caught exception: Line longer than " + boost::lexical_cast<std::string>(max_line_bytes)
+							+ " bytes");
+					return;
+				}
+			} else if (got == 0) {
+				close(s);
+				break;
+			} else if (errno == EINTR) {
+				continue;
+			} else {
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					close(s);
+				break;
+			}
+		}
+
+		schedule(s);
+	}
+
+	// moves the complete lines out of `in`, which has none before `from`
+	void split_lines(session_ptr const& s, std::string::size_type from) {
+		std::string::size_type start = 0;
+		std::string::size_type eol;
+		while ((eol = s->in.find('\n', from)) != std::string::npos) {
+			std::string line(s->in, start, eol - start);
+			if (!line.empty() && line[line.size() - 1] == '\r')
+				line.resize(line.size() - 1);
+			s->pending.push_back(line);
+			start = from = eol + 1;
+		}
+		s->in.erase(0, start);
+	}
+
+	// answers with why, and closes the session once that's sent
+	void refuse(session_ptr const& s, std::string const& why) {
+		s->in.clear();
+		s->pending.clear();
+		s->exiting = true;
+		s->out += why;
+		s->out += '\n';
+		flush(s);
+	}
+
+	bool backlogged(session_ptr const& s) const {
+		return s->pending.size() >= max_backlog || s->out.size() >= max_unsent_bytes;
+	}
+
+	// reading while it's keeping up, and writing while output's waiting
+	void rewatch(session_ptr const& s) {
+		if (s->closed)
+			return;
+		unsigned events = (s->exiting || backlogged(s) ? 0 : EPOLLIN) | (s->writing ? EPOLLOUT : 0);
+		if (events != s->watched)
+			watch(s->fd, events, EPOLL_CTL_MOD);
+		s->watched = events;
+	}
+
+	// hands the session's next line to the pool, unless it already has one there
+	void schedule(session_ptr const& s) {
+		if (s->busy || s->closed || s->exiting || s->pending.empty()) {
+			rewatch(s);
+			return;
+		}
+
+		std::string line = s->pending.front();
+		s->pending.pop_front();
+
+		if (line == ":exit") {
+			s->exiting = true;
+			s->pending.clear();
+			flush(s);
+			return;
+		}
+
+		s->busy = true;
+		pool.submit(boost::bind(&server::evaluate, this, s, line));
+		rewatch(s);
+	}
+
+	// runs on a worker, collecting a step once it's done if a collection's due
+	void evaluate(session_ptr s, std::string const& line) {
+		std::string result;
+		{
+			gc::mutator_scope scope;
+			result = evaluate_line(line, s->env);
+		}
+		{
+			boost::mutex::scoped_lock l(completed_lock);
+			completed.push_back(completion(s, result));
+		}
+		boost::uint64_t one = 1;
+		ssize_t r = ::write(wakeup, &one, sizeof(one));
+		(void) r; // an overflowing counter still leaves the eventfd readable
+
+		gc::safepoint();
+	}
+
+	void drain_completions() {
+		boost::uint64_t count;
+		while (::read(wakeup, &count, sizeof(count)) > 0) {
+		}
+
+		std::deque<completion> done;
+		{
+			boost::mutex::scoped_lock l(completed_lock);
+			done.swap(completed);
+		}
+
+		for (std::deque<completion>::iterator it(done.begin()); it != done.end(); ++it) {
+			session_ptr s = it->s;
+			s->busy = false;
+			if (s->closed)
+				continue;
+
+			s->out += it->result;
+			s->out += '\n';
+			flush(s);
+			schedule(s);
+		}
+	}
+
+	void flush(session_ptr const& s) {
+		while (!s->out.empty()) {
+			ssize_t sent = ::send(s->fd, s->out.data(), s->out.size(), MSG_NOSIGNAL);
+			if (sent >= 0) {
+				s->out.erase(0, sent);
+			} else if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				s->writing = true;
+				rewatch(s);
+				return;
+			} else {
+				close(s);
+				return;
+			}
+		}
+
+		if (s->exiting && !s->busy) {
+			close(s);
+		} else if (s->writing) {
+			s->writing = false;
+			rewatch(s);
+		}
+	}
+
+	void close(session_ptr const& s) {
+		if (s->closed)
+			return;
+		s->closed = true;
+		::epoll_ctl(epoll, EPOLL_CTL_DEL, s->fd, NULL);
+		::close(s->fd);
+		sessions.erase(s->fd);
+	}
+
+	std::string path;
+	environment base;
+	gc::root<environment> base_root;
+
+	int listener;
+	int epoll;
+	int wakeup;
+	bool stopping;
+
+	std::map<int, session_ptr> sessions;
+
+	boost::mutex completed_lock;
+	std::deque<completion> completed;
+
+	concurrency::thread_pool pool;
+};
+
+}
+
+int run_server(std::string const& socket_path, environment const& base, unsigned workers) {
+	try {
+		server_impl::server s(socket_path, base, workers);
+		s.listen();
+		std::cout << "Harkon listening on " << socket_path << " with " << workers << " workers" << std::endl;
+		s.run();
+	} catch (std::exception const& ex) {
+		std::cerr << "Server failed: " << ex.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+}
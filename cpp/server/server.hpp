@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+
+#include "../object.hpp"
+
+namespace harkon {
+
+// Serves REPL sessions over a unix domain socket. Every connection gets its own
+// copy of `base` (an O(1) copy, the map is persistent) and each line it sends is
+// evaluated on a worker from the pool, with the printed result written back as a
+// single line. Sessions are evaluated one line at a time, in order.
+int run_server(std::string const& socket_path, environment const& base, unsigned workers);
+
+}
@@ -1,8 +1,23 @@
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <unordered_map>
+
+#include <boost/lexical_cast.hpp>
 
 #include "../persistent/list.hpp"
 #include "../persistent/string.hpp"
 #include "../persistent/map.hpp"
+#include "../numeric/bigint.hpp"
+#include "../printer/printer.hpp"
+#include "../codec/codec.hpp"
+#include "../codec/module_cache.hpp"
+#include "../image/image.hpp"
+#include "../reader/source_span.hpp"
+#include "../interpretter/machine.hpp"
+#include "../compiler/runtime.hpp"
+#include "../reader/parser.cc"
+#include "../server/server.cc"
 
 void require(bool cond) {
     if (!cond) {
@@ -16,6 +31,80 @@ void string_test() {
     persistent::string str2("Little");
 
     require(str + str2 == persistent::string("ChickenLittle"));
+
+    // equal contents hash the same wherever they live, at every length the hash special cases
+    std::string long_text(200, 'x');
+    for (unsigned len(0); len < long_text.size(); ++len) {
+        long_text[len] = char('a' + len % 26);
+        persistent::string a(long_text.c_str(), len);
+        persistent::string b(persistent::string::MakeCopy(), long_text.c_str(), len);
+        require(a.hash() == b.hash());
+        require(a == b);
+        if (len > 0)
+            require(a != persistent::string(long_text.c_str(), len - 1));
+    }
+    require(persistent::string("Chicken").hash() != persistent::string("Chicken!").hash());
+
+    // short strings are kept inline, so copying one doesn't allocate
+    alloc_stats::snapshot before = alloc_stats::take();
+    persistent::string small(persistent::string::MakeCopy(), "fifteen bytes!!", 15);
+    persistent::string joined = small + persistent::string("");
+    require(alloc_stats::diff(before, alloc_stats::take()).empty());
+    require(joined == small);
+    require(::strcmp(joined.c_str(), "fifteen bytes!!") == 0);
+
+    persistent::string big = small + persistent::string("!");
+    require(big.size() == 16);
+    require(::strcmp(big.c_str(), "fifteen bytes!!!") == 0);
+
+    // ordering and equality go by the length, not a terminator
+    persistent::string nul_a("a\0b", 3), nul_c("a\0c", 3);
+    require(nul_a != nul_c);
+    require(nul_a < nul_c);
+    require(persistent::string("ab") < persistent::string("abc"));
+    require(persistent::string("abd") > persistent::string("abc"));
+    require(persistent::string("abc").compareTo(persistent::string("abc")) == 0);
+}
+
+void rope_test() {
+    using persistent::string;
+
+    // build a long string a piece at a time, in both directions
+    std::string expected;
+    string built("");
+    for (int i(0); i < 5000; ++i) {
+        std::string piece = boost::lexical_cast<std::string>(i) + ",";
+        string p(string::MakeCopy(), piece.c_str(), piece.size());
+        if (i % 3 == 0) {
+            built = p + built;
+            expected = piece + expected;
+        } else {
+            built = built + p;
+            expected += piece;
+        }
+    }
+    require(built.size() == expected.size());
+    require(built.depth() < 32); // balanced
+    require(built.at(0) == expected[0]);
+    require(built.at(12345) == expected[12345]);
+    require(built.at(expected.size() - 1) == expected[expected.size() - 1]);
+
+    string sub = built.substr(1000, 10000);
+    require(std::string(sub.c_str(), sub.size()) == expected.substr(1000, 10000));
+    string sub_sub = sub.substr(5, 3000);
+    require(sub_sub.at(2999) == expected[1000 + 5 + 2999]);
+
+    // a rope and a flat string with the same contents are the same string
+    string flat(string::MakeCopy(), expected.c_str(), expected.size());
+    require(built == flat);
+    require(built.hash() == flat.hash());
+    require(std::string(built.c_str()) == expected);
+
+    // a big flat string is sliced, rather than copied
+    string slice = flat.substr(3, 20000);
+    require(slice.depth() == 0);
+    require(slice.at(0) == expected[3]);
+    require(slice == string(string::MakeCopy(), expected.c_str() + 3, 20000));
 }
 
 void map_test() {
@@ -38,6 +127,171 @@ void map_test() {
     require(*phm3.find("tiger") == 1337);
 }
 
+// a key with only three hashes, so maps of them are mostly collision nodes
+struct clashing {
+    clashing(int v) :
+            v(v) {
+    }
+    bool operator==(clashing const& other) const {
+        return v == other.v;
+    }
+    bool operator<(clashing const& other) const {
+        return v < other.v;
+    }
+    int v;
+};
+
+std::size_t hash_value(clashing const& c) {
+    return c.v % 3;
+}
+
+int key_value(int k) {
+    return k;
+}
+
+int key_value(clashing const& k) {
+    return k.v;
+}
+
+void map_iteration_test() {
+    typedef persistent::map<int, int> map;
+    typedef persistent::map<clashing, int> clash_map;
+
+    clash_map m;
+    require(m.size() == 0);
+    require(m.begin() == m.end());
+
+    for (int i(0); i < 7; ++i) {
+        m.insert(clashing(i * 10), i);
+    }
+    require(m.size() == 7);
+
+    m.insert(clashing(10), 99); // replaces, so the size stays put
+    m.insert(clashing(40), 99);
+    require(m.size() == 7);
+    require(*m.find(clashing(40)) == 99);
+    require(m.find(clashing(41)) == NULL);
+
+    std::size_t seen = 0;
+    int key_sum = 0;
+    for (clash_map::const_iterator it(m.begin()); it != m.end(); ++it) {
+        ++seen;
+        key_sum += it.key().v;
+        require(*m.find(it.key()) == it.value());
+    }
+    require(seen == 7);
+    require(key_sum == 210);
+
+    clash_map more = clash_map().new_insert(clashing(20), -20).new_insert(clashing(1000), -1000);
+    clash_map both = m.new_merge(more);
+    require(both.size() == 8);
+    require(*both.find(clashing(20)) == -20);
+    require(*both.find(clashing(30)) == 3);
+
+    map big;
+    for (int i(0); i < 5000; ++i) {
+        big.insert(i * 7919, i);
+    }
+    require(big.size() == 5000);
+
+    map other;
+    for (int i(4000); i < 6000; ++i) {
+        other.insert(i * 7919, -i);
+    }
+    map merged = big.new_merge(other);
+    require(merged.size() == 6000);
+    require(*merged.find(4500 * 7919) == -4500); // the right hand side wins
+}
+
+void parallel_merge_test() {
+    typedef persistent::map<int, int> map;
+
+    // big enough that every slot under the root is over the parallel threshold
+    map left, right;
+    for (int i(0); i < 300000; ++i) {
+        left.insert(i, i);
+        right.insert(i + 200000, -i);
+    }
+
+    concurrency::thread_pool pool(4);
+    map merged = left.new_merge(right, pool);
+    require(merged.size() == 500000);
+    require(*merged.find(0) == 0);
+    require(*merged.find(250000) == -50000);
+    require(*merged.find(499999) == -299999);
+
+    std::size_t seen = 0;
+    for (map::const_iterator it(merged.begin()); it != merged.end(); ++it) {
+        ++seen;
+    }
+    require(seen == 500000);
+
+    // in a region it's merged on this thread alone, so the heap gets none of it
+    gc::root<map> left_root(left), right_root(right), merged_root(merged);
+    gc::collect();
+    unsigned long long freed = gc::stats().freed_bytes;
+    {
+        gc::region r;
+        require(left.new_merge(right, pool).size() == 500000);
+    }
+    gc::collect();
+    require(gc::stats().freed_bytes == freed);
+}
+
+// random inserts and erases against std::unordered_map
+template<typename Key>
+void random_erase_run() {
+    typedef persistent::map<Key, int> map;
+
+    map m;
+    std::unordered_map<int, int> expected;
+    unsigned seed = 12345;
+    for (int step(0); step < 40000; ++step) {
+        seed = seed * 1103515245 + 12345;
+        int key = (seed >> 8) % 2048;
+
+        if ((seed >> 4) % 3 == 0) {
+            m.erase(key);
+            expected.erase(key);
+        } else {
+            m.insert(key, step);
+            expected[key] = step;
+        }
+
+        require(m.size() == expected.size());
+        if (step % 1000 == 0) {
+            for (std::unordered_map<int, int>::const_iterator it(expected.begin()); it != expected.end(); ++it) {
+                require(m.find(it->first) != NULL && *m.find(it->first) == it->second);
+            }
+            std::size_t seen = 0;
+            for (typename map::const_iterator it(m.begin()); it != m.end(); ++it) {
+                require(expected.count(key_value(it.key())) == 1);
+                ++seen;
+            }
+            require(seen == expected.size());
+        }
+    }
+
+    for (std::unordered_map<int, int>::const_iterator it(expected.begin()); it != expected.end(); ++it) {
+        m.erase(it->first);
+    }
+    require(m.empty());
+}
+
+void erase_test() {
+    typedef persistent::map<int, int> map;
+
+    map m = map().new_insert(1, 1).new_insert(2, 2);
+    map without = m.new_erase(1);
+    require(without.find(1) == NULL);
+    require(*without.find(2) == 2);
+    require(*m.find(1) == 1); // untouched
+    require(without.new_erase(2).empty());
+    require(without.new_erase(42).size() == 1);
+
+    random_erase_run<int>();
+    random_erase_run<clashing>();
+}
 
 void merge_test() {
     typedef persistent::map<std::string, int> map;
@@ -84,13 +338,1064 @@ void merge_test() {
 }
 
 
+void alloc_stats_test() {
+    alloc_stats::snapshot before = alloc_stats::take();
+    persistent::list<int> l = persistent::list<int>().new_push_front(1).new_push_front(2);
+    alloc_stats::snapshot d = alloc_stats::diff(before, alloc_stats::take());
+
+    require(d.size() == 1);
+    require(d[0].name == "list node");
+    require(d[0].count == 2);
+    require(l.size() == 2);
+}
+
+// run last, as it uses up the slots every type after it would have had
+void alloc_slots_test() {
+    for (unsigned i(0); i < alloc_stats::max_slots + 10; ++i) {
+        unsigned slot = alloc_stats::detail::register_slot("type " + boost::lexical_cast<std::string>(i));
+        require(slot < alloc_stats::max_slots);
+    }
+    require(alloc_stats::detail::register_slot("one more") == alloc_stats::max_slots - 1);
+    alloc_stats::snapshot all = alloc_stats::take();
+    require(all.size() <= alloc_stats::max_slots);
+}
+
+harkon::bigint power_of_ten(unsigned n) {
+    return harkon::bigint::parse(("1" + std::string(n, '0')).c_str(), n + 1);
+}
+
+void bigint_test() {
+    using harkon::bigint;
+
+    require(bigint(2147483647LL).fits_int());
+    require(!(bigint(2147483647LL) + bigint(1LL)).fits_int());
+    require(bigint(-2147483648LL).fits_int());
+    require((bigint(2147483647LL) + bigint(1LL)).to_string() == "2147483648");
+    require((bigint(5LL) - bigint(7LL)).to_string() == "-2");
+    require((bigint(-3LL) * bigint(4LL)).to_int() == -12);
+
+    std::string digits = "-123456789012345678901234567890";
+    require(bigint::parse(digits.c_str(), digits.size()).to_string() == digits);
+
+    // big enough to take the karatsuba path, and lopsided enough for the chunked one
+    require((power_of_ten(700) * power_of_ten(900)) == power_of_ten(1600));
+    require((power_of_ten(3000) * power_of_ten(400)) == power_of_ten(3400));
+
+    bigint nines = power_of_ten(800) - bigint(1LL);
+    require((nines * nines) == power_of_ten(1600) - power_of_ten(800) - power_of_ten(800) + bigint(1LL));
+}
+
+std::string printed(harkon::object const& o, harkon::print_options const& opts = harkon::print_options()) {
+    std::string s;
+    harkon::string_sink out(s);
+    harkon::print(o, out, opts);
+    return s;
+}
+
+void printer_test() {
+    using namespace harkon;
+
+    object_list l;
+    l = l.new_push_front(symbol("c"));
+    l = l.new_push_front(object_list());
+    l = l.new_push_front(string("b"));
+    l = l.new_push_front(1);
+    require(printed(l) == "(1 \"b\" () c)");
+    require(pretty_print(l) == printed(l));
+
+    print_options opts;
+    opts.max_length = 2;
+    require(printed(l, opts) == "(1 \"b\" ...)");
+
+    object_list inner = object_list().new_push_front(l);
+    object_list nested = object_list().new_push_front(inner);
+    opts = print_options();
+    opts.max_depth = 2;
+    require(printed(nested, opts) == "((...))");
+
+    // shared lists are labelled the first time round and referred to after
+    object_list pair = object_list().new_push_front(2).new_push_front(1);
+    object_list shared = object_list().new_push_front(pair).new_push_front(pair).new_push_front(pair);
+    opts = print_options();
+    opts.label_shared = true;
+    require(printed(shared, opts) == "(#0=(1 2) #0# #0#)");
+    require(printed(shared) == "((1 2) (1 2) (1 2))");
+
+    // nesting far deeper than the native stack would take
+    object deep = object_list();
+    for (unsigned i(0); i < 200000; ++i) {
+        deep = object_list(object_list().new_push_front(deep));
+    }
+    std::string s = printed(deep);
+    require(s.size() == 2 * 200001);
+    require(s[200000] == '(' && s[200001] == ')');
+}
+
+void codec_test() {
+    using namespace harkon;
+
+    std::string long_text(100, 'x');
+    object_list l;
+    l = l.new_push_front(make_integer(power_of_ten(30)));
+    l = l.new_push_front(string(long_text.c_str(), long_text.size()));
+    object_list inner = object_list().new_push_front(symbol("shared")).new_push_front(-70000);
+    l = l.new_push_front(inner);
+    l = l.new_push_front(nil());
+    l = l.new_push_front(boolean(true));
+    l = l.new_push_front(symbol("shared"));
+    l = l.new_push_front(123);
+
+    std::string buff = encode(l);
+    object back = decode(buff.data(), buff.size());
+    require(pretty_print(back) == pretty_print(l));
+    require(pretty_print(back) == "(123 shared #t NIL (-70000 shared) \"" + long_text + "\" 1" + std::string(30, '0') + ")");
+
+    // long strings are used where they are in the buffer
+    object_list const& decoded = boost::get<object_list>(back);
+    object_list::const_iterator it = decoded.begin();
+    for (unsigned i(0); i < 5; ++i) {
+        ++it;
+    }
+    char const* text = boost::get<string>(*it).c_str();
+    require(text >= buff.data() && text < buff.data() + buff.size());
+
+    std::vector<object> forms;
+    forms.push_back(1);
+    forms.push_back(symbol("a"));
+    forms.push_back(object_list());
+    std::string all = encode_all(forms);
+    std::vector<object> forms_back = decode_all(all.data(), all.size());
+    require(forms_back.size() == 3);
+    require(pretty_print(forms_back[1]) == "a" && pretty_print(forms_back[2]) == "()");
+
+    bool threw = false;
+    try {
+        decode(buff.data(), buff.size() - 1);
+    } catch (codec_error const&) {
+        threw = true;
+    }
+    require(threw);
+
+    std::string bad_version(buff);
+    bad_version[4] = 99;
+    threw = false;
+    try {
+        decode(bad_version.data(), bad_version.size());
+    } catch (codec_error const&) {
+        threw = true;
+    }
+    require(threw);
+}
+
+harkon::object form(harkon::object a, harkon::object b, harkon::object c) {
+    return harkon::object_list(harkon::object_list().new_push_front(c).new_push_front(b).new_push_front(a));
+}
+
+harkon::object_list form(harkon::object a, harkon::object b) {
+    return harkon::object_list().new_push_front(b).new_push_front(a);
+}
+
+void closure_test() {
+    using namespace harkon;
+
+    // closures and builtins are small enough to be held in place
+    require(sizeof(lambda_closure) <= object_proc::inline_capacity);
+    require(sizeof(builtin_func) <= object_proc::inline_capacity);
+
+    environment env = create_new_environment();
+    symbol lambda("lambda"), a("a"), b("b");
+
+    // ((lambda (a) (lambda (b) (add a b))) 5)
+    object inner = form(lambda, object_list(object_list().new_push_front(b)), form(symbol("add"), a, b));
+    object outer = form(lambda, object_list(object_list().new_push_front(a)), inner);
+    object adder = eval(form(outer, 5), env);
+
+    object_proc const& add5 = boost::get<object_proc>(adder);
+    lambda_closure const* closure = add5.target<lambda_closure>();
+    require(closure != NULL);
+    require(closure->code->captures.size() == 1 && closure->code->captures[0] == a);
+    require(add5.target<builtin_func>() == NULL);
+
+    // a caller's own `a` doesn't get in the way of the captured one
+    environment caller = env.new_insert(a, 100);
+    require(pretty_print(add5(form(adder, 10), caller)) == "15");
+
+    // and it survives being encoded
+    std::string buff = encode(adder);
+    object back = decode(buff.data(), buff.size());
+    require(pretty_print(boost::get<object_proc>(back)(form(back, 1), env)) == "6");
+
+    // copies share nothing they shouldn't
+    object_proc copy(add5);
+    copy = boost::get<object_proc>(back);
+    require(copy.target<lambda_closure>() != NULL);
+}
+
+void error_test() {
+    using namespace harkon;
+
+    environment env = create_new_environment();
+
+    // (if v 1 2), with v bound to a long list rather than a boolean
+    object_list big;
+    for (int i(0); i < 1000; ++i) {
+        big = big.new_push_front(i);
+    }
+    env.insert("v", object_list(big));
+    object_list test = object_list().new_push_front(2).new_push_front(1).new_push_front(symbol("v")).new_push_front(
+            symbol("if"));
+
+    eval_result r = try_eval(object_list(test), env);
+    require(!r.ok());
+    require(r.error->kind == unexpected_type);
+    require(::strcmp(r.error->expected, "boolean") == 0);
+    require(!r.error->span());
+
+    // only printed when asked, and then only enough of it to recognise
+    std::string message = r.error->what();
+    require(message.compare(0, 12, "Unexpected (") == 0);
+    require(message.size() < 100);
+
+    r = try_eval(form(symbol("add"), 1), env);
+    require(r.ok() && pretty_print(r.value) == "1");
+
+    r = try_eval(symbol("nowhere"), env);
+    require(!r.ok() && r.error->kind == unresolved_symbol);
+    require(std::string(r.error->what()) == "Unable to resolve symbol: nowhere");
+
+    // the reader's spans: comments and strings don't open lists, and lines count from 1
+    std::string text = "; (not a list\n(a \"(\\\"\" (b)\n  (c d))";
+    std::vector<source_span> spans = list_spans(text);
+    require(spans.size() == 3);
+    require(spans[0].line == 2 && spans[0].column == 1 && spans[0].offset == 14);
+    require(spans[0].offset + spans[0].length == text.size());
+    require(spans[1].line == 2 && spans[1].column == 10 && spans[1].length == 3);
+    require(spans[2].line == 3 && spans[2].column == 3);
+
+    // and errors evaluating something read say where it was
+    std::vector<object> forms(1, object_list(test));
+    std::vector<source_span> one_span(1);
+    one_span[0].line = 7;
+    one_span[0].column = 3;
+    record_spans(forms, one_span);
+    require(find_span(test) && !find_span(big));
+
+    r = try_eval(object_list(test), env);
+    require(!r.ok() && r.error->span() && r.error->span()->line == 7 && r.error->span()->column == 3);
+
+    // if the spans don't line up with the forms, none are kept
+    std::vector<object> two(2, object_list(big));
+    record_spans(two, one_span);
+    require(!find_span(big));
+}
+
+void gc_test() {
+    using namespace harkon;
+
+    environment env = create_new_environment();
+    gc::root<environment> env_root(env);
+
+    // strings the collector made, long enough not to be inline, and ropes of them
+    std::string text(100, 'g');
+    string owned(string::MakeCopy(), text.c_str(), text.size());
+    env.insert("s", owned);
+    env.insert("rope", string(owned + owned + owned));
+    env.insert("big", bigint::parse("123456789012345678901234567890", 30));
+
+    // a closure over a captured value
+    symbol lambda("lambda"), a("a"), b("b");
+    object inner = form(lambda, object_list(object_list().new_push_front(b)), form(symbol("add"), a, b));
+    object outer = form(lambda, object_list(object_list().new_push_front(a)), inner);
+    env.insert("adder", eval(form(outer, 40), env));
+
+    // and collision nodes, whose entries are blocks of their own
+    typedef persistent::map<clashing, object> clash_map;
+    clash_map clashes;
+    gc::root<clash_map> clashes_root(clashes);
+    for (int i(0); i < 20; ++i) {
+        clashes.insert(clashing(i), object_list(object_list().new_push_front(i)));
+    }
+
+    // a span for a list that's kept, and one for a list that isn't
+    object_list kept = form(a, b);
+    gc::root<object_list> kept_root(kept);
+    std::vector<object> forms(1, object_list(kept));
+    forms.push_back(object_list(form(b, a)));
+    record_spans(forms, std::vector<source_span>(2));
+    forms.clear();
+    std::size_t spans_before = source_span_impl::spans().size();
+
+    gc::statistics before = gc::stats();
+    for (int i(0); i < 10000; ++i) {
+        object_list junk = object_list().new_push_front(i).new_push_front(owned);
+        env.new_insert("junk", junk);
+    }
+    gc::collect();
+    gc::statistics after = gc::stats();
+    require(after.cycles == before.cycles + 1);
+    require(after.freed_blocks >= before.freed_blocks + 20000);
+
+    // nothing reachable went, so collecting again frees nothing
+    gc::collect();
+    require(gc::stats().freed_blocks == after.freed_blocks);
+    require(gc::stats().live_bytes == after.live_bytes);
+
+    require(*boost::get<string>(env.find("s")) == owned);
+    require(boost::get<string>(*env.find("rope")).size() == 300);
+    require(boost::get<string>(*env.find("rope")).c_str() == text + text + text);
+    require(boost::get<bigint>(*env.find("big")).to_string() == "123456789012345678901234567890");
+    object adder = *env.find("adder");
+    require(pretty_print(boost::get<object_proc>(adder)(form(adder, 2), env)) == "42");
+    for (int i(0); i < 20; ++i) {
+        require(boost::get<object_list>(*clashes.find(clashing(i))).front() == object(i));
+    }
+
+    require(find_span(kept).is_initialized());
+    require(source_span_impl::spans().size() < spans_before);
+
+    // collecting as it goes, a step at a time, the heap stays put
+    gc::options small;
+    small.min_heap = 64 << 10;
+    small.step_budget = 500;
+    gc::configure(small);
+
+    std::size_t most = 0;
+    for (int i(0); i < 2000; ++i) {
+        {
+            gc::mutator_scope scope;
+            object_list junk;
+            for (int j(0); j < 50; ++j) {
+                junk = junk.new_push_front(string(owned + owned));
+            }
+            env.insert("junk", junk);
+        }
+        gc::safepoint();
+        most = std::max(most, gc::stats().live_bytes);
+    }
+    require(gc::stats().cycles > after.cycles + 10);
+    require(most < after.live_bytes + (256 << 10));
+    require(pretty_print(boost::get<object_proc>(adder)(form(adder, 2), env)) == "42");
+
+    gc::configure(gc::options());
+}
+
+void region_test() {
+    using namespace harkon;
+
+    environment env = create_new_environment();
+    gc::root<environment> env_root(env);
+
+    std::string text(40, 'r');
+    symbol lambda("lambda"), a("a"), b("b");
+    object_list kept, dropped;
+    gc::statistics before = gc::stats();
+    {
+        gc::region r;
+        require(r.active());
+
+        // junk the region throws away, and values that env keeps
+        for (int i(0); i < 1000; ++i) {
+            env.new_insert("junk", object_list(object_list().new_push_front(i)));
+        }
+        string owned(string::MakeCopy(), text.c_str(), text.size());
+        env.insert("s", owned);
+        env.insert("rope", string(owned + owned));
+        env.insert("big", bigint::parse("123456789012345678901234567890", 30));
+        object inner = form(lambda, object_list(object_list().new_push_front(b)), form(symbol("add"), a, b));
+        object outer = form(lambda, object_list(object_list().new_push_front(a)), inner);
+        env.insert("adder", eval(form(outer, 40), env));
+
+        // spans follow the lists that are promoted
+        kept = form(a, b);
+        dropped = form(b, a);
+        std::vector<object> forms(1, object_list(kept));
+        forms.push_back(object_list(dropped));
+        record_spans(forms, std::vector<source_span>(2));
+        env.insert("kept", kept);
+        {
+            gc::region nested;
+            require(!nested.active());
+        }
+
+        r.promote(env);
+        require(r.promoted_bytes() > 0);
+        require(r.promoted_bytes() * 4 < r.allocated_bytes());
+        kept = boost::get<object_list>(*env.find("kept"));
+    }
+    gc::statistics after = gc::stats();
+    require(after.regions == before.regions + 1);
+    require(after.promoted_bytes > before.promoted_bytes);
+    require(find_span(kept).is_initialized());
+
+    // another region reuses the arena, over whatever the first one left
+    {
+        gc::region r;
+        for (int i(0); i < 1000; ++i) {
+            env.new_insert("junk", string(string::MakeCopy(), text.c_str(), text.size()));
+        }
+    }
+    gc::collect();
+    require(boost::get<string>(*env.find("s")).c_str() == text);
+    require(boost::get<string>(*env.find("rope")).c_str() == text + text);
+    require(boost::get<bigint>(*env.find("big")).to_string() == "123456789012345678901234567890");
+    object adder = *env.find("adder");
+    require(pretty_print(boost::get<object_proc>(adder)(form(adder, 2), env)) == "42");
+    require(pretty_print(*env.find("kept")) == "(a b)");
+
+    // an error's offending value is promoted with it
+    object rope = form(symbol("concat"), string(text.c_str()), string(text.c_str()));
+    object test = object_list(object_list().new_push_front(2).new_push_front(1).new_push_front(rope).new_push_front(
+            symbol("if")));
+    std::vector<object> read(1, test);
+    std::vector<source_span> spans(2);
+    spans[0].line = 5;
+    spans[1].line = 6;
+    record_spans(read, spans);
+    eval_result failed = eval_in_region(test, env);
+    require(!failed.ok());
+    require(boost::get<string>(failed.error->offending).c_str() == text + text);
+    gc::collect();
+    require(failed.error->span() && failed.error->span()->line == 5);
+    require(pretty_print(eval_in_region(form(adder, 2), env).value) == "42");
+}
+
+void machine_test() {
+    using namespace harkon;
+
+    environment env = create_new_environment();
+    symbol lambda("lambda"), add("add"), n("n"), h("h"), a("a"), b("b");
+
+    // (def h (lambda (n) (if (eq n 0) 0 (add 1 (h (add n -1)))))), which recurses n deep
+    object recurse = object_list(form(h, form(add, n, -1)));
+    object test = object_list(object_list().new_push_front(form(add, 1, recurse)).new_push_front(0).new_push_front(
+            form(symbol("eq"), n, 0)).new_push_front(symbol("if")));
+    object def = form(symbol("def"), h, form(lambda, object_list(object_list().new_push_front(n)), test));
+    require(pretty_print(machine_eval(def, env)) == "NIL");
+    require(pretty_print(machine_eval(object_list(form(h, 1000)), env)) == "1000");
+    require(pretty_print(eval(object_list(form(h, 1000)), env)) == "1000");
+
+    // deeper than eval could go on the native stack
+    require(pretty_print(machine_eval(object_list(form(h, 200000)), env)) == "200000");
+
+    // closures, captures and their frames
+    object inner = form(lambda, object_list(object_list().new_push_front(b)), form(add, a, b));
+    object outer = form(lambda, object_list(object_list().new_push_front(a)), inner);
+    object adder = machine_eval(form(outer, 40), env);
+    require(pretty_print(machine_eval(object_list(form(adder, 2)), env)) == "42");
+    require(pretty_print(machine_eval(form(symbol("eq"), 1, 1), env)) == "#t");
+    require(pretty_print(machine_eval(form(symbol("concat"), string("ab"), string("cd")), env)) == "\"abcd\"");
+
+    // errors are the ones eval would throw, from the same form
+    eval_result r = try_eval(object_list(form(h, string("x"))), env, &machine_eval);
+    require(!r.ok() && r.error->kind == unexpected_type);
+    require(pretty_print(r.error->offending) == "\"x\"");
+    require(form_scope::innermost() == NULL);
+
+    object_list bad = form(symbol("if"), 1);
+    std::vector<object> forms(1, object_list(bad));
+    std::vector<source_span> one_span(1);
+    one_span[0].line = 3;
+    record_spans(forms, one_span);
+    r = try_eval(object_list(bad), env, &machine_eval);
+    require(!r.ok() && r.error->kind == bad_form && r.error->span() && r.error->span()->line == 3);
+}
+
+// every item of s, each followed by a |
+std::string drain(io::stream & s) {
+    std::string out;
+    char const* data;
+    std::size_t size;
+    while (s.next(data, size)) {
+        out.append(data, size);
+        out += '|';
+    }
+    return out;
+}
+
+int temp_file(std::string const& contents) {
+    char path[] = "/tmp/harkon_stream_XXXXXX";
+    int fd = ::mkstemp(path);
+    require(fd != -1);
+    ::unlink(path);
+    require(::write(fd, contents.data(), contents.size()) == ssize_t(contents.size()));
+    ::lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+void write_numbers(int fd, int n) {
+    for (int i(0); i < n; ++i) {
+        std::string line = boost::lexical_cast<std::string>(i) + "\n";
+        require(::write(fd, line.data(), line.size()) == ssize_t(line.size()));
+    }
+    ::close(fd);
+}
+
+void stream_test() {
+    using namespace harkon;
+
+    // buffers smaller than the lines, so most of them span a few
+    std::string text = "first line\n\na much longer line than the buffer\nno newline";
+    {
+        io::stream s(temp_file(text), true, io::stream::lines, 0, 7, 1);
+        require(drain(s) == "first line||a much longer line than the buffer|no newline|");
+        char const* data;
+        std::size_t size;
+        require(!s.next(data, size));
+    }
+    {
+        io::stream s(temp_file(text), true, io::stream::chunks, 20, 7, 2);
+        require(drain(s) == "first line\n\na much l|onger line than the |buffer\nno newline|");
+    }
+    {
+        io::stream s(temp_file(""), true, io::stream::lines);
+        require(drain(s).empty());
+    }
+
+    // from a pipe, which is polled and handed over as it arrives
+    int fds[2];
+    require(::pipe(fds) == 0);
+    boost::thread writer(boost::bind(&write_numbers, fds[1], 1000));
+    {
+        io::stream s(fds[0], true, io::stream::lines, 0, 64, 2);
+        char const* data;
+        std::size_t size;
+        int expected = 0;
+        while (s.next(data, size)) {
+            require(std::string(data, size) == boost::lexical_cast<std::string>(expected++));
+        }
+        require(expected == 1000);
+    }
+    writer.join();
+
+    // and from wisp
+    environment env = create_new_environment();
+    int fd = temp_file(text);
+    env.insert("s", object_proc(stream_ref(new io::stream(fd, true, io::stream::lines))));
+    object next = form(symbol("next"), symbol("s"));
+    require(pretty_print(eval(next, env)) == "\"first line\"");
+    require(pretty_print(eval(next, env)) == "\"\"");
+    require(pretty_print(eval(object_list(object_list().new_push_front(symbol("s"))), env)) == "\"a much longer line than the buffer\"");
+    require(pretty_print(eval(next, env)) == "\"no newline\"");
+    require(pretty_print(eval(next, env)) == "#f");
+    require(!try_eval(form(symbol("next"), 3), env).ok());
+
+    // what can't be opened or read is an eval error, keeping the errno
+    eval_result missing = try_eval(form(symbol("open-lines"), string("/nonexistent/file")), env);
+    require(!missing.ok() && missing.error->kind == io_failure);
+    require(std::string(missing.error->what()) == "Unable to open \"/nonexistent/file\": No such file or directory");
+    require(pretty_print(missing.error->offending) == "(\"/nonexistent/file\" " + boost::lexical_cast<std::string>(ENOENT) + ")");
+    env.insert("dir", eval(form(symbol("open-lines"), string("/tmp")), env));
+    eval_result unreadable = try_eval(form(symbol("next"), symbol("dir")), env);
+    require(!unreadable.ok() && unreadable.error->kind == io_failure);
+    require(std::string(unreadable.error->what()) == "Unable to read \"/tmp\": Is a directory");
+
+    // nor can stdin be read while it's someone else's
+    io::stdin_reserved() = true;
+    eval_result reserved = try_eval(object_list(object_list().new_push_front(symbol("stdin-lines"))), env);
+    io::stdin_reserved() = false;
+    require(!reserved.ok() && reserved.error->kind == bad_form);
+}
+
+// what the traced builtin has been called with, in order
+std::string traced;
+
+harkon::object builtin_traced(harkon::object_list const& args, harkon::environment & env) {
+    harkon::object o = harkon::eval(*(args.begin() + 1), env);
+    traced += harkon::pretty_print(o);
+    return o;
+}
+
+void sequence_test() {
+    using namespace harkon;
+
+    environment env = create_new_environment();
+    gc::root<environment> env_root(env);
+    env.insert("traced", object_proc(&builtin_traced));
+    symbol lambda("lambda"), x("x"), map("map"), range("range"), traced_sym("traced");
+    object square = form(lambda, object_list(object_list().new_push_front(x)), form(symbol("mul"), x, x));
+    object not3 = object_list(object_list().new_push_front(symbol("#t")).new_push_front(symbol("#f")).new_push_front(
+            form(symbol("eq"), x, 3)).new_push_front(symbol("if")));
+    object keep = form(lambda, object_list(object_list().new_push_front(x)), not3);
+
+    // each stage extends the one pipeline, and an element goes all the way
+    // through it before the next is pulled
+    object traced_twice = form(map, traced_sym, form(map, traced_sym, form(range, 0, 3)));
+    object s = eval(traced_twice, env);
+    sequence const* seq = boost::get<object_proc>(s).target<sequence>();
+    require(seq != NULL && seq->code->type == sequence_code::range_source && seq->code->stages.size() == 2);
+    require(traced.empty());
+    require(pretty_print(eval(form(symbol("to-list"), s), env)) == "(0 1 2)");
+    require(traced == "001122");
+
+    // only as much is pulled as is taken, from however long a source
+    traced.clear();
+    object first = form(symbol("take"), 2, form(map, traced_sym, form(range, 0, 1000000000)));
+    require(pretty_print(eval(form(symbol("to-list"), first), env)) == "(0 1)");
+    require(traced == "01");
+
+    env.insert("squares", eval(form(map, square, form(symbol("filter"), keep, form(range, 0, 6))), env));
+    require(pretty_print(eval(form(symbol("to-list"), symbol("squares")), env)) == "(0 1 4 16 25)");
+    object sum = object_list(object_list().new_push_front(symbol("squares")).new_push_front(0).new_push_front(symbol(
+            "add")).new_push_front(symbol("fold")));
+    require(pretty_print(eval(sum, env)) == "46");
+
+    // zipped elements are the next procedure's arguments, or lists
+    object zipped = form(symbol("zip"), form(range, 0, 3), symbol("squares"));
+    require(pretty_print(eval(form(symbol("to-list"), zipped), env)) == "((0 0) (1 1) (2 4))");
+    require(pretty_print(eval(form(symbol("to-list"), form(map, symbol("add"), zipped)), env)) == "(0 2 6)");
+
+    // over a list and a stream
+    env.insert("listed", eval(form(symbol("to-list"), form(range, 5, 8)), env));
+    object listed = form(map, square, symbol("listed"));
+    require(pretty_print(eval(form(symbol("to-list"), listed), env)) == "(25 36 49)");
+    env.insert("lines", object_proc(stream_ref(new io::stream(temp_file("a\nbb\nccc\n"), true, io::stream::lines))));
+    object lengths = form(map, symbol("str-length"), symbol("lines"));
+    require(pretty_print(eval(form(symbol("to-list"), lengths), env)) == "(1 2 3)");
+    require(pretty_print(eval(form(symbol("next"), symbol("lines")), env)) == "#f");
+
+    // a stage's procedure is checked when it's added, what it returns when it's run
+    require(!try_eval(form(map, 5, form(range, 0, 3)), env).ok());
+    require(!try_eval(form(symbol("take"), -1, form(range, 0, 3)), env).ok());
+    require(!try_eval(form(map, square, 7), env).ok());
+    object bad_filter = form(symbol("filter"), square, form(range, 0, 3));
+    require(try_eval(bad_filter, env).ok());
+    require(!try_eval(form(symbol("to-list"), bad_filter), env).ok());
+
+    // made in a region, and still good once it's gone
+    {
+        gc::mutator_scope scope;
+        require(eval_in_region(form(symbol("def"), symbol("kept"), form(map, square, form(range, 0, 4))), env).ok());
+    }
+    gc::collect();
+    require(pretty_print(eval(form(symbol("to-list"), symbol("kept")), env)) == "(0 1 4 9)");
+
+    // fused at compile time, as compiler.hpp writes it, over a sequence fused at runtime
+    object squares = *env.find("squares");
+    object folded = rt::fold<rt::taken<rt::mapped<rt::source> > >(env, { rt::proc(*env.find("add")), 0, rt::count(3),
+            rt::proc(eval(square, env)), squares });
+    require(pretty_print(folded) == "17");
+    object some = eval(form(symbol("to-list"), form(range, 2, 5)), env);
+    require(pretty_print(rt::to_list<rt::filtered<rt::source> >(env, { rt::proc(eval(keep, env)), some })) == "(2 4)");
+}
+
+// n int32s spread over the whole range, so sums and products overflow plenty
+harkon::packed spread(unsigned n, unsigned seed) {
+    harkon::packed p(harkon::packed::int32, n);
+    boost::uint32_t x = seed;
+    for (unsigned i(0); i < n; ++i) {
+        x = x * 1664525u + 1013904223u;
+        p.data<boost::int32_t>()[i] = boost::int32_t(x);
+    }
+    return p;
+}
+
+void packed_test() {
+    using namespace harkon;
+
+    // every build of the kernels this CPU runs agrees, over lengths that leave a
+    // ragged end for each width
+    packed a = spread(1003, 1), b = spread(1003, 2), small = spread(5, 3);
+    gc::root<packed> a_root(a), b_root(b), small_root(small);
+    std::vector<packed_impl::kernels const*> builds = packed_impl::supported();
+    std::vector<std::string> answers;
+    for (std::size_t i(0); i < builds.size(); ++i) {
+        require(use_packed_kernels(builds[i]->name) && std::string(packed_kernels()) == builds[i]->name);
+        std::ostringstream out;
+        packed sum, product, wider;
+        require(packed_add(a, b, sum) && packed_mul(a, b, product) && packed_add(packed_widen(a), b, wider));
+        __int128 dot;
+        require(packed_dot(a, b, dot));
+        out << pretty_print(sum) << pretty_print(product) << pretty_print(wider) << wide_bigint(packed_sum(a)).to_string()
+                << wide_bigint(packed_sum(product)).to_string() << wide_bigint(dot).to_string() << packed_extreme(a, false)
+                << packed_extreme(small, true) << pretty_print(packed_compare(a, b, false))
+                << pretty_print(packed_compare(a, a, true));
+        answers.push_back(out.str());
+        require(answers[i] == answers[0]);
+    }
+    require(!use_packed_kernels("mmx"));
+    use_packed_kernels(builds[0]->name);
+
+    // int32s that overflow come back wider, exactly
+    long long expected = 0;
+    for (unsigned i(0); i < a.size(); ++i) {
+        expected += a.at(i);
+    }
+    require(packed_sum(a) == expected);
+    packed sum;
+    require(packed_add(a, b, sum) && sum.type() == packed::int64 && sum.at(7) == a.at(7) + b.at(7));
+    require(sum == packed_widen(sum) && !(sum == packed_widen(a)));
+
+    environment env = create_new_environment();
+    gc::root<environment> env_root(env);
+    symbol add("add"), mul("mul"), range("range"), xs("xs");
+    env.insert("xs", eval(form(symbol("pack32"), form(range, 0, 20)), env));
+    require(pretty_print(eval(form(symbol("sum"), xs), env)) == "190");
+    require(pretty_print(eval(form(add, xs, 1), env)) == "#i32(1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20)");
+    require(pretty_print(eval(form(mul, xs, bigint(3000000000LL)), env)).compare(0, 20, "#i64(0 3000000000 60") == 0);
+    require(pretty_print(eval(form(symbol("dot"), xs, xs), env)) == "2470");
+    require(pretty_print(eval(form(symbol("max"), form(mul, xs, -1)), env)) == "0");
+    require(pretty_print(eval(form(symbol("sum"), form(symbol("mask-lt"), xs, 5)), env)) == "5");
+    require(pretty_print(eval(form(symbol("mask-eq"), form(symbol("pack64"), form(range, 0, 3)), form(symbol("pack32"),
+            form(range, 0, 3))), env)) == "#i32(1 1 1)");
+    require(pretty_print(eval(form(symbol("to-list"), form(symbol("take"), 3, xs)), env)) == "(0 1 2)");
+
+    // mismatched lengths, and int64s that overflow, are errors
+    require(!try_eval(form(add, xs, form(symbol("pack32"), form(range, 0, 3))), env).ok());
+    object huge = form(mul, form(symbol("pack64"), form(range, 1, 3)), power_of_ten(18));
+    require(pretty_print(eval(huge, env)) == "#i64(1" + std::string(18, '0') + " 2" + std::string(18, '0') + ")");
+    require(!try_eval(form(mul, huge, 10), env).ok());
+    require(!try_eval(form(symbol("pack32"), 5), env).ok());
+
+    // kept across a collection, and encoded
+    gc::collect();
+    std::string encoded = encode(*env.find("xs"));
+    require(decode(encoded.data(), encoded.size()) == *env.find("xs"));
+}
+
+void bytes_test() {
+    using namespace harkon;
+
+    char path[] = "/tmp/harkon_bytes_XXXXXX";
+    int fd = ::mkstemp(path);
+    require(fd != -1);
+    std::string contents("GET /a HTTP/1.1\r\nHost: x\r\n\r\n\x01\x02\x03\x04\xfe\xff\xff\xff", 36);
+    require(::write(fd, contents.data(), contents.size()) == ssize_t(contents.size()));
+    ::close(fd);
+
+    // mapped, and sliced without copying
+    persistent::bytes mapped = persistent::bytes::map(path);
+    gc::root<persistent::bytes> mapped_root(mapped);
+    require(mapped.size() == 36 && std::string(mapped.data(), 36) == contents);
+    persistent::bytes host = mapped.slice(17, 7);
+    require(host.data() == mapped.data() + 17 && std::string(host.data(), host.size()) == "Host: x");
+    require(host.find('x') == 6 && host.find('z') == persistent::bytes::npos && mapped.find("\r\n\r\n", 4) == 24);
+    require(mapped.find("\r\n", 2, 16) == 24 && host == persistent::bytes("Host: x", 7));
+
+    environment env = create_new_environment();
+    gc::root<environment> env_root(env);
+    env.insert("r", mapped);
+    symbol r("r"), find("find"), slice("slice");
+    object head = object_list(object_list().new_push_front(form(find, r, string("\r\n\r\n"))).new_push_front(0)
+            .new_push_front(r).new_push_front(slice));
+    require(pretty_print(eval(form(symbol("split"), head, string("\r\n")), env)) == "(#b\"GET /a HTTP/1.1\" #b\"Host: x\")");
+    require(pretty_print(eval(form(symbol("split"), form(symbol("to-bytes"), string("a,,b")), 44), env))
+            == "(#b\"a\" #b\"\" #b\"b\")");
+    require(pretty_print(eval(form(find, r, 47), env)) == "4" && pretty_print(eval(form(find, r, 122), env)) == "#f");
+
+    // integers little and big endian, signed or not
+    object reads = object_list(object_list().new_push_front(4).new_push_front(28).new_push_front(r).new_push_front(
+            symbol("read-uint")));
+    require(pretty_print(eval(reads, env)) == "67305985");
+    env.insert("tail", mapped.slice(28, 8));
+    symbol tail("tail");
+    object read_int = object_list(object_list().new_push_front(4).new_push_front(4).new_push_front(tail)
+            .new_push_front(symbol("read-int")));
+    require(pretty_print(eval(read_int, env)) == "-2");
+    object read_u64_be = object_list(object_list().new_push_front(8).new_push_front(0).new_push_front(tail)
+            .new_push_front(symbol("read-uint-be")));
+    require(pretty_print(eval(read_u64_be, env)) == "72623863984291839");
+    object past_end = object_list(object_list().new_push_front(4).new_push_front(6).new_push_front(tail)
+            .new_push_front(symbol("read-int")));
+    require(!try_eval(past_end, env).ok());
+    require(!try_eval(form(symbol("byte-at"), tail, 8), env).ok());
+    eval_result missing = try_eval(form(symbol("open-bytes"), string("/nonexistent/file")), env);
+    require(!missing.ok() && missing.error->kind == io_failure);
+    require(std::string(missing.error->what()) == "Unable to open \"/nonexistent/file\": No such file or directory");
+
+    // heap bytes made in a region, and slices of them, outlive it
+    {
+        gc::mutator_scope scope;
+        object made = form(symbol("to-bytes"), string("a string long enough to be on the heap"));
+        require(eval_in_region(form(symbol("def"), symbol("made"), made), env).ok());
+    }
+    gc::collect();
+    require(pretty_print(eval(form(symbol("bytes-str"), symbol("made")), env)) == "\"a string long enough to be on the heap\"");
+
+    // encoded, and decoded in place
+    std::string encoded = encode(host);
+    object back = decode(encoded.data(), encoded.size());
+    require(back == object(host));
+    persistent::bytes const& decoded = boost::get<persistent::bytes>(back);
+    require(decoded.data() >= encoded.data() && decoded.data() < encoded.data() + encoded.size());
+    ::unlink(path);
+}
+
+std::string read_all(char const* path) {
+    std::ifstream f(path, std::ios::binary);
+    std::stringstream buff;
+    buff << f.rdbuf();
+    return buff.str();
+}
+
+void write_all(char const* path, std::string const& contents) {
+    std::ofstream f(path, std::ios::binary | std::ios::trunc);
+    f << contents;
+}
+
+bool loads(char const* path) {
+    try {
+        harkon::load_image(path);
+        return true;
+    } catch (std::exception const&) {
+        return false;
+    }
+}
+
+void image_test() {
+    using namespace harkon;
+
+    char path[] = "/tmp/harkon_image_XXXXXX";
+    int fd = ::mkstemp(path);
+    require(fd != -1);
+    ::close(fd);
+
+    environment env = create_new_environment();
+    gc::root<environment> env_root(env);
+    env.insert("i", -70000);
+    env.insert("big", make_integer(power_of_ten(40)));
+    std::string half(3000, 'r');
+    persistent::string rope = persistent::string(persistent::string::MakeCopy(), half.c_str(), half.size())
+            + persistent::string("ope", 3);
+    require(rope.depth() > 0);
+    env.insert("rope", string(rope));
+    symbol lambda("lambda"), a("a"), b("b");
+    object inner = form(lambda, object_list(object_list().new_push_front(b)), form(symbol("add"), a, b));
+    env.insert("adder", eval(form(form(lambda, object_list(object_list().new_push_front(a)), inner), 5), env));
+    object_list shared = object_list().new_push_front(string("s")).new_push_front(symbol("t")).new_push_front(2);
+    env.insert("shared", shared);
+    env.insert("nested", object_list(object_list().new_push_front(shared).new_push_front(shared).new_push_front(boolean(true))));
+    env.insert("packed", spread(1000, 3));
+    persistent::bytes bytes("binary\0data", 11);
+    env.insert("bytes", bytes);
+    env.insert("slice", bytes.slice(4, 5));
+
+    save_image(env, path);
+    environment back = load_image(path);
+    gc::root<environment> back_root(back);
+    char const* names[] = { "i", "big", "rope", "shared", "nested", "packed", "bytes", "slice" };
+    for (unsigned i(0); i < sizeof(names) / sizeof(names[0]); ++i) {
+        require(back.find(names[i]) && pretty_print(*back.find(names[i])) == pretty_print(*env.find(names[i])));
+    }
+    require(pretty_print(*back.find("slice")) == "#b\"ry\\x00da\"");
+    require(pretty_print(eval(form(symbol("adder"), 10), back)) == "15");
+
+    // a list reachable twice is written once, and shared again once loaded
+    object_list const& nested = boost::get<object_list>(*back.find("nested"));
+    object const& first = *(nested.begin() + 1);
+    object const& second = *(nested.begin() + 2);
+    require(&*boost::get<object_list>(first).begin() == &*boost::get<object_list>(second).begin());
+    require(&*boost::get<object_list>(first).begin() == &*boost::get<object_list>(*back.find("shared")).begin());
+
+    // a damaged image is refused, however it's damaged
+    std::string image = read_all(path);
+    write_all(path, image.substr(0, image.size() / 2));
+    require(!loads(path));
+    std::string other_version(image);
+    other_version[8] ^= 1;
+    write_all(path, other_version);
+    require(!loads(path));
+    for (std::size_t i(0); i < image.size(); ++i) {
+        std::string corrupt(image);
+        corrupt[i] ^= 0xff;
+        write_all(path, corrupt);
+        loads(path); // either way, without crashing
+    }
+
+    // nor can a list be made to contain itself
+    environment one;
+    one.insert("l", object_list(object_list().new_push_front(1)));
+    save_image(one, path);
+    std::string cyclic = read_all(path);
+    boost::uint32_t list_at;
+    std::memcpy(&list_at, cyclic.data() + cyclic.size() - 4, 4); // the only binding's value
+    std::memcpy(&cyclic[list_at + 5], &list_at, 4); // its first element
+    write_all(path, cyclic);
+    require(!loads(path));
+    ::unlink(path);
+
+    // one too big for its offsets isn't written at all. the limit stands in for 4GB
+    image_impl::writer w;
+    w.limit = 4096;
+    bool refused = false;
+    try {
+        w.finish(env);
+    } catch (std::runtime_error const&) {
+        refused = true;
+    }
+    require(refused);
+    image_impl::writer fits;
+    fits.limit = 4096;
+    fits.finish(one);
+}
+
+void module_cache_test() {
+    using namespace harkon;
+
+    char dir[] = "/tmp/harkon_cache_XXXXXX";
+    require(::mkdtemp(dir) != NULL);
+    module_cache cache(dir);
+    std::string text = "(add 100000000000000000000 1)\n(def x 3)\n";
+    std::string printed_forms = "(add 100000000000000000000 1) (def x 3)";
+
+    std::vector<object> forms = cache.load_source(text);
+    require(forms.size() == 2 && pretty_print(forms[0]) + " " + pretty_print(forms[1]) == printed_forms);
+    require(cache.hits == 0 && cache.misses == 1 && cache.rebuilt == 0);
+    forms = cache.load_source(text);
+    require(pretty_print(forms[0]) + " " + pretty_print(forms[1]) == printed_forms);
+    require(cache.hits == 1 && cache.misses == 1 && cache.rebuilt == 0);
+
+    // an edit is a different entry
+    cache.load_source(text + "(def y 4)\n");
+    require(cache.hits == 1 && cache.misses == 2 && cache.rebuilt == 0);
+
+    // an entry that decodes but not into objects is rebuilt, as is one that doesn't decode
+    std::string entry = read_all(cache.entry_path(text).c_str());
+    std::string bad_digits(entry);
+    bad_digits[bad_digits.find("100000000000000000000")] = 'x';
+    write_all(cache.entry_path(text).c_str(), bad_digits);
+    forms = cache.load_source(text);
+    require(pretty_print(forms[0]) + " " + pretty_print(forms[1]) == printed_forms);
+    require(cache.hits == 1 && cache.misses == 3 && cache.rebuilt == 1);
+    write_all(cache.entry_path(text).c_str(), entry.substr(0, entry.size() - 3));
+    cache.load_source(text);
+    require(cache.hits == 1 && cache.misses == 4 && cache.rebuilt == 2);
+    cache.load_source(text);
+    require(cache.hits == 2 && cache.misses == 4 && cache.rebuilt == 2);
+
+    // and so is one made by another codec version
+    std::string other_version(entry);
+    other_version[8] ^= 1;
+    write_all(cache.entry_path(text).c_str(), other_version);
+    cache.load_source(text);
+    require(cache.hits == 2 && cache.misses == 5 && cache.rebuilt == 3);
+
+    ::unlink(cache.entry_path(text).c_str());
+    ::unlink(cache.entry_path(text + "(def y 4)\n").c_str());
+    ::rmdir(dir);
+}
+
+int connect_to(std::string const& path) {
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    require(fd != -1 && ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    return fd;
+}
+
+// the next line the server sends, or "" if the session's closed
+std::string read_line(int fd) {
+    std::string answer;
+    char c;
+    while (::read(fd, &c, 1) == 1 && c != '\n') {
+        answer += c;
+    }
+    return answer;
+}
+
+// sends a line and reads the one answering it
+std::string request(int fd, std::string const& line) {
+    std::string sent = line + "\n";
+    require(::write(fd, sent.data(), sent.size()) == ssize_t(sent.size()));
+    return read_line(fd);
+}
+
+// one client: its own `x` redefined and read back, which no other session sees
+void session_client(std::string const& path, int id, unsigned requests, bool* ok) {
+    int fd = connect_to(path);
+    *ok = true;
+    for (unsigned i(0); i < requests; i += 2) {
+        std::string value = boost::lexical_cast<std::string>(id * 100000 + i);
+        *ok = *ok && request(fd, "(def x " + value + ")") == "NIL" && request(fd, "(add x 0)") == value;
+    }
+    *ok = *ok && request(fd, ":exit") == "";
+    ::close(fd);
+}
+
+void server_test() {
+    using namespace harkon;
+
+    std::string path = "/tmp/harkon_server_" + boost::lexical_cast<std::string>(::getpid());
+    server_impl::server s(path, create_new_environment(), 4);
+    s.listen();
+    boost::thread serving(boost::bind(&server_impl::server::run, &s));
+
+    const int sessions = 8;
+    bool ok[sessions];
+    boost::thread_group clients;
+    for (int i(0); i < sessions; ++i) {
+        clients.create_thread(boost::bind(&session_client, path, i, 400, &ok[i]));
+    }
+    clients.join_all();
+    for (int i(0); i < sessions; ++i) {
+        require(ok[i]);
+    }
+
+    // a session's defs are its own, not the base's
+    int fd = connect_to(path);
+    require(request(fd, "x").find("Unable to resolve symbol") != std::string::npos);
+
+    // requests sent without waiting for the answers are all answered, in order,
+    // however far past the backlog the client gets
+    int pipelined = connect_to(path);
+    std::string requests;
+    for (int i(0); i < 1000; ++i) {
+        requests += "(add 1 " + boost::lexical_cast<std::string>(i) + ")\n";
+    }
+    require(::write(pipelined, requests.data(), requests.size()) == ssize_t(requests.size()));
+    for (int i(0); i < 1000; ++i) {
+        require(read_line(pipelined) == boost::lexical_cast<std::string>(i + 1));
+    }
+    ::close(pipelined);
+
+    // and a line that never ends is refused
+    int unending = connect_to(path);
+    std::string chunk(1 << 16, 'a');
+    for (unsigned sent(0); sent < 2 * server_impl::max_line_bytes; sent += chunk.size()) {
+        if (::send(unending, chunk.data(), chunk.size(), MSG_NOSIGNAL) != ssize_t(chunk.size()))
+            break;
+    }
+    require(read_line(unending).find("Line longer than") != std::string::npos);
+    ::close(unending);
+
+    // stopped with a request still being evaluated, which is waited for
+    std::string slow = "(fold add 0 (range 0 2000000))\n";
+    require(::write(fd, slow.data(), slow.size()) == ssize_t(slow.size()));
+    ::usleep(20000);
+    s.stop();
+    serving.join();
+    ::close(fd);
+}
+
 int test_main(int, char**) {
 
     std::cout << "Harkon Test\n\n";
 
+    rope_test();
     map_test();
+    map_iteration_test();
+    erase_test();
+    parallel_merge_test();
     string_test();
     merge_test();
+    alloc_stats_test();
+    bigint_test();
+    printer_test();
+    codec_test();
+    closure_test();
+    error_test();
+    gc_test();
+    region_test();
+    machine_test();
+    stream_test();
+    sequence_test();
+    packed_test();
+    bytes_test();
+    image_test();
+    module_cache_test();
+    server_test();
+    alloc_slots_test();
 
     std::cout << "All tests passed!";
     return 0;